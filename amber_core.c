@@ -0,0 +1,1877 @@
+/* ======================================================================== */
+/* Amber core - finding links in HTML and adding attributes to them         */
+/* Originally from amber_utils.c in amber_nginx                             */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "amber_core.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define AMBER_HAVE_SSE2 1       /* Search 16 bytes at a time (always there on x86-64) */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define AMBER_HAVE_AVX2 1       /* Find where tags are 32 bytes at a time, if the CPU supports it */
+#endif
+#endif
+
+/* Set up the state for finding links in a stream of buffers (e.g. one response)
+
+    amber_scan_t *scan      : the state to set up
+    amber_alloc_fn alloc    : how to allocate the results
+    void *baton             : passed to alloc
+*/
+void amber_scan_init(amber_scan_t *scan, amber_alloc_fn alloc, void *baton)
+{
+    memset(&scan->html, 0, sizeof(scan->html));
+    scan->html.mode = AMBER_HTML_TEXT;
+    scan->alloc = alloc;
+    scan->baton = baton;
+    scan->carry_size = 0;
+#ifdef AMBER_HAVE_AVX2
+    __builtin_cpu_init();
+    scan->avx2 = __builtin_cpu_supports("avx2");
+#else
+    scan->avx2 = 0;
+#endif
+}
+
+#define AMBER_IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\f')
+#define AMBER_IS_ALPHA(c) ((unsigned char)(((c) | 0x20) - 'a') < 26)
+
+/* Characters that end a tag name or attribute name (1), or an unquoted attribute value (2). Tags 
+   are mostly made up of names, so they're passed over with a table lookup per character */
+#define AMBER_ENDS_NAME  1
+#define AMBER_ENDS_VALUE 2
+static const unsigned char amber_tag_delimiters[256] = {
+    ['\t'] = 3, ['\n'] = 3, ['\f'] = 3, ['\r'] = 3, [' '] = 3, ['/'] = 1, ['='] = 1, ['>'] = 3
+};
+
+/* Characters that can't be part of a url in AMBER_HREF_PATTERN (its [^\v()<>{}\[\]"'] class, where
+   \v is any vertical space) */
+static const unsigned char amber_url_delimiters[256] = {
+    ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1, [0x85] = 1, ['('] = 1, [')'] = 1, ['<'] = 1, 
+    ['>'] = 1, ['{'] = 1, ['}'] = 1, ['['] = 1, [']'] = 1, ['"'] = 1, ['\''] = 1
+};
+
+/* The tags amber_tag_kind() looks for: link tags, whose hrefs may be rewritten, and elements whose
+   contents are text rather than HTML, so they can't contain links. The names are compared eight 
+   letters at a time */
+static const struct {
+    union { char c[8]; uint64_t n; } name, mask;
+    unsigned char size;
+    unsigned char kind;
+} amber_tag_names[] = {
+    { { "a" }, { "\xff" }, 1, AMBER_TAG_LINK },
+    { { "area" }, { "\xff\xff\xff\xff" }, 4, AMBER_TAG_LINK },
+    { { "iframe" }, { "\xff\xff\xff\xff\xff\xff" }, 6, AMBER_TAG_RAWTEXT },
+    { { "link" }, { "\xff\xff\xff\xff" }, 4, AMBER_TAG_LINK },
+    { { "noembed" }, { "\xff\xff\xff\xff\xff\xff\xff" }, 7, AMBER_TAG_RAWTEXT },
+    { { "noframes" }, { "\xff\xff\xff\xff\xff\xff\xff\xff" }, 8, AMBER_TAG_RAWTEXT },
+    { { "script" }, { "\xff\xff\xff\xff\xff\xff" }, 6, AMBER_TAG_RAWTEXT },
+    { { "style" }, { "\xff\xff\xff\xff\xff" }, 5, AMBER_TAG_RAWTEXT },
+    { { "textarea" }, { "\xff\xff\xff\xff\xff\xff\xff\xff" }, 8, AMBER_TAG_RAWTEXT },
+    { { "title" }, { "\xff\xff\xff\xff\xff" }, 5, AMBER_TAG_RAWTEXT },
+    { { "xmp" }, { "\xff\xff\xff" }, 3, AMBER_TAG_RAWTEXT }
+};
+
+/* The tags in amber_tag_names that start with each pair of letters (in any case), from the bottom
+   five bits of each. A tag name can also be one letter, so the second character can be anything
+   that ends a name */
+#define AMBER_TAG_PAIR(a, b) ((((a) & 0x1f) << 5) | ((b) & 0x1f))
+static const uint16_t amber_tag_pairs[1024] = {
+    [AMBER_TAG_PAIR('a', ' ')] = 1 << 0, [AMBER_TAG_PAIR('a', '\t')] = 1 << 0, [AMBER_TAG_PAIR('a', '\n')] = 1 << 0, 
+    [AMBER_TAG_PAIR('a', '\f')] = 1 << 0, [AMBER_TAG_PAIR('a', '\r')] = 1 << 0, [AMBER_TAG_PAIR('a', '/')] = 1 << 0, 
+    [AMBER_TAG_PAIR('a', '=')] = 1 << 0, [AMBER_TAG_PAIR('a', '>')] = 1 << 0, 
+    [AMBER_TAG_PAIR('a', 'r')] = 1 << 1, [AMBER_TAG_PAIR('i', 'f')] = 1 << 2, [AMBER_TAG_PAIR('l', 'i')] = 1 << 3,
+    [AMBER_TAG_PAIR('n', 'o')] = (1 << 4) | (1 << 5), [AMBER_TAG_PAIR('s', 'c')] = 1 << 6, 
+    [AMBER_TAG_PAIR('s', 't')] = 1 << 7, [AMBER_TAG_PAIR('t', 'e')] = 1 << 8, [AMBER_TAG_PAIR('t', 'i')] = 1 << 9,
+    [AMBER_TAG_PAIR('x', 'm')] = 1 << 10
+};
+
+/* First letters of the tags in amber_tag_names */
+static const unsigned char amber_tag_initials[256] = {
+    ['a'] = 1, ['i'] = 1, ['l'] = 1, ['n'] = 1, ['s'] = 1, ['t'] = 1, ['x'] = 1,
+    ['A'] = 1, ['I'] = 1, ['L'] = 1, ['N'] = 1, ['S'] = 1, ['T'] = 1, ['X'] = 1
+};
+
+
+/* "href" and "http" as they are in memory, whatever the byte order */
+static const union { char c[4]; uint32_t n; } amber_href_word = { { 'h', 'r', 'e', 'f' } }, amber_http_word = { { 'h', 't', 't', 'p' } };
+#define amber_href_letters amber_href_word.n
+#define amber_http_letters amber_http_word.n
+
+/* Results of amber_match_href() */
+#define AMBER_HREF_NONE     0
+#define AMBER_HREF_FOUND    1
+#define AMBER_HREF_PARTIAL  2
+
+/* Find the next occurrence of a character, like memchr(). Most of what is searched for is only a 
+   few dozen bytes away, so this is inlined rather than paying for a call each time. SSE2 is always
+   there on x86-64, and compares 16 bytes at a time
+
+    char *pos               : where to start
+    char *end               : the end of the buffer
+    char c                  : the character to find
+
+    returns the first occurrence of c, or NULL if there isn't one
+*/
+static inline const char *amber_find_char(const char *pos, const char *end, char c)
+{
+#ifdef AMBER_HAVE_SSE2
+    const __m128i target = _mm_set1_epi8(c);
+    unsigned int mask;
+
+    for (; end - pos >= 16; pos += 16) {
+        if ((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)pos), target)))) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    return (pos < end) ? memchr(pos, c, end - pos) : NULL;
+}
+
+/* Find the next occurrence of either of two characters, in the same way as amber_find_char()
+
+    char *pos               : where to start
+    char *end               : the end of the buffer
+    char a, char b          : the characters to find
+
+    returns the first occurrence of a or b, or NULL if there isn't one
+*/
+static inline const char *amber_find_either(const char *pos, const char *end, char a, char b)
+{
+#ifdef AMBER_HAVE_SSE2
+    const __m128i target_a = _mm_set1_epi8(a);
+    const __m128i target_b = _mm_set1_epi8(b);
+    __m128i block;
+    unsigned int mask;
+
+    for (; end - pos >= 16; pos += 16) {
+        block = _mm_loadu_si128((const __m128i *)pos);
+        if ((mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, target_a), _mm_cmpeq_epi8(block, target_b))))) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; pos < end; pos++) {
+        if ((*pos == a) || (*pos == b)) {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+/* Find the next occurrence of a character followed by another (such as "</"), in the same way as 
+   amber_find_char(). Raw text such as a script has plenty of "<"s, but few of them start an end tag
+
+    char *pos               : where to start
+    char *end               : the end of the buffer
+    char a, char b          : the characters to find
+
+    returns the first a that is followed by b or by the end of the buffer, or NULL if there isn't one
+*/
+static inline const char *amber_find_pair(const char *pos, const char *end, char a, char b)
+{
+#ifdef AMBER_HAVE_SSE2
+    const __m128i target_a = _mm_set1_epi8(a);
+    const __m128i target_b = _mm_set1_epi8(b);
+    unsigned int mask;
+
+    for (; end - pos > 16; pos += 16) {
+        if ((mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)pos), target_a),
+                                                     _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pos + 1)), target_b))))) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; pos < end; pos++) {
+        if ((*pos == a) && ((pos + 1 == end) || (pos[1] == b))) {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+/* Find the end of a url, at the first character in amber_url_delimiters
+
+    char *pos               : where to start
+    char *end               : the end of the buffer
+
+    returns the end of the url, or end if it runs to the end of the buffer
+*/
+static inline const char *amber_find_url_end(const char *pos, const char *end)
+{
+#ifdef AMBER_HAVE_SSE2
+    /* Pairs of delimiters that differ by one bit are compared together */
+    __m128i block, found;
+    unsigned int mask;
+
+    for (; end - pos >= 16; pos += 16) {
+        block = _mm_loadu_si128((const __m128i *)pos);
+        found = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('\n' - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8('\r' + 1)));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(_mm_or_si128(block, _mm_set1_epi8(0x01)), _mm_set1_epi8(')')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(_mm_or_si128(block, _mm_set1_epi8(0x02)), _mm_set1_epi8('>')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(_mm_or_si128(block, _mm_set1_epi8(0x20)), _mm_set1_epi8('{')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(_mm_or_si128(block, _mm_set1_epi8(0x20)), _mm_set1_epi8('}')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(block, _mm_set1_epi8((char) 0x85)));
+        if ((mask = _mm_movemask_epi8(found))) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; (pos < end) && !amber_url_delimiters[(unsigned char)*pos]; pos++);
+    return pos;
+}
+
+/* Find the ">" that ends a tag, from somewhere in the tag outside an attribute value. Every "=" in a 
+   tag starts a value, and only a quoted value can contain ">", so everything else can be passed over
+
+    char *pos               : where to start
+    char *end               : the end of the buffer
+
+    returns the ">" ending the tag, or NULL if it doesn't end in the buffer
+*/
+static inline const char *amber_find_tag_end(const char *pos, const char *end)
+{
+    while ((pos = amber_find_either(pos, end, '=', '>'))) {
+        if (*pos == '>') {
+            return pos;
+        }
+        for (pos++; (pos < end) && AMBER_IS_SPACE(*pos); pos++);
+        if (pos >= end) {
+            return NULL;
+        }
+        if ((*pos == '"') || (*pos == '\'')) {
+            if (!(pos = amber_find_char(pos + 1, end, *pos))) {
+                return NULL;
+            }
+            pos++;
+        } else {
+            while ((pos < end) && !(amber_tag_delimiters[(unsigned char)*pos] & AMBER_ENDS_VALUE)) {
+                pos++;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Work out what kind of start tag a name in the buffer is, without finding where the name ends first.
+   Setting 0x20 in every byte only turns upper case letters into the lower case ones in the names (and
+   leaves everything else different from them)
+
+    char *name              : the start of the tag name, with at least AMBER_MAX_TAG_NAME + 1 bytes
+                              after it
+
+    returns one of the AMBER_TAG_* values
+*/
+static inline int amber_name_kind(const char *name)
+{
+    unsigned int candidates = amber_tag_pairs[AMBER_TAG_PAIR(name[0], name[1])];
+    uint64_t word;
+    int i;
+
+    if (!candidates) {
+        return AMBER_TAG_OTHER;
+    }
+    memcpy(&word, name, sizeof(word));
+    word |= 0x2020202020202020ull;
+    for (i = 0; candidates; i++, candidates >>= 1) {
+        if ((candidates & 1) && !((word ^ amber_tag_names[i].name.n) & amber_tag_names[i].mask.n) && 
+            (amber_tag_delimiters[(unsigned char)name[amber_tag_names[i].size]] & AMBER_ENDS_NAME)) {
+            return amber_tag_names[i].kind;
+        }
+    }
+    return AMBER_TAG_OTHER;
+}
+
+/* Work out what kind of tag the tokenizer has just read the name of
+
+    amber_html_state_t *html : the tokenizer state, with the complete tag name
+
+    returns one of the AMBER_TAG_* values
+*/
+static int amber_tag_kind(const amber_html_state_t *html)
+{
+    char name[AMBER_MAX_TAG_NAME + 1];
+
+    if (html->end_tag || (html->name_size > AMBER_MAX_TAG_NAME)) {
+        return AMBER_TAG_OTHER;
+    }
+    memset(name, ' ', sizeof(name));
+    memcpy(name, html->name, html->name_size);
+    return amber_name_kind(name);
+}
+
+/* Where the characters that tags are made of are in 64 bytes of the buffer, kept by amber_find_tag()
+   from one call to the next */
+typedef struct {
+    const char  *base;          /* Start of the 64 bytes, or NULL if nothing has been found yet */
+    uint64_t    less;           /* A bit for each "<" */
+    uint64_t    greater;
+    uint64_t    equals;
+    uint64_t    quotes;         /* '"' */
+    uint64_t    apostrophes;    /* "'" */
+    uint64_t    odd;            /* Bytes with an odd number of '"' at or before them */
+    const char  *tag;           /* "<" of a tag that goes on past the 64 bytes, or NULL */
+    int         kind;           /* Its AMBER_TAG_* */
+    uint64_t    open;           /* 1 if it's in a value at the end of the 64 bytes */
+    int         count;          /* Number of matches before it, to go back to if it's left to amber_scan_tag() */
+    int         last_match_end;
+} amber_block_t;
+
+#ifdef AMBER_HAVE_SSE2
+/* Get a bit for each byte of 16 that is c */
+#define AMBER_MASK16(bytes, c) ((uint64_t)(uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8((bytes), _mm_set1_epi8(c))))
+#define AMBER_MASK64(bytes, c) (AMBER_MASK16((bytes)[0], c) | (AMBER_MASK16((bytes)[1], c) << 16) | \
+                                (AMBER_MASK16((bytes)[2], c) << 32) | (AMBER_MASK16((bytes)[3], c) << 48))
+
+/* Find where the characters are in the 64 bytes from pos, 16 at a time */
+static void amber_block_find(amber_block_t *block, const char *pos)
+{
+    __m128i bytes[4];
+
+    bytes[0] = _mm_loadu_si128((const __m128i *)pos);
+    bytes[1] = _mm_loadu_si128((const __m128i *)(pos + 16));
+    bytes[2] = _mm_loadu_si128((const __m128i *)(pos + 32));
+    bytes[3] = _mm_loadu_si128((const __m128i *)(pos + 48));
+    block->less = AMBER_MASK64(bytes, '<');
+    block->greater = AMBER_MASK64(bytes, '>');
+    block->equals = AMBER_MASK64(bytes, '=');
+    block->quotes = AMBER_MASK64(bytes, '"');
+    block->apostrophes = AMBER_MASK64(bytes, '\'');
+}
+#endif
+
+#ifdef AMBER_HAVE_AVX2
+/* The same as amber_block_find(), 32 bytes at a time */
+#define AMBER_MASK32(bytes, c) ((uint64_t)(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8((bytes), _mm256_set1_epi8(c))))
+
+__attribute__((target("avx2")))
+static void amber_block_find_avx2(amber_block_t *block, const char *pos)
+{
+    __m256i low = _mm256_loadu_si256((const __m256i *)pos);
+    __m256i high = _mm256_loadu_si256((const __m256i *)(pos + 32));
+
+    block->less = AMBER_MASK32(low, '<') | (AMBER_MASK32(high, '<') << 32);
+    block->greater = AMBER_MASK32(low, '>') | (AMBER_MASK32(high, '>') << 32);
+    block->equals = AMBER_MASK32(low, '=') | (AMBER_MASK32(high, '=') << 32);
+    block->quotes = AMBER_MASK32(low, '"') | (AMBER_MASK32(high, '"') << 32);
+    block->apostrophes = AMBER_MASK32(low, '\'') | (AMBER_MASK32(high, '\'') << 32);
+}
+#endif
+
+/* Match AMBER_HREF_PATTERN at the start of an attribute: "href=", a quote, then a url starting with
+   "http" (in any case) up to a quote. The pattern has no alternatives, so it's matched here with a 
+   table lookup per character of the url rather than by running a regex for every link
+
+    char *pos               : the start of the attribute
+    char *end               : the end of the buffer
+    const char **url        : set to the start of the url if it matches
+    const char **url_end    : set to the end of the url if it matches (the closing quote)
+
+    returns AMBER_HREF_FOUND, AMBER_HREF_NONE, or AMBER_HREF_PARTIAL if the buffer ends before it's 
+    known whether the attribute matches
+*/
+static int amber_match_href(const char *pos, const char *end, const char **url, const char **url_end)
+{
+    static const char prefix[] = "href=?http";
+    const char *p;
+    uint32_t href, http;
+    size_t i = 0;
+
+    if (end - pos >= 10) {
+        /* The letters are compared four at a time, in lower case */
+        memcpy(&href, pos, 4);
+        memcpy(&http, pos + 6, 4);
+        if (((href | 0x20202020) != amber_href_letters) || (pos[4] != '=') || 
+            ((pos[5] != '"') && (pos[5] != '\'')) || ((http | 0x20202020) != amber_http_letters)) {
+            return AMBER_HREF_NONE;
+        }
+        i = 10;
+    }
+    for (; i < sizeof(prefix) - 1; i++) {
+        if (pos + i >= end) {
+            return AMBER_HREF_PARTIAL;
+        }
+        if (prefix[i] == '?') {
+            if ((pos[i] != '"') && (pos[i] != '\'')) {
+                return AMBER_HREF_NONE;
+            }
+        } else if ((prefix[i] == '=') ? (pos[i] != '=') : ((pos[i] | 0x20) != prefix[i])) {
+            return AMBER_HREF_NONE;
+        }
+    }
+    p = amber_find_url_end(pos + i, end);
+    if (p >= end) {
+        return AMBER_HREF_PARTIAL;
+    }
+    /* There must be something after "http", and the url must end with a quote */
+    if ((p == pos + i) || ((*p != '"') && (*p != '\''))) {
+        return AMBER_HREF_NONE;
+    }
+    *url = pos + 6;
+    *url_end = p;
+    return AMBER_HREF_FOUND;
+}
+
+/* Add a link to the results of amber_find_links(), making more space for them if needed
+
+    amber_scan_t *scan      : state for the stream, used to allocate the results
+    amber_matches_t *result : the results so far
+    int *capacity           : number of matches there is space for in the result
+    const char *buffer      : the buffer being searched
+    const char *tag_start   : the "<" of the tag the link is in, or NULL if it's before the buffer
+    const char *pos         : the start of the href attribute, where attributes are inserted
+    const char *url         : the url
+    const char *url_end     : the end of the url (the closing quote)
+*/
+static void amber_add_match(amber_scan_t *scan, amber_matches_t *result, int *capacity, const char *buffer, 
+                            const char *tag_start, const char *pos, const char *url, const char *url_end)
+{
+    int url_size = url_end - url;
+
+    if (result->count == *capacity) {
+        /* Lazy allocation of memory for our result structure when it's needed for the first time,
+           doubling it when it's full so that the copying stays linear in the number of matches */
+        *capacity = *capacity ? *capacity * 2 : AMBER_MATCHES_INITIAL;
+        int  *new_insert_pos = scan->alloc(scan->baton, *capacity * sizeof(int));
+        int  *new_tag_pos = scan->alloc(scan->baton, *capacity * sizeof(int));
+        char **new_url = scan->alloc(scan->baton, *capacity * sizeof(char *));
+        if (result->count) {
+            memcpy(new_insert_pos, result->insert_pos, sizeof(int) * result->count);
+            memcpy(new_tag_pos, result->tag_pos, sizeof(int) * result->count);
+            memcpy(new_url, result->url, sizeof(char *) * result->count);
+        }
+        result->insert_pos = new_insert_pos;
+        result->tag_pos = new_tag_pos;
+        result->url = new_url;
+    }
+
+    result->insert_pos[result->count] = pos - buffer;
+    result->tag_pos[result->count] = tag_start ? tag_start - buffer : -1;
+    result->url[result->count] = scan->alloc(scan->baton, url_size + 1);
+    memcpy(result->url[result->count], url, url_size);
+    result->url[result->count][url_size] = 0;
+    result->count++;
+    result->last_match_end = url_end + 1 - buffer;
+}
+
+/* Find the next tag that needs amber_scan_tag(), passing over text and the tags in between. Tags are
+   only a few dozen bytes apart, so rather than going from each "<" to the next ">", the positions of
+   everything that matters in 64 bytes are found at once, and all the tags in them are found together
+   with arithmetic on those positions, a bit for each byte. A tag that goes on past the 64 bytes is 
+   carried on into the next 64.
+
+   A tag is taken to end at the first ">" after it with an even number of '"' between them. That's 
+   only right if every '"' that would start a value follows "=", every "=" outside the values is 
+   followed by '"' (so there are no unquoted values or values in single quotes), and there's no 
+   "<" and a letter in a value. This is true of most tags. Then the attributes of a link tag all 
+   start after a space, "/" or the end of a value, so hrefs are matched wherever "href" comes just 
+   before an "=" after one of those.
+
+   Anything else is left to amber_scan_tag(): raw text elements, markup, tags that don't look like
+   that (going back to the results from before the tag if it was carried), and anything within the 
+   last 64 bytes of the buffer
+
+    amber_scan_t *scan      : state for the stream
+    amber_block_t *block    : positions found by the last call, which are updated
+    char *buffer            : the buffer being searched
+    char *pos               : where to start, in text
+    char *end               : the end of the buffer
+    amber_matches_t *result : where to add any links found, or NULL to just find the next tag
+    int *capacity           : number of matches there is space for in the result
+
+    returns the "<" of the next tag to be tokenized, or NULL if there isn't one
+*/
+static inline const char *amber_find_tag(amber_scan_t *scan, amber_block_t *block, const char *buffer, 
+                                         const char *pos, const char *end, amber_matches_t *result, int *capacity)
+{
+#ifdef AMBER_HAVE_SSE2
+    const char *base = block->base;
+    const char *tag;
+    const char *url;
+    const char *url_end;
+    uint64_t carried, tags, links, others, boundaries, in_value, stops, rest, chains, inside, values, bad, bits, earlier;
+    int i, j, limit, last, kind, end_tag, saved;
+
+    /* Everything looked at is within 64 + AMBER_MAX_TAG_NAME + 2 bytes of the start of the block */
+    for (;;) {
+        if (!base || (pos < base) || (pos >= base + 64)) {
+            if (end - pos < 64 + AMBER_MAX_TAG_NAME + 2) {
+                break;
+            }
+#ifdef AMBER_HAVE_AVX2
+            if (scan->avx2) {
+                amber_block_find_avx2(block, pos);
+            } else
+#endif
+            amber_block_find(block, pos);
+            block->odd = block->quotes;
+            block->odd ^= block->odd << 1;
+            block->odd ^= block->odd << 2;
+            block->odd ^= block->odd << 4;
+            block->odd ^= block->odd << 8;
+            block->odd ^= block->odd << 16;
+            block->odd ^= block->odd << 32;
+            base = block->base = pos;
+        }
+        carried = (block->tag != NULL);
+        bits = block->less & (~0ull << (pos - base));
+        if (!bits && !carried) {
+            pos = base + 64;
+            continue;
+        }
+
+        /* Tags start with "<" and a letter, or "</" and a letter. Any other "<" outside the tags, or
+           a raw text tag, is as far as this can go */
+        tags = links = others = 0;
+        limit = 64;
+        for (; bits; bits &= bits - 1) {
+            i = __builtin_ctzll(bits);
+            end_tag = (base[i + 1] == '/');
+            if (!AMBER_IS_ALPHA(base[i + 1 + end_tag])) {
+                others |= 1ull << i;
+                continue;
+            }
+            tags |= 1ull << i;
+            if (!end_tag && ((kind = amber_name_kind(base + i + 1)) != AMBER_TAG_OTHER)) {
+                if (kind == AMBER_TAG_RAWTEXT) {
+                    limit = i;
+                    break;
+                }
+                links |= 1ull << i;
+            }
+        }
+
+        /* Bytes that are in values: an odd number of '"' since the start of their tag. The carry
+           of adding a bit at each tag that starts after an odd number of '"' runs up to the next
+           tag that doesn't, which gives the number of '"' before each tag for the bytes after it
+           (except for the "<" of a tag after another like it) */
+        boundaries = ~(tags & ~block->odd);
+        in_value = block->odd ^ (((boundaries + ((tags & block->odd) | block->open)) ^ boundaries) & boundaries);
+
+        /* Each tag ends at the first ">" outside a value, found the same way by adding a bit just 
+           after each tag, whose carry runs through the tag to the ">" (or the next tag, which means
+           there's a "<" in the tag, or past the 64 bytes) */
+        stops = block->greater & ~in_value;
+        rest = ~(stops | tags);
+        chains = rest + ((tags << 1) | carried);
+        inside = rest & ~chains;
+        values = block->equals & ~in_value & inside;
+
+        /* Bytes that mean a tag has to be left to amber_scan_tag(): "'", '"' not after "=", "=" 
+           not before '"' or at the end of the 64 bytes, and the "<" of another tag. An href that 
+           starts before the 64 bytes in a link tag that's carried on can't be checked here */
+        bad = (block->apostrophes & inside) | (block->quotes & in_value & inside & ~(block->equals << 1)) |
+              ((values << 1) & ~block->quotes) | (values & (1ull << 63)) | ((chains & ~rest & tags) >> 1);
+        if (carried && (block->kind == AMBER_TAG_LINK)) {
+            bad |= values & 0x1f & ((tags & (0 - tags)) - 1);
+        }
+        if (carried && (chains & ~rest & tags & 1)) {
+            limit = -1;
+        } else if (bad) {
+            earlier = tags & ((2ull << __builtin_ctzll(bad)) - 1);
+            i = earlier ? 63 - __builtin_clzll(earlier) : -1;
+            limit = (i < limit) ? i : limit;
+        }
+        if ((bits = others & ~inside) && (__builtin_ctzll(bits) < limit)) {
+            limit = __builtin_ctzll(bits);
+        }
+
+        /* The tag that goes on past the 64 bytes, if there is one */
+        last = ((chains < rest) || (tags >> 63)) ? (tags ? 63 - __builtin_clzll(tags) : (int)(block->tag - base)) : 64;
+        saved = (last < 0);
+        if (limit < 0) {
+            tag = block->tag;
+            block->tag = NULL;
+            block->open = 0;
+            if (result) {
+                result->count = block->count;
+                result->last_match_end = block->last_match_end;
+            }
+            return tag;
+        }
+
+        /* Match the hrefs in link tags before the limit */
+        if (result && (links || (carried && (block->kind == AMBER_TAG_LINK)))) {
+            bits = values & ~(rest + ((links << 1) | (carried && (block->kind == AMBER_TAG_LINK)))) & 
+                   ((limit < 64) ? (1ull << limit) - 1 : ~0ull);
+            for (; bits; bits &= bits - 1) {
+                j = __builtin_ctzll(bits) - 4;
+                earlier = tags & ((1ull << (j + 4)) - 1);
+                i = earlier ? 63 - __builtin_clzll(earlier) : (int)(block->tag - base);
+                if ((j >= i + 3) && (AMBER_IS_SPACE(base[j - 1]) || (base[j - 1] == '/') || 
+                                     ((base[j - 1] == '"') && !((in_value >> (j - 1)) & 1))) &&
+                    (amber_match_href(base + j, end, &url, &url_end) == AMBER_HREF_FOUND)) {
+                    if ((i == last) && !saved) {
+                        block->count = result->count;
+                        block->last_match_end = result->last_match_end;
+                        saved = 1;
+                    }
+                    amber_add_match(scan, result, capacity, buffer, earlier ? base + i : block->tag, base + j, url, url_end);
+                }
+            }
+        }
+        if (limit < 64) {
+            block->tag = NULL;
+            block->open = 0;
+            return base + limit;
+        }
+        if ((last >= 0) && (last < 64)) {
+            block->tag = base + last;
+            block->kind = ((links >> last) & 1) ? AMBER_TAG_LINK : AMBER_TAG_OTHER;
+            if (result && !saved) {
+                block->count = result->count;
+                block->last_match_end = result->last_match_end;
+            }
+        } else if (last == 64) {
+            block->tag = NULL;
+        }
+        block->open = (block->tag && (last < 63)) ? (in_value >> 63) : 0;
+        pos = base + 64;
+    }
+    if ((tag = block->tag)) {
+        block->tag = NULL;
+        block->open = 0;
+        if (result) {
+            result->count = block->count;
+            result->last_match_end = block->last_match_end;
+        }
+        return tag;
+    }
+#endif
+    return amber_find_char(pos, end, '<');
+}
+
+/* Tokenize a whole tag that starts with "<" and a letter (or "</" and a letter) and ends in the buffer,
+   matching hrefs wherever an attribute of a link start tag begins. This is the common case, so it's 
+   done in one pass over the tag rather than going back through the state machine in amber_scan_html()
+   for each character: names and unquoted values are passed over with a table lookup per character, 
+   and quoted values with amber_find_char(). The result is the same as the state machine's. Anything 
+   else (markup, a tag cut off by the end of the buffer, or a link that might be) is left to the state 
+   machine, with the results and the tokenizer state as they were.
+
+    amber_scan_t *scan      : state for the stream, whose tokenizer state is updated if the tag is done
+    char *buffer            : the buffer being searched
+    char *end               : the end of the buffer
+    char *tag_start         : the "<" of the tag
+    amber_matches_t *result : where to add any links found, or NULL to just update the state
+    int *capacity           : number of matches there is space for in the result
+
+    returns the position just after the ">" ending the tag, or NULL if the tag was left alone
+*/
+static const char *amber_scan_tag(amber_scan_t *scan, const char *buffer, const char *end, const char *tag_start, 
+                                  amber_matches_t *result, int *capacity)
+{
+    amber_html_state_t *html = &scan->html;
+    const char *pos = tag_start + 1;
+    const char *name;
+    const char *url;
+    const char *url_end;
+    int saved_count = result ? result->count : 0;
+    int saved_last_match_end = result ? result->last_match_end : 0;
+    int kind = AMBER_TAG_OTHER;
+    int boundary = 1;
+    size_t name_size;
+    size_t i;
+
+    if ((pos < end) && (*pos == '/')) {
+        /* End tags are never links, so all that matters is where they end */
+        pos++;
+        if ((pos >= end) || !AMBER_IS_ALPHA(*pos)) {
+            return NULL;
+        }
+    } else if ((pos >= end) || !AMBER_IS_ALPHA(*pos)) {
+        return NULL;
+    } else if (amber_tag_initials[(unsigned char)*pos]) {
+        /* Only the names of tags that might be links or raw text are needed */
+        name = pos;
+        for (pos++; (pos < end) && !(amber_tag_delimiters[(unsigned char)*pos] & AMBER_ENDS_NAME); pos++);
+        if (pos >= end) {
+            return NULL;
+        }
+        name_size = pos - name;
+        if ((name_size == 1) && ((*name | 0x20) == 'a')) {
+            kind = AMBER_TAG_LINK;
+        } else if (name_size <= AMBER_MAX_TAG_NAME) {
+            for (i = 0; i < name_size; i++) {
+                html->name[i] = tolower((unsigned char)name[i]);
+            }
+            html->name[name_size] = 0;
+            html->name_size = name_size;
+            html->end_tag = 0;
+            kind = amber_tag_kind(html);
+        }
+    }
+
+    if ((kind != AMBER_TAG_LINK) || !result) {
+        /* Attribute names only matter in link tags, so all that's needed is where the tag ends */
+        if (!(pos = amber_find_tag_end(pos, end))) {
+            return NULL;
+        }
+        if (kind == AMBER_TAG_RAWTEXT) {
+            html->mode = AMBER_HTML_RAWTEXT;
+            html->kind = kind;
+            html->count = 0;
+        }
+        return pos + 1;
+    }
+
+    while (pos < end) {
+        switch (amber_tag_delimiters[(unsigned char)*pos]) {
+        case 0:
+            /* The start of an attribute name */
+            if (boundary && result && (kind == AMBER_TAG_LINK) && ((*pos | 0x20) == 'h')) {
+                switch (amber_match_href(pos, end, &url, &url_end)) {
+                case AMBER_HREF_FOUND:
+                    amber_add_match(scan, result, capacity, buffer, tag_start, pos, url, url_end);
+                    if (*url_end == url[-1]) {
+                        /* The url ends the quoted value, so carry on after it */
+                        pos = url_end + 1;
+                        boundary = 1;
+                        continue;
+                    }
+                    break;
+                case AMBER_HREF_PARTIAL:
+                    /* Leave the link to be carried over by the state machine */
+                    result->count = saved_count;
+                    result->last_match_end = saved_last_match_end;
+                    return NULL;
+                }
+            }
+            boundary = 0;
+            for (pos++; (pos < end) && !(amber_tag_delimiters[(unsigned char)*pos] & AMBER_ENDS_NAME); pos++);
+            break;
+
+        case AMBER_ENDS_NAME:
+            if (*pos == '/') {
+                boundary = 1;
+                pos++;
+                break;
+            }
+            /* "=" starts an attribute value, which may be quoted */
+            boundary = 0;
+            for (pos++; (pos < end) && AMBER_IS_SPACE(*pos); pos++);
+            if (pos >= end) {
+                break;
+            }
+            if ((*pos == '"') || (*pos == '\'')) {
+                if (!(pos = amber_find_char(pos + 1, end, *pos))) {
+                    pos = end;
+                    break;
+                }
+                pos++;
+                boundary = 1;
+            } else {
+                while ((pos < end) && !(amber_tag_delimiters[(unsigned char)*pos] & AMBER_ENDS_VALUE)) {
+                    pos++;
+                }
+            }
+            break;
+
+        default:
+            if (*pos == '>') {
+                if (kind == AMBER_TAG_RAWTEXT) {
+                    html->mode = AMBER_HTML_RAWTEXT;
+                    html->kind = kind;
+                    html->count = 0;
+                }
+                return pos + 1;
+            }
+            boundary = 1;
+            pos++;
+            break;
+        }
+    }
+
+    /* The tag isn't finished by the end of the buffer */
+    if (result) {
+        result->count = saved_count;
+        result->last_match_end = saved_last_match_end;
+    }
+    return NULL;
+}
+
+/* Walk through a buffer with the HTML tokenizer, matching hrefs wherever an attribute of a link start
+   tag begins. Everything else is passed over as quickly as possible: text up to the next "<", whole 
+   tags with amber_scan_tag(), comments up to the next "-", and the contents of script, style and similar 
+   elements up to the next "<". The state machine here deals with everything else a character at a time,
+   including tags and links cut off by the end of the buffer. This follows the HTML5 tokenizer closely
+   enough for real pages, but doesn't handle the rarer cases (like "<!--" inside a script) exactly.
+
+    amber_scan_t *scan      : state for the stream the buffer is part of, which is updated
+    char *buffer            : the buffer to search
+    size_t size             : size of the buffer
+    size_t start            : position in the buffer from which to start searching
+    amber_matches_t *result : where to add any links found, or NULL to just update the state
+*/
+static void amber_scan_html(amber_scan_t *scan, const char *buffer, size_t size, size_t start, amber_matches_t *result)
+{
+    amber_html_state_t *html = &scan->html;
+    const char *pos = buffer + start;
+    const char *end = buffer + size;
+    const char *next;
+    const char *tag_start = NULL;   /* The "<" of the current tag, if it's in this buffer */
+    const char *url;
+    const char *url_end;
+    int capacity = 0;   /* Number of matches there is space for in the result */
+    amber_block_t block = { 0 };
+    char c;
+
+    /* Each case either moves on, or changes mode and leaves the character to be looked at again */
+    while (pos < end) {
+        c = *pos;
+        switch (html->mode) {
+        case AMBER_HTML_TEXT:
+            /* Whole tags are done in one go, and anything else is left to the state machine */
+            do {
+                if (!(tag_start = amber_find_tag(scan, &block, buffer, pos, end, result, &capacity))) {
+                    return;
+                }
+            } while ((pos = amber_scan_tag(scan, buffer, end, tag_start, result, &capacity)) && 
+                     (html->mode == AMBER_HTML_TEXT));
+            if (pos) {
+                break;
+            }
+            pos = tag_start + 1;
+            html->mode = AMBER_HTML_TAG_OPEN;
+            html->end_tag = 0;
+            break;
+
+        case AMBER_HTML_TAG_OPEN:
+            if (AMBER_IS_ALPHA(c)) {
+                html->mode = AMBER_HTML_TAG_NAME;
+                html->name_size = 0;
+            } else if ((c == '/') && !html->end_tag) {
+                html->end_tag = 1;
+                pos++;
+            } else if ((c == '!') && !html->end_tag) {
+                html->mode = AMBER_HTML_MARKUP;
+                html->count = 0;
+                pos++;
+            } else if ((c == '>') && html->end_tag) {
+                html->mode = AMBER_HTML_TEXT;
+                pos++;
+            } else if ((c == '?') || html->end_tag) {
+                html->mode = AMBER_HTML_BOGUS;
+            } else {
+                html->mode = AMBER_HTML_TEXT;
+            }
+            break;
+
+        case AMBER_HTML_TAG_NAME:
+            if (amber_tag_delimiters[(unsigned char)c] & AMBER_ENDS_NAME) {
+                html->kind = amber_tag_kind(html);
+                html->boundary = 1;
+                html->mode = AMBER_HTML_TAG;
+            } else {
+                if (html->name_size < AMBER_MAX_TAG_NAME) {
+                    html->name[html->name_size] = tolower((unsigned char)c);
+                    html->name[html->name_size + 1] = 0;
+                }
+                if (html->name_size <= AMBER_MAX_TAG_NAME) {
+                    html->name_size++;
+                }
+                pos++;
+            }
+            break;
+
+        case AMBER_HTML_TAG:
+            if (AMBER_IS_SPACE(c) || (c == '/')) {
+                html->boundary = 1;
+            } else if (c == '>') {
+                html->mode = (html->kind == AMBER_TAG_RAWTEXT) ? AMBER_HTML_RAWTEXT : AMBER_HTML_TEXT;
+                html->count = 0;
+            } else if (c == '=') {
+                html->mode = AMBER_HTML_VALUE_START;
+                html->boundary = 0;
+            } else {
+                if (html->boundary && result && (html->kind == AMBER_TAG_LINK) && ((c | 0x20) == 'h')) {
+                    /* A link cut off by the end of the buffer is reported, so we can look for the rest of 
+                       it in the next buffer. The tokenizer stops there, so the state is right for carrying
+                       on from the start of the link. Otherwise the attribute itself is tokenized as usual, 
+                       so the state doesn't depend on whether it matched */
+                    switch (amber_match_href(pos, end, &url, &url_end)) {
+                    case AMBER_HREF_FOUND:
+                        amber_add_match(scan, result, &capacity, buffer, tag_start, pos, url, url_end);
+                        break;
+                    case AMBER_HREF_PARTIAL:
+                        result->partial_pos = pos - buffer;
+                        return;
+                    }
+                }
+                /* Pass over the rest of the attribute name */
+                html->boundary = 0;
+                for (pos++; (pos < end) && !(amber_tag_delimiters[(unsigned char)*pos] & AMBER_ENDS_NAME); pos++);
+                break;
+            }
+            pos++;
+            break;
+
+        case AMBER_HTML_VALUE_START:
+            if (AMBER_IS_SPACE(c)) {
+                pos++;
+            } else if ((c == '"') || (c == '\'')) {
+                html->quote = c;
+                html->mode = AMBER_HTML_QUOTED;
+                pos++;
+            } else if (c == '>') {
+                html->mode = AMBER_HTML_TAG;
+            } else {
+                html->mode = AMBER_HTML_VALUE;
+            }
+            break;
+
+        case AMBER_HTML_VALUE:
+            while ((pos < end) && !(amber_tag_delimiters[(unsigned char)*pos] & AMBER_ENDS_VALUE)) {
+                pos++;
+            }
+            if (pos < end) {
+                html->mode = AMBER_HTML_TAG;
+            }
+            break;
+
+        case AMBER_HTML_QUOTED:
+            if (!(next = amber_find_char(pos, end, html->quote))) {
+                return;
+            }
+            pos = next + 1;
+            html->boundary = 1;
+            html->mode = AMBER_HTML_TAG;
+            break;
+
+        case AMBER_HTML_MARKUP:
+            /* Only "<!--" starts a comment. A comment can also be closed straight away ("<!-->") */
+            if (c == '-') {
+                if (html->count) {
+                    html->mode = AMBER_HTML_COMMENT;
+                    html->count = 2;
+                } else {
+                    html->count = 1;
+                }
+                pos++;
+            } else {
+                html->mode = AMBER_HTML_BOGUS;
+            }
+            break;
+
+        case AMBER_HTML_COMMENT:
+            if (c == '-') {
+                if (html->count < 2) {
+                    html->count++;
+                }
+                pos++;
+            } else if ((c == '>') && (html->count == 2)) {
+                html->mode = AMBER_HTML_TEXT;
+                pos++;
+            } else {
+                html->count = 0;
+                if (!(next = amber_find_char(pos, end, '-'))) {
+                    return;
+                }
+                pos = next;
+            }
+            break;
+
+        case AMBER_HTML_BOGUS:
+            if (!(next = amber_find_char(pos, end, '>'))) {
+                return;
+            }
+            pos = next + 1;
+            html->mode = AMBER_HTML_TEXT;
+            break;
+
+        case AMBER_HTML_RAWTEXT:
+            /* Look for "</" and the name of the element, followed by anything that can end a tag name. 
+               count is how much of that has been seen */
+            if (html->count == 0) {
+                if (!(next = amber_find_pair(pos, end, '<', '/'))) {
+                    return;
+                }
+                pos = next + 1;
+                html->count = 1;
+            } else if (html->count == 1) {
+                if (c == '/') {
+                    html->count++;
+                    pos++;
+                } else {
+                    html->count = 0;
+                }
+            } else if (html->count < html->name_size + 2) {
+                if (tolower((unsigned char)c) == html->name[html->count - 2]) {
+                    html->count++;
+                    pos++;
+                } else {
+                    html->count = 0;
+                }
+            } else if (AMBER_IS_SPACE(c) || (c == '/') || (c == '>')) {
+                html->end_tag = 1;
+                html->kind = AMBER_TAG_OTHER;
+                html->boundary = 1;
+                html->mode = AMBER_HTML_TAG;
+            } else {
+                html->count = 0;
+            }
+            break;
+        }
+    }
+}
+
+/* Search a buffer for links that are candidates to be rewritten. Only hrefs in a, area and link start
+   tags are found, so links in scripts, styles, comments and other attributes are left alone. The 
+   state of the HTML tokenizer is kept in scan, so a buffer must start where the last one searched 
+   ended (or at the partial_pos it reported, if the rest was carried over to this buffer).
+
+    amber_scan_t *scan      : state for the stream the buffer is part of
+    char *buffer            : the buffer to search
+    size_t size             : size of the buffer
+    size_t start            : position in the buffer from which to start searching
+    amber_matches_t *result : set to the number of links found, and arrays with the link URL and 
+                              offset within the buffer where any rewriting should occur. If the buffer
+                              ends part way through what may be a link, partial_pos is where it starts, 
+                              and the search stopped there.
+*/
+void amber_find_links(amber_scan_t *scan, const char *buffer, size_t size, size_t start, amber_matches_t *result)
+{
+    result->count = 0;
+    result->insert_pos = NULL;
+    result->tag_pos = NULL;
+    result->url = NULL;
+    result->last_match_end = 0;
+    result->partial_pos = -1;
+    amber_scan_html(scan, buffer, size, start, result);
+}
+
+/* Move the HTML tokenizer on through part of a stream without looking for links. That's needed where 
+   part of a buffer is skipped, or has already been searched with a different state (e.g. the start of
+   a buffer that was searched together with a link carried over from the previous one)
+
+    amber_scan_t *scan      : state for the stream the buffer is part of
+    char *buffer            : the buffer to move through
+    size_t size             : size of the buffer
+    size_t start            : position in the buffer to start from
+*/
+void amber_scan_advance(amber_scan_t *scan, const char *buffer, size_t size, size_t start)
+{
+    amber_scan_html(scan, buffer, size, start, NULL);
+}
+
+/* Join what was held back from the last buffer (see amber_scan_hold()) to the start of the next one, 
+   and look for links starting in what was held back. Links starting in the buffer itself are left to 
+   be found when it's searched. If the link still isn't finished by the end of the buffer, the buffer 
+   is held back along with it
+
+    amber_scan_t *scan      : state for the stream the buffer is part of
+    char *buffer            : the next buffer
+    size_t size             : size of the buffer
+    amber_junction_t *junction : set to the content to pass on before the buffer, and the links in it
+
+    returns the position in the buffer from which to search it with amber_find_links(), or a value 
+    greater than size if the whole buffer has been held back
+*/
+size_t amber_scan_join(amber_scan_t *scan, const char *buffer, size_t size, amber_junction_t *junction)
+{
+    size_t head_size = (size < AMBER_MAX_CARRY) ? size : AMBER_MAX_CARRY;
+    size_t carry_size = scan->carry_size;
+    size_t junction_size = carry_size + head_size;
+    size_t start = 0;
+    amber_html_state_t html = scan->html;
+    char *data;
+    int i;
+
+    junction->data = NULL;
+    junction->size = 0;
+    junction->links.count = 0;
+    junction->links.partial_pos = -1;
+    if (!carry_size) {
+        return 0;
+    }
+
+    data = scan->alloc(scan->baton, junction_size);
+    memcpy(data, scan->carry, carry_size);
+    memcpy(data + carry_size, buffer, head_size);
+    amber_find_links(scan, data, junction_size, 0, &junction->links);
+
+    /* Only links starting in what was held back are dealt with here */
+    for (i = 0; (i < junction->links.count) && (junction->links.insert_pos[i] < carry_size); i++);
+    if (i < junction->links.count) {
+        /* Continue from the first link starting in the buffer itself, which can't overlap those before it */
+        start = junction->links.insert_pos[i] - carry_size;
+    } else if (junction->links.count) {
+        start = junction->links.last_match_end - carry_size;
+    }
+    junction->links.count = i;
+
+    if ((junction->links.partial_pos >= 0) && (junction->links.partial_pos < carry_size) && 
+        (head_size == size) && (junction_size - junction->links.partial_pos <= AMBER_MAX_CARRY)) {
+        /* The link still isn't finished by the end of this buffer, so keep holding it back */
+        carry_size = junction->links.partial_pos;
+        start = size + 1;
+    }
+    junction->data = data;
+    junction->size = carry_size;
+
+    scan->carry_size = junction_size - carry_size;
+    if (start > size) {
+        /* The search stopped at the start of what's held back, so the tokenizer is ready to carry on from there */
+        memcpy(scan->carry, data + carry_size, scan->carry_size);
+    } else {
+        /* The buffer is searched from start, so take the tokenizer back to the start of the junction 
+           and bring it up to there */
+        scan->carry_size = 0;
+        scan->html = html;
+        amber_scan_advance(scan, data, carry_size + start, 0);
+    }
+    return start;
+}
+
+/* Hold back the end of a buffer if it may be the start of a link that's cut off, so that it can be 
+   joined to the next buffer with amber_scan_join(). A link that's too long to be found 
+   (AMBER_MAX_CARRY) is passed on as it is
+
+    amber_scan_t *scan      : state for the stream the buffer is part of
+    char *buffer            : the buffer that was searched
+    size_t size             : size of the buffer
+    amber_matches_t *links  : what amber_find_links() found in it
+
+    returns how much of the buffer to pass on now
+*/
+size_t amber_scan_hold(amber_scan_t *scan, const char *buffer, size_t size, const amber_matches_t *links)
+{
+    if (links->partial_pos < 0) {
+        return size;
+    }
+    if (size - links->partial_pos <= AMBER_MAX_CARRY) {
+        scan->carry_size = size - links->partial_pos;
+        memcpy(scan->carry, buffer + links->partial_pos, scan->carry_size);
+        return links->partial_pos;
+    }
+    /* The search stopped at the link, so bring the tokenizer up to the end of the buffer */
+    amber_scan_advance(scan, buffer, size, links->partial_pos);
+    return size;
+}
+
+/* Give up anything held back from the last buffer, to be passed on as it is since no more data is 
+   coming (or it must be sent now)
+
+    amber_scan_t *scan      : state for the stream
+    const char **data       : set to what was held back, which stays there until something else is 
+                              held back
+
+    returns the size of what was held back, 0 if nothing was
+*/
+size_t amber_scan_flush(amber_scan_t *scan, const char **data)
+{
+    size_t size = scan->carry_size;
+
+    *data = scan->carry;
+    if (size) {
+        /* The search stopped at the start of what was held back, so bring the tokenizer up to the end of it */
+        amber_scan_advance(scan, scan->carry, size, 0);
+        scan->carry_size = 0;
+    }
+    return size;
+}
+
+/* Rewrite a buffer, inserting attributes at the links found in it. Nothing is copied here: the 
+   original content is passed to emit in pieces, with the attributes in between
+
+    char *buffer            : the original content
+    size_t size             : size of the buffer
+    amber_matches_t *links  : links found in the buffer by amber_find_links()
+    amber_attribute_fn attribute : gets the attributes to insert for each link
+    amber_emit_fn emit      : receives the rewritten output
+    void *baton             : passed to attribute and emit
+
+    returns 0 on success, or the first non-zero value returned by emit
+*/
+int amber_splice(const char *buffer, size_t size, const amber_matches_t *links,
+                 amber_attribute_fn attribute, amber_emit_fn emit, void *baton)
+{
+    size_t done = 0;
+    int rc;
+    int i;
+
+    for (i = 0; i < links->count; i++) {
+        const char *insert = attribute(baton, i, links->url[i]);
+        if (!insert || !insert[0] || (links->insert_pos[i] > size)) {
+            continue;
+        }
+        if ((links->insert_pos[i] > done) && (rc = emit(baton, buffer + done, links->insert_pos[i] - done, 0))) {
+            return rc;
+        }
+        done = links->insert_pos[i];
+        if ((rc = emit(baton, insert, strlen(insert), 1))) {
+            return rc;
+        }
+    }
+    if (done < size) {
+        return emit(baton, buffer + done, size - done, 0);
+    }
+    return 0;
+}
+
+/* Format the date a url was cached, as used in the data-versiondate attribute
+
+    time_t date             : when the cache was generated (unix epoch)
+    char *out               : buffer of at least AMBER_MAX_DATE_STRING characters
+*/
+void amber_format_date(time_t date, char *out)
+{
+    struct tm timeinfo;
+    localtime_r(&date, &timeinfo);
+    strftime(out, AMBER_MAX_DATE_STRING, "%FT%T%z", &timeinfo);
+}
+
+/* Create a string containing attributes to be added to the HREF, from its parts. The string is 
+   allocated once, at the right size
+
+    amber_alloc_fn alloc    : how to allocate the string
+    void *baton             : passed to alloc
+    char *url_prefix        : absolute url of the root of the server
+    char *location          : location of the cached copy, relative to the root
+    char *date_string       : when the cache was generated, from amber_format_date()
+    char *behavior          : value of the behavior attribute, from amber_get_behavior()
+
+    returns the attributes, or NULL if they could not be allocated
+*/
+char *amber_format_attribute(amber_alloc_fn alloc, void *baton, const char *url_prefix, const char *location,
+                             const char *date_string, const char *behavior)
+{
+    const char *parts[] = { "data-versionurl='", url_prefix, location, "' data-versiondate='", date_string,
+                            "' data-amber-behavior='", behavior, "' " };
+    size_t sizes[sizeof(parts) / sizeof(parts[0])];
+    size_t total = 0;
+    char *out, *pos;
+    size_t i;
+
+    for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        sizes[i] = strlen(parts[i]);
+        total += sizes[i];
+    }
+    if (!(out = alloc(baton, total + 1))) {
+        return NULL;
+    }
+    for (pos = out, i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        memcpy(pos, parts[i], sizes[i]);
+        pos += sizes[i];
+    }
+    *pos = 0;
+    return out;
+}
+
+/* Create a string containing attributes to be added to the HREF
+
+    amber_options_t *options : configuration settings
+    char *out               : buffer to where the attribute is written
+    chatr *locatino         : location of the cached copy
+    int status              : whether the site is up or down
+    time_t date             : when the cache was generated (unix epoch)
+
+    returns 0 on success
+*/
+int amber_build_attribute(amber_options_t *options, unsigned char *out, char *location, int status, time_t date)
+{
+    unsigned char behavior[AMBER_MAX_BEHAVIOR_STRING];
+    char date_string[AMBER_MAX_DATE_STRING];
+
+    int rc = amber_get_behavior(options, behavior, status);
+    if (!rc && (strlen((char*)behavior) > 0)) {
+        amber_format_date(date, date_string);
+        snprintf((char *)out,
+             AMBER_MAX_ATTRIBUTE_STRING,
+             "data-versionurl='%s' data-versiondate='%s' data-amber-behavior='%s' ",
+             location,
+             date_string,
+             behavior
+             );
+         }
+    return rc;
+}
+
+/* Get the contents of behavior attribute based on the status of the link
+   and the configuration settings.
+
+   amber_options_t *options : configuration settings
+   char *out               : buffer to where the attribute is written
+   int status              : whether the site is up or down
+
+   returns 0 on success
+
+   TODO: Country-specific behavior
+   */
+int amber_get_behavior(amber_options_t *options, unsigned char *out, int status) {
+    if (!options || !out) {
+        return 1;
+    }
+    if (status == AMBER_STATUS_UP) {
+        switch (options->behavior_up) {
+            case AMBER_ACTION_HOVER:
+                snprintf((char *)out,
+                         AMBER_MAX_ATTRIBUTE_STRING,
+                         "up hover:%d",
+                         options->hover_delay_up);
+                break;
+            case AMBER_ACTION_POPUP:
+                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "up popup");
+                break;
+            case AMBER_ACTION_CACHE:
+                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "up cache");
+                break;
+            case AMBER_ACTION_NONE:
+                out[0] = 0;
+                break;
+        }
+    } else if (status == AMBER_STATUS_DOWN) {
+        switch (options->behavior_down) {
+            case AMBER_ACTION_HOVER:
+                snprintf((char *)out,
+                         AMBER_MAX_ATTRIBUTE_STRING,
+                         "down hover:%d",
+                         options->hover_delay_down);
+                break;
+            case AMBER_ACTION_POPUP:
+                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "down popup");
+                break;
+            case AMBER_ACTION_CACHE:
+                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "down cache");
+                break;
+            case AMBER_ACTION_NONE:
+                out[0] = 0;
+                break;
+
+        }
+    }
+    if (options->country && strlen(options->country)) {
+        char country_attribute[AMBER_MAX_ATTRIBUTE_STRING] = "";
+        if (status == AMBER_STATUS_UP) {
+            switch (options->country_behavior_up) {
+                case AMBER_ACTION_HOVER:
+                    snprintf(country_attribute,
+                             AMBER_MAX_ATTRIBUTE_STRING,
+                             ",%s up hover:%d",
+                             options->country,
+                             options->country_hover_delay_up);
+                    break;
+                case AMBER_ACTION_POPUP:
+                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s up popup", options->country);
+                    break;
+                case AMBER_ACTION_CACHE:
+                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s up cache", options->country);
+                    break;
+                case AMBER_ACTION_NONE:
+                    break;
+            }
+        } else if (status == AMBER_STATUS_DOWN) {
+            switch (options->country_behavior_down) {
+                case AMBER_ACTION_HOVER:
+                    snprintf(country_attribute,
+                             AMBER_MAX_ATTRIBUTE_STRING,
+                             ",%s down hover:%d",
+                             options->country,
+                             options->country_hover_delay_down);
+                    break;
+                case AMBER_ACTION_POPUP:
+                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s down popup", options->country);
+                    break;
+                case AMBER_ACTION_CACHE:
+                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s down cache", options->country);
+                    break;
+                case AMBER_ACTION_NONE:
+                    break;
+            }
+        }
+        if (strlen(country_attribute)) {
+            strncat((char *) out, country_attribute, AMBER_MAX_ATTRIBUTE_STRING - strlen((char *)out));
+        }
+    }
+
+    return 0;
+}
+
+/* 64-bit FNV-1a hash of a string
+
+    char *s                 : the string to hash
+    uint64_t seed           : 0, or the hash of a previous string to combine with this one
+
+    returns the hash
+*/
+uint64_t amber_hash(const char *s, uint64_t seed) {
+    uint64_t hash = seed ? seed : 14695981039346656037ULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Hash a url for a lookup index. 0 marks an unused slot, so it's never returned
+
+    const char *url         : the url
+
+    returns the hash
+*/
+uint64_t amber_index_hash(const char *url) {
+    uint64_t hash = amber_hash(url, 0);
+    return hash ? hash : 1;
+}
+
+/* Get the host from a url, in lower case, without any user name or port
+
+    const char *url         : the url
+    char *host              : set to the host, which is at most AMBER_MAX_HOST characters 
+                              (the buffer must hold AMBER_MAX_HOST + 1)
+
+    returns the length of the host, or -1 if the url has no host or it's too long
+*/
+int amber_url_host(const char *url, char *host) {
+    const char *start = strstr(url, "://");
+    const char *end, *at, *port;
+    int i;
+
+    if (!start) {
+        return -1;
+    }
+    start += 3;
+    end = start + strcspn(start, "/?#");
+    for (at = start; at < end; at++) {
+        if (*at == '@') {
+            start = at + 1;
+        }
+    }
+    /* A port follows the last ':', unless it's part of an IPv6 address in brackets */
+    for (port = end; (port > start) && (port[-1] != ':') && (port[-1] != ']'); port--);
+    if ((port > start) && (port[-1] == ':')) {
+        end = port - 1;
+    }
+    while ((end > start) && (end[-1] == '.')) {
+        end--;
+    }
+    if ((end == start) || (end - start > AMBER_MAX_HOST)) {
+        return -1;
+    }
+    for (i = 0; start + i < end; i++) {
+        host[i] = tolower((unsigned char)start[i]);
+    }
+    host[i] = 0;
+    return i;
+}
+
+/* Put a url into the form it's looked up and queued in, so that the different ways of writing the 
+   same url in HTML are treated as one. The "&" entities that HTML requires in query strings are 
+   decoded, the scheme and host are lower-cased, the port is removed if it's the default for the 
+   scheme, and so is any fragment. An empty path becomes "/". Other trailing slashes are kept, since 
+   "/a" and "/a/" can be different pages. Anything without "://" is only decoded.
+
+    amber_alloc_fn alloc    : how to allocate the result
+    void *baton             : passed to alloc
+    const char *url         : the url, as found in the HTML
+
+    returns the canonical url, or NULL if it could not be allocated
+*/
+char *amber_canonical_url(amber_alloc_fn alloc, void *baton, const char *url) {
+    char *out = alloc(baton, strlen(url) + 2);      /* Room to add a "/" */
+    char *p = out;
+    char *scheme_end, *host, *end, *port, *c;
+    size_t scheme_size;
+
+    if (!out) {
+        return NULL;
+    }
+    while (*url) {
+        if (*url == '&') {
+            if (!strncmp(url, "&amp;", 5) || !strncmp(url, "&#38;", 5)) {
+                *p++ = '&';
+                url += 5;
+                continue;
+            }
+            if (!strncasecmp(url, "&#x26;", 6)) {
+                *p++ = '&';
+                url += 6;
+                continue;
+            }
+        }
+        *p++ = *url++;
+    }
+    *p = 0;
+
+    if (!(scheme_end = strstr(out, "://"))) {
+        return out;
+    }
+    scheme_size = scheme_end - out;
+    for (c = out; c < scheme_end; c++) {
+        *c = tolower((unsigned char)*c);
+    }
+
+    /* Leave any user name and password alone */
+    host = scheme_end + 3;
+    end = host + strcspn(host, "/?#");
+    for (c = host; c < end; c++) {
+        if (*c == '@') {
+            host = c + 1;
+        }
+    }
+    for (c = host; c < end; c++) {
+        *c = tolower((unsigned char)*c);
+    }
+
+    /* A port follows the last ':', unless it's part of an IPv6 address in brackets */
+    for (port = end; (port > host) && (port[-1] != ':') && (port[-1] != ']'); port--);
+    if ((port > host) && (port[-1] == ':')) {
+        size_t port_size = end - port;
+        if (!port_size || 
+            ((scheme_size == 4) && !strncmp(out, "http", 4) && (port_size == 2) && !strncmp(port, "80", 2)) ||
+            ((scheme_size == 5) && !strncmp(out, "https", 5) && (port_size == 3) && !strncmp(port, "443", 3))) {
+            memmove(port - 1, end, strlen(end) + 1);
+            end = port - 1;
+        }
+    }
+
+    if ((c = strchr(end, '#'))) {
+        *c = 0;
+    }
+    if (*end != '/') {
+        memmove(end + 1, end, strlen(end) + 1);
+        *end = '/';
+    }
+    return out;
+}
+
+/* Build the sql query that looks up to AMBER_LOOKUP_BATCH_SIZE urls at once, as the Apache module 
+   does. With by_hash, rows are found by the amber_index_hash() of the url's canonical form (the 
+   first AMBER_LOOKUP_BATCH_SIZE parameters), or by the url as written in the page (the next 
+   AMBER_LOOKUP_BATCH_SIZE) if the row has no url_hash yet. Those are found through amber_cache's 
+   index on url, rather than by going through every row without a hash. Otherwise (for a database 
+   without a url_hash column) there are only the urls as written. Unused parameters are left NULL. 
+   Each row is the url, the location of the cache, its date and the status, and may be for a 
+   different url with the same hash, so the caller compares the canonical form of the url to the 
+   one looked up
+
+    amber_alloc_fn alloc    : how to allocate the result
+    void *baton             : passed to alloc
+    int by_hash             : does the amber_check table have a url_hash column?
+
+    returns the query, or NULL if it could not be allocated
+*/
+char *amber_lookup_query(amber_alloc_fn alloc, void *baton, int by_hash) {
+    static const char select[] = "SELECT ah.url, aa.location, aa.date, ah.status FROM amber_cache aa, amber_check ah "
+                                 "WHERE aa.id = ah.id AND ";
+    char *out = alloc(baton, 2 * sizeof(select) + 4 * AMBER_LOOKUP_BATCH_SIZE + 100);
+    char *p = out;
+    int i;
+
+    if (!out) {
+        return NULL;
+    }
+    p += sprintf(p, "%s%s", select, by_hash ? "ah.url_hash IN (" : "aa.url IN (");
+    for (i = 0; i < (by_hash ? 2 : 1) * AMBER_LOOKUP_BATCH_SIZE; i++) {
+        if (i == AMBER_LOOKUP_BATCH_SIZE) {
+            p += sprintf(p, ") UNION ALL %s+ah.url_hash IS NULL AND aa.url IN (", select);
+        } else if (i) {
+            *p++ = ',';
+        }
+        *p++ = '?';
+    }
+    strcpy(p, ")");
+    return out;
+}
+
+/* Set up an empty skip list
+
+    amber_skip_t *skip      : the skip list
+    int count               : the most patterns that will be added
+    amber_alloc_fn alloc    : how to allocate the table
+    void *baton             : passed to alloc
+
+    returns 0 on success
+*/
+int amber_skip_init(amber_skip_t *skip, int count, amber_alloc_fn alloc, void *baton) {
+    uint32_t slot_count = 16;
+
+    /* A domain takes two entries, and the table is kept at most half full */
+    while (slot_count < (uint32_t)count * 4) {
+        slot_count <<= 1;
+    }
+    skip->mask = slot_count - 1;
+    skip->count = 0;
+    if (!(skip->slots = alloc(baton, slot_count * sizeof(uint64_t)))) {
+        return -1;
+    }
+    memset(skip->slots, 0, slot_count * sizeof(uint64_t));
+    return 0;
+}
+
+static int amber_skip_insert(amber_skip_t *skip, uint64_t hash) {
+    uint32_t i = hash & skip->mask;
+
+    if ((skip->count + 1) * 2 > skip->mask + 1) {
+        return -1;
+    }
+    while (skip->slots[i] && (skip->slots[i] != hash)) {
+        i = (i + 1) & skip->mask;
+    }
+    if (!skip->slots[i]) {
+        skip->slots[i] = hash;
+        skip->count++;
+    }
+    return 0;
+}
+
+static int amber_skip_contains(const amber_skip_t *skip, uint64_t hash) {
+    uint32_t i = hash & skip->mask;
+
+    while (skip->slots[i]) {
+        if (skip->slots[i] == hash) {
+            return 1;
+        }
+        i = (i + 1) & skip->mask;
+    }
+    return 0;
+}
+
+/* Add a pattern to a skip list. A pattern is a url in the form from amber_canonical_url() (left alone 
+   only if it matches exactly), a host, or a domain starting with "." or "*." (which matches the domain 
+   and any host within it)
+
+    amber_skip_t *skip      : the skip list
+    const char *pattern     : the pattern
+
+    returns 0 on success, or -1 if the pattern isn't valid or the list is full
+*/
+int amber_skip_add(amber_skip_t *skip, const char *pattern) {
+    char host[AMBER_MAX_HOST + 2];
+    size_t size;
+    int domain = 0;
+    size_t i;
+
+    if (strstr(pattern, "://")) {
+        return amber_skip_insert(skip, amber_index_hash(pattern));
+    }
+    if ((pattern[0] == '*') && (pattern[1] == '.')) {
+        pattern++;
+    }
+    if (pattern[0] == '.') {
+        domain = 1;
+        pattern++;
+    }
+    size = strlen(pattern);
+    while (size && (pattern[size - 1] == '.')) {
+        size--;
+    }
+    if (!size || (size > AMBER_MAX_HOST)) {
+        return -1;
+    }
+
+    /* Domains are kept with the leading ".", which a host never has */
+    host[0] = '.';
+    for (i = 0; i < size; i++) {
+        host[i + 1] = tolower((unsigned char)pattern[i]);
+    }
+    host[size + 1] = 0;
+    if (amber_skip_insert(skip, amber_index_hash(host + 1))) {
+        return -1;
+    }
+    return domain ? amber_skip_insert(skip, amber_index_hash(host)) : 0;
+}
+
+/* Check whether a link should be left alone. Costs a hash of the url and the host, and one probe 
+   for each level of the host's domain
+
+    amber_skip_t *skip      : the skip list
+    const char *url         : the link, in the form from amber_canonical_url()
+    const char *host        : the host of the link from amber_url_host(), or NULL if it has none
+
+    returns 1 if the link matches the skip list
+*/
+int amber_skip_match(const amber_skip_t *skip, const char *url, const char *host) {
+    const char *dot;
+
+    if (!skip->count) {
+        return 0;
+    }
+    if (amber_skip_contains(skip, amber_index_hash(url))) {
+        return 1;
+    }
+    if (!host || !host[0]) {
+        return 0;
+    }
+    if (amber_skip_contains(skip, amber_index_hash(host))) {
+        return 1;
+    }
+    for (dot = strchr(host, '.'); dot; dot = strchr(dot + 1, '.')) {
+        if (amber_skip_contains(skip, amber_index_hash(dot))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Number of slots in a lookup index, which is kept at most half full so that probes are short */
+static uint32_t amber_index_slot_count(int count) {
+    uint32_t slot_count = 16;
+    while (slot_count < (uint32_t)count * 2) {
+        slot_count <<= 1;
+    }
+    return slot_count;
+}
+
+/* Work out how much memory amber_index_build() needs for an index
+
+    amber_index_entry_t *entries : the urls to put in the index
+    int count               : number of entries
+
+    returns the size in bytes, or 0 if the index would be too large
+*/
+size_t amber_index_size(const amber_index_entry_t *entries, int count) {
+    uint64_t strings_size = 0;
+    int i;
+
+    if ((count < 0) || (count > (1 << 30))) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        strings_size += strlen(entries[i].url) + strlen(entries[i].location) + 2;
+    }
+    if (strings_size > UINT32_MAX) {
+        return 0;
+    }
+    return sizeof(amber_index_header_t) + amber_index_slot_count(count) * sizeof(amber_index_slot_t) + strings_size;
+}
+
+/* Build a lookup index. If a url appears more than once, the first entry for it is used
+
+    amber_index_entry_t *entries : the urls to put in the index
+    int count               : number of entries
+    uint64_t generation     : amber_generation of the database the entries were read from, or 0 if not known
+    void *out               : where to build the index, amber_index_size() bytes (8-byte aligned)
+
+    returns the size of the index, which may be less than amber_index_size() if there are duplicate urls
+*/
+size_t amber_index_build(const amber_index_entry_t *entries, int count, uint64_t generation, void *out) {
+    amber_index_header_t *header = out;
+    uint32_t slot_count = amber_index_slot_count(count);
+    uint32_t mask = slot_count - 1;
+    amber_index_slot_t *slots = (amber_index_slot_t *)(header + 1);
+    char *strings = (char *)(slots + slot_count);
+    uint32_t strings_size = 0;
+    uint32_t entry_count = 0;
+    int i;
+
+    memset(header, 0, sizeof(amber_index_header_t) + slot_count * sizeof(amber_index_slot_t));
+    for (i = 0; i < count; i++) {
+        uint64_t hash = amber_index_hash(entries[i].url);
+        uint32_t j = hash & mask;
+        size_t url_size = strlen(entries[i].url) + 1;
+        size_t location_size = strlen(entries[i].location) + 1;
+
+        while (slots[j].hash && ((slots[j].hash != hash) || strcmp(strings + slots[j].url, entries[i].url))) {
+            j = (j + 1) & mask;
+        }
+        if (slots[j].hash) {
+            continue;
+        }
+        slots[j].hash = hash;
+        slots[j].url = strings_size;
+        slots[j].date = entries[i].date;
+        slots[j].status = entries[i].status;
+        memcpy(strings + strings_size, entries[i].url, url_size);
+        memcpy(strings + strings_size + url_size, entries[i].location, location_size);
+        strings_size += url_size + location_size;
+        entry_count++;
+    }
+
+    memcpy(header->magic, AMBER_INDEX_MAGIC, sizeof(header->magic));
+    header->version = AMBER_INDEX_VERSION;
+    header->slot_count = slot_count;
+    header->entry_count = entry_count;
+    header->strings_size = strings_size;
+    header->generation = generation;
+    return sizeof(amber_index_header_t) + slot_count * sizeof(amber_index_slot_t) + strings_size;
+}
+
+/* Check that a lookup index is complete and consistent, so that lookups can't read outside it
+
+    amber_index_t *index    : set up to look urls up in the index
+    const void *data        : the index file (e.g. mapped into memory), which must be 8-byte aligned
+    size_t size             : size of the file
+
+    returns 0 on success
+*/
+int amber_index_open(amber_index_t *index, const void *data, size_t size) {
+    const amber_index_header_t *header = data;
+    size_t slots_size;
+
+    if ((size < sizeof(amber_index_header_t)) || memcmp(header->magic, AMBER_INDEX_MAGIC, sizeof(header->magic)) ||
+        (header->version != AMBER_INDEX_VERSION) || !header->slot_count || 
+        (header->slot_count & (header->slot_count - 1)) || (header->entry_count >= header->slot_count)) {
+        return -1;
+    }
+    slots_size = (size_t)header->slot_count * sizeof(amber_index_slot_t);
+    if ((slots_size / sizeof(amber_index_slot_t) != header->slot_count) || 
+        (size - sizeof(amber_index_header_t) < slots_size) ||
+        (size - sizeof(amber_index_header_t) - slots_size < header->strings_size)) {
+        return -1;
+    }
+    index->header = header;
+    index->slots = (const amber_index_slot_t *)(header + 1);
+    index->strings = (const char *)(index->slots + header->slot_count);
+
+    /* Every string must be terminated within the index */
+    if (header->strings_size && index->strings[header->strings_size - 1]) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Look up a url in a lookup index. Nothing is copied, and nothing is written to the index, so any 
+   number of threads can look urls up at the same time
+
+    amber_index_t *index    : an index opened by amber_index_open()
+    const char *url         : the url to look up
+    const char **location   : set to the location of the cache (within the index) if the url is found
+    int *date               : set to when the cache was generated
+    int *status             : set to whether the site is up or down
+
+    returns AMBER_CACHE_ATTRIBUTES_FOUND, AMBER_CACHE_ATTRIBUTES_EMPTY if the url has been checked but 
+    not cached, AMBER_CACHE_ATTRIBUTES_NOT_FOUND if it isn't in the index, or 
+    AMBER_CACHE_ATTRIBUTES_ERROR if the index is corrupt
+*/
+int amber_index_lookup(const amber_index_t *index, const char *url, const char **location, int *date, int *status) {
+    uint64_t hash = amber_index_hash(url);
+    uint32_t mask = index->header->slot_count - 1;
+    uint32_t strings_size = index->header->strings_size;
+    uint32_t probes;
+    uint32_t i = hash & mask;
+
+    for (probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+        const amber_index_slot_t *slot = &index->slots[i];
+        size_t url_size;
+        if (!slot->hash) {
+            return AMBER_CACHE_ATTRIBUTES_NOT_FOUND;
+        }
+        if (slot->hash != hash) {
+            continue;
+        }
+        if (slot->url >= strings_size) {
+            return AMBER_CACHE_ATTRIBUTES_ERROR;
+        }
+        if (strcmp(index->strings + slot->url, url)) {
+            continue;
+        }
+        url_size = strlen(url) + 1;
+        if (strings_size - slot->url <= url_size) {
+            return AMBER_CACHE_ATTRIBUTES_ERROR;
+        }
+        *location = index->strings + slot->url + url_size;
+        *date = slot->date;
+        *status = slot->status;
+        return (*location)[0] ? AMBER_CACHE_ATTRIBUTES_FOUND : AMBER_CACHE_ATTRIBUTES_EMPTY;
+    }
+    return AMBER_CACHE_ATTRIBUTES_NOT_FOUND;
+}
@@ -0,0 +1,210 @@
+/* ======================================================================== */
+/* Amber core - finding links in HTML and adding attributes to them         */
+/* Platform-independent, so it can be shared by the Apache module, other    */
+/* ports, and the benchmarks in bench/                                      */
+/* ======================================================================== */
+
+#ifndef AMBER_CORE_H
+#define AMBER_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define AMBER_ACTION_NONE     0
+#define AMBER_ACTION_HOVER    1
+#define AMBER_ACTION_POPUP    2
+#define AMBER_ACTION_CACHE    3
+#define AMBER_STATUS_DOWN     0
+#define AMBER_STATUS_UP       1
+#define AMBER_MAX_ATTRIBUTE_STRING 250
+#define AMBER_MAX_BEHAVIOR_STRING 100
+#define AMBER_MAX_DATE_STRING 30
+#define AMBER_CACHE_ATTRIBUTES_ERROR -1
+#define AMBER_CACHE_ATTRIBUTES_FOUND 0
+#define AMBER_CACHE_ATTRIBUTES_EMPTY 1
+#define AMBER_CACHE_ATTRIBUTES_NOT_FOUND 2
+#define AMBER_MAX_CARRY 2048            /* Longest link that will be found if it is split between two buffers */
+#define AMBER_MATCHES_INITIAL 8         /* Matches to allocate space for at first (doubled as required) */
+#define AMBER_MAX_TAG_NAME 8            /* Longest tag name that the HTML tokenizer needs to recognise */
+#define AMBER_LOOKUP_BATCH_SIZE 50      /* Maximum number of urls looked up in a single database query */
+
+#define AMBER_MAX_HOST 255              /* Longest host name that can be matched by a skip list */
+#define AMBER_INDEX_MAGIC "AMBERIX"      /* Start of a lookup index file (with the terminating 0) */
+#define AMBER_INDEX_VERSION 3           /* Urls are canonical (see amber_canonical_url()) since version 2, and the header has the generation since version 3 */
+
+/* Regex pattern for urls within hrefs. amber_find_links() matches it without a regex library, 
+   wherever an attribute of a link tag starts */
+#define AMBER_HREF_PATTERN "href=[\"'](http[^\v()<>{}\\[\\]\"']+)['\"]"
+
+/* Configuration settings */
+typedef struct {
+    int        enabled;                  /* Is Amber enabled? */
+    char *     database;                 /* Path to the sqlite database */
+    int        behavior_up;              /* Default behaviour when site is up */
+    int        behavior_down;            /* Default behaviour when site is down */
+    int        hover_delay_up;           /* Hover delay when site is up */
+    int        hover_delay_down;         /* Hover delay when site is down */
+    char *     country;                  /* Two-character country code for country-specific behavior */
+    int        country_behavior_up;      /* Default behaviour when site is up */
+    int        country_behavior_down;    /* Default behaviour when site is down */
+    int        country_hover_delay_up;   /* Hover delay when site is up */
+    int        country_hover_delay_down; /* Hover delay when site is down */
+    int        cache_delivery;
+    char *     behavior_attribute[2];    /* data-amber-behavior values for sites that are down and up, built
+                                            when the configuration is merged (NULL if not built yet) */
+    int        inject_assets;            /* Insert the Amber javascript and CSS after </head>? */
+    char *     inject_locale;            /* Locale of the javascript and CSS, or NULL for the default */
+    char *     assets;                   /* The tags to insert, built when the configuration is merged (NULL for none) */
+    char *     index;                    /* Path to the lookup index built from the database, or NULL for none */
+    char *     skip_hosts;               /* Hosts whose links are left alone, separated by spaces (NULL for none) */
+    int        skip_self;                /* Leave links to the host the page was requested from alone? */
+    int        lookup_budget;            /* Most milliseconds spent looking up links for a response (0 for no limit) */
+    int        lookup_max_links;         /* Most links annotated in a response (0 for no limit) */
+} amber_options_t;
+
+/* Structure representing the complete list of URLs found within a chunk of HTML, with offsets */
+typedef struct {
+    int   count;        /* Number of matching insertion positions and urls */
+    int   *insert_pos;  /* Array - positions within the buffer where additional
+                           attributes should in inserted for matching hrefs */
+    int   *tag_pos;     /* Array - positions of the "<" starting the tag each href is in,
+                           or -1 if the tag started before the buffer */
+    char  **url;        /* Array - urls within the buffer. */
+    int   last_match_end; /* Position just after the end of the last match */
+    int   partial_pos;  /* Position of a match that was cut off by the end of the buffer, or -1 */
+} amber_matches_t;
+
+/* Allocate memory that lives as long as the caller needs it (e.g. from an APR pool). Memory is never
+   freed individually. Results of amber_find_links() are only needed until the buffer has been 
+   rewritten, so the caller can free everything allocated for one buffer (e.g. clear a subpool) 
+   before searching the next */
+typedef void *(*amber_alloc_fn)(void *baton, size_t size);
+
+/* Get the attributes to insert for a url, or NULL (or an empty string) to leave it alone */
+typedef const char *(*amber_attribute_fn)(void *baton, int index, const char *url);
+
+/* Receive the next piece of rewritten output. Original content is passed as a pointer into the
+   buffer being rewritten, so the caller can avoid copying it. Returns 0 to continue */
+typedef int (*amber_emit_fn)(void *baton, const char *data, size_t size, int inserted);
+
+/* Where the HTML tokenizer is in the document */
+#define AMBER_HTML_TEXT         0       /* Ordinary text */
+#define AMBER_HTML_TAG_OPEN     1       /* Just after "<" (or "</") */
+#define AMBER_HTML_TAG_NAME     2       /* In the name of a tag */
+#define AMBER_HTML_TAG          3       /* In a tag, between or in attribute names */
+#define AMBER_HTML_VALUE_START  4       /* After the "=" of an attribute */
+#define AMBER_HTML_VALUE        5       /* In an unquoted attribute value */
+#define AMBER_HTML_QUOTED       6       /* In a quoted attribute value */
+#define AMBER_HTML_MARKUP       7       /* Just after "<!" */
+#define AMBER_HTML_COMMENT      8       /* In a comment */
+#define AMBER_HTML_BOGUS        9       /* In a doctype, "<?...>" or other markup that runs to the next ">" */
+#define AMBER_HTML_RAWTEXT      10      /* In the contents of a script, style or similar element */
+
+/* The kind of tag the HTML tokenizer is in */
+#define AMBER_TAG_OTHER         0
+#define AMBER_TAG_LINK          1       /* a, area and link start tags, whose hrefs may be rewritten */
+#define AMBER_TAG_RAWTEXT       2       /* Start tags of elements whose contents aren't HTML */
+
+/* State of the HTML tokenizer, carried from one buffer to the next */
+typedef struct {
+    unsigned char   mode;               /* AMBER_HTML_* */
+    unsigned char   kind;               /* AMBER_TAG_* */
+    unsigned char   end_tag;            /* Is this an end tag? */
+    unsigned char   boundary;           /* Could an attribute name start here? */
+    unsigned char   count;              /* Dashes seen in a comment, or characters of the end tag matched in raw text */
+    char            quote;              /* The quote that ends a quoted attribute value */
+    unsigned char   name_size;          /* Length of the tag name, which is AMBER_MAX_TAG_NAME + 1 if it's too long */
+    char            name[AMBER_MAX_TAG_NAME + 1]; /* The tag name, in lower case */
+} amber_html_state_t;
+
+/* Per-stream state for finding links */
+typedef struct {
+    amber_html_state_t html;            /* Where the end of the last buffer searched was in the HTML */
+    amber_alloc_fn  alloc;
+    void            *baton;
+    int             avx2;               /* Can the CPU find characters 32 bytes at a time? */
+    char            carry[AMBER_MAX_CARRY]; /* End of the last buffer, held back by amber_scan_hold() because 
+                                           it may be the start of a link */
+    size_t          carry_size;
+} amber_scan_t;
+
+/* What was held back from the last buffer, joined to the start of the next one by amber_scan_join() */
+typedef struct {
+    const char      *data;              /* Content to pass on before the buffer (allocated with the scan's alloc) */
+    size_t          size;               /* Size of the content, 0 if there's nothing to pass on */
+    amber_matches_t links;              /* Links found in the content */
+} amber_junction_t;
+
+/* A lookup index file is a read-only snapshot of the cache and check tables, which can be mapped into
+   memory and shared by any number of processes. The header is followed by slot_count slots (an open 
+   addressing table, probed linearly from the url's hash) and then the strings. Numbers are in the 
+   byte order of the machine that built the index */
+typedef struct {
+    char        magic[8];       /* AMBER_INDEX_MAGIC */
+    uint32_t    version;        /* AMBER_INDEX_VERSION */
+    uint32_t    slot_count;     /* A power of two, at least twice entry_count */
+    uint32_t    entry_count;
+    uint32_t    strings_size;
+    uint64_t    generation;     /* amber_generation of the database when the index was built, 0 if not known */
+} amber_index_header_t;
+
+typedef struct {
+    uint64_t    hash;           /* amber_index_hash() of the url, 0 if the slot is unused */
+    uint32_t    url;            /* Offset of the url in the strings. It's followed by the location */
+    int32_t     date;           /* When the cache was generated (unix epoch) */
+    int32_t     status;         /* Whether the site is up or down */
+    uint32_t    reserved;
+} amber_index_slot_t;
+
+/* A set of hosts, domains and urls whose links are left alone. Only hashes are kept, so a url may 
+   (very rarely) be matched by mistake */
+typedef struct {
+    uint64_t    *slots;         /* Open addressing table of hashes, 0 if the slot is unused */
+    uint32_t    mask;           /* Number of slots - 1 */
+    uint32_t    count;
+} amber_skip_t;
+
+/* A url to be added to a lookup index */
+typedef struct {
+    const char  *url;
+    const char  *location;      /* Empty if the url has been checked but not cached */
+    int         date;
+    int         status;
+} amber_index_entry_t;
+
+/* A lookup index that has been checked by amber_index_open() */
+typedef struct {
+    const amber_index_header_t  *header;
+    const amber_index_slot_t    *slots;
+    const char                  *strings;
+} amber_index_t;
+
+void amber_scan_init(amber_scan_t *scan, amber_alloc_fn alloc, void *baton);
+void amber_find_links(amber_scan_t *scan, const char *buffer, size_t size, size_t start, amber_matches_t *result);
+void amber_scan_advance(amber_scan_t *scan, const char *buffer, size_t size, size_t start);
+size_t amber_scan_join(amber_scan_t *scan, const char *buffer, size_t size, amber_junction_t *junction);
+size_t amber_scan_hold(amber_scan_t *scan, const char *buffer, size_t size, const amber_matches_t *links);
+size_t amber_scan_flush(amber_scan_t *scan, const char **data);
+int amber_splice(const char *buffer, size_t size, const amber_matches_t *links,
+                 amber_attribute_fn attribute, amber_emit_fn emit, void *baton);
+
+void amber_format_date(time_t date, char *out);
+char *amber_format_attribute(amber_alloc_fn alloc, void *baton, const char *url_prefix, const char *location,
+                             const char *date_string, const char *behavior);
+int amber_get_behavior(amber_options_t *options, unsigned char *out, int status);
+int amber_build_attribute(amber_options_t *options, unsigned char *out, char *location, int status, time_t date);
+uint64_t amber_hash(const char *s, uint64_t seed);
+uint64_t amber_index_hash(const char *url);
+int amber_url_host(const char *url, char *host);
+char *amber_canonical_url(amber_alloc_fn alloc, void *baton, const char *url);
+char *amber_lookup_query(amber_alloc_fn alloc, void *baton, int by_hash);
+int amber_skip_init(amber_skip_t *skip, int count, amber_alloc_fn alloc, void *baton);
+int amber_skip_add(amber_skip_t *skip, const char *pattern);
+int amber_skip_match(const amber_skip_t *skip, const char *url, const char *host);
+size_t amber_index_size(const amber_index_entry_t *entries, int count);
+size_t amber_index_build(const amber_index_entry_t *entries, int count, uint64_t generation, void *out);
+int amber_index_open(amber_index_t *index, const void *data, size_t size);
+int amber_index_lookup(const amber_index_t *index, const char *url, const char **location, int *date, int *status);
+
+#endif
@@ -0,0 +1,701 @@
+/* ======================================================================== */
+/* Benchmarks for amber_core                                                */
+/*                                                                          */
+/* Runs the link scanner, attribute building and the whole rewrite          */
+/* (scanning, lookups in a synthetic sqlite database, and splicing) over    */
+/* an HTML corpus, at a range of bucket sizes, and in many threads at once  */
+/* to check that the results don't change. See bench/README.md              */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "pcre.h"
+#include "amber_harness.h"
+
+#define BENCH_DEFAULT_SECONDS 1.0
+#define BENCH_SYNTHETIC_SIZE (512 * 1024)   /* Size of each generated page */
+#define BENCH_SYNTHETIC_PAGES 4
+#define BENCH_MEMO_SIZE 4096                /* Urls remembered per page (must be a power of 2) */
+#define BENCH_MAX_THREADS 16
+
+/* A page of HTML from the corpus */
+typedef struct {
+    char    *name;
+    char    *data;
+    size_t  size;
+} bench_page_t;
+
+/* A url looked up while rewriting a page */
+typedef struct {
+    uint64_t    key;
+    const char  *url;
+    const char  *attribute;
+} bench_memo_entry_t;
+
+/* State for rewriting a page */
+typedef struct {
+    harness_rewrite_t   harness;        /* Passed to bench_attribute() and bench_lookup_links() */
+    sqlite3_stmt        *lookup;
+    amber_options_t     *options;
+    const char          *behavior[2];
+    bench_memo_entry_t  memo[BENCH_MEMO_SIZE];
+    unsigned long       links;
+    int                 last_date;
+    char                last_date_string[AMBER_MAX_DATE_STRING];
+} bench_rewrite_t;
+
+static double bench_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Read the corpus, or generate some pages if no files were given */
+static int bench_load_corpus(int argc, char **argv, bench_page_t **pages)
+{
+    int count = 0;
+    int i;
+
+    if (argc == 0) {
+        *pages = calloc(BENCH_SYNTHETIC_PAGES, sizeof(bench_page_t));
+        for (i = 0; i < BENCH_SYNTHETIC_PAGES; i++) {
+            bench_page_t *page = &(*pages)[i];
+            int n;
+            page->name = "synthetic";
+            page->data = malloc(BENCH_SYNTHETIC_SIZE + 1024);
+
+            /* Laid out like a page from a modern site: a stylesheet in the head, then the text, then the 
+               structured data and the scripts inlined at the end of the body */
+            page->size = sprintf(page->data, "<!DOCTYPE html>\n<html><head><title>Synthetic</title><style>\n");
+            while (page->size < BENCH_SYNTHETIC_SIZE / 8) {
+                n = rand() % 400;
+                page->size += sprintf(page->data + page->size,
+                    ".c%d>.item:hover{color:#%06x;background:url(\"http://cdn%d.com/bg.png\");margin:0 auto}\n",
+                    n, n * 40503, n % 10);
+            }
+            page->size += sprintf(page->data + page->size, "</style></head>\n<body>\n");
+            while (page->size < BENCH_SYNTHETIC_SIZE / 2) {
+                n = rand() % 400;
+                if (n % 10 == 0) {
+                    /* Some scripts and comments with links in them, which shouldn't be found */
+                    page->size += sprintf(page->data + page->size,
+                        "<script>var tracker = { url: 'http://tracker%d.com/pixel' }; "
+                        "document.write('<a href=\"http://ads%d.com/click\">Advertisement</a>');</script>\n"
+                        "<!-- <a href=\"http://old%d.com/\">Old link</a> -->\n", n, n, n);
+                }
+                page->size += sprintf(page->data + page->size,
+                    "<p class=\"body\">Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor "
+                    "incididunt ut labore et dolore magna aliqua. <a href=\"/local/%d\">Local</a> Ut enim ad minim veniam, "
+                    "quis nostrud exercitation ullamco laboris <a href=\"http://example%d.com/article/%d\" title=\"x\">nisi</a> "
+                    "ut aliquip ex ea commodo consequat.</p>\n", n, n % 50, n);
+            }
+            page->size += sprintf(page->data + page->size, "<script type=\"application/ld+json\">{\"@graph\":[");
+            while (page->size < BENCH_SYNTHETIC_SIZE * 5 / 8) {
+                n = rand() % 400;
+                page->size += sprintf(page->data + page->size,
+                    "{\"@type\":\"Article\",\"url\":\"http://example%d.com/article/%d\",\"headline\":\"Article %d\","
+                    "\"description\":\"<p>See <a href='http://example%d.com/'>here</a></p>\"},", n % 50, n, n, n % 50);
+            }
+            page->size += sprintf(page->data + page->size, "{}]}</script>\n<script>");
+            while (page->size < BENCH_SYNTHETIC_SIZE) {
+                n = rand() % 400;
+                page->size += sprintf(page->data + page->size,
+                    "function f%d(e,t){for(var n=0;n<e.length&&n<%d;n++)if(e[n]<t)return'<li class=\"i%d\">'+e[n]+'</li>';"
+                    "return fetch(\"http://api%d.com/v1/items?id=\"+t).then(function(r){return r.json()})}\n", n, n, n, n % 10);
+            }
+            page->size += sprintf(page->data + page->size, "</script>\n</body></html>\n");
+            count++;
+        }
+        return count;
+    }
+
+    *pages = calloc(argc, sizeof(bench_page_t));
+    for (i = 0; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        long size;
+        if (!file) {
+            perror(argv[i]);
+            continue;
+        }
+        fseek(file, 0, SEEK_END);
+        size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        (*pages)[count].name = argv[i];
+        (*pages)[count].data = malloc(size + 1);
+        (*pages)[count].size = fread((*pages)[count].data, 1, size, file);
+        fclose(file);
+        count++;
+    }
+    return count;
+}
+
+/* Create an in-memory database with the same tables as the real one. Every other url found in
+   the corpus has a cache. Most of them have a url_hash, as the module fills in, and the rest are
+   found by the url as written, like rows the module hasn't got to yet */
+static sqlite3 *bench_create_database(bench_page_t *pages, int page_count)
+{
+    sqlite3 *db;
+    sqlite3_stmt *cache, *check;
+    harness_arena_t arena = { NULL, 0, 0 };
+    amber_scan_t scan;
+    amber_matches_t links;
+    int id = 0;
+    int i, j;
+
+    sqlite3_open(":memory:", &db);
+    sqlite3_exec(db,
+        "CREATE TABLE amber_cache (id TEXT PRIMARY KEY, url TEXT, location TEXT, date INTEGER, type TEXT, size INTEGER);"
+        "CREATE INDEX url_index ON amber_cache (url);"
+        "CREATE TABLE amber_check (id TEXT PRIMARY KEY, url TEXT, status INTEGER, last_checked INTEGER, next_check INTEGER, message TEXT, url_hash INTEGER);"
+        "CREATE INDEX amber_check_url_hash ON amber_check (url_hash);"
+        "BEGIN", NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO amber_cache (id, url, location, date, type) VALUES (?1, ?2, 'amber/cache/' || ?1 || '/', ?3, 'text/html')", -1, &cache, NULL);
+    sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO amber_check (id, url, status, last_checked, url_hash) VALUES (?1, ?2, ?3, ?4, ?5)", -1, &check, NULL);
+
+    amber_scan_init(&scan, harness_alloc, &arena);
+    for (i = 0; i < page_count; i++) {
+        amber_find_links(&scan, pages[i].data, pages[i].size, 0, &links);
+        for (j = 0; j < links.count; j++) {
+            char id_string[40];
+            if (amber_hash(links.url[j], 0) % 2) {
+                continue;
+            }
+            sprintf(id_string, "%032llx", (unsigned long long)amber_hash(links.url[j], 0));
+            sqlite3_bind_text(cache, 1, id_string, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(cache, 2, links.url[j], -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(cache, 3, 1400000000 + (id++ % 1000) * 86400);
+            sqlite3_step(cache);
+            sqlite3_reset(cache);
+            sqlite3_bind_text(check, 1, id_string, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(check, 2, links.url[j], -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(check, 3, id % 3 ? AMBER_STATUS_UP : AMBER_STATUS_DOWN);
+            sqlite3_bind_int(check, 4, 1400000000);
+            if (id % 8) {
+                sqlite3_bind_int64(check, 5, (sqlite3_int64) amber_index_hash(amber_canonical_url(harness_alloc, &arena, links.url[j])));
+            } else {
+                sqlite3_bind_null(check, 5);
+            }
+            sqlite3_step(check);
+            sqlite3_reset(check);
+        }
+    }
+    sqlite3_finalize(cache);
+    sqlite3_finalize(check);
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    harness_arena_clear(&arena);
+    return db;
+}
+
+/* Look up the urls found in a bucket that aren't remembered yet, AMBER_LOOKUP_BATCH_SIZE at a time
+   as the module does, and remember their attributes */
+static void bench_lookup_links(harness_rewrite_t *harness, char **urls, int count)
+{
+    bench_rewrite_t *rewrite = harness->data;
+    harness_lookup_t batch[AMBER_LOOKUP_BATCH_SIZE];
+    int batch_count = 0;
+    int i, k;
+
+    for (i = 0; i < count; i++) {
+        uint64_t key = amber_hash(urls[i], 0);
+        bench_memo_entry_t *entry = &rewrite->memo[key & (BENCH_MEMO_SIZE - 1)];
+
+        if (!entry->url || (entry->key != key) || strcmp(entry->url, urls[i])) {
+            /* Urls found in a bucket are in the scratch arena, so the memo needs its own copy */
+            batch[batch_count++].url = strcpy(harness_alloc(&harness->arena, strlen(urls[i]) + 1), urls[i]);
+        }
+        if (!batch_count || ((batch_count < AMBER_LOOKUP_BATCH_SIZE) && (i < count - 1))) {
+            continue;
+        }
+
+        harness_lookup(rewrite->lookup, &harness->arena, batch, batch_count);
+        for (k = 0; k < batch_count; k++) {
+            const char *attribute = NULL;
+            key = amber_hash(batch[k].url, 0);
+            entry = &rewrite->memo[key & (BENCH_MEMO_SIZE - 1)];
+            if (batch[k].location) {
+                if (batch[k].date != rewrite->last_date) {
+                    amber_format_date(batch[k].date, rewrite->last_date_string);
+                    rewrite->last_date = batch[k].date;
+                }
+                attribute = amber_format_attribute(harness_alloc, &harness->arena, "http://localhost/", batch[k].location,
+                                                   rewrite->last_date_string, 
+                                                   rewrite->behavior[batch[k].status ? AMBER_STATUS_UP : AMBER_STATUS_DOWN]);
+            }
+            entry->key = key;
+            entry->url = batch[k].url;
+            entry->attribute = attribute;
+        }
+        batch_count = 0;
+    }
+}
+
+/* The attributes for a url, which has been looked up unless two urls in the same bucket were 
+   remembered in the same place */
+static const char *bench_attribute(void *baton, int index, const char *url)
+{
+    harness_rewrite_t *harness = baton;
+    bench_rewrite_t *rewrite = harness->data;
+    uint64_t key = amber_hash(url, 0);
+    bench_memo_entry_t *entry = &rewrite->memo[key & (BENCH_MEMO_SIZE - 1)];
+
+    rewrite->links++;
+    if (!entry->url || (entry->key != key) || strcmp(entry->url, url)) {
+        bench_lookup_links(harness, (char **) &url, 1);
+    }
+    return entry->attribute;
+}
+
+/* Set up for rewriting pages, looking urls up in a database */
+static bench_rewrite_t *bench_rewrite_create(sqlite3 *db, amber_options_t *options, const char *behavior[2])
+{
+    bench_rewrite_t *rewrite = calloc(1, sizeof(bench_rewrite_t));
+
+    if (harness_prepare_lookup(db, &rewrite->lookup) != SQLITE_OK) {
+        free(rewrite);
+        return NULL;
+    }
+    rewrite->harness.attribute = bench_attribute;
+    rewrite->harness.lookup = bench_lookup_links;
+    rewrite->harness.data = rewrite;
+    rewrite->options = options;
+    rewrite->behavior[0] = behavior[0];
+    rewrite->behavior[1] = behavior[1];
+    return rewrite;
+}
+
+/* Rewrite a page delivered in buckets of a given size into rewrite->harness.out, looking up each url
+   once */
+static void bench_rewrite_page(bench_rewrite_t *rewrite, const char *data, size_t size, size_t bucket_size)
+{
+    memset(rewrite->memo, 0, sizeof(rewrite->memo));
+    rewrite->last_date = -1;
+    rewrite->harness.arena.allocations = 0;
+    rewrite->harness.scratch.allocations = 0;
+    harness_rewrite_page(&rewrite->harness, data, size, bucket_size);
+}
+
+static void bench_rewrite_destroy(bench_rewrite_t *rewrite)
+{
+    sqlite3_finalize(rewrite->lookup);
+    harness_rewrite_free(&rewrite->harness);
+    free(rewrite);
+}
+
+/* Scan the corpus with the HTML tokenizer (amber_find_links), and with the regex alone over every byte as before */
+static void bench_scanner(bench_page_t *pages, int page_count, double seconds)
+{
+    harness_arena_t arena = { NULL, 0, 0 };
+    amber_scan_t scan;
+    amber_matches_t links;
+    const char *error;
+    int error_offset;
+    pcre *regex;
+    pcre_extra *extra;
+    int ovector[30];
+    unsigned long long bytes;
+    unsigned long found;
+    double start, elapsed;
+    int i;
+
+    printf("Scanner\n");
+
+    bytes = found = 0;
+    start = bench_now();
+    do {
+        for (i = 0; i < page_count; i++) {
+            amber_scan_init(&scan, harness_alloc, &arena);
+            amber_find_links(&scan, pages[i].data, pages[i].size, 0, &links);
+            found += links.count;
+            bytes += pages[i].size;
+            harness_arena_clear(&arena);
+        }
+    } while ((elapsed = bench_now() - start) < seconds);
+    printf("  tokenizer          %10.1f MB/s %12.0f links/s\n", bytes / elapsed / 1e6, found / elapsed);
+
+    /* The pattern the tokenizer matches, over every byte with PCRE as the module used to */
+    if (!(regex = pcre_compile(AMBER_HREF_PATTERN, PCRE_CASELESS, &error, &error_offset, NULL))) {
+        return;
+    }
+#ifdef PCRE_STUDY_JIT_COMPILE
+    extra = pcre_study(regex, PCRE_STUDY_JIT_COMPILE | PCRE_STUDY_JIT_PARTIAL_HARD_COMPILE, &error);
+#else
+    extra = pcre_study(regex, 0, &error);
+#endif
+
+    bytes = found = 0;
+    start = bench_now();
+    do {
+        for (i = 0; i < page_count; i++) {
+            int pos = 0;
+            while (pcre_exec(regex, extra, pages[i].data, pages[i].size, pos, PCRE_PARTIAL_HARD, ovector, 30) > 0) {
+                pos = ovector[1];
+                found++;
+            }
+            bytes += pages[i].size;
+        }
+    } while ((elapsed = bench_now() - start) < seconds);
+    printf("  pcre only          %10.1f MB/s %12.0f links/s\n", bytes / elapsed / 1e6, found / elapsed);
+
+    if (extra) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+        pcre_free_study(extra);
+#else
+        pcre_free(extra);
+#endif
+    }
+    pcre_free(regex);
+}
+
+/* Build attributes with amber_build_attribute() (snprintf and localtime for each link), and from
+   precomputed pieces as the module does */
+static void bench_attributes(amber_options_t *options, const char *behavior[2], double seconds)
+{
+    unsigned char out[AMBER_MAX_ATTRIBUTE_STRING];
+    char date_string[AMBER_MAX_DATE_STRING];
+    harness_arena_t arena = { NULL, 0, 0 };
+    unsigned long count;
+    double start, elapsed;
+    int last_date = -1;
+
+    printf("Attributes\n");
+
+    count = 0;
+    start = bench_now();
+    do {
+        int i;
+        for (i = 0; i < 1000; i++, count++) {
+            amber_build_attribute(options, out, "http://localhost/amber/cache/0123456789abcdef0123456789abcdef/",
+                                  i % 2, 1400000000 + (i % 10) * 86400);
+        }
+    } while ((elapsed = bench_now() - start) < seconds);
+    printf("  amber_build_attribute  %12.0f attributes/s\n", count / elapsed);
+
+    count = 0;
+    start = bench_now();
+    do {
+        int i;
+        for (i = 0; i < 1000; i++, count++) {
+            int date = 1400000000 + (i / 100) * 86400;
+            if (date != last_date) {
+                amber_format_date(date, date_string);
+                last_date = date;
+            }
+            amber_format_attribute(harness_alloc, &arena, "http://localhost/", "amber/cache/0123456789abcdef0123456789abcdef/",
+                                   date_string, behavior[i % 2]);
+        }
+        harness_arena_clear(&arena);
+    } while ((elapsed = bench_now() - start) < seconds);
+    printf("  amber_format_attribute %12.0f attributes/s\n", count / elapsed);
+}
+
+/* Look up every url in the corpus in the database, and in a lookup index built from it */
+static void bench_lookups(bench_page_t *pages, int page_count, sqlite3 *db, double seconds)
+{
+    harness_arena_t arena = { NULL, 0, 0 };
+    amber_index_entry_t *entries = NULL;
+    int entry_count = 0, allocated = 0;
+    sqlite3_stmt *statement;
+    amber_matches_t links;
+    amber_scan_t scan;
+    amber_index_t index;
+    const char *location;
+    int date, status;
+    unsigned long count, found;
+    double start, elapsed;
+    size_t size;
+    void *data;
+    int i, j;
+
+    printf("Lookups\n");
+    sqlite3_prepare_v2(db, "SELECT aa.url, COALESCE(aa.location, ''), aa.date, ah.status FROM amber_cache aa, amber_check ah WHERE aa.id = ah.id", -1, &statement, NULL);
+    while (SQLITE_ROW == sqlite3_step(statement)) {
+        if (entry_count == allocated) {
+            allocated = allocated ? allocated * 2 : 1024;
+            entries = realloc(entries, allocated * sizeof(amber_index_entry_t));
+        }
+        entries[entry_count].url = strdup((const char *) sqlite3_column_text(statement, 0));
+        entries[entry_count].location = strdup((const char *) sqlite3_column_text(statement, 1));
+        entries[entry_count].date = sqlite3_column_int(statement, 2);
+        entries[entry_count].status = sqlite3_column_int(statement, 3);
+        entry_count++;
+    }
+    sqlite3_finalize(statement);
+    size = amber_index_size(entries, entry_count);
+    data = malloc(size);
+    size = amber_index_build(entries, entry_count, 0, data);
+    amber_index_open(&index, data, size);
+
+    /* AMBER_LOOKUP_BATCH_SIZE urls at a time, as the module looks them up */
+    harness_prepare_lookup(db, &statement);
+    count = found = 0;
+    start = bench_now();
+    do {
+        for (i = 0; i < page_count; i++) {
+            amber_scan_init(&scan, harness_alloc, &arena);
+            amber_find_links(&scan, pages[i].data, pages[i].size, 0, &links);
+            for (j = 0; j < links.count; j += AMBER_LOOKUP_BATCH_SIZE) {
+                harness_lookup_t batch[AMBER_LOOKUP_BATCH_SIZE];
+                int batch_count = (links.count - j < AMBER_LOOKUP_BATCH_SIZE) ? links.count - j : AMBER_LOOKUP_BATCH_SIZE;
+                int k;
+                for (k = 0; k < batch_count; k++) {
+                    batch[k].url = links.url[j + k];
+                }
+                harness_lookup(statement, &arena, batch, batch_count);
+                for (k = 0; k < batch_count; k++) {
+                    found += (batch[k].location != NULL);
+                }
+                count += batch_count;
+            }
+            harness_arena_clear(&arena);
+        }
+    } while ((elapsed = bench_now() - start) < seconds);
+    printf("  sqlite             %12.0f lookups/s (%lu found)\n", count / elapsed, found);
+    sqlite3_finalize(statement);
+
+    count = found = 0;
+    start = bench_now();
+    do {
+        for (i = 0; i < page_count; i++) {
+            amber_scan_init(&scan, harness_alloc, &arena);
+            amber_find_links(&scan, pages[i].data, pages[i].size, 0, &links);
+            for (j = 0; j < links.count; j++, count++) {
+                found += (AMBER_CACHE_ATTRIBUTES_NOT_FOUND != amber_index_lookup(&index, links.url[j], &location, &date, &status));
+            }
+            harness_arena_clear(&arena);
+        }
+    } while ((elapsed = bench_now() - start) < seconds);
+    printf("  lookup index       %12.0f lookups/s (%lu found, %d urls in %lu bytes)\n", count / elapsed, found, 
+           (int) index.header->entry_count, (unsigned long) size);
+
+    for (i = 0; i < entry_count; i++) {
+        free((char *) entries[i].url);
+        free((char *) entries[i].location);
+    }
+    free(entries);
+    free(data);
+}
+
+/* Rewrite the whole corpus at a range of bucket sizes */
+static void bench_rewrite(bench_page_t *pages, int page_count, sqlite3 *db,
+                          amber_options_t *options, const char *behavior[2], double seconds)
+{
+    static const size_t bucket_sizes[] = { 512, 8000, 65536, 0 };
+    bench_rewrite_t *rewrite = bench_rewrite_create(db, options, behavior);
+    size_t b;
+
+    printf("Rewrite (scan, lookup, splice)\n");
+
+    for (b = 0; b < sizeof(bucket_sizes) / sizeof(bucket_sizes[0]); b++) {
+        unsigned long long bytes = 0;
+        unsigned long allocations = 0;
+        double start, elapsed;
+        int i;
+
+        rewrite->links = 0;
+        rewrite->harness.scratch_peak = 0;
+        start = bench_now();
+        do {
+            for (i = 0; i < page_count; i++) {
+                bench_rewrite_page(rewrite, pages[i].data, pages[i].size, bucket_sizes[b] ? bucket_sizes[b] : pages[i].size);
+                allocations += rewrite->harness.arena.allocations + rewrite->harness.scratch.allocations;
+                bytes += pages[i].size;
+            }
+        } while ((elapsed = bench_now() - start) < seconds);
+
+        if (bucket_sizes[b]) {
+            printf("  %6lu byte buckets ", (unsigned long) bucket_sizes[b]);
+        } else {
+            printf("  whole page          ");
+        }
+        printf("%10.1f MB/s %12.0f links/s %8.2f allocations/link %8.1f KB peak scratch\n", bytes / elapsed / 1e6, 
+               rewrite->links / elapsed, rewrite->links ? (double) allocations / rewrite->links : 0.0, 
+               rewrite->harness.scratch_peak / 1024.0);
+    }
+    bench_rewrite_destroy(rewrite);
+}
+
+/* A thread rewriting the corpus for bench_threads() */
+typedef struct {
+    int                 index;
+    bench_page_t        *pages;
+    int                 page_count;
+    const char          *db_path;
+    amber_options_t     *options;
+    const char          **behavior;
+    char                **expected;     /* Output of a single thread for each page */
+    size_t              *expected_size;
+    double              seconds;
+    unsigned long long  bytes;
+    unsigned long       links;
+    unsigned long       mismatches;     /* Pages whose output wasn't what was expected */
+    int                 error;
+} bench_thread_t;
+
+/* Rewrite every page over and over with a different bucket size each time, using a database 
+   connection of this thread's own as the module does, until the time is up */
+static void *bench_thread_run(void *data)
+{
+    static const size_t bucket_sizes[] = { 512, 8000, 65536, 0 };
+    bench_thread_t *thread = data;
+    bench_rewrite_t *rewrite = NULL;
+    sqlite3 *db = NULL;
+    double start = bench_now();
+    int round = thread->index;
+    int i;
+
+    if ((sqlite3_open_v2(thread->db_path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) ||
+        !(rewrite = bench_rewrite_create(db, thread->options, thread->behavior))) {
+        thread->error = 1;
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    do {
+        size_t bucket_size = bucket_sizes[round++ % (sizeof(bucket_sizes) / sizeof(bucket_sizes[0]))];
+        for (i = 0; i < thread->page_count; i++) {
+            bench_rewrite_page(rewrite, thread->pages[i].data, thread->pages[i].size, 
+                               bucket_size ? bucket_size : thread->pages[i].size);
+            if ((rewrite->harness.out_size != thread->expected_size[i]) || 
+                memcmp(rewrite->harness.out, thread->expected[i], rewrite->harness.out_size)) {
+                thread->mismatches++;
+            }
+            thread->bytes += thread->pages[i].size;
+        }
+    } while (bench_now() - start < thread->seconds);
+
+    thread->links = rewrite->links;
+    bench_rewrite_destroy(rewrite);
+    sqlite3_close(db);
+    return NULL;
+}
+
+/* Rewrite the corpus in several threads at once, sharing a database file, as 
+   the module does under the worker and event MPMs. Every page must come out the same as it does 
+   from a single thread */
+static void bench_threads(bench_page_t *pages, int page_count, sqlite3 *db,
+                          amber_options_t *options, const char *behavior[2], double seconds)
+{
+    static const int thread_counts[] = { 1, 2, 4, 8, BENCH_MAX_THREADS };
+    bench_thread_t threads[BENCH_MAX_THREADS];
+    bench_rewrite_t *rewrite;
+    char **expected = calloc(page_count, sizeof(char *));
+    size_t *expected_size = calloc(page_count, sizeof(size_t));
+    char db_path[] = "/tmp/amber_bench_XXXXXX";
+    sqlite3 *file_db = NULL;
+    sqlite3_backup *backup;
+    size_t t;
+    int fd;
+    int i;
+
+    printf("Threads (rewrite in each thread, with its own database connection)\n");
+
+    /* The threads need a database file to share */
+    if (((fd = mkstemp(db_path)) < 0) || (sqlite3_open(db_path, &file_db) != SQLITE_OK) ||
+        !(backup = sqlite3_backup_init(file_db, "main", db, "main"))) {
+        printf("  could not create a database file\n");
+        goto done;
+    }
+    close(fd);
+    sqlite3_backup_step(backup, -1);
+    sqlite3_backup_finish(backup);
+    sqlite3_close(file_db);
+
+    /* What a single thread makes of each page */
+    rewrite = bench_rewrite_create(db, options, behavior);
+    for (i = 0; i < page_count; i++) {
+        bench_rewrite_page(rewrite, pages[i].data, pages[i].size, pages[i].size);
+        expected[i] = rewrite->harness.out;
+        expected_size[i] = rewrite->harness.out_size;
+        rewrite->harness.out = NULL;
+        rewrite->harness.out_size = rewrite->harness.out_allocated = 0;
+    }
+    bench_rewrite_destroy(rewrite);
+
+    for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        unsigned long long bytes = 0;
+        unsigned long links = 0, mismatches = 0;
+        int errors = 0;
+        double start = bench_now(), elapsed;
+
+        for (i = 0; i < thread_counts[t]; i++) {
+            bench_thread_t *thread = &threads[i];
+            memset(thread, 0, sizeof(bench_thread_t));
+            thread->index = i;
+            thread->pages = pages;
+            thread->page_count = page_count;
+            thread->db_path = db_path;
+            thread->options = options;
+            thread->behavior = behavior;
+            thread->expected = expected;
+            thread->expected_size = expected_size;
+            thread->seconds = seconds;
+        }
+        errors = harness_run_threads(bench_thread_run, threads, sizeof(bench_thread_t), thread_counts[t]);
+        for (i = 0; i < thread_counts[t]; i++) {
+            bytes += threads[i].bytes;
+            links += threads[i].links;
+            mismatches += threads[i].mismatches;
+            errors += threads[i].error;
+        }
+        elapsed = bench_now() - start;
+        printf("  %2d threads          %10.1f MB/s %12.0f links/s %8lu pages differ", thread_counts[t], 
+               bytes / elapsed / 1e6, links / elapsed, mismatches);
+        printf(errors ? " %8d errors\n" : "\n", errors);
+    }
+
+done:
+    unlink(db_path);
+    for (i = 0; i < page_count; i++) {
+        free(expected[i]);
+    }
+    free(expected);
+    free(expected_size);
+}
+
+int main(int argc, char **argv)
+{
+    amber_options_t options = { 1, NULL, AMBER_ACTION_HOVER, AMBER_ACTION_POPUP, 2, 0, NULL, -1, -1, -1, -1, 0, { NULL, NULL } };
+    unsigned char behavior_up[AMBER_MAX_BEHAVIOR_STRING] = "", behavior_down[AMBER_MAX_BEHAVIOR_STRING] = "";
+    const char *behavior[2];
+    double seconds = BENCH_DEFAULT_SECONDS;
+    bench_page_t *pages;
+    int page_count;
+    size_t total = 0;
+    sqlite3 *db;
+    int i;
+
+    if ((argc > 2) && !strcmp(argv[1], "-t")) {
+        seconds = atof(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    srand(1);
+    if (!(page_count = bench_load_corpus(argc - 1, argv + 1, &pages))) {
+        return 1;
+    }
+    for (i = 0; i < page_count; i++) {
+        total += pages[i].size;
+    }
+    printf("Corpus: %d pages, %lu bytes\n", page_count, (unsigned long) total);
+
+    amber_get_behavior(&options, behavior_down, AMBER_STATUS_DOWN);
+    amber_get_behavior(&options, behavior_up, AMBER_STATUS_UP);
+    behavior[AMBER_STATUS_DOWN] = (char *) behavior_down;
+    behavior[AMBER_STATUS_UP] = (char *) behavior_up;
+
+    db = bench_create_database(pages, page_count);
+    bench_scanner(pages, page_count, seconds);
+    bench_attributes(&options, behavior, seconds);
+    bench_lookups(pages, page_count, db, seconds);
+    bench_rewrite(pages, page_count, db, &options, behavior, seconds);
+    bench_threads(pages, page_count, db, &options, behavior, seconds);
+
+    sqlite3_close(db);
+    return 0;
+}
@@ -4,64 +4,498 @@
 #include "http_protocol.h"
 #include "ap_config.h"
 #include "apr_strings.h"
+#include "apr_lib.h"
+#include "apr_hash.h"
 #include "http_log.h"
-#include "pcre.h"
+#include "ap_mpm.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
+#include "apr_atomic.h"
+#include "apr_version.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "apr_mmap.h"
+#include "util_mutex.h"
+#include "amber_core.h"
 #include <sqlite3.h>
+#include <zlib.h>
 #include <time.h>
-
-#define AMBER_ACTION_NONE     0
-#define AMBER_ACTION_HOVER    1
-#define AMBER_ACTION_POPUP    2
-#define AMBER_ACTION_CACHE    3
-#define AMBER_STATUS_DOWN     0
-#define AMBER_STATUS_UP       1
-#define AMBER_MAX_ATTRIBUTE_STRING 250
-#define AMBER_CACHE_ATTRIBUTES_ERROR -1
-#define AMBER_CACHE_ATTRIBUTES_FOUND 0
-#define AMBER_CACHE_ATTRIBUTES_EMPTY 1
-#define AMBER_CACHE_ATTRIBUTES_NOT_FOUND 2
+#include <stdint.h>
+#include <limits.h>
+
+#ifndef SQLITE_DETERMINISTIC
+#define SQLITE_DETERMINISTIC 0          /* Before sqlite 3.8.3, functions can't be marked as deterministic */
+#endif
+
+#define AMBER_MIN_DATABASES 8           /* Database connections kept open by each child (or one per thread, if more) */
+#define AMBER_SHM_MUTEX_TYPE "amber-shm"  /* Mutex type protecting our shared memory segments (see Mutex directive) */
+#define AMBER_LOOKUP_CACHE_DEFAULT_TTL 300
+#define AMBER_LOOKUP_CACHE_WAYS 8       /* Number of slots searched for each url in the shared lookup cache */
+#define AMBER_LOOKUP_CACHE_MAX_URL 512
+#define AMBER_LOOKUP_CACHE_MAX_LOCATION 128
+#define AMBER_ENQUEUE_DEFAULT_QUEUE_SIZE 1024   /* Urls waiting to be enqueued by the background writer */
+#define AMBER_ENQUEUE_DEFAULT_BATCH_SIZE 100    /* Urls written in each transaction */
+#define AMBER_ENQUEUE_DEFAULT_INTERVAL 500      /* Maximum milliseconds a url waits before being written */
+#define AMBER_ENQUEUE_BUSY_TIMEOUT 5000         /* Milliseconds the background writer waits for the database lock */
+#define AMBER_ENQUEUE_QUEUED 1                  /* Results of amber_enqueue_push() */
+#define AMBER_ENQUEUE_SYNC 0
+#define AMBER_ENQUEUE_DROPPED -1
+#define AMBER_ACTIVITY_MAX_ENTRIES 1024         /* Cache items whose views can be counted between flushes */
+#define AMBER_ACTIVITY_WAYS 8                   /* Number of slots searched for each cache item */
+#define AMBER_ACTIVITY_FLUSH_INTERVAL 10        /* Seconds between writes of view counts to the database */
+#define AMBER_ENQUEUE_FILTER_DEFAULT_SIZE (256 * 1024)  /* Bytes of shared memory used to remember enqueued urls */
+#define AMBER_ENQUEUE_FILTER_DEFAULT_TTL 600    /* Seconds before an enqueued url will be enqueued again */
+#define AMBER_ENQUEUE_FILTER_HASHES 4           /* Bits set in the filter for each url */
+#define AMBER_OUTPUT_CACHE_DEFAULT_MAX (1024 * 1024)   /* Largest response kept in the output cache */
+#define AMBER_OUTPUT_CACHE_MAX_KEY 4096         /* Longest key stored at the start of an output cache file */
+#define AMBER_OUTPUT_CACHE_DEFAULT_TOTAL (256 * 1024 * 1024)  /* Most bytes kept in the output cache directory */
+#define AMBER_OUTPUT_CACHE_SWEEP_PARTS 16       /* The directory is swept each time this fraction of the total has been stored */
+#define AMBER_OUTPUT_CACHE_SWEEP_LOW 90         /* Percentage of the total the directory is brought down to when it's swept */
+#define AMBER_GENERATION_CHECK_INTERVAL 5       /* Seconds between checks of whether the database has changed */
+#define AMBER_OUTPUT_CACHE_NONE 0               /* Output cache states for a request */
+#define AMBER_OUTPUT_CACHE_UNKNOWN 1
+#define AMBER_OUTPUT_CACHE_HIT 2
+#define AMBER_OUTPUT_CACHE_STORE 3
+#define AMBER_STATS_HANDLER "amber-status"     /* Handler that reports the statistics (see SetHandler) */
+#define AMBER_STAT_RESPONSES_FILTERED 0         /* Counters kept in shared memory for the amber-status handler */
+#define AMBER_STAT_RESPONSES_SKIPPED 1
+#define AMBER_STAT_OUTPUT_CACHE_HITS 2
+#define AMBER_STAT_BYTES_SCANNED 3
+#define AMBER_STAT_LINKS_MATCHED 4
+#define AMBER_STAT_LOOKUP_HITS 5
+#define AMBER_STAT_LOOKUP_MISSES 6
+#define AMBER_STAT_LOOKUP_ERRORS 7
+#define AMBER_STAT_LOOKUP_CACHE_HITS 8
+#define AMBER_STAT_ENQUEUES 9
+#define AMBER_STAT_ENQUEUES_FILTERED 10
+#define AMBER_STAT_ENQUEUES_DROPPED 11
+#define AMBER_STAT_CACHE_DELIVERIES 12
+#define AMBER_STAT_SQLITE_BUSY 13
+#define AMBER_STAT_LOOKUP_INDEX_HITS 14
+#define AMBER_STAT_LINKS_SKIPPED 15
+#define AMBER_STAT_LOOKUP_BUDGET_SPENT 16
+#define AMBER_STAT_LOOKUP_INDEX_MISSES 17
+#define AMBER_STAT_COUNTERS 18
+#define AMBER_HISTOGRAM_SCAN 0                  /* Latency histograms kept for each rewritten response */
+#define AMBER_HISTOGRAM_LOOKUP 1
+#define AMBER_HISTOGRAM_REWRITE 2
+#define AMBER_HISTOGRAMS 3
+#define AMBER_HISTOGRAM_BUCKETS 12              /* Not counting the last bucket, for anything slower */
+#define AMBER_INJECT_NONE 0                     /* Progress of inserting the javascript and CSS into a response */
+#define AMBER_INJECT_PENDING 1                  /* To be inserted before the first annotated link */
+#define AMBER_INJECT_NEXT 2                     /* A link was annotated where they couldn't go, so insert them before
+                                                   the next link tag (or at the end) */
+#define AMBER_ENCODING_NONE 0                   /* Content-Encoding of a response */
+#define AMBER_ENCODING_GZIP 1
+#define AMBER_ENCODING_DEFLATE 2
+#define AMBER_ENCODING_UNSUPPORTED 3
+#define AMBER_GZIP_BUFFER_SIZE 8192             /* Size of the buckets inflated or deflated at a time */
+#define AMBER_GZIP_LEVEL 6                      /* Compression level used to compress responses again */
+#define AMBER_MAX_INDEXES 4                     /* Maximum number of lookup indexes mapped by each child */
+#define AMBER_INDEX_CHECK_INTERVAL 1            /* Seconds between checks of whether a lookup index has been rebuilt */
+#define AMBER_MAX_SKIP_LISTS 4                  /* Maximum number of skip lists kept by each child */
+#define AMBER_SKIP_REFRESH_INTERVAL 60          /* Seconds between reloads of the amber_exclude table */
+#define AMBER_URL_HASH_UPDATE_INTERVAL 60       /* Seconds between the background writer filling in url_hash for newly checked urls */
+#define AMBER_URL_HASH_UPDATE_BATCH 1000        /* Rows given a url_hash in each transaction, so the database isn't locked for long */
+#define AMBER_URL_HASH_UNAVAILABLE -1           /* Results of amber_url_hash_state() */
+#define AMBER_URL_HASH_PENDING 0
+#define AMBER_URL_HASH_READY 1
+#define AMBER_BUDGET_NONE 0                     /* Why links in a response were passed on without being looked up */
+#define AMBER_BUDGET_TIME 1                     /* The time allowed by AmberLookupBudget was spent */
+#define AMBER_BUDGET_LINKS 2                    /* The most links allowed by AmberLookupBudget were annotated */
+#define AMBER_CACHE_HANDLER "amber-cache"      /* Handler that serves cached items (see SetHandler) */
+#define AMBER_CACHE_META_ENTRIES 1024           /* Content types and dates of cache items remembered by each child */
+#define AMBER_MAX_CONTENT_TYPE 128
+#define AMBER_MAX_PATH 256
+#define AMBER_MAX_CACHE_ID 64
+
+#define AMBER_SQL_LOG_ACTIVITY "INSERT OR REPLACE INTO amber_activity (id, date, views) VALUES (?1, ?2, COALESCE ((SELECT views from amber_activity where id = ?1), 0) + ?3)"
+#define AMBER_SQL_GENERATION "SELECT generation FROM amber_generation"
+#define AMBER_SQL_GENERATION_TRIGGER(name, event) \
+    "CREATE TRIGGER IF NOT EXISTS " name " AFTER " event " BEGIN UPDATE amber_generation SET generation = generation + 1; END;"
+#define AMBER_SQL_GENERATION_CREATE "CREATE TABLE IF NOT EXISTS amber_generation (generation INTEGER NOT NULL);" \
+    "INSERT INTO amber_generation (generation) SELECT 1 WHERE NOT EXISTS (SELECT 1 FROM amber_generation);" \
+    AMBER_SQL_GENERATION_TRIGGER("amber_cache_insert_generation", "INSERT ON amber_cache") \
+    AMBER_SQL_GENERATION_TRIGGER("amber_cache_delete_generation", "DELETE ON amber_cache") \
+    AMBER_SQL_GENERATION_TRIGGER("amber_cache_update_generation", "UPDATE OF url, location, date ON amber_cache " \
+                                 "WHEN OLD.url IS NOT NEW.url OR OLD.location IS NOT NEW.location OR OLD.date IS NOT NEW.date") \
+    AMBER_SQL_GENERATION_TRIGGER("amber_check_insert_generation", "INSERT ON amber_check") \
+    AMBER_SQL_GENERATION_TRIGGER("amber_check_delete_generation", "DELETE ON amber_check")
+/* Updates to amber_check are counted once it has url_hash, since a url isn't looked up by its url 
+   once it has a hash. A trigger naming url_hash breaks every update of the table until the column 
+   exists, so the one for a table without it leaves url_hash out, and is replaced once it's added */
+#define AMBER_SQL_GENERATION_CHECK_TRIGGER \
+    AMBER_SQL_GENERATION_TRIGGER("amber_check_update_generation", "UPDATE OF url, status ON amber_check " \
+                                 "WHEN OLD.url IS NOT NEW.url OR OLD.status IS NOT NEW.status")
+#define AMBER_SQL_GENERATION_CHECK_HASH_TRIGGER "DROP TRIGGER IF EXISTS amber_check_update_generation;" \
+    AMBER_SQL_GENERATION_TRIGGER("amber_check_hash_update_generation", "UPDATE OF url, status, url_hash ON amber_check " \
+                                 "WHEN OLD.url IS NOT NEW.url OR OLD.status IS NOT NEW.status OR OLD.url_hash IS NOT NEW.url_hash")
+#define AMBER_SQL_EXCLUSIONS "SELECT url FROM amber_exclude WHERE url IS NOT NULL"
+#define AMBER_SQL_URL_HASH_COLUMNS "PRAGMA table_info(amber_check)"
+#define AMBER_SQL_URL_HASH_ADD "ALTER TABLE amber_check ADD COLUMN url_hash INTEGER"
+#define AMBER_SQL_URL_HASH_INDEX "CREATE INDEX IF NOT EXISTS amber_check_url_hash ON amber_check (url_hash)"
+#define AMBER_SQL_URL_HASH_UPDATE "UPDATE amber_check SET url_hash = amber_url_hash(url) WHERE rowid IN (SELECT rowid FROM amber_check WHERE url_hash IS NULL AND url IS NOT NULL LIMIT " APR_STRINGIFY(AMBER_URL_HASH_UPDATE_BATCH) ")"
+#define AMBER_SQL_ENQUEUE_URL "INSERT OR IGNORE INTO amber_queue (url, created) SELECT ?1,?2 where not exists (select 1 from amber_exclude where url = ?1) and ?1 not in (select url from amber_check)"
+#define AMBER_SQL_ENQUEUE_URL_HASH "INSERT OR IGNORE INTO amber_queue (url, created) SELECT ?1,?2 where not exists (select 1 from amber_exclude where url = ?1) and not exists (select 1 from amber_check where url_hash = ?3)"
 
 /* Macros for debug and error logging */
-#define amber_debug(mess) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, f->r->server, mess)
-#define amber_debug1(mess,p1) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, f->r->server, mess, p1)
-#define amber_debug2(mess,p1,p2) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, f->r->server, mess, p1, p2)
-#define amber_debug4(mess,p1,p2,p3,p4) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, f->r->server, mess, p1, p2, p3, p4)
-#define amber_error(mess) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, f->r->server, mess)
-#define amber_error1(mess,p1) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, f->r->server, mess, p1)
-#define amber_error2(mess,p1,p2) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, f->r->server, mess, p1, p2)
-
-/* Structure representing the complete list of URLs found within a chunk of HTML, with offsets */
+#define amber_debug(mess) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, r->server, mess)
+#define amber_debug1(mess,p1) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, r->server, mess, p1)
+#define amber_debug2(mess,p1,p2) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, r->server, mess, p1, p2)
+#define amber_debug4(mess,p1,p2,p3,p4) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, r->server, mess, p1, p2, p3, p4)
+#define amber_error(mess) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, r->server, mess)
+#define amber_error1(mess,p1) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, r->server, mess, p1)
+#define amber_error2(mess,p1,p2) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, r->server, mess, p1, p2)
+
+/* Server-wide configuration settings */
+typedef struct {
+    apr_size_t lookup_cache_size;        /* Size of the shared memory lookup cache in bytes (0 to disable) */
+    int        lookup_cache_ttl;         /* Seconds a lookup result is cached for */
+    int        enqueue_queue_size;       /* Size of the background enqueue queue (0 to enqueue synchronously) */
+    int        enqueue_batch_size;       /* Urls written by the background writer in each transaction */
+    int        enqueue_interval;         /* Maximum milliseconds before queued urls are written */
+    apr_size_t enqueue_filter_size;      /* Size of the shared memory filter of enqueued urls in bytes (0 to disable) */
+    int        enqueue_filter_ttl;       /* Seconds an enqueued url is remembered for */
+    const char *output_cache_dir;        /* Directory where rewritten responses are kept (NULL to disable) */
+    apr_size_t output_cache_max;         /* Largest response that will be kept */
+    apr_size_t output_cache_total;       /* Most bytes kept in the directory, after which the oldest are removed */
+    int        trace_interval;           /* Record timings in the notes of one in this many responses (0 for none) */
+} amber_server_options_t;
+
+/* The result of looking up a url, as returned by amber_db_get_url_lookup_query() */
+typedef struct {
+    const char *url;                     /* The url in canonical form, as it's looked up and queued */
+    const char *written;                 /* The url as it was written in the page, which is looked up in
+                                            rows that don't have a url_hash */
+    uint64_t   hash;                     /* amber_index_hash() of the canonical url */
+    int        result;                   /* One of AMBER_CACHE_ATTRIBUTES_* */
+    char       *location;                /* Location of the cached copy, relative to the root */
+    int        date;                     /* When the cache was generated (unix epoch) */
+    int        status;                   /* Whether the site is up or down */
+    char       *attribute;               /* Attributes to insert in the HREF, built the first time they are needed */
+    int        enqueued;                 /* Has the url already been enqueued during this request? */
+    uint64_t   generation;               /* Generation of the database the result was read from (0 if not known) */
+} amber_lookup_t;
+
+/* A lookup index file mapped into memory. Requests take a reference while they use it, so that a 
+   rebuilt index can be swapped in without waiting for them; the old one is unmapped by the last to finish */
+typedef struct {
+    apr_pool_t      *pool;              /* Holds the mapping, and is destroyed with it */
+    amber_index_t   index;
+    int             refs;               /* Requests using the mapping, plus one while it is current */
+    apr_time_t      mtime;              /* Identify the file that was mapped */
+    apr_ino_t       inode;
+} amber_index_map_t;
+
+/* A lookup index file, and the version of it that is mapped */
+typedef struct {
+    char                *path;          /* NULL if the slot is unused */
+    amber_index_map_t   *map;           /* NULL if the file could not be mapped */
+    apr_time_t          mtime;          /* Identify the version of the file that was last looked at */
+    apr_off_t           size;
+    apr_ino_t           inode;
+    apr_time_t          checked;        /* When the file was last checked for a new version */
+} amber_index_file_t;
+
+/* Per-child table of mapped lookup indexes. The mutex is only held to take and release references 
+   (once per response); lookups in a mapped index don't need it */
+typedef struct {
+    server_rec          *server;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t  *mutex;
+#endif
+    amber_index_file_t  files[AMBER_MAX_INDEXES];
+} amber_index_pool_t;
+
+static amber_index_pool_t *amber_index_pool = NULL;
+
+/* Hosts, domains and urls whose links are left alone, from AmberSkipHosts and the amber_exclude table. 
+   Requests take a reference while they use it, like a lookup index, so it can be reloaded at any time */
 typedef struct {
-    int   count;        /* Number of matching insertion positions and urls */
-    int   *insert_pos;  /* Array - positions within the buffer where additional 
-                           attributes should in inserted for matching hrefs */
-    char  **url;        /* Array - urls within the buffer. */
-} amber_matches_t;
+    apr_pool_t      *pool;              /* Holds the list, and is destroyed with it */
+    amber_skip_t    skip;
+    int             refs;               /* Requests using the list, plus one while it is current */
+} amber_skip_list_t;
 
-/* Configuration settings */
+/* The skip list for a configuration (a database and AmberSkipHosts) */
 typedef struct {
-    int        enabled;                  /* Is Amber enabled? */
-    char *     database;                 /* Path to the sqlite database */
-    int        behavior_up;              /* Default behaviour when site is up */
-    int        behavior_down;            /* Default behaviour when site is down */
-    int        hover_delay_up;           /* Hover delay when site is up */
-    int        hover_delay_down;         /* Hover delay when site is down */
-    char *     country;                  /* Two-character country code for country-specific behavior */
-    int        country_behavior_up;      /* Default behaviour when site is up */
-    int        country_behavior_down;    /* Default behaviour when site is down */
-    int        country_hover_delay_up;   /* Hover delay when site is up */
-    int        country_hover_delay_down; /* Hover delay when site is down */
-    int        cache_delivery;          
-} amber_options_t;
+    char                *db_path;       /* NULL if the slot is unused */
+    char                *hosts;
+    amber_skip_list_t   *list;          /* NULL until it has been loaded */
+    apr_time_t          loaded;         /* When amber_exclude was last read */
+    int                 loading;        /* Is a request reading amber_exclude now? */
+} amber_skip_slot_t;
+
+/* Per-child table of skip lists */
+typedef struct {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t  *mutex;
+#endif
+    amber_skip_slot_t   slots[AMBER_MAX_SKIP_LISTS];
+} amber_skip_pool_t;
+
+static amber_skip_pool_t *amber_skip_pool = NULL;
+
+/* State for rewriting a compressed response. Each bucket is inflated into buckets of up to 
+   AMBER_GZIP_BUFFER_SIZE, which are rewritten and then compressed again, so only a few buffers 
+   are held at any time */
+typedef struct {
+    int                 encoding;       /* AMBER_ENCODING_GZIP or AMBER_ENCODING_DEFLATE */
+    z_stream            inflate;
+    z_stream            deflate;
+    int                 error;          /* Set if the response could not be inflated */
+    int                 sent;           /* Has any compressed output been added to the output brigade? */
+    apr_bucket_brigade  *raw;           /* Compressed input, kept until there is some output, so that the response 
+                                           can be passed on as it is if it can't be inflated */
+    apr_bucket_brigade  *plain;         /* Inflated content being rewritten */
+    char                *out;           /* Buffer that deflated content is written to, or NULL */
+} amber_gzip_t;
 
 typedef struct {
     int        activity_logged;
+    apr_hash_t *lookups;                    /* Memo of lookup results (amber_lookup_t) for this request, keyed by url */
+    amber_index_map_t *index;               /* The lookup index used for this response, or NULL */
+    int        index_checked;               /* Has the lookup index been looked for? */
+    int        index_stale;                 /* Is the index older than the database? 0 if not, or not known yet */
+    int        index_stale_checked;         /* Has the index been compared with the database? */
+    amber_skip_list_t *skip;                /* Links to leave alone, or NULL */
+    int        skip_checked;                /* Has the skip list been looked for? */
+    amber_scan_t scan;                      /* State for finding links, reused for every bucket in the request */
+    apr_pool_t *scratch;                    /* Links found in a bucket, and anything else only needed while 
+                                               it's rewritten. Cleared for each bucket */
+    apr_bucket_brigade *out;                /* Rewritten content, reused every time the filter is called */
+    int        output_cache_state;          /* One of AMBER_OUTPUT_CACHE_* */
+    apr_file_t *output_cache_file;          /* Stored response being delivered, or the temporary file being written */
+    const char *output_cache_path;
+    const char *output_cache_temp_path;
+    apr_off_t  output_cache_offset;         /* Where the response starts in the file (after the key) */
+    apr_off_t  output_cache_size;           /* Size of the response */
+    uint64_t   output_cache_generation;     /* Generation of the database in the key of the response being stored */
+    int        output_cache_stale;          /* Was a link in the response looked up in an older generation? */
+    const char *url_prefix;                 /* Absolute url of the root of this server, built when first needed */
+    int        last_date;                   /* The cache date most recently formatted, and how it was formatted */
+    char       last_date_string[AMBER_MAX_DATE_STRING];
+    apr_interval_time_t scan_time;          /* Time spent on this response, for the latency histograms */
+    apr_interval_time_t lookup_time;
+    apr_interval_time_t rewrite_time;
+    int        trace;                       /* Are the timings and counts for this response recorded in its notes? */
+    int        link_count;
+    int        enqueued_count;
+    int        annotate_count;              /* Links (not counting those skipped) given to amber_lookup_links() */
+    int        budget_spent;                /* One of AMBER_BUDGET_* */
+    apr_size_t bytes_added;
+    amber_gzip_t *gzip;                     /* State for rewriting a compressed response, or NULL */
+    int        inject;                      /* One of AMBER_INJECT_* */
 } amber_context_t;
 
+/* An open database connection, along with the statements we run against it. Statements are prepared
+   the first time they are needed and then kept for the life of the connection */
+typedef struct {
+    char            *path;                      /* Path to the sqlite database, or NULL if the slot is unused */
+    sqlite3         *handle;
+    sqlite3_stmt    *url_lookup_query;
+    sqlite3_stmt    *enqueue_url_query;
+    sqlite3_stmt    *log_activity_query;
+    sqlite3_stmt    *content_type_date_query;
+    sqlite3_stmt    *data_version_query;
+    sqlite3_stmt    *generation_query;
+    sqlite3_stmt    *exclusions_query;
+    int             url_hash;                   /* Whether urls are looked up and queued by url_hash, which is
+                                                   AMBER_URL_HASH_PENDING until that is known */
+    int             data_version;               /* PRAGMA data_version when the generation was last calculated */
+    uint64_t        generation;                 /* Changes whenever the cache or check tables change */
+    apr_time_t      generation_checked;         /* When the generation was last checked (0 if never) */
+    int             in_use;                     /* Is a request currently using this connection? */
+    int             pooled;                     /* Is this connection owned by the pool (or opened just for one request)? */
+    apr_time_t      last_used;                  /* Used to pick the least recently used connection for eviction */
+} amber_db_t;
+
+/* Per-child pool of database connections. A connection is only used by one thread at a time, so there
+   are enough for every thread in the child to have its own */
+typedef struct {
+    server_rec          *server;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t  *mutex;
+#endif
+    int                 size;
+    amber_db_t          *connections;
+} amber_db_pool_t;
+
+static amber_db_pool_t *amber_db_pool = NULL;
+
+/* An entry in the shared memory lookup cache. Negative results (url not found) are cached too */
+typedef struct {
+    uint64_t   key;                                         /* Hash of the database path and url, 0 if unused */
+    apr_time_t expires;
+    int        result;
+    int        date;
+    int        status;
+    uint64_t   generation;                                  /* Generation of the database the result was read from */
+    char       url[AMBER_LOOKUP_CACHE_MAX_URL];
+    char       location[AMBER_LOOKUP_CACHE_MAX_LOCATION];
+} amber_lookup_cache_entry_t;
+
+/* Shared memory cache of url lookups, shared by all children. Created in post_config */
+typedef struct {
+    apr_shm_t                   *shm;
+    apr_global_mutex_t          *mutex;
+    amber_lookup_cache_entry_t  *entries;
+    apr_size_t                  set_count;                 /* Number of sets of AMBER_LOOKUP_CACHE_WAYS entries */
+    apr_interval_time_t         ttl;
+} amber_lookup_cache_t;
+
+static amber_lookup_cache_t *amber_lookup_cache = NULL;
+
+/* A url waiting to be added to the amber_queue table. Strings are malloc'd, since they are 
+   freed by the background writer thread */
+typedef struct {
+    char       *db_path;
+    char       *url;
+    uint64_t   hash;                            /* amber_index_hash() of the url */
+    int        created;
+} amber_enqueue_item_t;
+
+/* A database whose url_hash column the background writer keeps filled in. Entries are added at the 
+   head of the list by requests, and only freed when the writer has stopped, so the rest of the list 
+   can be walked without the lock */
+typedef struct amber_url_hash_db {
+    char                        *path;
+    int                         state;          /* AMBER_URL_HASH_*, only changed by the writer */
+    apr_time_t                  filled;         /* When url_hash was last filled in (0 to do it as soon as possible) */
+    struct amber_url_hash_db    *next;
+} amber_url_hash_db_t;
+
+/* Per-child bounded queue of urls to enqueue, drained by a background thread that writes 
+   them in batches, one transaction per batch */
+typedef struct {
+    server_rec              *server;
+    apr_thread_mutex_t      *mutex;
+    apr_thread_cond_t       *cond;
+    apr_thread_t            *thread;
+    amber_enqueue_item_t    *items;             /* Ring buffer of queued urls */
+    int                     capacity;
+    int                     head;               /* Index of the oldest url in the ring buffer */
+    int                     count;
+    int                     batch_size;
+    apr_interval_time_t     interval;
+    int                     shutdown;           /* Set when the child is exiting */
+    volatile apr_uint32_t   dropped;            /* Urls discarded because the queue was full */
+    amber_db_t              db;                 /* Connection used by the writer thread */
+    amber_url_hash_db_t     *url_hash_dbs;      /* Databases whose url_hash is kept filled in */
+} amber_enqueue_queue_t;
+
+#if APR_HAS_THREADS
+static amber_enqueue_queue_t *amber_enqueue_queue = NULL;
+#endif
+
+/* Views of a cache item that have not yet been written to the amber_activity table */
+typedef struct {
+    uint64_t    key;                            /* Hash of the database path and cache id, 0 if unused */
+    apr_uint32_t views;
+    apr_time_t  last_view;
+    char        db_path[AMBER_MAX_PATH];
+    char        cache_id[AMBER_MAX_CACHE_ID];
+} amber_activity_entry_t;
+
+/* The content type and date of a cache item, so that they are only read from the database once */
+typedef struct {
+    uint64_t    key;                            /* Hash of the database path and cache id, 0 if unused */
+    apr_time_t  mtime;                          /* Of the cached file when they were read, so they are read */
+    apr_off_t   size;                           /* again if the item is cached again */
+    int         date;                           /* When the item was cached, or 0 if it's not in the database */
+    char        type[AMBER_MAX_CONTENT_TYPE];   /* Empty if the item is not in the database */
+} amber_cache_meta_entry_t;
+
+/* Per-child table of cache item metadata, indexed by key */
+typedef struct {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t          *mutex;
+#endif
+    amber_cache_meta_entry_t    entries[AMBER_CACHE_META_ENTRIES];
+} amber_cache_meta_t;
+
+static amber_cache_meta_t *amber_cache_meta = NULL;
+
+/* Layout of the shared memory segment holding view counts */
+typedef struct {
+    apr_time_t              last_flush;
+    amber_activity_entry_t  entries[AMBER_ACTIVITY_MAX_ENTRIES];
+} amber_activity_shm_t;
+
+/* View counts shared by all children, so that each view is not a separate database write. 
+   Created in post_config, and flushed periodically by the background writer threads */
+typedef struct {
+    apr_shm_t               *shm;
+    apr_global_mutex_t      *mutex;
+    amber_activity_shm_t    *data;
+} amber_activity_t;
+
+static amber_activity_t *amber_activity = NULL;
+
+/* Layout of the shared memory segment remembering which urls have been enqueued. There are two Bloom 
+   filters, each covering half the ttl. The older one is cleared and reused when a new period starts, 
+   so a url is remembered for between half the ttl and the full ttl */
+typedef struct {
+    apr_uint32_t            period[2];      /* The period each filter holds urls for */
+    apr_uint32_t            bits[1];        /* Both filters, one after the other */
+} amber_enqueue_filter_shm_t;
+
+/* Urls that have recently been enqueued, or that were not found but may have been excluded or 
+   already checked. These are not enqueued again, which saves a database write for every link on 
+   every view of a popular page. Created in post_config */
+typedef struct {
+    apr_shm_t                   *shm;
+    apr_global_mutex_t          *mutex;
+    amber_enqueue_filter_shm_t  *data;
+    apr_uint32_t                filter_bits;    /* Number of bits in each filter */
+    int                         period_length;  /* Seconds */
+} amber_enqueue_filter_t;
+
+static amber_enqueue_filter_t *amber_enqueue_filter = NULL;
+
+/* Layout of the shared memory segment holding the statistics. Counters are only ever added to, 
+   atomically, so no mutex is needed */
+typedef struct {
+    apr_time_t              started;                                    /* When the counters were last reset */
+    volatile apr_uint64_t   counters[AMBER_STAT_COUNTERS];
+    volatile apr_uint64_t   histograms[AMBER_HISTOGRAMS][AMBER_HISTOGRAM_BUCKETS + 1];
+    volatile apr_uint64_t   histogram_sums[AMBER_HISTOGRAMS];           /* Microseconds */
+} amber_stats_shm_t;
+
+/* Statistics shared by all the children, reported by the amber-status handler. Created in post_config */
+typedef struct {
+    apr_shm_t               *shm;
+    amber_stats_shm_t       *data;
+} amber_stats_t;
+
+static amber_stats_t *amber_stats = NULL;
+
+/* Responses seen by this child, to pick the ones whose timings are recorded (see AmberTraceSample) */
+static volatile apr_uint32_t amber_trace_counter = 0;
+
+/* When the configuration was loaded, so that responses rewritten with an earlier configuration aren't used */
+static apr_time_t amber_config_generation = 0;
+static volatile apr_uint32_t amber_output_cache_stored = 0;    /* Bytes this child has stored in the output cache since it was swept */
+
 /* Functions and callbacks specifically related to Apache integration */
 static void         register_hooks(apr_pool_t *pool);
+static int          amber_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp);
+static int          amber_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+static void         amber_child_init(apr_pool_t *pchild, server_rec *s);
+static int          amber_check_sqlite_threads(server_rec *s);
 static void*        amber_create_dir_conf(apr_pool_t* pool, char* x);
 static void*        amber_merge_dir_conf(apr_pool_t* pool, void* BASE, void* ADD);
+static void*        amber_create_server_conf(apr_pool_t* pool, server_rec *s);
+static void*        amber_merge_server_conf(apr_pool_t* pool, void* BASE, void* ADD);
+static const char*  amber_set_lookup_cache(cmd_parms *cmd, void *cfg, const char *arg);
+static const char*  amber_set_enqueue(cmd_parms *cmd, void *cfg, const char *arg);
+static const char*  amber_set_enqueue_filter(cmd_parms *cmd, void *cfg, const char *arg);
+static const char*  amber_set_output_cache(cmd_parms *cmd, void *cfg, const char *arg);
+static const char*  amber_set_trace_sample(cmd_parms *cmd, void *cfg, const char *arg);
+static const char*  amber_set_inject_assets(cmd_parms *cmd, void *cfg, const char *arg, const char *locale);
+static const char*  amber_set_skip_hosts(cmd_parms *cmd, void *cfg, const char *arg);
+static const char*  amber_set_lookup_budget(cmd_parms *cmd, void *cfg, const char *arg, const char *max_links);
 static const char*  amber_set_behavior_up(cmd_parms *cmd, void *cfg, const char *arg);
 static const char*  amber_set_behavior_down(cmd_parms *cmd, void *cfg, const char *arg);
 static const char*  amber_set_country_behavior_up(cmd_parms *cmd, void *cfg, const char *arg);
@@ -71,37 +505,110 @@ static apr_status_t amber_filter(ap_filter_t *f, apr_bucket_brigade *bb);
 /* Other functions */
 static int              amber_should_apply_filter(ap_filter_t *f);
 static int              amber_is_cache_delivery(ap_filter_t *f);
-static apr_bucket*      amber_process_bucket(ap_filter_t *f, apr_bucket *bucket, const char *buffer, size_t buffer_size);
-static amber_matches_t  find_links_in_buffer(ap_filter_t *f, const char *buffer, size_t buffer_size);
-static size_t           amber_insert_attributes(ap_filter_t *f, amber_matches_t links, const char *old_buffer, size_t old_buffer_size, const char *new_buffer, size_t new_buffer_size);
-static char*            get_cache_item_id(ap_filter_t *f);
-static int              amber_log_activity(ap_filter_t *f);
-static int              amber_set_cache_delivery_headers(ap_filter_t *f);
-static char*            get_absolute_url(ap_filter_t *f, char *location);
-static size_t           get_maximum_attribute_size(ap_filter_t *f);
+static void             amber_process_bucket(ap_filter_t *f, amber_context_t *context, apr_bucket *bucket, const char *buffer, size_t buffer_size);
+static size_t           amber_process_carry(ap_filter_t *f, amber_context_t *context, apr_bucket *bucket, const char *buffer, size_t buffer_size);
+static void             amber_flush_carry(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb);
+static amber_matches_t  find_links_in_buffer(ap_filter_t *f, amber_context_t *context, const char *buffer, size_t buffer_size, size_t start);
+static int              amber_lookup_links(ap_filter_t *f, amber_context_t *context, amber_matches_t links, amber_db_t **db);
+static void             amber_enqueue_lookup(ap_filter_t *f, amber_context_t *context, amber_db_t **db, amber_lookup_t *lookup);
+static void             amber_enqueue_links(ap_filter_t *f, amber_context_t *context, amber_matches_t *links, int first, amber_db_t **db);
+static int              amber_lookup_budget_spent(ap_filter_t *f, amber_context_t *context, apr_interval_time_t elapsed);
+static int              amber_insert_attributes(ap_filter_t *f, amber_context_t *context, amber_matches_t links, apr_bucket *bucket, const char *buffer, size_t buffer_size);
+static char*            get_cache_item_id(request_rec *r);
+static int              amber_log_activity(request_rec *r);
+static int              amber_set_cache_delivery_headers(request_rec *r);
+static const char*      get_absolute_url_prefix(request_rec *r);
+static const char*      amber_get_behavior_attribute(apr_pool_t *pool, amber_options_t *options, int status);
+static void             amber_set_trace_notes(ap_filter_t *f, amber_context_t *context);
+static void             amber_skip_links(ap_filter_t *f, amber_context_t *context, amber_matches_t *links);
+static apr_bucket*      amber_assets_bucket(ap_filter_t *f, amber_context_t *context);
+static char*            amber_build_lookup_attribute(request_rec *r, amber_context_t *context, amber_lookup_t *lookup);
 
 /* Functions that interact with the database */
-static sqlite3*         amber_db_get_database(ap_filter_t *f, char *db_path);
-static int              amber_db_finalize_statement (ap_filter_t *f, sqlite3_stmt *sqlite_statement);
-static int              amber_db_close_database(ap_filter_t *f, sqlite3 *sqlite_handle);
-static sqlite3_stmt*    amber_db_get_statement(ap_filter_t *f, sqlite3 *sqlite_handle, char *statement);
-
-static sqlite3_stmt*    amber_db_get_url_lookup_query(ap_filter_t *f, sqlite3 *sqlite_handle);
-static sqlite3_stmt*    amber_db_get_enqueue_url_query(ap_filter_t *f, sqlite3 *sqlite_handle);
-static sqlite3_stmt*    amber_db_get_log_activity_query(ap_filter_t *f, sqlite3 *sqlite_handle);
-static sqlite3_stmt*    amber_db_get_content_type_date_query(ap_filter_t *f, sqlite3 *sqlite_handle);
-static int              amber_db_enqueue_url(ap_filter_t *f, sqlite3 *sqlite_handle, char *url);
-static int              amber_db_get_attribute(ap_filter_t *f, sqlite3 *sqlite_handle, sqlite3_stmt *sqlite_statement, char * url, char **result);
-
-/* Utility functions (platform independent) */
-int amber_get_behavior(amber_options_t *options, unsigned char *out, int status);
-int amber_build_attribute(amber_options_t *options, unsigned char *out, char *location, int status, time_t date);
+static amber_db_pool_t* amber_db_pool_create(apr_pool_t *p, server_rec *s);
+static amber_db_t*      amber_db_get_database(request_rec *r, char *db_path);
+static void             amber_db_release_database(request_rec *r, amber_db_t *db);
+static int              amber_db_reset_statement(request_rec *r, sqlite3_stmt *sqlite_statement);
+static sqlite3_stmt*    amber_db_get_statement(request_rec *r, amber_db_t *db, sqlite3_stmt **cached_statement, char *statement);
+
+static sqlite3_stmt*    amber_db_get_url_lookup_query(request_rec *r, amber_db_t *db);
+static void             amber_db_url_hash_function(sqlite3_context *sqlite_context, int argc, sqlite3_value **argv);
+static void             amber_db_check_url_hash(request_rec *r, amber_db_t *db);
+static sqlite3_stmt*    amber_db_get_enqueue_url_query(request_rec *r, amber_db_t *db);
+static sqlite3_stmt*    amber_db_get_log_activity_query(request_rec *r, amber_db_t *db);
+static sqlite3_stmt*    amber_db_get_content_type_date_query(request_rec *r, amber_db_t *db);
+static int              amber_db_get_exclusions(request_rec *r, amber_db_t *db, apr_array_header_t *patterns);
+static int              amber_db_enqueue_url(request_rec *r, amber_db_t *db, char *url, uint64_t hash);
+static int              amber_db_get_generation(request_rec *r, amber_db_t *db, uint64_t *generation);
+
+/* Functions that manage the cache of rewritten responses */
+static void             amber_output_cache_open(ap_filter_t *f, amber_context_t *context);
+static apr_status_t     amber_output_cache_deliver(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb);
+static void             amber_output_cache_store(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb);
+static void             amber_output_cache_abandon(amber_context_t *context);
+static void             amber_output_cache_child_init(apr_pool_t *pchild, server_rec *s);
+static void             amber_output_cache_sweep(server_rec *s);
+
+/* Functions that manage the background writer */
+static void             amber_background_child_init(apr_pool_t *pchild, server_rec *s);
+static int              amber_enqueue_push(request_rec *r, const char *db_path, const char *url, uint64_t hash);
+static int              amber_url_hash_state(request_rec *r, const char *db_path);
+
+/* Functions that manage the shared memory view counts */
+static apr_status_t     amber_activity_create(apr_pool_t *pconf, server_rec *s);
+static void             amber_activity_child_init(apr_pool_t *pchild, server_rec *s);
+
+/* Functions that manage the shared memory filter of enqueued urls */
+static apr_status_t     amber_enqueue_filter_create(apr_pool_t *pconf, server_rec *s, amber_server_options_t *server_options);
+static void             amber_enqueue_filter_child_init(apr_pool_t *pchild, server_rec *s);
+static int              amber_enqueue_filter_check(const char *db_path, uint64_t hash);
+static void             amber_enqueue_filter_add(request_rec *r, const char *db_path, uint64_t hash);
+static int              amber_activity_record(request_rec *r, const char *db_path, const char *cache_id);
+static void             amber_activity_flush(server_rec *s, int force);
+static int              amber_db_lookup_urls(request_rec *r, amber_db_t *db, amber_lookup_t **lookups, int lookup_count);
+
+/* Functions that manage the shared memory lookup cache */
+static apr_status_t     amber_lookup_cache_create(apr_pool_t *pconf, server_rec *s, amber_server_options_t *server_options);
+static void             amber_lookup_cache_child_init(apr_pool_t *pchild, server_rec *s);
+static int              amber_lookup_cache_get(request_rec *r, const char *db_path, const char *url, amber_lookup_t *lookup);
+static void             amber_lookup_cache_set(request_rec *r, const char *db_path, const char *url, amber_lookup_t *lookup);
+
+/* Functions that manage the mapped lookup indexes */
+static void             amber_index_child_init(apr_pool_t *pchild, server_rec *s);
+static amber_index_map_t* amber_index_acquire(request_rec *r, const char *path);
+
+/* Functions that manage the skip lists */
+static void             amber_skip_child_init(apr_pool_t *pchild, server_rec *s);
+static amber_skip_list_t* amber_skip_acquire(request_rec *r, amber_options_t *options);
+
+/* Functions that rewrite compressed responses */
+static int              amber_get_content_encoding(request_rec *r);
+static int              amber_gzip_start(ap_filter_t *f, amber_context_t *context, int encoding);
+static void             amber_gzip_inflate(ap_filter_t *f, amber_context_t *context, const char *buffer, size_t buffer_size);
+static void             amber_gzip_deflate(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb, int flush);
+static apr_status_t     amber_gzip_abort(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb, apr_status_t rv);
+
+/* Functions that manage the shared memory statistics */
+static apr_status_t     amber_stats_create(apr_pool_t *pconf, server_rec *s);
+static void             amber_stats_count(int counter, apr_uint64_t n);
+static void             amber_stats_count_sqlite(int sqlite_rc);
+static void             amber_stats_time(int histogram, apr_interval_time_t elapsed);
+static int              amber_stats_handler(request_rec *r);
+
+/* Functions that serve cached items */
+static void             amber_cache_meta_child_init(apr_pool_t *pchild, server_rec *s);
+static int              amber_cache_get_metadata(request_rec *r, const char *cache_id, const apr_finfo_t *finfo, char *type, int *date);
+static int              amber_cache_handler(request_rec *r);
+
+/* Allocate memory for amber_core from a pool */
+static void*            amber_pool_alloc(void *pool, size_t size);
 
 /* Apache structure that defines how configuration settings should be handled */
 static const command_rec amber_directives[] =
 {
     AP_INIT_FLAG("AmberEnabled",                ap_set_flag_slot, (void*)APR_OFFSETOF(amber_options_t, enabled), ACCESS_CONF, "Enable Amber"),
     AP_INIT_TAKE1("AmberDatabase",              ap_set_file_slot, (void*)APR_OFFSETOF(amber_options_t, database), ACCESS_CONF, "Location of the Amber database"),
+    AP_INIT_TAKE1("AmberLookupIndex",           ap_set_file_slot, (void*)APR_OFFSETOF(amber_options_t, index), ACCESS_CONF, "Location of the lookup index built from the Amber database by tools/amber_index"),
     AP_INIT_TAKE1("AmberBehaviorUp",            amber_set_behavior_up, NULL, ACCESS_CONF, "Set the behavior for links that are available"),
     AP_INIT_TAKE1("AmberBehaviorDown",          amber_set_behavior_down, NULL, ACCESS_CONF, "Set the behavior for links that are not available"),
     AP_INIT_TAKE1("AmberHoverDelayUp",          ap_set_int_slot, (void*)APR_OFFSETOF(amber_options_t, hover_delay_up), ACCESS_CONF, "Set the hover delay for links that are available"),
@@ -112,6 +619,14 @@ static const command_rec amber_directives[] =
     AP_INIT_TAKE1("AmberCountryHoverDelayUp",   ap_set_int_slot, (void*)APR_OFFSETOF(amber_options_t, country_hover_delay_up), ACCESS_CONF, "Set the hover delay for links that are available for the specified country"),
     AP_INIT_TAKE1("AmberCountryHoverDelayDown", ap_set_int_slot, (void*)APR_OFFSETOF(amber_options_t, country_hover_delay_down), ACCESS_CONF, "Set the hover delay for links that are not available for the specified country"),
     AP_INIT_FLAG("AmberCacheDelivery",          ap_set_flag_slot, (void*)APR_OFFSETOF(amber_options_t, cache_delivery), ACCESS_CONF, "Enable for directory from which cached content will be served "),
+    AP_INIT_ITERATE("AmberLookupCache",         amber_set_lookup_cache, NULL, RSRC_CONF, "Share url lookups between processes: 'size=<bytes>[K|M|G] ttl=<seconds>', or 'off'"),
+    AP_INIT_ITERATE("AmberEnqueue",             amber_set_enqueue, NULL, RSRC_CONF, "Enqueue new urls in the background: 'size=<urls> batch=<urls> interval=<ms>', or 'off' to enqueue while the request waits"),
+    AP_INIT_ITERATE("AmberEnqueueFilter",       amber_set_enqueue_filter, NULL, RSRC_CONF, "Remember enqueued urls so they are not enqueued again: 'size=<bytes>[K|M|G] ttl=<seconds>', or 'off'"),
+    AP_INIT_ITERATE("AmberOutputCache",         amber_set_output_cache, NULL, RSRC_CONF, "Keep rewritten static pages until they or the database change: 'dir=<path> max=<bytes>[K|M|G] total=<bytes>[K|M|G]', or 'off'"),
+    AP_INIT_TAKE12("AmberInjectAssets",         amber_set_inject_assets, NULL, ACCESS_CONF, "Insert the Amber javascript and CSS in pages with annotated links: 'on [locale]' or 'off'"),
+    AP_INIT_ITERATE("AmberSkipHosts",           amber_set_skip_hosts, NULL, ACCESS_CONF, "Hosts whose links are left alone: hosts, '.domain' for a domain and all its hosts, 'self' for the requested host, or 'none'"),
+    AP_INIT_TAKE12("AmberLookupBudget",         amber_set_lookup_budget, NULL, ACCESS_CONF, "Limit the time spent looking up links for a response: '<ms> [links]', or 'off'"),
+    AP_INIT_TAKE1("AmberTraceSample",           amber_set_trace_sample, NULL, RSRC_CONF, "Fraction of rewritten responses whose timings are recorded in the request notes (0 to 1)"),
     { NULL }
 };
 
@@ -121,8 +636,8 @@ module AP_MODULE_DECLARE_DATA   amber_module =
     STANDARD20_MODULE_STUFF,
     amber_create_dir_conf,            // Per-directory configuration handler
     amber_merge_dir_conf,             // Merge handler for per-directory configurations
-    NULL,                             // Per-server configuration handler
-    NULL,                             // Merge handler for per-server configurations
+    amber_create_server_conf,         // Per-server configuration handler
+    amber_merge_server_conf,          // Merge handler for per-server configurations
     amber_directives,                 // Any directives we may have for httpd
     register_hooks                    // Our hook registering function
 };
@@ -130,9 +645,80 @@ module AP_MODULE_DECLARE_DATA   amber_module =
 /* Apache: Adds a hook to the httpd process */
 static void register_hooks(apr_pool_t *pool) 
 {
+    ap_hook_pre_config(amber_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(amber_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(amber_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(amber_stats_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(amber_cache_handler, NULL, NULL, APR_HOOK_MIDDLE);
     ap_register_output_filter("amber-filter", amber_filter, NULL, AP_FTYPE_RESOURCE) ;
 }
 
+/**
+ * Apache: Register the mutex type used to protect our shared memory
+ */
+static int amber_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp) {
+    return ap_mutex_register(pconf, AMBER_SHM_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+}
+
+/**
+ * Apache: Set up state that is shared by all the children. This runs in the parent before the 
+ * children are forked, so every child inherits it.
+ */
+static int amber_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) {
+    amber_server_options_t *server_options = ap_get_module_config(s->module_config, &amber_module);
+    int rc;
+
+    if ((rc = amber_check_sqlite_threads(s)) != OK) {
+        return rc;
+    }
+    amber_config_generation = apr_time_now();
+    if (amber_lookup_cache_create(pconf, s, server_options) != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    amber_activity_create(pconf, s);
+    amber_enqueue_filter_create(pconf, s, server_options);
+    amber_stats_create(pconf, s);
+    return OK;
+}
+
+/**
+ * Make sure the sqlite library can be used from more than one thread. Requests are handled by many
+ * threads under the worker and event MPMs, and the background writer is a thread of its own
+ * @param s the server, for logging
+ * @return OK if it's safe to go on
+ */
+static int amber_check_sqlite_threads(server_rec *s) {
+    int threaded = 0;
+
+    if (sqlite3_threadsafe()) {
+        return OK;
+    }
+    if ((ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) == APR_SUCCESS) && (threaded != AP_MPMQ_NOT_SUPPORTED)) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, 
+            "Amber: sqlite was built without thread support (SQLITE_THREADSAFE=0), so it can't be used with a threaded MPM");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, s, 
+        "Amber: sqlite was built without thread support (SQLITE_THREADSAFE=0) - urls and views will be written synchronously");
+    return OK;
+}
+
+/**
+ * Apache: Set up the per-child state. The database connection pool lives in the child pool, so 
+ * its cleanup closes all the connections when the child exits (including on graceful restart)
+ */
+static void amber_child_init(apr_pool_t *pchild, server_rec *s) {
+    amber_db_pool = amber_db_pool_create(pchild, s);
+    amber_lookup_cache_child_init(pchild, s);
+    amber_index_child_init(pchild, s);
+    amber_skip_child_init(pchild, s);
+    amber_activity_child_init(pchild, s);
+    amber_cache_meta_child_init(pchild, s);
+    amber_enqueue_filter_child_init(pchild, s);
+    amber_output_cache_child_init(pchild, s);
+    amber_background_child_init(pchild, s);
+}
+
 /**
  * Apache: Set the default values for the configuration directives. 
  */
@@ -152,10 +738,47 @@ static void* amber_create_dir_conf(apr_pool_t* pool, char* x) {
         options->country_hover_delay_up = -1;
         options->country_hover_delay_down = -1;
         options->cache_delivery = -1;
+        options->behavior_attribute[AMBER_STATUS_DOWN] = NULL;
+        options->behavior_attribute[AMBER_STATUS_UP] = NULL;
+        options->inject_assets = -1;
+        options->inject_locale = NULL;
+        options->assets = NULL;
+        options->index = NULL;
+        options->skip_hosts = NULL;
+        options->skip_self = -1;
+        options->lookup_budget = -1;
+        options->lookup_max_links = -1;
     }
     return options ;
 }
 
+/**
+ * Apache: Set the default values for the server-wide configuration directives
+ */
+static void* amber_create_server_conf(apr_pool_t* pool, server_rec *s) {
+    amber_server_options_t* server_options = apr_pcalloc(pool, sizeof(amber_server_options_t));
+    server_options->lookup_cache_size = 0;
+    server_options->lookup_cache_ttl = AMBER_LOOKUP_CACHE_DEFAULT_TTL;
+    server_options->enqueue_queue_size = AMBER_ENQUEUE_DEFAULT_QUEUE_SIZE;
+    server_options->enqueue_batch_size = AMBER_ENQUEUE_DEFAULT_BATCH_SIZE;
+    server_options->enqueue_interval = AMBER_ENQUEUE_DEFAULT_INTERVAL;
+    server_options->enqueue_filter_size = AMBER_ENQUEUE_FILTER_DEFAULT_SIZE;
+    server_options->enqueue_filter_ttl = AMBER_ENQUEUE_FILTER_DEFAULT_TTL;
+    server_options->output_cache_dir = NULL;
+    server_options->output_cache_max = AMBER_OUTPUT_CACHE_DEFAULT_MAX;
+    server_options->output_cache_total = AMBER_OUTPUT_CACHE_DEFAULT_TOTAL;
+    server_options->trace_interval = 0;
+    return server_options;
+}
+
+/**
+ * Apache: Every server-wide setting can only be set outside <VirtualHost>, so virtual hosts use 
+ * the main server's settings
+ */
+static void* amber_merge_server_conf(apr_pool_t* pool, void* BASE, void* ADD) {
+    return BASE;
+}
+
 /**
  * Apache: Merge hierarchical configuration settings 
  */
@@ -166,6 +789,11 @@ static void* amber_merge_dir_conf(apr_pool_t* pool, void* BASE, void* ADD) {
 
     conf->enabled                   =  ( add->enabled == -1 ) ? base->enabled : add->enabled ;
     conf->database                  =  ( !add->database ) ? base->database : add->database ;
+    conf->index                     =  ( !add->index ) ? base->index : add->index ;
+    conf->skip_hosts                =  ( add->skip_self == -1 ) ? base->skip_hosts : add->skip_hosts ;
+    conf->skip_self                 =  ( add->skip_self == -1 ) ? base->skip_self : add->skip_self ;
+    conf->lookup_budget             =  ( add->lookup_budget == -1 ) ? base->lookup_budget : add->lookup_budget ;
+    conf->lookup_max_links          =  ( add->lookup_budget == -1 ) ? base->lookup_max_links : add->lookup_max_links ;
     conf->behavior_up               =  ( add->behavior_up == -1 ) ? base->behavior_up : add->behavior_up ;
     conf->behavior_down             =  ( add->behavior_down == -1 ) ? base->behavior_down : add->behavior_down ;
     conf->hover_delay_up            =  ( add->hover_delay_up == -1 ) ? base->hover_delay_up : add->hover_delay_up ;
@@ -176,6 +804,25 @@ static void* amber_merge_dir_conf(apr_pool_t* pool, void* BASE, void* ADD) {
     conf->country_hover_delay_up    =  ( add->country_hover_delay_up == -1 ) ? base->country_hover_delay_up : add->country_hover_delay_up ;
     conf->country_hover_delay_down  =  ( add->country_hover_delay_down == -1 ) ? base->country_hover_delay_down : add->country_hover_delay_down ;
     conf->cache_delivery            =  ( add->cache_delivery == -1 ) ? base->cache_delivery : add->cache_delivery ;
+    conf->inject_assets             =  ( add->inject_assets == -1 ) ? base->inject_assets : add->inject_assets ;
+    conf->inject_locale             =  ( add->inject_assets == -1 ) ? base->inject_locale : add->inject_locale ;
+
+    /* The behavior is the same for every link with the same status, so only work it out once */
+    conf->behavior_attribute[AMBER_STATUS_DOWN] = (char *)amber_get_behavior_attribute(pool, conf, AMBER_STATUS_DOWN);
+    conf->behavior_attribute[AMBER_STATUS_UP] = (char *)amber_get_behavior_attribute(pool, conf, AMBER_STATUS_UP);
+
+    /* The tags amber.conf used to insert in the head with mod_substitute. They now go in the body, before
+       the first annotated link, so amber.js is deferred until the whole page has been parsed (and can
+       find every link); the locale is set by an inline script ahead of it, which runs first */
+    conf->assets = NULL;
+    if (1 == conf->inject_assets) {
+        conf->assets = "<script type='text/javascript' src='/amber/js/amber.js' defer></script>"
+                       "<link rel='stylesheet' type='text/css' href='/amber/css/amber.css'>";
+        if (conf->inject_locale) {
+            conf->assets = apr_pstrcat(pool, "<script type='text/javascript'>var amber_locale='", conf->inject_locale, "';</script>", 
+                                       conf->assets, "<link rel='stylesheet' type='text/css' href='/amber/css/amber_", conf->inject_locale, ".css'>", NULL);
+        }
+    }
     return conf ;
 }
 
@@ -196,6 +843,32 @@ static int amber_convert_behavior_config(const char *s) {
     }
 }
 
+/**
+ * Convert a size from a configuration file (e.g. 64M) into bytes
+ * @param s description of the size, with an optional K, M or G suffix
+ * @param size the size in bytes
+ * @return NULL on success, or an error message
+ */
+static const char *amber_convert_size_config(const char *s, apr_size_t *size) {
+    char *end;
+    apr_int64_t value = apr_strtoi64(s, &end, 10);
+    if ((end == s) || (value < 0)) {
+        return "invalid size";
+    }
+    switch (apr_toupper(*end)) {
+        case 'G': value *= 1024;            /* fall through */
+        case 'M': value *= 1024;            /* fall through */
+        case 'K': value *= 1024; end++;     /* fall through */
+        case 0: break;
+        default: return "invalid size suffix (use K, M or G)";
+    }
+    if (*end) {
+        return "invalid size suffix (use K, M or G)";
+    }
+    *size = (apr_size_t)value;
+    return NULL;
+}
+
 /* Callback functions for setting up some configuration settings */
 static const char *amber_set_behavior_up(cmd_parms *cmd, void *cfg, const char *arg)
 {
@@ -221,6 +894,215 @@ static const char *amber_set_country_behavior_down(cmd_parms *cmd, void *cfg, co
     return NULL;
 }
 
+/* The lookup cache is shared by every virtual host, so is configured once for the whole server */
+static const char *amber_set_lookup_cache(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    amber_server_options_t *server_options = ap_get_module_config(cmd->server->module_config, &amber_module);
+    const char *err;
+
+    if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
+        return err;
+    }
+    if (!strcasecmp(arg, "off")) {
+        server_options->lookup_cache_size = 0;
+    } else if (!strncasecmp(arg, "size=", 5)) {
+        if ((err = amber_convert_size_config(arg + 5, &server_options->lookup_cache_size))) {
+            return apr_pstrcat(cmd->pool, "AmberLookupCache: ", err, NULL);
+        }
+    } else if (!strncasecmp(arg, "ttl=", 4)) {
+        server_options->lookup_cache_ttl = atoi(arg + 4);
+        if (server_options->lookup_cache_ttl <= 0) {
+            return "AmberLookupCache: ttl must be a positive number of seconds";
+        }
+    } else {
+        return apr_pstrcat(cmd->pool, "AmberLookupCache: unknown argument ", arg, NULL);
+    }
+    return NULL;
+}
+
+/* The background writer runs in every child, so is configured once for the whole server */
+static const char *amber_set_enqueue(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    amber_server_options_t *server_options = ap_get_module_config(cmd->server->module_config, &amber_module);
+    const char *err;
+    int *setting;
+
+    if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
+        return err;
+    }
+    if (!strcasecmp(arg, "off")) {
+        server_options->enqueue_queue_size = 0;
+        return NULL;
+    } else if (!strncasecmp(arg, "size=", 5)) {
+        setting = &server_options->enqueue_queue_size;
+    } else if (!strncasecmp(arg, "batch=", 6)) {
+        setting = &server_options->enqueue_batch_size;
+    } else if (!strncasecmp(arg, "interval=", 9)) {
+        setting = &server_options->enqueue_interval;
+    } else {
+        return apr_pstrcat(cmd->pool, "AmberEnqueue: unknown argument ", arg, NULL);
+    }
+    if ((*setting = atoi(strchr(arg, '=') + 1)) <= 0) {
+        return apr_pstrcat(cmd->pool, "AmberEnqueue: ", arg, " must be a positive number", NULL);
+    }
+    return NULL;
+}
+
+/* The filter of enqueued urls is shared by every virtual host, so is configured once for the whole server */
+static const char *amber_set_enqueue_filter(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    amber_server_options_t *server_options = ap_get_module_config(cmd->server->module_config, &amber_module);
+    const char *err;
+
+    if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
+        return err;
+    }
+    if (!strcasecmp(arg, "off")) {
+        server_options->enqueue_filter_size = 0;
+    } else if (!strncasecmp(arg, "size=", 5)) {
+        if ((err = amber_convert_size_config(arg + 5, &server_options->enqueue_filter_size))) {
+            return apr_pstrcat(cmd->pool, "AmberEnqueueFilter: ", err, NULL);
+        }
+    } else if (!strncasecmp(arg, "ttl=", 4)) {
+        server_options->enqueue_filter_ttl = atoi(arg + 4);
+        if (server_options->enqueue_filter_ttl < 2) {
+            return "AmberEnqueueFilter: ttl must be at least 2 seconds";
+        }
+    } else {
+        return apr_pstrcat(cmd->pool, "AmberEnqueueFilter: unknown argument ", arg, NULL);
+    }
+    return NULL;
+}
+
+/* The output cache is shared by every virtual host (the host name is part of the key), so is 
+   configured once for the whole server */
+static const char *amber_set_output_cache(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    amber_server_options_t *server_options = ap_get_module_config(cmd->server->module_config, &amber_module);
+    const char *err;
+
+    if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
+        return err;
+    }
+    if (!strcasecmp(arg, "off")) {
+        server_options->output_cache_dir = NULL;
+    } else if (!strncasecmp(arg, "dir=", 4)) {
+        if (!(server_options->output_cache_dir = ap_server_root_relative(cmd->pool, arg + 4))) {
+            return apr_pstrcat(cmd->pool, "AmberOutputCache: invalid directory ", arg + 4, NULL);
+        }
+    } else if (!strncasecmp(arg, "max=", 4)) {
+        if ((err = amber_convert_size_config(arg + 4, &server_options->output_cache_max))) {
+            return apr_pstrcat(cmd->pool, "AmberOutputCache: ", err, NULL);
+        }
+    } else if (!strncasecmp(arg, "total=", 6)) {
+        if ((err = amber_convert_size_config(arg + 6, &server_options->output_cache_total))) {
+            return apr_pstrcat(cmd->pool, "AmberOutputCache: ", err, NULL);
+        }
+    } else {
+        return apr_pstrcat(cmd->pool, "AmberOutputCache: unknown argument ", arg, NULL);
+    }
+    return NULL;
+}
+
+static const char *amber_set_inject_assets(cmd_parms *cmd, void *cfg, const char *arg, const char *locale)
+{
+    amber_options_t *options = (amber_options_t *) cfg;
+    const char *c;
+
+    if (!strcasecmp(arg, "off")) {
+        options->inject_assets = 0;
+        options->inject_locale = NULL;
+        return NULL;
+    } else if (strcasecmp(arg, "on")) {
+        return "AmberInjectAssets must be 'on' (optionally followed by a locale) or 'off'";
+    }
+    if (locale) {
+        /* The locale ends up in a script and a url, so keep it simple */
+        for (c = locale; *c; c++) {
+            if (!apr_isalnum(*c) && (*c != '_') && (*c != '-')) {
+                return "AmberInjectAssets: the locale can only contain letters, numbers, '_' and '-'";
+            }
+        }
+    }
+    options->inject_assets = 1;
+    options->inject_locale = locale ? apr_pstrdup(cmd->pool, locale) : NULL;
+    return NULL;
+}
+
+static const char *amber_set_lookup_budget(cmd_parms *cmd, void *cfg, const char *arg, const char *max_links)
+{
+    amber_options_t *options = (amber_options_t *) cfg;
+    char *end;
+    long budget;
+    long links = 0;
+
+    if (!strcasecmp(arg, "off") && !max_links) {
+        options->lookup_budget = 0;
+        options->lookup_max_links = 0;
+        return NULL;
+    }
+    budget = strtol(arg, &end, 10);
+    if ((end == arg) || *end || (budget < 0) || (budget > INT_MAX)) {
+        return "AmberLookupBudget must be a number of milliseconds (0 for no limit), optionally followed by a number of links, or 'off'";
+    }
+    if (max_links) {
+        links = strtol(max_links, &end, 10);
+        if ((end == max_links) || *end || (links < 0) || (links > INT_MAX)) {
+            return "AmberLookupBudget: the number of links must be a number (0 for no limit)";
+        }
+    }
+    options->lookup_budget = (int)budget;
+    options->lookup_max_links = (int)links;
+    return NULL;
+}
+
+/* The hosts are kept as they were given, and the skip list is built from them by each child (see amber_skip_acquire()) */
+static const char *amber_set_skip_hosts(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    amber_options_t *options = (amber_options_t *) cfg;
+    const char *host = arg;
+
+    /* Any use of the directive replaces the hosts inherited from elsewhere */
+    if (options->skip_self == -1) {
+        options->skip_self = 0;
+        options->skip_hosts = NULL;
+    }
+    if (!strcasecmp(arg, "none")) {
+        return NULL;
+    }
+    if (!strcasecmp(arg, "self")) {
+        options->skip_self = 1;
+        return NULL;
+    }
+    if ((host[0] == '*') && (host[1] == '.')) {
+        host++;
+    }
+    if (!host[0] || ((host[0] == '.') && !host[1]) || (strlen(host) > AMBER_MAX_HOST + 1) || strstr(host, "://") || strchr(host, '/')) {
+        return apr_psprintf(cmd->pool, "AmberSkipHosts: '%s' is not a host or a domain", arg);
+    }
+    options->skip_hosts = options->skip_hosts ? apr_pstrcat(cmd->pool, options->skip_hosts, " ", arg, NULL) : apr_pstrdup(cmd->pool, arg);
+    return NULL;
+}
+
+/* Sampling is done by counting responses rather than at random, which is cheaper and close enough */
+static const char *amber_set_trace_sample(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    amber_server_options_t *server_options = ap_get_module_config(cmd->server->module_config, &amber_module);
+    const char *err;
+    char *end;
+    double sample;
+
+    if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
+        return err;
+    }
+    sample = strtod(arg, &end);
+    if ((end == arg) || *end || (sample < 0) || (sample > 1)) {
+        return "AmberTraceSample must be a number between 0 and 1";
+    }
+    server_options->trace_interval = (sample > 0) ? (int)(1 / sample + 0.5) : 0;
+    return NULL;
+}
+
 /** 
  * Search for external links to be annotated with cache location or saved for future caching
  * @param f the filter
@@ -229,31 +1111,69 @@ static const char *amber_set_country_behavior_down(cmd_parms *cmd, void *cfg, co
  */
 static apr_status_t amber_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
-    apr_bucket          *bucket, *next_bucket, *new_bucket;
+    request_rec         *r = f->r;
+    apr_bucket          *bucket, *next_bucket;
     apr_bucket_brigade  *outBB;
     const char          *buffer;
     size_t              buffer_size;
     apr_status_t        rv;
     amber_context_t     *context;
+    apr_time_t          start_time;
 
     amber_debug("Filter start");
     context = f->ctx;
     if (!context) {
         f->ctx = context = apr_palloc(f->r->pool, sizeof(amber_context_t));
         context->activity_logged = 0;
+        context->lookups = NULL;
+        context->index = NULL;
+        context->index_checked = 0;
+        context->skip = NULL;
+        context->skip_checked = 0;
+        context->scratch = NULL;
+        context->out = NULL;
+        context->scan.carry_size = 0;
+        context->output_cache_state = AMBER_OUTPUT_CACHE_UNKNOWN;
+        context->output_cache_file = NULL;
+        context->output_cache_generation = 0;
+        context->output_cache_stale = 0;
+        context->url_prefix = NULL;
+        context->last_date = -1;
+        context->scan_time = 0;
+        context->lookup_time = 0;
+        context->rewrite_time = 0;
+        context->trace = 0;
+        context->link_count = 0;
+        context->enqueued_count = 0;
+        context->annotate_count = 0;
+        context->budget_spent = AMBER_BUDGET_NONE;
+        context->bytes_added = 0;
+        context->gzip = NULL;
+        context->inject = AMBER_INJECT_NONE;
+    }
+
+    if (f->r->handler && !strcmp(f->r->handler, AMBER_CACHE_HANDLER)) {
+        /* The amber-cache handler has already set the headers and counted the view */
+        ap_remove_output_filter(f);
+        return ap_pass_brigade(f->next, bb);
     }
 
     if (amber_is_cache_delivery(f)) {
         amber_debug("Delivering cached item");
         if (!context->activity_logged) {
-            amber_log_activity(f);
-            amber_set_cache_delivery_headers(f);
+            amber_log_activity(r);
+            amber_set_cache_delivery_headers(r);
+            context->activity_logged = 1;
+            amber_stats_count(AMBER_STAT_CACHE_DELIVERIES, 1);
         }
         return ap_pass_brigade(f->next, bb);
     }
 
     if (!amber_should_apply_filter(f)) {
+        /* Remove ourselves, so the rest of the response goes straight through (and is counted once) */
         amber_debug("Skipping file");
+        amber_stats_count(AMBER_STAT_RESPONSES_SKIPPED, 1);
+        ap_remove_output_filter(f);
         return ap_pass_brigade(f->next, bb);
     }
 
@@ -262,13 +1182,43 @@ static apr_status_t amber_filter(ap_filter_t *f, apr_bucket_brigade *bb)
         return APR_SUCCESS;
     }
 
-    /* Create the output brigade which will contain the transformed response */
-    /* TODO - Save this brigade in the context, so we don't create one for each invocation */    
-    if (!(outBB = apr_brigade_create(f->r->pool, f->c->bucket_alloc))) {
-        /* Error - log the problem and don't process the brigade */
-        amber_error("Amber: Could not create output buffer brigade");    
-        return ap_pass_brigade(f->next, bb);
-    } 
+    /* If we've already rewritten this version of the page, send that instead */
+    if (AMBER_OUTPUT_CACHE_UNKNOWN == context->output_cache_state) {
+        amber_server_options_t *server_options = ap_get_module_config(f->r->server->module_config, &amber_module);
+        int encoding = amber_get_content_encoding(f->r);
+        if ((AMBER_ENCODING_NONE != encoding) && amber_gzip_start(f, context, encoding)) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+        /* Adding attributes changes the length */
+        apr_table_unset(f->r->headers_out, "Content-Length");
+        amber_stats_count(AMBER_STAT_RESPONSES_FILTERED, 1);
+        context->trace = server_options->trace_interval && 
+                         !(apr_atomic_inc32(&amber_trace_counter) % server_options->trace_interval);
+        if (((amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module))->assets) {
+            context->inject = AMBER_INJECT_PENDING;
+        }
+        amber_output_cache_open(f, context);
+    }
+    if (AMBER_OUTPUT_CACHE_HIT == context->output_cache_state) {
+        return amber_output_cache_deliver(f, context, bb);
+    }
+
+    /* Create the output brigade which will contain the transformed response the first time through. It's
+       emptied each time it's passed on, so the same one is used for the whole response */
+    if (!context->out) {
+        if ((APR_SUCCESS != apr_pool_create(&context->scratch, f->r->pool)) || 
+            !(context->out = apr_brigade_create(f->r->pool, f->c->bucket_alloc))) {
+            /* Error - log the problem and don't process the response */
+            amber_error("Amber: Could not create output buffer brigade");    
+            amber_output_cache_abandon(context);
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+        apr_pool_tag(context->scratch, "amber_scratch");
+        amber_scan_init(&context->scan, amber_pool_alloc, context->scratch);
+    }
+    outBB = context->out;
 
 
     /* Start out with non-blocking reads, so that if we're reading from a stream, we don't 
@@ -279,64 +1229,139 @@ static apr_status_t amber_filter(ap_filter_t *f, apr_bucket_brigade *bb)
     /* Main loop through which we process all the buckets in the brigade */
     while (bucket != APR_BRIGADE_SENTINEL(bb)) {
         amber_debug("In bucket loop");
-        next_bucket = APR_BUCKET_NEXT(bucket);
-        if (bucket == next_bucket) {
-            amber_error("Avoiding infinite bucket loop!");
-            return ap_pass_brigade(f->next, bb);
-        }
 
         /* This is a metadata bucket indicating the end of the response */
         if (APR_BUCKET_IS_EOS(bucket)) {
+            if (context->gzip) {
+                amber_flush_carry(f, context, context->gzip->plain);
+                if (AMBER_INJECT_NEXT == context->inject) {
+                    APR_BRIGADE_INSERT_TAIL(context->gzip->plain, amber_assets_bucket(f, context));
+                }
+                amber_gzip_deflate(f, context, outBB, Z_FINISH);
+            } else {
+                amber_flush_carry(f, context, outBB);
+                if (AMBER_INJECT_NEXT == context->inject) {
+                    APR_BRIGADE_INSERT_TAIL(outBB, amber_assets_bucket(f, context));
+                }
+            }
             APR_BUCKET_REMOVE(bucket);
             APR_BRIGADE_INSERT_TAIL(outBB, bucket);
+            amber_output_cache_store(f, context, outBB);
+            amber_stats_time(AMBER_HISTOGRAM_SCAN, context->scan_time);
+            amber_stats_time(AMBER_HISTOGRAM_LOOKUP, context->lookup_time);
+            amber_stats_time(AMBER_HISTOGRAM_REWRITE, context->rewrite_time);
+            if (context->trace) {
+                amber_set_trace_notes(f, context);
+            }
+            apr_pool_destroy(context->scratch);
             f->ctx = context = NULL;
             amber_debug("Filter end");
-            return ap_pass_brigade(f->next, outBB);
+            rv = ap_pass_brigade(f->next, outBB);
+            apr_brigade_cleanup(outBB);
+            return rv;
         }
 
         /* This is a metadata bucket indicating that we should flush output, and then continue */
         if (APR_BUCKET_IS_FLUSH(bucket)) {
-            APR_BRIGADE_INSERT_TAIL(outBB, bucket);
-            if ((rv = ap_pass_brigade(f->next, outBB)) != APR_SUCCESS) {
-                return rv;
+            next_bucket = APR_BUCKET_NEXT(bucket);
+            if (context->gzip) {
+                amber_flush_carry(f, context, context->gzip->plain);
+                amber_gzip_deflate(f, context, outBB, Z_SYNC_FLUSH);
+            } else {
+                amber_flush_carry(f, context, outBB);
             }
+            APR_BUCKET_REMOVE(bucket);
+            APR_BRIGADE_INSERT_TAIL(outBB, bucket);
+            amber_output_cache_store(f, context, outBB);
+            rv = ap_pass_brigade(f->next, outBB);
             /* Reset our output brigade */
             apr_brigade_cleanup(outBB);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            bucket = next_bucket;
+            continue;
+        }
+
+        /* Any other metadata is passed through unchanged */
+        if (APR_BUCKET_IS_METADATA(bucket)) {
+            next_bucket = APR_BUCKET_NEXT(bucket);
+            APR_BUCKET_REMOVE(bucket);
+            APR_BRIGADE_INSERT_TAIL(outBB, bucket);
+            bucket = next_bucket;
             continue;
         }
 
         /* Read the bucket! */
-        if (!APR_BUCKET_IS_METADATA(bucket)) {
-            rv = apr_bucket_read(bucket, &buffer, &buffer_size, read_mode);
-            if (APR_SUCCESS == rv) {
-                read_mode = APR_NONBLOCK_READ;
-                new_bucket = amber_process_bucket(f, bucket, buffer, buffer_size);
-            } else if ((APR_EAGAIN == rv) && (APR_NONBLOCK_READ == read_mode)) {
-                /* Data is not available, so we need to try again. Flush everything we have so far 
-                   and switch to using blocking reads */
-                read_mode = APR_BLOCK_READ;
-                APR_BRIGADE_INSERT_TAIL(outBB, apr_bucket_flush_create(f->c->bucket_alloc));
-                if ((rv = ap_pass_brigade(f->next, outBB)) != APR_SUCCESS) {
-                    return rv;
-                }
-                apr_brigade_cleanup(outBB);
-                continue;
-            } else {
-                /* Error - log the problem and don't process the rest of the brigade */
-                amber_error("Error reading from bucket");    
-                return ap_pass_brigade(f->next, bb);
+        rv = apr_bucket_read(bucket, &buffer, &buffer_size, read_mode);
+        if (APR_SUCCESS == rv) {
+            read_mode = APR_NONBLOCK_READ;
+        } else if ((APR_EAGAIN == rv) && (APR_NONBLOCK_READ == read_mode)) {
+            /* Data is not available, so we need to try again. Flush everything we have so far 
+               and switch to using blocking reads */
+            read_mode = APR_BLOCK_READ;
+            if (context->gzip) {
+                amber_gzip_deflate(f, context, outBB, Z_SYNC_FLUSH);
+            }
+            APR_BRIGADE_INSERT_TAIL(outBB, apr_bucket_flush_create(f->c->bucket_alloc));
+            amber_output_cache_store(f, context, outBB);
+            rv = ap_pass_brigade(f->next, outBB);
+            apr_brigade_cleanup(outBB);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            continue;
+        } else {
+            /* Error - log the problem and don't process the rest of the brigade */
+            amber_error("Error reading from bucket");    
+            amber_output_cache_abandon(context);
+            if (context->gzip) {
+                /* The rest of the compressed data can't follow what we've compressed again */
+                return amber_gzip_abort(f, context, bb, rv);
             }
+            amber_flush_carry(f, context, outBB);
+            APR_BRIGADE_CONCAT(outBB, bb);
+            rv = ap_pass_brigade(f->next, outBB);
+            apr_brigade_cleanup(outBB);
+            return rv;
         }
 
-        APR_BUCKET_REMOVE(bucket);
-        APR_BRIGADE_INSERT_TAIL(outBB, new_bucket); 
+        /* Reading may have split the bucket (e.g. a file is read in chunks), so only now do we know what comes next */
+        next_bucket = APR_BUCKET_NEXT(bucket);
+
+        start_time = apr_time_now();
+        if (context->gzip) {
+            /* Inflate and rewrite the bucket, and add what's been compressed again to the output brigade */
+            amber_gzip_inflate(f, context, buffer, buffer_size);
+            if (context->gzip->error) {
+                return amber_gzip_abort(f, context, bb, APR_EGENERAL);
+            }
+            amber_gzip_deflate(f, context, outBB, Z_NO_FLUSH);
+            if (context->gzip->sent) {
+                apr_bucket_delete(bucket);
+                apr_brigade_cleanup(context->gzip->raw);
+            } else {
+                APR_BUCKET_REMOVE(bucket);
+                apr_bucket_setaside(bucket, f->r->pool);
+                APR_BRIGADE_INSERT_TAIL(context->gzip->raw, bucket);
+            }
+        } else {
+            /* Move the bucket to the output brigade, where it is replaced by the rewritten content */
+            APR_BUCKET_REMOVE(bucket);
+            APR_BRIGADE_INSERT_TAIL(outBB, bucket); 
+            amber_process_bucket(f, context, bucket, buffer, buffer_size);
+        }
+        context->rewrite_time += apr_time_now() - start_time;
 
         bucket = next_bucket;
     }
 
     amber_debug("Filter end");
 
-    return ap_pass_brigade(f->next, outBB);
+    amber_output_cache_store(f, context, outBB);
+    rv = ap_pass_brigade(f->next, outBB);
+    apr_brigade_cleanup(outBB);
+    return rv;
 }    
 
 /**
@@ -346,6 +1371,7 @@ static apr_status_t amber_filter(ap_filter_t *f, apr_bucket_brigade *bb)
  * @return true if the requests should be processed
  */
 static int amber_should_apply_filter(ap_filter_t *f) {
+    request_rec *r = f->r;
     
     amber_debug1("Amber: File type: %s", f->r->content_type);
     amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
@@ -354,7 +1380,8 @@ static int amber_should_apply_filter(ap_filter_t *f) {
         f->r && 
         f->r->content_type && 
         (1 == options->enabled) && 
-        !strncmp("text/html", f->r->content_type, 9));
+        !strncmp("text/html", f->r->content_type, 9) &&
+        (AMBER_ENCODING_UNSUPPORTED != amber_get_content_encoding(f->r)));
 }
 
 /**
@@ -369,213 +1396,644 @@ static int amber_is_cache_delivery(ap_filter_t *f) {
 }
 
 
+/**
+ * Make a bucket with the javascript and CSS, which are then no longer waiting to be inserted. They're
+ * only needed on pages with annotated links, so they're inserted just before the first one, in the body.
+ * @param f the filter
+ * @param context the filter context for this request
+ * @return the bucket
+ */
+static apr_bucket *amber_assets_bucket(ap_filter_t *f, amber_context_t *context) {
+    request_rec *r = f->r;
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
+    apr_size_t size = strlen(options->assets);
+
+    context->inject = AMBER_INJECT_NONE;
+    context->bytes_added += size;
+    amber_debug("Amber: inserted javascript and CSS");
+    return apr_bucket_immortal_create(options->assets, size, f->c->bucket_alloc);
+}
+
 /** 
- * Create the updated bucket to be added to the output filter change
+ * Rewrite a bucket in the output brigade, adding attributes to any links. If the end of the bucket 
+ * may be the start of a link, it is held back in the context and joined to the start of the next bucket.
  * @param f the filter
- * @param bucket the bucket to process
+ * @param context the filter context for this request
+ * @param bucket the bucket to process, which is already in the output brigade
  * @param buffer the contents of the bucket
  * @param buffer_size the size of the buffer containing the bucket contents
- * @return the bucket to add to the output filter chain.
  */
-static apr_bucket* amber_process_bucket(ap_filter_t *f, apr_bucket *bucket, const char *buffer, size_t buffer_size) {
+static void amber_process_bucket(ap_filter_t *f, amber_context_t *context, apr_bucket *bucket, const char *buffer, size_t buffer_size) {
+    request_rec *r = f->r;
+    size_t scan_start = 0;
+    size_t keep_size;
+
+    /* Nothing found in the previous bucket is needed any more */
+    apr_pool_clear(context->scratch);
+    amber_stats_count(AMBER_STAT_BYTES_SCANNED, buffer_size);
+
+    /* Deal with the end of the previous bucket first */
+    if (context->scan.carry_size) {
+        scan_start = amber_process_carry(f, context, bucket, buffer, buffer_size);
+        if (scan_start > buffer_size) {
+            /* The whole bucket was added to the carry */
+            apr_bucket_delete(bucket);
+            return;
+        }
+    }
 
     // ap_log_error(APLOG_MARK, APLOG_EMERG, 0, f->r->server, "Amber: Buffer contents %d %s", (int)buffer_size, buffer);
-    amber_matches_t links = find_links_in_buffer(f, buffer, buffer_size);
+    amber_matches_t links = find_links_in_buffer(f, context, buffer, buffer_size, scan_start);
 
-    /* If there are no links to evaluate, just return the original bucket */
-    if (0 == links.count) {
-        return bucket;
+    /* Hold back a link that is cut off by the end of the bucket, unless it's too long to be a link we'd find */
+    keep_size = amber_scan_hold(&context->scan, buffer, buffer_size, &links);
+    if (keep_size < buffer_size) {
+        amber_debug1("Amber: holding back %d bytes for the next bucket", (int)(buffer_size - keep_size));
     }
 
-    /* If there are links to evaluate, create a new buffer for the updated links. 
-       Allocate additional memory for the HTML attributes we are going to add */
-    size_t amber_attributes_size = get_maximum_attribute_size(f);
-    size_t new_buffer_memory_allocated = buffer_size + (links.count * sizeof(char) * amber_attributes_size);
-    char *new_buffer = apr_bucket_alloc( new_buffer_memory_allocated, f->c->bucket_alloc);
+    /* Drop what we held back from the original bucket */
+    if (keep_size == 0) {
+        apr_bucket_delete(bucket);
+        return;
+    } else if (keep_size < buffer_size) {
+        if (APR_SUCCESS != apr_bucket_split(bucket, keep_size)) {
+            /* Pass on the whole bucket instead */
+            amber_error("Amber: Could not split bucket");
+            amber_flush_carry(f, context, NULL);
+        } else {
+            apr_bucket_delete(APR_BUCKET_NEXT(bucket));
+        }
+    }
 
-    size_t new_bucket_size = amber_insert_attributes(f, links, buffer, buffer_size, new_buffer, new_buffer_memory_allocated);
-    if (0 == new_bucket_size) {
-        return bucket; /* An error, so just return the old bucket */
+    /* The original bucket is left in place, with the attributes for any links inserted into it */
+    if (links.count) {
+        amber_insert_attributes(f, context, links, bucket, buffer, keep_size);
     }
-    
-    apr_bucket *new_bucket = apr_bucket_heap_create(new_buffer, new_bucket_size, NULL, f->c->bucket_alloc);
-    return new_bucket;
 }
 
-/** 
- * Search a buffer for links that are candidates to be rewritten, using PCRE
+/**
+ * Join what was held back from the previous bucket to the start of this bucket, and look for a link 
+ * starting in it (see amber_scan_join()). What was held back (with any attributes added) is inserted 
+ * before the bucket.
  * @param f the filter
+ * @param context the filter context for this request
+ * @param bucket the bucket to process, which is already in the output brigade
  * @param buffer the contents of the bucket
  * @param buffer_size the size of the buffer containing the bucket contents
- * @return amber_matches_t containing the number of links found, and arrays with the
- *         link URL and offset within the buffer where any rewriting should occur
+ * @return the position in the bucket from which to continue searching for links, or a value greater 
+ *         than buffer_size if the whole bucket has been held back
  */
-static amber_matches_t find_links_in_buffer(ap_filter_t *f, const char *buffer, size_t buffer_size) {
-
-    amber_matches_t result = { .count = 0, .insert_pos = NULL, .url = NULL };
-    int MATCHES_CHUNK_SIZE = 5; /* Allocate memory for this many matches (will increase if required) */
-    pcre *re;
-    const char *pcre_error;
-    int pcre_error_offset;
-
-    /* Regex pattern to find urls within hrefs */
-    char *pattern = "href=[\"'](http[^\v()<>{}\\[\\]\"']+)['\"]";
-
-    /* Compile the pattern to use */
-    if (!(re = pcre_compile(pattern, PCRE_CASELESS, &pcre_error, &pcre_error_offset, NULL))) {
-        amber_error2("Amber: PCRE compilation failed at offset %d: %s", pcre_error_offset, pcre_error);
-        return result;
-    }
+static size_t amber_process_carry(ap_filter_t *f, amber_context_t *context, apr_bucket *bucket, const char *buffer, size_t buffer_size) {
+    request_rec *r = f->r;
+    apr_time_t start_time = apr_time_now();
+    amber_junction_t junction;
+    apr_bucket *new_bucket;
+    size_t scan_start;
+    int i;
 
-    /* Find out how many subpatterns for matching there are in the pattern */
-    int subpattern_captures_count;
-    int pcre_result;
-    if ((pcre_result = pcre_fullinfo(re, NULL, PCRE_INFO_CAPTURECOUNT, &subpattern_captures_count)) < 0) {
-        amber_error1("Amber: PCRE subpattern capture count failed with code %d", pcre_result);
-        return result;
+    scan_start = amber_scan_join(&context->scan, buffer, buffer_size, &junction);
+    context->scan_time += apr_time_now() - start_time;
+    for (i = 0; i < junction.links.count; i++) {
+        amber_debug1("Amber: Match: %s", junction.links.url[i]);
     }
 
-    /* Setup the structures into which pcre_exec will place the information about any matches */
-    int  pcre_results_vector_count = (subpattern_captures_count + 1) * 3;
-    int  *pcre_results_vector = apr_palloc(f->r->pool, pcre_results_vector_count * sizeof(int));
-
-    /* Walk through the buffer, until we stop getting matches or get to the end */
-    char   *pos = (char *)buffer;
-    size_t remaining_buffer = buffer_size;
-    
-    do {
-        pcre_result = pcre_exec(re, NULL, pos, remaining_buffer, 0, 0, pcre_results_vector, pcre_results_vector_count); 
-        if (PCRE_ERROR_NOMATCH == pcre_result) { /* No matches */
-            break;
-        }
-        if (pcre_result < 0) {  /* An error occurred */
-            amber_error1("Amber: Error while matching regular expression %d", pcre_result);
-            break;
+    if (junction.size) {
+        /* The junction is in the scratch pool, so the bucket takes a copy of it */
+        new_bucket = apr_bucket_heap_create(junction.data, junction.size, NULL, f->c->bucket_alloc);
+        APR_BUCKET_INSERT_BEFORE(bucket, new_bucket);
+        if (junction.links.count) {
+            amber_insert_attributes(f, context, junction.links, new_bucket, junction.data, junction.size);
         }
-        if (pcre_result > 0) { /* We have a match! */   
-            if (!result.insert_pos || !result.url) {
-                /* Lazy allocation of memory for our result structure when it's needed for the first time */
-                result.insert_pos = apr_palloc(f->r->pool, MATCHES_CHUNK_SIZE * sizeof(int));
-                result.url = apr_palloc(f->r->pool, MATCHES_CHUNK_SIZE * sizeof(char *));
-            } else if ((result.count % MATCHES_CHUNK_SIZE) == 0) {
-                /* Allocate another chunk of memory if needed */
-                int  *new_insert_pos = apr_palloc(f->r->pool, (result.count + MATCHES_CHUNK_SIZE) * sizeof(int));
-                char **new_url = apr_palloc(f->r->pool, (result.count + MATCHES_CHUNK_SIZE) * sizeof(char *));
-                memcpy(new_insert_pos, result.insert_pos, sizeof(int) * result.count);
-                memcpy(new_url, result.url, sizeof(char *) * result.count);
-                result.insert_pos = new_insert_pos;
-                result.url = new_url;
-            }   
-
-            /* pcre_results_vector[0] and pcre_results_vector[1] are for the capture group matching the full regex. 
-               pcre_results_vector[2] and pcre_results_vector[3] are for the first capture group within it 
-               The start of the full regesx is the insertion point, and the first capture group is the URL */
-            result.insert_pos[result.count] = (pos - buffer) + pcre_results_vector[0];
-            int url_size = (pcre_results_vector[3] - pcre_results_vector[2] + 1) * sizeof(char);
-            result.url[result.count] = apr_palloc(f->r->pool, url_size);
-            memcpy(result.url[result.count], pos + pcre_results_vector[2], url_size);
-            result.url[result.count][pcre_results_vector[3] - pcre_results_vector[2]] = 0; /* Null-terminate the string */
-            result.count++;
-
-            amber_debug1("Amber: Match: %s", result.url[result.count-1]);
-
-            pos += pcre_results_vector[1];
-            remaining_buffer = buffer - pos + buffer_size;
-        }
-    } while (pos < (buffer + buffer_size));
-
-    return result;
+    }
+    return scan_start;
 }
 
 /**
- * Copy data from the old buffer to the new buffer, looking up link attributes and inserting them as we go
- * Links which are not found in the database are enqueued for future caching
+ * Pass on anything held back from the previous bucket as it is, since no more data is coming 
+ * (or it must be sent now)
  * @param f the filter
- * @param links links detected in the old buffer
- * @param old_buffer buffer with original content 
- * @param old_buffer_size size of old_buffer
- * @param new_buffer buffer which will contain the updated content (memory already allocated)
- * @param new_buffer_size memory allocated for the new buffer 
- * @return actual size of the new buffer (or 0 on error)
+ * @param context the filter context for this request
+ * @param bb the brigade to add the held back data to, or NULL to discard it
  */
-static size_t amber_insert_attributes(ap_filter_t *f, amber_matches_t links, const char *old_buffer, size_t old_buffer_size, const char *new_buffer, size_t new_buffer_size) {
-
-    // Setup database for all the queries we're going to make
+static void amber_flush_carry(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb) {
+    const char *carry;
+    size_t carry_size;
 
-    char *src = (char *)old_buffer;
-    char *dest = (char *)new_buffer;
-    int copy_size;
-
-    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
-    sqlite3 *sqlite_handle = amber_db_get_database(f, options->database);
-    if (!sqlite_handle) {
-        return 0;
-    }
-
-    sqlite3_stmt *sqlite_statement = amber_db_get_url_lookup_query(f,sqlite_handle);
-    if (!sqlite_statement) {
-        return 0;
+    if (context && (carry_size = amber_scan_flush(&context->scan, &carry)) && bb) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(carry, carry_size, NULL, f->c->bucket_alloc));
     }
+}
 
+/** 
+ * Search a buffer for links that are candidates to be rewritten, in the hrefs of link tags that the 
+ * HTML tokenizer finds
+ * @param f the filter
+ * @param context the filter context, which holds the tokenizer state carried across buckets
+ * @param buffer the contents of the bucket
+ * @param buffer_size the size of the buffer containing the bucket contents
+ * @param start position in the buffer from which to start searching
+ * @return amber_matches_t containing the number of links found, and arrays with the
+ *         link URL and offset within the buffer where any rewriting should occur. If the buffer
+ *         ends part way through what may be a link, partial_pos is the position where it starts.
+ */
+static amber_matches_t find_links_in_buffer(ap_filter_t *f, amber_context_t *context, const char *buffer, size_t buffer_size, size_t start) {
+    request_rec *r = f->r;
+    amber_matches_t result;
+    apr_time_t start_time = apr_time_now();
     int i;
-    for (i = 0; i < links.count; i++) {  
 
-        /* Copy the data up to the insertion point for the next match */
-        copy_size = links.insert_pos[i] + old_buffer - src;
-        if (copy_size + dest >= new_buffer + new_buffer_size) {
-            amber_error("Amber: Not enough memory allocated for new buffer");
-            // TODO: Is there anything sensible we can do here?
+    amber_find_links(&context->scan, buffer, buffer_size, start, &result);
+    context->scan_time += apr_time_now() - start_time;
+    for (i = 0; i < result.count; i++) {
+        amber_debug1("Amber: Match: %s", result.url[i]);
+    }
+    return result;
+}
+
+/**
+ * Check whether the time allowed for looking up links in this response (see AmberLookupBudget) has 
+ * been spent. The budget is checked before each database query, so it can be overrun by one query.
+ * @param f the filter
+ * @param context the filter context for this request
+ * @param elapsed time spent on lookups that isn't in context->lookup_time yet
+ * @return 1 if there's no more time for database lookups
+ */
+static int amber_lookup_budget_spent(ap_filter_t *f, amber_context_t *context, apr_interval_time_t elapsed) {
+    request_rec *r = f->r;
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module);
+
+    if (!context->budget_spent && (options->lookup_budget > 0) && 
+        (context->lookup_time + elapsed >= apr_time_from_msec(options->lookup_budget))) {
+        amber_debug1("Amber: lookup budget of %dms spent, passing on the remaining links as they are", options->lookup_budget);
+        amber_stats_count(AMBER_STAT_LOOKUP_BUDGET_SPENT, 1);
+        context->budget_spent = AMBER_BUDGET_TIME;
+    }
+    return (AMBER_BUDGET_TIME == context->budget_spent);
+}
+
+/**
+ * Is the lookup index older than the database? Urls checked since it was built may have been cached 
+ * since, so an entry for a url without a cache can only be trusted if the database is still at the
+ * generation the index was built from. The generation is only read (once per request) when it's 
+ * needed, and the index is trusted if it can't be read.
+ * @param f the filter
+ * @param context the filter context, which holds the index
+ * @param db the database connection to use. If NULL, a connection is opened and returned here, and 
+ *           must be released by the caller
+ * @return 1 if the index is older than the database
+ */
+static int amber_index_stale(ap_filter_t *f, amber_context_t *context, amber_db_t **db) {
+    request_rec *r = f->r;
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
+    uint64_t generation;
+
+    if (!context->index_stale_checked) {
+        context->index_stale_checked = 1;
+        if (!*db) {
+            *db = amber_db_get_database(f->r, options->database);
+        }
+        if (*db && !amber_db_get_generation(f->r, *db, &generation)) {
+            context->index_stale = (context->index->index.header->generation != generation);
+            if (context->index_stale) {
+                amber_debug1("Amber: lookup index %s is older than the database, so urls without a cache in it are looked up", options->index);
+            }
+        }
+    }
+    return context->index_stale;
+}
+
+/**
+ * Find the cache status of every link in a bucket. Each unique url is only looked up once per request,
+ * and the results are kept in the request's lookup memo. Urls that have not been seen before are put in
+ * canonical form, and looked up in the lookup index if there is one. Otherwise (or if the index has 
+ * them without a cache, but is older than the database) they are checked in the shared lookup cache, 
+ * and the rest are looked up in the database AMBER_LOOKUP_BATCH_SIZE at a time.
+ * Once the AmberLookupBudget for the response has been spent, urls that would need the database are
+ * left out of the memo, so those links are passed on without attributes.
+ * @param f the filter
+ * @param context the filter context, which holds the lookup memo
+ * @param links links detected in the bucket
+ * @param db the database connection to use. If NULL, a connection is opened (only if needed) and 
+ *           returned here, and must be released by the caller
+ * @return 0 on success
+ */
+static int amber_lookup_links(ap_filter_t *f, amber_context_t *context, amber_matches_t links, amber_db_t **db) {
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
+    amber_lookup_t **pending = apr_palloc(context->scratch, links.count * sizeof(amber_lookup_t *));
+    char **pending_urls = apr_palloc(context->scratch, links.count * sizeof(char *));
+    int pending_count = 0;
+    amber_lookup_t *lookup;
+    apr_time_t start_time = apr_time_now();
+    int over_budget = amber_lookup_budget_spent(f, context, 0);
+    uint64_t generation = 0;
+    int rc = 0;
+    int i, j;
+
+    if (!context->lookups) {
+        context->lookups = apr_hash_make(f->r->pool);
+    }
+    if (!context->index_checked) {
+        context->index = options->index ? amber_index_acquire(f->r, options->index) : NULL;
+        context->index_checked = 1;
+    }
+
+    amber_stats_count(AMBER_STAT_LINKS_MATCHED, links.count);
+    context->link_count += links.count;
+    for (i = 0; i < links.count; i++) {
+        if (apr_hash_get(context->lookups, links.url[i], APR_HASH_KEY_STRING)) {
+            continue;
+        }
+        /* The url is in the scratch pool, so the memo keeps its own copy */
+        char *url = apr_pstrdup(f->r->pool, links.url[i]);
+        const char *location = NULL;
+        lookup = apr_pcalloc(f->r->pool, sizeof(amber_lookup_t));
+        lookup->written = url;
+        lookup->url = amber_canonical_url(amber_pool_alloc, f->r->pool, url);
+        lookup->hash = amber_index_hash(lookup->url);
+        if (context->index) {
+            lookup->result = amber_index_lookup(&context->index->index, lookup->url, &location, &lookup->date, &lookup->status);
+            if (AMBER_CACHE_ATTRIBUTES_NOT_FOUND == lookup->result) {
+                amber_stats_count(AMBER_STAT_LOOKUP_INDEX_MISSES, 1);
+            }
+        }
+        if (context->index && ((AMBER_CACHE_ATTRIBUTES_FOUND == lookup->result) || 
+                               ((AMBER_CACHE_ATTRIBUTES_EMPTY == lookup->result) && !amber_index_stale(f, context, db)))) {
+            /* The index has every url that has been checked, so only urls that have never been checked 
+               (or were checked after it was built, or may have been cached since) are looked for in the 
+               database. The location is in the index, which stays mapped until the end of the request */
+            lookup->location = (char *)location;
+            amber_stats_count(AMBER_STAT_LOOKUP_INDEX_HITS, 1);
+            amber_stats_count((AMBER_CACHE_ATTRIBUTES_FOUND == lookup->result) ? AMBER_STAT_LOOKUP_HITS : AMBER_STAT_LOOKUP_MISSES, 1);
+        } else if (!amber_lookup_cache_get(f->r, options->database, lookup->url, lookup) ||
+                   ((AMBER_OUTPUT_CACHE_STORE == context->output_cache_state) && (lookup->generation != context->output_cache_generation))) {
+            /* Anything the database query doesn't return is not in the database. Once the budget is 
+               spent, the link isn't looked up, and is passed on as it is. It's still enqueued: the 
+               queue ignores urls that have been checked already. A response being kept in the output 
+               cache doesn't use results older than the generation in its key */
+            lookup->result = AMBER_CACHE_ATTRIBUTES_NOT_FOUND;
+            if (!over_budget) {
+                pending_urls[pending_count] = url;
+                pending[pending_count++] = lookup;
+            }
+        } else {
+            amber_stats_count(AMBER_STAT_LOOKUP_CACHE_HITS, 1);
+            amber_stats_count((AMBER_CACHE_ATTRIBUTES_FOUND == lookup->result) ? AMBER_STAT_LOOKUP_HITS : AMBER_STAT_LOOKUP_MISSES, 1);
+        }
+        apr_hash_set(context->lookups, url, APR_HASH_KEY_STRING, lookup);
+    }
+
+    if (pending_count && !*db) {
+        *db = amber_db_get_database(f->r, options->database);
+    }
+    /* The generation is read before the urls, so the results are at least as recent as it */
+    if (pending_count && *db && amber_db_get_generation(f->r, *db, &generation)) {
+        generation = 0;
+    }
+    for (i = 0; i < pending_count; i += AMBER_LOOKUP_BATCH_SIZE) {
+        int batch_count = (pending_count - i < AMBER_LOOKUP_BATCH_SIZE) ? pending_count - i : AMBER_LOOKUP_BATCH_SIZE;
+        if (i && amber_lookup_budget_spent(f, context, apr_time_now() - start_time)) {
+            /* The rest are left in the memo as not found, so they're passed on as they are and enqueued */
             break;
-        }        
-        memcpy(dest, src, copy_size);
-        src += copy_size;
-        dest += copy_size;
-
-        /* Get the attributes to insert, and copy them too */
-        char *insert;
-        int result = amber_db_get_attribute(f, sqlite_handle, sqlite_statement, links.url[i], &insert);
-
-        if (AMBER_CACHE_ATTRIBUTES_NOT_FOUND == result) {
-            /* If the URL is not found, queue it up to be cached later */
-            amber_db_enqueue_url(f, sqlite_handle, links.url[i]);
-        } else if (AMBER_CACHE_ATTRIBUTES_FOUND == result) {
-            /* If the URL is found, insert the attributes we got */
-            copy_size = strlen(insert);
-            if (copy_size + dest >= new_buffer + new_buffer_size) {
-                amber_error("Amber: Not enough memory allocated for new buffer");
-                // TODO: Is there anything sensible we can do here?
-                break;
+        }
+        if (!*db || amber_db_lookup_urls(f->r, *db, pending + i, batch_count)) {
+            /* Forget about urls we couldn't look up, so that we try again if they appear later in the response */
+            for (j = i; j < pending_count; j++) {
+                apr_hash_set(context->lookups, pending_urls[j], APR_HASH_KEY_STRING, NULL);
             }
-            memcpy(dest, insert, copy_size);
-            dest += copy_size;
+            amber_stats_count(AMBER_STAT_LOOKUP_ERRORS, pending_count - i);
+            rc = -1;
+            break;
+        }
+        for (j = i; j < i + batch_count; j++) {
+            lookup = pending[j];
+            lookup->generation = generation;
+            amber_stats_count((AMBER_CACHE_ATTRIBUTES_FOUND == lookup->result) ? AMBER_STAT_LOOKUP_HITS : AMBER_STAT_LOOKUP_MISSES, 1);
+            amber_lookup_cache_set(f->r, options->database, lookup->url, lookup);
+        }
+        if ((AMBER_OUTPUT_CACHE_STORE == context->output_cache_state) && (generation != context->output_cache_generation)) {
+            /* The database changed after the key was made */
+            context->output_cache_stale = 1;
+        }
+    }
+    context->lookup_time += apr_time_now() - start_time;
+    return rc;
+}
+
+/**
+ * Queue a url that isn't in the database (or wasn't looked up) to be cached later. This is normally 
+ * handed to the background writer; we only write to the database ourselves if that is disabled. 
+ * Urls enqueued recently (by any process) are skipped, and the queue ignores urls that have already 
+ * been checked or are excluded. The canonical form of the url is queued, and these are all decided by 
+ * the hash of the canonical form, so that it's only queued once however it's written.
+ * @param f the filter
+ * @param context the filter context
+ * @param db the database connection to use. If NULL, a connection is opened (only if needed) and 
+ *           returned here, and must be released by the caller
+ * @param lookup the url, which is marked as enqueued
+ */
+static void amber_enqueue_lookup(ap_filter_t *f, amber_context_t *context, amber_db_t **db, amber_lookup_t *lookup) {
+    request_rec *r = f->r;
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
+    int queued;
+
+    lookup->enqueued = 1;
+    if (amber_enqueue_filter_check(options->database, lookup->hash)) {
+        amber_debug1("Amber: url was enqueued recently: %s", lookup->url);
+        amber_stats_count(AMBER_STAT_ENQUEUES_FILTERED, 1);
+        return;
+    }
+
+    /* Only urls that were queued or written are remembered, so a dropped url is tried 
+       again the next time it's seen */
+    queued = amber_enqueue_push(r, options->database, lookup->url, lookup->hash);
+    if (AMBER_ENQUEUE_SYNC == queued) {
+        if (!*db) {
+            *db = amber_db_get_database(r, options->database);
+        }
+        if (*db && !amber_db_enqueue_url(r, *db, (char *)lookup->url, lookup->hash)) {
+            queued = AMBER_ENQUEUE_QUEUED;
         }
     }
+    if (AMBER_ENQUEUE_QUEUED == queued) {
+        amber_stats_count(AMBER_STAT_ENQUEUES, 1);
+        context->enqueued_count++;
+        amber_enqueue_filter_add(r, options->database, lookup->hash);
+    }
+}
+
+/**
+ * Enqueue links that are passed on without being looked up, because AmberLookupBudget allows no 
+ * more in the response. Links already in the memo are only enqueued if they weren't found.
+ * @param f the filter
+ * @param context the filter context, which holds the lookup memo
+ * @param links the links
+ * @param first the first link to enqueue
+ * @param db the database connection to use, as for amber_enqueue_lookup()
+ */
+static void amber_enqueue_links(ap_filter_t *f, amber_context_t *context, amber_matches_t *links, int first, amber_db_t **db) {
+    amber_lookup_t *lookup;
+    char *url;
+    int i;
+
+    if (!context->lookups) {
+        context->lookups = apr_hash_make(f->r->pool);
+    }
+    for (i = first; i < links->count; i++) {
+        if (!(lookup = apr_hash_get(context->lookups, links->url[i], APR_HASH_KEY_STRING))) {
+            url = apr_pstrdup(f->r->pool, links->url[i]);
+            lookup = apr_pcalloc(f->r->pool, sizeof(amber_lookup_t));
+            lookup->written = url;
+            lookup->url = amber_canonical_url(amber_pool_alloc, f->r->pool, url);
+            lookup->hash = amber_index_hash(lookup->url);
+            lookup->result = AMBER_CACHE_ATTRIBUTES_NOT_FOUND;
+            apr_hash_set(context->lookups, url, APR_HASH_KEY_STRING, lookup);
+        }
+        if ((AMBER_CACHE_ATTRIBUTES_NOT_FOUND == lookup->result) && !lookup->enqueued) {
+            amber_enqueue_lookup(f, context, db, lookup);
+        }
+    }
+}
+
+/* State shared by the callbacks that amber_insert_attributes() gives to amber_splice() */
+typedef struct {
+    ap_filter_t     *f;
+    amber_context_t *context;
+    const amber_matches_t *links;
+    amber_db_t      *db;            /* Opened the first time a url has to be enqueued synchronously */
+    apr_bucket      *bucket;        /* The rest of the original content that hasn't been passed yet */
+    apr_size_t      remaining;      /* Size of bucket */
+    apr_size_t      size;           /* Size of the original content */
+    int             inject_pos;     /* Where to insert the javascript and CSS, or -1 */
+} amber_splice_state_t;
+
+/**
+ * Get the attributes to insert for a link, enqueuing it for caching if it's not in the database
+ * @param state the splice state
+ * @param url the link
+ * @return the attributes, or NULL if nothing should be inserted
+ */
+static const char *amber_splice_lookup_attribute(amber_splice_state_t *state, const char *url) {
+    ap_filter_t *f = state->f;
+    request_rec *r = f->r;
+
+    amber_lookup_t *lookup = apr_hash_get(state->context->lookups, url, APR_HASH_KEY_STRING);
+    if (!lookup) {
+        return NULL; /* The lookup failed, and has already been reported */
+    }
 
-    amber_db_finalize_statement(f, sqlite_statement);
-    amber_db_close_database(f, sqlite_handle);
+    if ((AMBER_CACHE_ATTRIBUTES_NOT_FOUND == lookup->result) && !lookup->enqueued) {
+        /* If the URL is not found, queue it up to be cached later */
+        amber_enqueue_lookup(f, state->context, &state->db, lookup);
+    } else if (AMBER_CACHE_ATTRIBUTES_FOUND == lookup->result) {
+        /* If the URL is found, insert the attributes we got */
+        if (!lookup->attribute) {
+            lookup->attribute = amber_build_lookup_attribute(r, state->context, lookup);
+        }
+        return lookup->attribute;
+    }
+    return NULL;
+}
 
-    /* Copy any remaining content after the last match */
-    if (src < old_buffer + old_buffer_size) {
-        copy_size = old_buffer + old_buffer_size - src;
-        if (dest + copy_size >= new_buffer + new_buffer_size) {
-            amber_error("Amber: Not enough memory allocated for new buffer");
+/**
+ * Get the attributes to insert for a link, and work out where the javascript and CSS are inserted
+ * if this is the first link that is annotated
+ * @param baton the splice state
+ * @param index the index of the link
+ * @param url the link
+ * @return the attributes, or NULL if nothing should be inserted
+ */
+static const char *amber_splice_attribute(void *baton, int index, const char *url) {
+    amber_splice_state_t *state = baton;
+    amber_context_t *context = state->context;
+    const char *attribute = amber_splice_lookup_attribute(state, url);
+    int tag_pos;
+
+    if ((AMBER_INJECT_NEXT == context->inject) || 
+        ((AMBER_INJECT_PENDING == context->inject) && attribute && attribute[0])) {
+        /* The javascript and CSS go just before the tag, unless it started in content already passed on */
+        tag_pos = state->links->tag_pos[index];
+        if ((tag_pos >= 0) && (tag_pos >= state->size - state->remaining) && (state->inject_pos < 0)) {
+            state->inject_pos = tag_pos;
         } else {
-            memcpy(dest, src, copy_size);
-            dest += copy_size;
+            context->inject = AMBER_INJECT_NEXT;
         }
     }
-    /* Actual size of the new buffer */
-    return dest - new_buffer;
+    return attribute;
 }
 
 /**
- * Get the cache id of an item being served from the cache in the current request
+ * Add the next piece of rewritten content to the brigade. Original content is left where it is, 
+ * by splitting the bucket after it; attributes are added as pool buckets (the strings live in the 
+ * request pool, for as long as the lookup memo). The javascript and CSS are added where 
+ * amber_splice_attribute() chose.
+ * @param baton the splice state
+ * @param data the content
+ * @param size the size of the content
+ * @param inserted is this an attribute (or original content)?
+ * @return 0 to continue
+ */
+static int amber_splice_emit(void *baton, const char *data, size_t size, int inserted) {
+    amber_splice_state_t *state = baton;
+    ap_filter_t *f = state->f;
+    request_rec *r = f->r;
+    apr_status_t rv;
+    apr_size_t before;
+
+    if (!inserted && (state->inject_pos >= 0)) {
+        before = state->inject_pos - (state->size - state->remaining);
+        state->inject_pos = -1;
+        if (before < size) {
+            if (before && amber_splice_emit(baton, data, before, 0)) {
+                return -1;
+            }
+            APR_BUCKET_INSERT_BEFORE(state->bucket, amber_assets_bucket(f, state->context));
+            data += before;
+            size -= before;
+        }
+    }
+    if (inserted) {
+        APR_BUCKET_INSERT_BEFORE(state->bucket, apr_bucket_pool_create(data, size, f->r->pool, f->c->bucket_alloc));
+        state->context->bytes_added += size;
+    } else if (size < state->remaining) {
+        if (APR_SUCCESS != (rv = apr_bucket_split(state->bucket, size))) {
+            amber_error1("Amber: Could not split bucket (%d)", rv);
+            return -1;
+        }
+        state->bucket = APR_BUCKET_NEXT(state->bucket);
+        state->remaining -= size;
+    }
+    return 0;
+}
+
+/**
+ * Look up link attributes and insert them into the brigade as we go. The bucket is split at each 
+ * insertion point and the attributes are added as separate buckets, so the content itself is never copied.
+ * Links which are not found in the database are enqueued for future caching. Links that are skipped
+ * (see amber_skip_links()) are removed first, so they are never looked up, and so are links beyond the
+ * most that AmberLookupBudget allows in a response.
+ * @param f the filter
+ * @param context the filter context, which holds the lookup memo
+ * @param links links detected in the bucket
+ * @param bucket bucket with the original content, which must be in a brigade
+ * @param buffer the contents of the bucket
+ * @param buffer_size the size of the bucket
+ * @return 0 on success
+ */
+static int amber_insert_attributes(ap_filter_t *f, amber_context_t *context, amber_matches_t links, apr_bucket *bucket, const char *buffer, size_t buffer_size) {
+    request_rec *r = f->r;
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module);
+    amber_splice_state_t state = { f, context, &links, NULL, bucket, buffer_size, buffer_size, -1 };
+    int result;
+
+    amber_skip_links(f, context, &links);
+    if ((options->lookup_max_links > 0) && (context->annotate_count + links.count > options->lookup_max_links)) {
+        /* Links beyond the most allowed in a response are passed on as they are, but still enqueued. 
+           They're still counted, as amber_lookup_links() counts the rest */
+        int allowed = options->lookup_max_links - context->annotate_count;
+        amber_stats_count(AMBER_STAT_LINKS_MATCHED, links.count - allowed);
+        context->link_count += links.count - allowed;
+        amber_enqueue_links(f, context, &links, allowed, &state.db);
+        links.count = allowed;
+        if (!context->budget_spent) {
+            amber_debug1("Amber: annotated the most links allowed (%d), passing on the rest as they are", options->lookup_max_links);
+            amber_stats_count(AMBER_STAT_LOOKUP_BUDGET_SPENT, 1);
+            context->budget_spent = AMBER_BUDGET_LINKS;
+        }
+    }
+    if (!links.count) {
+        if (state.db) {
+            amber_db_release_database(r, state.db);
+        }
+        return 0;
+    }
+    context->annotate_count += links.count;
+
+    /* The database is only opened the first time we need it, since lookups may all be answered 
+       by the lookup memo or the shared lookup cache */
+    amber_lookup_links(f, context, links, &state.db);
+
+    result = amber_splice(buffer, buffer_size, &links, amber_splice_attribute, amber_splice_emit, &state);
+
+    if (state.db) {
+        amber_db_release_database(r, state.db);
+    }
+
+    return result;
+}
+
+/**
+ * Remove links to hosts in AmberSkipHosts and links in the amber_exclude table, so that nothing is 
+ * looked up or enqueued for them
+ * @param f the filter
+ * @param context the filter context, which holds the skip list for the response
+ * @param links links detected in the bucket, which are removed from in place
+ */
+static void amber_skip_links(ap_filter_t *f, amber_context_t *context, amber_matches_t *links) {
+    request_rec *r = f->r;
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
+    const char *self = (1 == options->skip_self) ? f->r->hostname : NULL;
+    char host[AMBER_MAX_HOST + 1];
+    int kept = 0;
+    int i;
+
+    if (!context->skip_checked) {
+        context->skip = amber_skip_acquire(r, options);
+        context->skip_checked = 1;
+    }
+    if (!self && (!context->skip || !context->skip->skip.count)) {
+        return;
+    }
+
+    for (i = 0; i < links->count; i++) {
+        /* Excluded urls are matched in canonical form, as they are looked up and queued */
+        char *url = amber_canonical_url(amber_pool_alloc, context->scratch, links->url[i]);
+        int has_host = (amber_url_host(url, host) >= 0);
+        if ((context->skip && amber_skip_match(&context->skip->skip, url, has_host ? host : NULL)) ||
+            (self && has_host && !strcasecmp(host, self))) {
+            amber_debug1("Amber: skipping url: %s", links->url[i]);
+            continue;
+        }
+        links->insert_pos[kept] = links->insert_pos[i];
+        links->tag_pos[kept] = links->tag_pos[i];
+        links->url[kept] = links->url[i];
+        kept++;
+    }
+    if (kept < links->count) {
+        amber_stats_count(AMBER_STAT_LINKS_MATCHED, links->count - kept);
+        amber_stats_count(AMBER_STAT_LINKS_SKIPPED, links->count - kept);
+        context->link_count += links->count - kept;
+        links->count = kept;
+    }
+}
+
+/**
+ * Record the timings and counts for a response in its notes, so they can be logged with %{amber-...}n 
+ * in a LogFormat. Called when the end of the response is seen.
  * @param f the filter
+ * @param context the filter context for the response
+ */
+static void amber_set_trace_notes(ap_filter_t *f, amber_context_t *context) {
+    apr_pool_t *pool = f->r->pool;
+    apr_table_t *notes = f->r->notes;
+
+    apr_table_setn(notes, "amber-scan-us", apr_psprintf(pool, "%" APR_TIME_T_FMT, context->scan_time));
+    apr_table_setn(notes, "amber-lookup-us", apr_psprintf(pool, "%" APR_TIME_T_FMT, context->lookup_time));
+    apr_table_setn(notes, "amber-rewrite-us", apr_psprintf(pool, "%" APR_TIME_T_FMT, context->rewrite_time));
+    apr_table_setn(notes, "amber-links", apr_itoa(pool, context->link_count));
+    apr_table_setn(notes, "amber-unique-links", apr_itoa(pool, context->lookups ? apr_hash_count(context->lookups) : 0));
+    apr_table_setn(notes, "amber-enqueued", apr_itoa(pool, context->enqueued_count));
+    apr_table_setn(notes, "amber-budget-spent", apr_itoa(pool, context->budget_spent));
+    apr_table_setn(notes, "amber-bytes-added", apr_psprintf(pool, "%" APR_SIZE_T_FMT, context->bytes_added));
+}
+
+/**
+ * Get the cache id of an item being served from the cache in the current request
+ * @param r the request
  * @return pointer to cache id, or null if not found
  */
-static char* get_cache_item_id(ap_filter_t *f) {
+static char* get_cache_item_id(request_rec *r) {
 
-    char *uri = apr_pstrdup(f->r->pool, f->r->uri);
+    char *uri = apr_pstrdup(r->pool, r->uri);
 
     if (!uri) {
         return NULL;
@@ -596,39 +2054,54 @@ static char* get_cache_item_id(ap_filter_t *f) {
 }
 
 /**
- * Log a view of a cached item to the amber_activity table
- * @param f the filter
+ * Log a view of a cached item to the amber_activity table. Views are normally counted in shared memory 
+ * and written later by the background writer; they are only written immediately if they can't be counted.
+ * @param r the request
  * @return 0 on success
  */
-static int amber_log_activity(ap_filter_t *f) {
+static int amber_log_activity(request_rec *r) {
     int sqlite_rc;
-    char *cache_id = get_cache_item_id(f);
+    char *cache_id = get_cache_item_id(r);
 
     if (cache_id) {
         amber_debug1("Logging activity for cache item: [%s]", cache_id);
 
-        amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
-        sqlite3 *sqlite_handle = amber_db_get_database(f, options->database);
-        if (!sqlite_handle) {
+        amber_options_t *options = (amber_options_t*) ap_get_module_config(r->per_dir_config, &amber_module); 
+        if (amber_activity_record(r, options->database, cache_id)) {
+            /* Without a background writer, whichever request finds the counts are due writes them */
+#if APR_HAS_THREADS
+            if (!amber_enqueue_queue)
+#endif
+                amber_activity_flush(r->server, 0);
+            return 0;
+        }
+
+        amber_db_t *db = amber_db_get_database(r, options->database);
+        if (!db) {
             return -1;
         }
 
-        sqlite3_stmt *sqlite_statement = amber_db_get_log_activity_query(f,sqlite_handle);
+        sqlite3_stmt *sqlite_statement = amber_db_get_log_activity_query(r, db);
         if (!sqlite_statement) {
+            amber_db_release_database(r, db);
             return -1;
         }
 
         if ((sqlite_rc = sqlite3_bind_text(sqlite_statement, 1, cache_id, strlen(cache_id), SQLITE_STATIC)) != SQLITE_OK) {
             amber_error2("Amber: error binding sqlite parameter: %s (%d)", cache_id, sqlite_rc);
-            amber_db_finalize_statement(f ,sqlite_statement);
+            amber_db_reset_statement(r, sqlite_statement);
+            amber_db_release_database(r, db);
             return -1;
         }
 
         sqlite_rc = sqlite3_bind_int(sqlite_statement, 2, time(NULL));
+        if (sqlite_rc == SQLITE_OK) {
+            sqlite_rc = sqlite3_bind_int(sqlite_statement, 3, 1);
+        }
         if (sqlite_rc != SQLITE_OK) {
             amber_error2("Amber: error binding sqlite parameter: %s (%d)", "time()", sqlite_rc);
-            amber_db_finalize_statement(f ,sqlite_statement);
-            amber_db_close_database(f, sqlite_handle);
+            amber_db_reset_statement(r, sqlite_statement);
+            amber_db_release_database(r, db);
             return -1;
         }
 
@@ -639,8 +2112,8 @@ static int amber_log_activity(ap_filter_t *f) {
             amber_debug2("Error logging cache visit: %s (%d)", cache_id, sqlite_rc);
             amber_error("Amber: error writing sqlite database. Make sure database file and its directory are writable");
         }
-        amber_db_finalize_statement(f, sqlite_statement);
-        amber_db_close_database(f, sqlite_handle);
+        amber_db_reset_statement(r, sqlite_statement);
+        amber_db_release_database(r, db);
         return 0;
 
     }
@@ -649,68 +2122,31 @@ static int amber_log_activity(ap_filter_t *f) {
 
 /**
  * Set the content-type and Memento headers for an item that we're returning from the cache
- * @param f the filter
+ * @param r the request
  * @return 0 on success
  */
-static int amber_set_cache_delivery_headers(ap_filter_t *f) {
-    int sqlite_rc;
-    char *cache_id = get_cache_item_id(f);
+static int amber_set_cache_delivery_headers(request_rec *r) {
+    char type[AMBER_MAX_CONTENT_TYPE];
+    char memento_time[APR_RFC822_DATE_LEN];
+    char *cache_id = get_cache_item_id(r);
+    int date;
 
     if (cache_id) {
         amber_debug1("Setting content type for cache item: [%s]", cache_id);
-
-        amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
-        sqlite3 *sqlite_handle = amber_db_get_database(f, options->database);
-        if (!sqlite_handle) {
-            return -1;
-        }
-
-        sqlite3_stmt *sqlite_statement = amber_db_get_content_type_date_query(f,sqlite_handle);
-        if (!sqlite_statement) {
+        if (amber_cache_get_metadata(r, cache_id, &r->finfo, type, &date)) {
             return -1;
         }
-
-        if ((sqlite_rc = sqlite3_bind_text(sqlite_statement, 1, cache_id, strlen(cache_id), SQLITE_STATIC)) != SQLITE_OK) {
-            amber_error2("Amber: error binding sqlite parameter: %s (%d)", cache_id, sqlite_rc);
-            amber_db_finalize_statement(f ,sqlite_statement);
-            amber_db_close_database(f, sqlite_handle);
-            return -1;
+        if (!type[0]) {
+            amber_debug1("No content type found when serving cache item: %s", cache_id); 
+            return 0;
         }
 
-        sqlite_rc = sqlite3_step(sqlite_statement);
-        if (sqlite_rc == SQLITE_DONE) { /* No data returned */
-            amber_debug1("No content type found when serving cache item: %s", cache_id); 
-        } else if (sqlite_rc == SQLITE_ROW) {
-            /* Set the Content-Type header */
-            char *mimetype = (char *)sqlite3_column_text(sqlite_statement,0);
-            strncpy((char *)f->r->content_type, mimetype, strlen(mimetype));
-            amber_debug2("Set content type for cache item (%s): %s", cache_id, mimetype);
-
-            /* Set the Memento-Datetime header */
-            const int MEMENTO_TIME_HEADER_SIZE = 40;
-            long cache_date = sqlite3_column_int(sqlite_statement, 1);
-            struct tm * t = gmtime((const time_t*) &cache_date);
-            if (!t) {
-                amber_error1("Error calculating Memento-Datetime response header: %s", cache_id); 
-            } else {
-                char *memento_time = apr_pcalloc(f->r->pool, MEMENTO_TIME_HEADER_SIZE * sizeof(char));
-                if (!memento_time) {
-                    amber_error1("Error allocating memory for Memento-Datetime response header: %s", cache_id); 
-                } else {
-                    strftime(memento_time, MEMENTO_TIME_HEADER_SIZE * sizeof(char), "%a, %d %b %Y %H:%M:%S %Z", t);
-                    apr_table_set(f->r->headers_out, "Memento-Datetime", memento_time);
-                    amber_debug2("Set Memento-Datetime for cache item (%s): %s", cache_id, memento_time);
-                }
-            }
+        ap_set_content_type(r, apr_pstrdup(r->pool, type));
+        amber_debug2("Set content type for cache item (%s): %s", cache_id, type);
 
-        } else {
-            amber_error2("Error retrieving cache item content type: %s (%d)", cache_id, sqlite_rc);
-            amber_db_finalize_statement(f, sqlite_statement);
-            amber_db_close_database(f, sqlite_handle);
-            return -1;
-        }
-        amber_db_finalize_statement(f, sqlite_statement);
-        amber_db_close_database(f, sqlite_handle);
+        apr_rfc822_date(memento_time, apr_time_from_sec(date));
+        apr_table_set(r->headers_out, "Memento-Datetime", memento_time);
+        amber_debug2("Set Memento-Datetime for cache item (%s): %s", cache_id, memento_time);
     }
     return 0;
 }
@@ -719,237 +2155,629 @@ static int amber_set_cache_delivery_headers(ap_filter_t *f) {
 /* Database access code - could be moved to a separate file                 */
 /* ======================================================================== */
 
-/** 
- * Get a handle to the sqlite database
- * @param f the filter
+/**
+ * Open a sqlite database. Each connection is only used by one thread at a time (the pool hands them
+ * out to one request at a time, and the background writer has its own), so sqlite doesn't need to
+ * lock the connection for every call
+ * @param s the server, for logging
  * @param db_path location of the sqlite database on disk
  * @return handle to the open sqlite database. If failed to open, return null
- */ 
-static sqlite3 *amber_db_get_database(ap_filter_t *f, char *db_path) {
+ */
+static sqlite3 *amber_db_open(server_rec *s, char *db_path) {
     sqlite3 *sqlite_handle;
     int sqlite_rc;
 
-    amber_debug1("Database: %s", db_path);
-    sqlite_rc = sqlite3_open(db_path, &sqlite_handle);
+    sqlite_rc = sqlite3_open_v2(db_path, &sqlite_handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
     if (sqlite_rc) {
-        /* GCC thinks these are not being used for some reason, so annotate to avoid compiler warnings */
-        /* TODO: See if we can remove these */
-        __attribute__ ((__unused__)) int extended_rc = sqlite3_extended_errcode(sqlite_handle);
-        __attribute__ ((__unused__)) const char * msg = sqlite3_errmsg(sqlite_handle);
-        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, f->r->server,
+        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s,
             "Amber: Error opening sqlite database (%d,%s). Make sure database file and its directory are writable", sqlite_rc, db_path);
         sqlite3_close(sqlite_handle);
         return NULL;
     }
+    if ((sqlite_rc = sqlite3_create_function(sqlite_handle, "amber_url_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 
+                                             NULL, amber_db_url_hash_function, NULL, NULL)) != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, "Amber: error registering amber_url_hash() (%d)", sqlite_rc);
+        sqlite3_close(sqlite_handle);
+        return NULL;
+    }
     return sqlite_handle;
 }
 
-static int amber_db_finalize_statement (ap_filter_t *f, sqlite3_stmt *sqlite_statement) {
+/**
+ * Finalize any prepared statements and close a database connection
+ * @param s the server, for logging
+ * @param db the connection to close
+ */
+static void amber_db_close(server_rec *s, amber_db_t *db) {
     int sqlite_rc;
-    if ((sqlite_rc = sqlite3_finalize(sqlite_statement)) != SQLITE_OK) {
-        amber_error1("AMBER error finalizing statement (%d)", sqlite_rc);
+    sqlite3_finalize(db->url_lookup_query);
+    sqlite3_finalize(db->enqueue_url_query);
+    sqlite3_finalize(db->log_activity_query);
+    sqlite3_finalize(db->content_type_date_query);
+    sqlite3_finalize(db->data_version_query);
+    sqlite3_finalize(db->generation_query);
+    sqlite3_finalize(db->exclusions_query);
+    if (db->handle && (sqlite_rc = sqlite3_close(db->handle)) != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "Amber: error closing sqlite database (%d)", sqlite_rc);
     }
-    return sqlite_rc;
+    if (db->path) {
+        free(db->path);
+    }
+    memset(db, 0, sizeof(amber_db_t));
 }
 
 /**
- * Close the database
- * @param f the filter
- * @param sqlite_handle handle to the database to close
- * @return sqlite3 status code
+ * Close all the connections in the pool. Registered as a cleanup on the child pool.
  */
-static int amber_db_close_database(ap_filter_t *f, sqlite3 *sqlite_handle) {
-    int sqlite_rc;
-    if ((sqlite_rc = sqlite3_close(sqlite_handle)) != SQLITE_OK) {
-        amber_error1("Amber: error closing sqlite database (%d)", sqlite_rc);
+static apr_status_t amber_db_pool_destroy(void *data) {
+    amber_db_pool_t *pool = data;
+    int i;
+    for (i = 0; i < pool->size; i++) {
+        if (pool->connections[i].path) {
+            amber_db_close(pool->server, &pool->connections[i]);
+        }
     }
-    return sqlite_rc;
+    if (amber_db_pool == pool) {
+        amber_db_pool = NULL;
+    }
+    return APR_SUCCESS;
 }
 
 /**
- * Prepare a sql query
- * @param f the filter
- * @param sqlite_handle handle to the database to use
- * @param statement SQL query with '?' for variable parameters
- * @return sqlite_statement to be executed
+ * Create the per-child pool of database connections, with room for a connection for each thread
+ * the MPM runs in the child
+ * @param p the child pool, which owns the connection pool
+ * @param s the server, for logging
+ * @return the new connection pool
  */
-static sqlite3_stmt *amber_db_get_statement(ap_filter_t *f, sqlite3 *sqlite_handle, char *statement) {
-    sqlite3_stmt *sqlite_statement;
-    const char *query_tail;
-    int sqlite_rc = sqlite3_prepare_v2(sqlite_handle, statement, -1, &sqlite_statement, &query_tail);
-    if (sqlite_rc != SQLITE_OK) {
-        amber_error1("AMBER error creating sqlite prepared statement (%d)", sqlite_rc);
-        amber_db_close_database(f, sqlite_handle);
+static amber_db_pool_t *amber_db_pool_create(apr_pool_t *p, server_rec *s) {
+    amber_db_pool_t *pool = apr_pcalloc(p, sizeof(amber_db_pool_t));
+    int threads = 0;
+
+    if ((ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS) || (threads < AMBER_MIN_DATABASES)) {
+        threads = AMBER_MIN_DATABASES;
+    }
+    pool->size = threads;
+    pool->connections = apr_pcalloc(p, pool->size * sizeof(amber_db_t));
+    pool->server = s;
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "Amber: could not create database pool mutex");
+        return NULL;
+    }
+#endif
+    apr_pool_cleanup_register(p, pool, amber_db_pool_destroy, apr_pool_cleanup_null);
+    return pool;
+}
+
+/** 
+ * Get a handle to the sqlite database. An idle pooled connection to the same database is reused if 
+ * there is one. Otherwise a new connection is opened into a free slot, evicting the least recently
+ * used idle connection if necessary. If every slot is busy, a connection is opened just for this request.
+ * The connection must be returned with amber_db_release_database()
+ * @param r the request
+ * @param db_path location of the sqlite database on disk
+ * @return the database connection. If failed to open, return null
+ */ 
+static amber_db_t *amber_db_get_database(request_rec *r, char *db_path) {
+    amber_db_t *db = NULL;
+    amber_db_t *free_slot = NULL;
+    int i;
+
+    amber_debug1("Database: %s", db_path);
+    if (!db_path) {
+        amber_error("Amber: AmberDatabase is not set");
+        return NULL;
+    }
+
+    if (amber_db_pool) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(amber_db_pool->mutex);
+#endif
+        for (i = 0; i < amber_db_pool->size; i++) {
+            amber_db_t *slot = &amber_db_pool->connections[i];
+            if (!slot->path) {
+                /* Prefer an empty slot over evicting an open connection */
+                if (!free_slot || free_slot->path) {
+                    free_slot = slot;
+                }
+            } else if (!slot->in_use) {
+                if (!strcmp(slot->path, db_path)) {
+                    db = slot;
+                    break;
+                }
+                if (!free_slot || (free_slot->path && (slot->last_used < free_slot->last_used))) {
+                    free_slot = slot;
+                }
+            }
+        }
+        if (!db && free_slot) {
+            if (free_slot->path) {
+                amber_debug1("Database: evicting connection to %s", free_slot->path);
+                amber_db_close(r->server, free_slot);
+            }
+            if ((free_slot->handle = amber_db_open(r->server, db_path))) {
+                free_slot->path = strdup(db_path);
+                free_slot->pooled = 1;
+                db = free_slot;
+            }
+        }
+        if (db) {
+            db->in_use = 1;
+            db->last_used = apr_time_now();
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(amber_db_pool->mutex);
+#endif
+        if (db || free_slot) {
+            return db;
+        }
+    }
+
+    /* No pool, or every pooled connection is busy - open a connection just for this request */
+    db = apr_pcalloc(r->pool, sizeof(amber_db_t));
+    if (!(db->handle = amber_db_open(r->server, db_path))) {
         return NULL;
     }
-    return sqlite_statement;
+    db->path = strdup(db_path);
+    db->in_use = 1;
+    return db;
 }
 
 /**
- * Prepare a sql query for retrieving information about a url
- * @param f the filter
- * @param sqlite_handle handle to the database to use
- * @return sqlite_statement to be executed
+ * Return a connection obtained from amber_db_get_database(). Pooled connections are kept open
+ * with their prepared statements; connections opened for a single request are closed.
+ * @param r the request
+ * @param db the connection to release
  */
-static sqlite3_stmt *amber_db_get_url_lookup_query(ap_filter_t *f, sqlite3 *sqlite_handle) {
-    return amber_db_get_statement(f, sqlite_handle, "SELECT aa.location, aa.date, ah.status FROM amber_cache aa, amber_check ah WHERE aa.url = ? AND aa.id = ah.id");
+static void amber_db_release_database(request_rec *r, amber_db_t *db) {
+    if (!db->pooled) {
+        amber_db_close(r->server, db);
+        return;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(amber_db_pool->mutex);
+#endif
+    db->in_use = 0;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(amber_db_pool->mutex);
+#endif
 }
 
 /**
- * Prepare a sql query for enqueuing url
- * @param f the filter
- * @param sqlite_handle handle to the database to use
- * @return sqlite_statement to be executed
+ * Reset a prepared statement so it can be used again, and release any locks it holds
+ * @param r the request
+ * @param sqlite_statement the statement to reset
+ * @return sqlite3 status code
  */
-static sqlite3_stmt *amber_db_get_enqueue_url_query(ap_filter_t *f, sqlite3 *sqlite_handle) {
-    return amber_db_get_statement(f, sqlite_handle, "INSERT OR IGNORE INTO amber_queue (url, created) SELECT ?1,?2 where ?1 not in (select url from amber_exclude) and ?1 not in (select url from amber_check)");
+static int amber_db_reset_statement(request_rec *r, sqlite3_stmt *sqlite_statement) {
+    int sqlite_rc;
+    /* sqlite3_reset returns the error from the last step (if any), which has already been reported */
+    sqlite3_reset(sqlite_statement);
+    if ((sqlite_rc = sqlite3_clear_bindings(sqlite_statement)) != SQLITE_OK) {
+        amber_error1("Amber: error clearing bindings (%d)", sqlite_rc);
+    }
+    return sqlite_rc;
 }
 
 /**
- * Prepare a sql query for logging activity
- * @param f the filter
- * @param sqlite_handle handle to the database to use
+ * Get a prepared sql query, preparing it if this connection has not used it before
+ * @param r the request
+ * @param db the database connection to use
+ * @param cached_statement where the prepared statement is kept on the connection
+ * @param statement SQL query with '?' for variable parameters
  * @return sqlite_statement to be executed
  */
-static sqlite3_stmt *amber_db_get_log_activity_query(ap_filter_t *f, sqlite3 *sqlite_handle) {
-    return amber_db_get_statement(f, sqlite_handle, "INSERT OR REPLACE INTO amber_activity (id, date, views) VALUES (?1, ?2, COALESCE ((SELECT views+1 from amber_activity where id = ?1), 1))");
+static sqlite3_stmt *amber_db_get_statement(request_rec *r, amber_db_t *db, sqlite3_stmt **cached_statement, char *statement) {
+    const char *query_tail;
+    if (!*cached_statement) {
+        int sqlite_rc = sqlite3_prepare_v2(db->handle, statement, -1, cached_statement, &query_tail);
+        if (sqlite_rc != SQLITE_OK) {
+            amber_error2("AMBER error creating sqlite prepared statement (%d): %s", sqlite_rc, sqlite3_errmsg(db->handle));
+            *cached_statement = NULL;
+            return NULL;
+        }
+    }
+    return *cached_statement;
 }
 
 /**
- * Prepare a sql query for getting the mime-type and cache date of a cached item
- * @param f the filter
- * @param sqlite_handle handle to the database to use
- * @return sqlite_statement to be executed
+ * Allocate memory for amber_core from sqlite, to be freed with sqlite3_free()
  */
-static sqlite3_stmt *amber_db_get_content_type_date_query(ap_filter_t *f, sqlite3 *sqlite_handle) {
-    return amber_db_get_statement(f, sqlite_handle, "SELECT type, date FROM amber_cache WHERE id = ?");
+static void *amber_db_alloc(void *baton, size_t size) {
+    return sqlite3_malloc((int) size);
 }
 
 /**
- * Get the AMBER attributes that should be added to the HREF with the given target URL, based on data from the cache.
- * @param f the filter
- * @param sqlite_handle handle to the database to use
- * @param sqlite_statement prepared statement to use in the query
- * @param url to lookup
- * @param result pointer to the attributes to be added (if any)
- * @return status code indicating the results of the query:
- *      AMBER_CACHE_ATTRIBUTES_ERROR - there was an error
- *      AMBER_CACHE_ATTRIBUTES_FOUND - the URL was found and attributes to insert in the HREF are in the result parameter
- *      AMBER_CACHE_ATTRIBUTES_EMPTY -  the URL was found, but there is no cache 
- *      AMBER_CACHE_ATTRIBUTES_NOT_FOUND - the URL was not found
- */
-static int amber_db_get_attribute(ap_filter_t *f, sqlite3 *sqlite_handle, sqlite3_stmt *sqlite_statement, char * url, char **result) {
+ * The amber_url_hash(url) SQL function: the hash of the canonical form of a url, which is what urls 
+ * are looked up by (see amber_lookup_links)
+ */
+static void amber_db_url_hash_function(sqlite3_context *sqlite_context, int argc, sqlite3_value **argv) {
+    const char *url = (const char *) sqlite3_value_text(argv[0]);
+    char *canonical;
+
+    if (!url) {
+        sqlite3_result_null(sqlite_context);
+    } else if (!(canonical = amber_canonical_url(amber_db_alloc, NULL, url))) {
+        sqlite3_result_error_nomem(sqlite_context);
+    } else {
+        sqlite3_result_int64(sqlite_context, (sqlite3_int64) amber_index_hash(canonical));
+        sqlite3_free(canonical);
+    }
+}
 
-    int rc;
-    const char *location_tmp;
-    char *location;
-    int date;
-    int status;
+/**
+ * Check whether amber_check has a url_hash column
+ * @param s the server, for logging
+ * @param handle the database connection to use
+ * @return 1 if it does, 0 if it doesn't, -1 on error
+ */
+static int amber_db_has_url_hash(server_rec *s, sqlite3 *handle) {
+    sqlite3_stmt *sqlite_statement;
+    const char *name;
+    int found = 0;
+    int sqlite_rc;
 
-    /* Clear any existing bindings on the statement, in case it had been used before. sqlite3_reset does not do this */
-    if ((rc = sqlite3_clear_bindings(sqlite_statement)) != SQLITE_OK) {
-        amber_error2("Amber: error error clearing bindings: %s (%d)", url, rc);
-        return AMBER_CACHE_ATTRIBUTES_ERROR;
+    if ((sqlite_rc = sqlite3_prepare_v2(handle, AMBER_SQL_URL_HASH_COLUMNS, -1, &sqlite_statement, NULL)) != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, s, "Amber: error reading the columns of amber_check (%d): %s", sqlite_rc, sqlite3_errmsg(handle));
+        return -1;
     }
-
-    /* Reset the query to be executed again */
-    if ((rc = sqlite3_reset(sqlite_statement)) != SQLITE_OK) {
-        amber_error2("Amber: error reseting prepared statement: %s (%d)", url, rc);
-        return AMBER_CACHE_ATTRIBUTES_ERROR;
+    while ((sqlite_rc = sqlite3_step(sqlite_statement)) == SQLITE_ROW) {
+        name = (const char *) sqlite3_column_text(sqlite_statement, 1);
+        if (name && !strcmp(name, "url_hash")) {
+            found = 1;
+        }
     }
+    sqlite3_finalize(sqlite_statement);
+    return (sqlite_rc == SQLITE_DONE) ? found : -1;
+}
 
-    /* Bind parameter 1 - the URL to lookup */
-    if ((rc = sqlite3_bind_text(sqlite_statement, 1, url, strlen(url), SQLITE_STATIC)) != SQLITE_OK) {
-        amber_error2("Amber: error binding sqlite parameter: %s (%d)", url, rc);
-        return AMBER_CACHE_ATTRIBUTES_ERROR;
-    }
+/**
+ * Find out whether urls can be looked up and queued by url_hash yet, which is once the background 
+ * writer has added the column and filled it in (see amber_url_hash_state()). Statements prepared
+ * before that use the url as written, so they are prepared again when it's known.
+ * @param r the request
+ * @param db the database connection to use
+ */
+static void amber_db_check_url_hash(request_rec *r, amber_db_t *db) {
+    if (AMBER_URL_HASH_PENDING != db->url_hash) {
+        return;
+    }
+    if (AMBER_URL_HASH_PENDING == (db->url_hash = amber_url_hash_state(r, db->path))) {
+        return;
+    }
+    sqlite3_finalize(db->url_lookup_query);
+    db->url_lookup_query = NULL;
+    sqlite3_finalize(db->enqueue_url_query);
+    db->enqueue_url_query = NULL;
+}
 
-    /* Get the first result (the only one we care about) */
-    rc = sqlite3_step(sqlite_statement);
-    if (rc == SQLITE_DONE) {                 /* No data returned */
-        return AMBER_CACHE_ATTRIBUTES_NOT_FOUND;
-    } else if (rc == SQLITE_ROW) {           /* Some data found - extract the results */
-        /* Copy the location string, since it gets clobbered when the sqlite objects are closed */
-        location = apr_pstrdup(f->r->pool, (const char *) sqlite3_column_text(sqlite_statement, 0));
-        date = sqlite3_column_int(sqlite_statement,1);
-        status = sqlite3_column_int(sqlite_statement,2);
-        amber_debug4("Amber: sqlite results for url: (%s) %s, %d, %d", url, location, date, status);
-    } else {
-        amber_error1("Amber: error executing sqlite statement: (%d)", rc);
-        return AMBER_CACHE_ATTRIBUTES_ERROR;
+/**
+ * Prepare a sql query for retrieving information about up to AMBER_LOOKUP_BATCH_SIZE urls. The urls 
+ * are found by the hash of their canonical form (the first AMBER_LOOKUP_BATCH_SIZE parameters), or 
+ * by the url as written (the next AMBER_LOOKUP_BATCH_SIZE) in rows the background writer hasn't given 
+ * a hash yet. If the database has no hashes, there are only the urls as written. See amber_lookup_query()
+ * @param r the request
+ * @param db the database connection to use
+ * @return sqlite_statement to be executed
+ */
+static sqlite3_stmt *amber_db_get_url_lookup_query(request_rec *r, amber_db_t *db) {
+    amber_db_check_url_hash(r, db);
+    if (db->url_lookup_query) {
+        return db->url_lookup_query;
+    }
+    return amber_db_get_statement(r, db, &db->url_lookup_query, 
+                                  amber_lookup_query(amber_pool_alloc, r->pool, AMBER_URL_HASH_READY == db->url_hash));
+}
+
+/**
+ * Prepare a sql query for enqueuing url
+ * @param r the request
+ * @param db the database connection to use
+ * @return sqlite_statement to be executed
+ */
+static sqlite3_stmt *amber_db_get_enqueue_url_query(request_rec *r, amber_db_t *db) {
+    amber_db_check_url_hash(r, db);
+    return amber_db_get_statement(r, db, &db->enqueue_url_query, 
+                                  (AMBER_URL_HASH_READY == db->url_hash) ? AMBER_SQL_ENQUEUE_URL_HASH : AMBER_SQL_ENQUEUE_URL);
+}
+
+/**
+ * Prepare a sql query for logging activity
+ * @param r the request
+ * @param db the database connection to use
+ * @return sqlite_statement to be executed
+ */
+static sqlite3_stmt *amber_db_get_log_activity_query(request_rec *r, amber_db_t *db) {
+    return amber_db_get_statement(r, db, &db->log_activity_query, AMBER_SQL_LOG_ACTIVITY);
+}
+
+/**
+ * Prepare a sql query for getting the mime-type and cache date of a cached item
+ * @param r the request
+ * @param db the database connection to use
+ * @return sqlite_statement to be executed
+ */
+static sqlite3_stmt *amber_db_get_content_type_date_query(request_rec *r, amber_db_t *db) {
+    return amber_db_get_statement(r, db, &db->content_type_date_query, "SELECT type, date FROM amber_cache WHERE id = ?");
+}
+
+/**
+ * Read the urls and hosts in the amber_exclude table
+ * @param r the request
+ * @param db the database connection to use
+ * @param patterns array the urls are added to, which are copied into its pool
+ * @return 0 on success
+ */
+static int amber_db_get_exclusions(request_rec *r, amber_db_t *db, apr_array_header_t *patterns) {
+    sqlite3_stmt *sqlite_statement = amber_db_get_statement(r, db, &db->exclusions_query, AMBER_SQL_EXCLUSIONS);
+    int rc;
+
+    if (!sqlite_statement) {
+        return -1;
+    }
+    while ((rc = sqlite3_step(sqlite_statement)) == SQLITE_ROW) {
+        const char *url = (const char *) sqlite3_column_text(sqlite_statement, 0);
+        if (url && url[0]) {
+            APR_ARRAY_PUSH(patterns, char *) = apr_pstrdup(patterns->pool, url);
+        }
+    }
+    if (rc != SQLITE_DONE) {
+        amber_error1("Amber: error reading exclusions: %s", sqlite3_errmsg(db->handle));
+        amber_stats_count_sqlite(rc);
+    }
+    amber_db_reset_statement(r, sqlite_statement);
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/**
+ * Get a number that changes whenever the amber_cache or amber_check tables change, so that anything 
+ * derived from lookups can be thrown away. It's counted by triggers that the background writer adds
+ * (see amber_url_hash_fill_database()), so reading it is a single row. It's only read again if the 
+ * database has been written since (according to PRAGMA data_version), and at most every few seconds.
+ * @param r the request
+ * @param db the database connection to use
+ * @param generation set to the current generation
+ * @return 0 on success
+ */
+static int amber_db_get_generation(request_rec *r, amber_db_t *db, uint64_t *generation) {
+    sqlite3_stmt *sqlite_statement;
+    apr_time_t now = apr_time_now();
+    int data_version;
+    int rc = -1;
+
+    if (db->generation_checked && (now - db->generation_checked < apr_time_from_sec(AMBER_GENERATION_CHECK_INTERVAL))) {
+        *generation = db->generation;
+        return 0;
+    }
+
+    if (!(sqlite_statement = amber_db_get_statement(r, db, &db->data_version_query, "PRAGMA data_version"))) {
+        return -1;
+    }
+    if (SQLITE_ROW != sqlite3_step(sqlite_statement)) {
+        amber_db_reset_statement(r, sqlite_statement);
+        return -1;
+    }
+    data_version = sqlite3_column_int(sqlite_statement, 0);
+    amber_db_reset_statement(r, sqlite_statement);
+    if (db->generation_checked && (data_version == db->data_version)) {
+        db->generation_checked = now;
+        *generation = db->generation;
+        return 0;
     }
 
-    /* If the location is empty, no cache exists */
-    if (strlen(location) == 0) {
-        return AMBER_CACHE_ATTRIBUTES_EMPTY;
+    if (!(sqlite_statement = amber_db_get_statement(r, db, &db->generation_query, AMBER_SQL_GENERATION))) {
+        return -1;
+    }
+    if (SQLITE_ROW == sqlite3_step(sqlite_statement)) {
+        db->generation = (uint64_t) sqlite3_column_int64(sqlite_statement, 0);
+        db->data_version = data_version;
+        db->generation_checked = now;
+        *generation = db->generation;
+        amber_debug2("Amber: database generation %" APR_UINT64_T_FMT " (data version %d)", db->generation, data_version);
+        rc = 0;
     } else {
-        amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
+        /* Most likely the background writer hasn't added the table yet */
+        amber_debug1("Amber: could not read database generation: %s", sqlite3_errmsg(db->handle));
+    }
+    amber_db_reset_statement(r, sqlite_statement);
+    return rc;
+}
+
+/**
+ * Look up a batch of urls in the database, with a single query
+ * @param r the request
+ * @param db the database connection to use
+ * @param lookups the urls to look up (at most AMBER_LOOKUP_BATCH_SIZE), as written and in their canonical 
+ *                forms with their hashes, and the result set to AMBER_CACHE_ATTRIBUTES_NOT_FOUND. Those found in the 
+ *                database are updated with the location, date and status of the cache.
+ * @param lookup_count number of urls
+ * @return 0 on success
+ */
+static int amber_db_lookup_urls(request_rec *r, amber_db_t *db, amber_lookup_t **lookups, int lookup_count) {
+
+    int rc = SQLITE_OK;
+    int by_hash;
+    int i;
+    const char *url;
+    const char *location;
+    char *canonical;
+    uint64_t hash;
+    amber_lookup_t *lookup;
+
+    sqlite3_stmt *sqlite_statement = amber_db_get_url_lookup_query(r, db);
+    if (!sqlite_statement) {
+        return -1;
+    }
+    by_hash = (AMBER_URL_HASH_READY == db->url_hash);
+
+    /* Bind the hashes and the urls as written to look up. Any unused parameters are left NULL, and 
+       so never match */
+    for (i = 0; i < lookup_count; i++) {
+        if (by_hash) {
+            rc = sqlite3_bind_int64(sqlite_statement, i + 1, (sqlite3_int64) lookups[i]->hash);
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_bind_text(sqlite_statement, (by_hash ? AMBER_LOOKUP_BATCH_SIZE : 0) + i + 1, 
+                                   lookups[i]->written, strlen(lookups[i]->written), SQLITE_STATIC);
+        }
+        if (rc != SQLITE_OK) {
+            amber_error2("Amber: error binding sqlite parameter: %s (%d)", lookups[i]->url, rc);
+            amber_db_reset_statement(r, sqlite_statement);
+            return -1;
+        }
+    }
+
+    while ((rc = sqlite3_step(sqlite_statement)) == SQLITE_ROW) {
+        if (!(url = (const char *) sqlite3_column_text(sqlite_statement, 0))) {
+            continue;
+        }
+        /* The database may have the url written another way, so the canonical forms are compared. 
+           This also rules out urls that only have the same hash by chance */
+        canonical = amber_canonical_url(amber_pool_alloc, r->pool, url);
+        hash = amber_index_hash(canonical);
+        location = (const char *) sqlite3_column_text(sqlite_statement, 1);
+
+        for (i = 0; i < lookup_count; i++) {
+            lookup = lookups[i];
+            /* Only the first result for each url is used */
+            if ((lookup->hash != hash) || (AMBER_CACHE_ATTRIBUTES_NOT_FOUND != lookup->result) || strcmp(lookup->url, canonical)) {
+                continue;
+            }
+
+            /* Copy the location string, since it gets clobbered when the statement is reset */
+            lookup->location = apr_pstrdup(r->pool, location ? location : "");
+            lookup->date = sqlite3_column_int(sqlite_statement, 2);
+            lookup->status = sqlite3_column_int(sqlite_statement, 3);
+            amber_debug4("Amber: sqlite results for url: (%s) %s, %d, %d", url, lookup->location, lookup->date, lookup->status);
 
-        char *url = get_absolute_url(f, location);
-        char *attribute = apr_pcalloc(f->r->pool, AMBER_MAX_ATTRIBUTE_STRING * sizeof(char));
-        if ((rc = amber_build_attribute(options, (unsigned char *)attribute, url, status, date))) {
-            amber_error1("Amber: error generating attribute string (%d)", rc);
-            return AMBER_CACHE_ATTRIBUTES_ERROR;
+            /* If the location is empty, no cache exists */
+            lookup->result = strlen(lookup->location) ? AMBER_CACHE_ATTRIBUTES_FOUND : AMBER_CACHE_ATTRIBUTES_EMPTY;
         }
-        amber_debug2("Amber: attribute string for url: (%s) : %s", url, attribute);
-        *result = attribute;
+    }
+    if (rc != SQLITE_DONE) {
+        amber_error1("Amber: error executing sqlite statement: (%d)", rc);
+        amber_stats_count_sqlite(rc);
+    }
+
+    /* Reset now, so that the statement doesn't hold a read lock on the database between lookups */
+    amber_db_reset_statement(r, sqlite_statement);
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/**
+ * Build the attribute string for a url which has a cache. The behavior comes from the configuration, 
+ * the server's url is worked out once per request, and the date formatting is reused for links 
+ * cached at the same time, so this is a single string concatenation in most cases.
+ * @param r the request
+ * @param context the filter context, which holds the server url and last formatted date
+ * @param lookup the location, date and status of the cache
+ * @return the attributes to insert in the HREF (empty if no behavior is configured), or NULL on error
+ */
+static char *amber_build_lookup_attribute(request_rec *r, amber_context_t *context, amber_lookup_t *lookup) {
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(r->per_dir_config, &amber_module); 
+    const char *behavior;
+
+    if ((lookup->status != AMBER_STATUS_UP) && (lookup->status != AMBER_STATUS_DOWN)) {
+        amber_error1("Amber: unexpected status for cached url (%d)", lookup->status);
+        return NULL;
+    }
+    behavior = options->behavior_attribute[lookup->status];
+    if (!behavior) {
+        /* The configuration was never merged, so the behavior wasn't worked out in advance */
+        behavior = amber_get_behavior_attribute(r->pool, options, lookup->status);
+    }
+    if (!behavior[0]) {
+        return "";
     }
 
-    return AMBER_CACHE_ATTRIBUTES_FOUND;
+    if (!context->url_prefix) {
+        context->url_prefix = get_absolute_url_prefix(r);
+    }
+    if (lookup->date != context->last_date) {
+        amber_format_date(lookup->date, context->last_date_string);
+        context->last_date = lookup->date;
+    }
+
+    char *attribute = amber_format_attribute(amber_pool_alloc, r->pool, context->url_prefix, lookup->location, 
+                                             context->last_date_string, behavior);
+    amber_debug2("Amber: attribute string for url: (%s) : %s", lookup->location, attribute);
+    return attribute;
+}
+
+/**
+ * Get the value of the data-amber-behavior attribute for links with a given status
+ * @param pool the pool to allocate the value from
+ * @param options configuration settings
+ * @param status whether the site is up or down
+ * @return the behavior, which is empty if links with this status shouldn't be annotated
+ */
+static const char *amber_get_behavior_attribute(apr_pool_t *pool, amber_options_t *options, int status) {
+    unsigned char behavior[AMBER_MAX_ATTRIBUTE_STRING] = "";
+
+    if (amber_get_behavior(options, behavior, status)) {
+        return "";
+    }
+    return apr_pstrdup(pool, (char *)behavior);
+}
+
+/**
+ * Allocate memory for amber_core from a pool
+ * @param pool the pool
+ * @param size number of bytes
+ * @return the memory
+ */
+static void *amber_pool_alloc(void *pool, size_t size) {
+    return apr_palloc((apr_pool_t *)pool, size);
 }
 
 /**
- * Get the absolute URL on this server for a URL relative to the root
+ * Get the absolute URL of the root of this server
  * @param  f        the filter
- * @param  location a URL relative to the root
- * @return          an absolute URL to the resource
- */
-static char *get_absolute_url(ap_filter_t *f, char *location) {
-    char *scheme = (char *)ap_http_scheme(f->r);
-    char *hostname = (char*) (f->r->hostname ? f->r->hostname : f->r->server->server_hostname);
-    int port = ap_get_server_port(f->r);
-    char *url = apr_pcalloc(f->r->pool, (strlen(scheme) + strlen(hostname) + strlen(location) + 15) * sizeof(char));
+ * @return          the URL, ending with '/'
+ */
+static const char *get_absolute_url_prefix(request_rec *r) {
+    const char *scheme = ap_http_scheme(r);
+    const char *hostname = r->hostname ? r->hostname : r->server->server_hostname;
+    int port = ap_get_server_port(r);
     if (port == 80) {
-        sprintf(url, "%s://%s/%s", scheme, hostname, location);
+        return apr_psprintf(r->pool, "%s://%s/", scheme, hostname);
     } else {
-        sprintf(url, "%s://%s:%d/%s", scheme, hostname, port, location);    
+        return apr_psprintf(r->pool, "%s://%s:%d/", scheme, hostname, port);
     }
-    return url;
 }
 
-/* Get the maximum possible size for the attributes that will be added to a link */
-static size_t get_maximum_attribute_size(ap_filter_t *f) {
-    size_t result = 0;
-    result += strlen(" data-versionurl='X' data-versiondate='0000-00-00T00:00:00+0000' data-amber-behavior='down hover:000,zz down hover:000' ");
-    result += strlen(get_absolute_url(f, "amber/cache/12345678901234567890123456789012/"));
-    result += 30; /* Additional padding */ 
-    return result;
-}                                                    
-
 /**
  * Add the URL to the amber_queue table so that it will be cached during the next caching run
- * @param f the filter
- * @param sqlite_handle handle to the database to use
- * @param url to enqueue
- * @return 0 on success
+ * @param r the request
+ * @param db the database connection to use
+ * @param url to enqueue, in canonical form
+ * @param hash amber_index_hash() of the url
+ * @return 0 if the url was written (or was already queued, checked or excluded), -1 on error
 */
-static int amber_db_enqueue_url(ap_filter_t *f, sqlite3 *sqlite_handle, char *url) {
+static int amber_db_enqueue_url(request_rec *r, amber_db_t *db, char *url, uint64_t hash) {
     int sqlite_rc;
 
-    sqlite3_stmt *sqlite_statement = amber_db_get_enqueue_url_query(f, sqlite_handle);
+    sqlite3_stmt *sqlite_statement = amber_db_get_enqueue_url_query(r, db);
     if (!sqlite_statement) {
         return -1;
      }
 
     if ((sqlite_rc = sqlite3_bind_text(sqlite_statement, 1, url, strlen(url), SQLITE_STATIC)) != SQLITE_OK) {
         amber_error2("Amber: error binding sqlite parameter: %s (%d)", url, sqlite_rc);
-        amber_db_finalize_statement(f ,sqlite_statement);
+        amber_db_reset_statement(r, sqlite_statement);
         return -1;
     }
     sqlite_rc = sqlite3_bind_int(sqlite_statement, 2, time(NULL));
     if (sqlite_rc != SQLITE_OK) {
         amber_error2("Amber: error binding sqlite parameter: %s (%d)", "time()", sqlite_rc);
-        amber_db_finalize_statement(f ,sqlite_statement);
+        amber_db_reset_statement(r, sqlite_statement);
+        return -1;
+    }
+    if ((AMBER_URL_HASH_READY == db->url_hash) && 
+        ((sqlite_rc = sqlite3_bind_int64(sqlite_statement, 3, (sqlite3_int64) hash)) != SQLITE_OK)) {
+        amber_error2("Amber: error binding sqlite parameter: %s (%d)", "hash", sqlite_rc);
+        amber_db_reset_statement(r, sqlite_statement);
         return -1;
     }
     sqlite_rc = sqlite3_step(sqlite_statement);
@@ -957,150 +2785,2360 @@ static int amber_db_enqueue_url(ap_filter_t *f, sqlite3 *sqlite_handle, char *ur
         amber_debug1("Enqueued URL: %s", url);
     } else {
         amber_debug2("Error enqueuing URL: %s (%d)", url, sqlite_rc);
+        amber_stats_count_sqlite(sqlite_rc);
         amber_error("Amber: error writing sqlite database. Make sure database file and its directory are writable");
+        amber_db_reset_statement(r, sqlite_statement);
+        return -1;
     }
-    amber_db_finalize_statement(f, sqlite_statement);
+    amber_db_reset_statement(r, sqlite_statement);
     return 0;
 }
 
 
 /* ======================================================================== */
-/* Amber Utilities - from amber_utils.c in amber_nginx                 */   
-/* Platform-independent and could be moved to a separate file               */
+/* Background writer                                                        */
 /* ======================================================================== */
 
-#define AMBER_MAX_BEHAVIOR_STRING 100
-#define AMBER_MAX_DATE_STRING 30
+#if APR_HAS_THREADS
 
-/* Create a string containing attributes to be added to the HREF
+/**
+ * Find a database in the list of those whose url_hash is kept filled in
+ * @param queue the enqueue queue, which holds the list
+ * @param path the database
+ * @return the entry, or NULL if the database isn't in the list. Only the writer thread can rely on 
+ *         the entry's state without holding the lock
+ */
+static amber_url_hash_db_t *amber_url_hash_find(amber_enqueue_queue_t *queue, const char *path) {
+    amber_url_hash_db_t *entry;
+
+    apr_thread_mutex_lock(queue->mutex);
+    entry = queue->url_hash_dbs;
+    apr_thread_mutex_unlock(queue->mutex);
+    while (entry && strcmp(entry->path, path)) {
+        entry = entry->next;
+    }
+    return entry;
+}
 
-    amber_options_t *options : configuration settings
-    char *out               : buffer to where the attribute is written
-    chatr *locatino         : location of the cached copy
-    int status              : whether the site is up or down
-    time_t date             : when the cache was generated (unix epoch)
+/**
+ * Add the url_hash column to a database's amber_check table if it doesn't have it, and fill it in 
+ * for urls that don't have one yet. Rows are done AMBER_URL_HASH_UPDATE_BATCH at a time, each batch 
+ * in its own transaction, so the caching jobs aren't kept waiting. The amber_generation table and 
+ * its triggers are added at the same time. Runs on the writer thread.
+ * @param queue the enqueue queue, for logging
+ * @param path the database
+ * @return AMBER_URL_HASH_READY if every url has a hash, AMBER_URL_HASH_PENDING if the database was 
+ *         busy, or AMBER_URL_HASH_UNAVAILABLE if it can't have the column (e.g. it's read-only)
+ */
+static int amber_url_hash_fill_database(amber_enqueue_queue_t *queue, char *path) {
+    sqlite3 *handle;
+    sqlite3_stmt *sqlite_statement = NULL;
+    int sqlite_rc = SQLITE_OK;
+    int total = 0;
+    int changes = 0;
+    int found;
+
+    if (!(handle = amber_db_open(queue->server, path))) {
+        return AMBER_URL_HASH_PENDING;
+    }
+    sqlite3_busy_timeout(handle, AMBER_ENQUEUE_BUSY_TIMEOUT);
 
-    returns 0 on success
-*/
-int amber_build_attribute(amber_options_t *options, unsigned char *out, char *location, int status, time_t date)
-{
-    unsigned char behavior[AMBER_MAX_BEHAVIOR_STRING];
-    char date_string[AMBER_MAX_DATE_STRING];
-
-    int rc = amber_get_behavior(options, behavior, status);
-    if (!rc && (strlen((char*)behavior) > 0)) {
-        struct tm *timeinfo = localtime(&date);
-        strftime(date_string,AMBER_MAX_DATE_STRING,"%FT%T%z",timeinfo);
-        snprintf((char *)out,
-             AMBER_MAX_ATTRIBUTE_STRING,
-             "data-versionurl='%s' data-versiondate='%s' data-amber-behavior='%s' ",
-             location,
-             date_string,
-             behavior
-             );
-         }
-    return rc;
+    /* The triggers that count changes for amber_db_get_generation() are kept up on the same schedule */
+    if ((sqlite_rc = sqlite3_exec(handle, AMBER_SQL_GENERATION_CREATE, NULL, NULL, NULL)) != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, queue->server, "Amber: could not add the amber_generation triggers to %s (%d)", path, sqlite_rc);
+        amber_stats_count_sqlite(sqlite_rc);
+    }
+    sqlite_rc = SQLITE_OK;
+
+    if (!(found = amber_db_has_url_hash(queue->server, handle))) {
+        if ((sqlite_rc = sqlite3_exec(handle, AMBER_SQL_URL_HASH_ADD, NULL, NULL, NULL)) != SQLITE_OK) {
+            /* Another process may have just added it */
+            found = amber_db_has_url_hash(queue->server, handle);
+        } else {
+            found = 1;
+        }
+    }
+    if ((found == 0) && (sqlite3_exec(handle, AMBER_SQL_GENERATION_CHECK_TRIGGER, NULL, NULL, NULL) != SQLITE_OK)) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, queue->server, "Amber: could not add the amber_check trigger to %s", path);
+    }
+    if ((found > 0) && 
+        ((sqlite_rc = sqlite3_exec(handle, AMBER_SQL_GENERATION_CHECK_HASH_TRIGGER, NULL, NULL, NULL)) == SQLITE_OK) &&
+        ((sqlite_rc = sqlite3_exec(handle, AMBER_SQL_URL_HASH_INDEX, NULL, NULL, NULL)) == SQLITE_OK) &&
+        ((sqlite_rc = sqlite3_prepare_v2(handle, AMBER_SQL_URL_HASH_UPDATE, -1, &sqlite_statement, NULL)) == SQLITE_OK)) {
+        do {
+            if ((sqlite_rc = sqlite3_step(sqlite_statement)) == SQLITE_DONE) {
+                changes = sqlite3_changes(handle);
+                total += changes;
+            }
+            sqlite3_reset(sqlite_statement);
+        } while ((sqlite_rc == SQLITE_DONE) && (changes >= AMBER_URL_HASH_UPDATE_BATCH));
+        sqlite3_finalize(sqlite_statement);
+    }
+    sqlite3_close(handle);
+
+    if ((found < 0) && (sqlite_rc == SQLITE_OK)) {
+        /* The columns couldn't be read, most likely because the database was busy */
+        return AMBER_URL_HASH_PENDING;
+    }
+    if (total) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, queue->server, "Amber: filled in url_hash for %d urls in %s", total, path);
+    }
+    if ((found > 0) && (sqlite_rc == SQLITE_DONE)) {
+        return AMBER_URL_HASH_READY;
+    }
+    amber_stats_count_sqlite(sqlite_rc);
+    if ((sqlite_rc == SQLITE_BUSY) || (sqlite_rc == SQLITE_LOCKED)) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, queue->server, "Amber: database busy, url_hash will be filled in later");
+        return AMBER_URL_HASH_PENDING;
+    }
+    ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, queue->server, 
+                 "Amber: could not add url_hash to amber_check in %s, so urls will be looked up as written (%d)", path, sqlite_rc);
+    return AMBER_URL_HASH_UNAVAILABLE;
+}
+
+/**
+ * Fill in url_hash in the databases that requests have asked about (see amber_url_hash_state()): 
+ * as soon as possible the first time, or if the database was busy, and then every 
+ * AMBER_URL_HASH_UPDATE_INTERVAL seconds for newly checked urls. Runs on the writer thread.
+ * @param queue the enqueue queue, which holds the list of databases
+ */
+static void amber_url_hash_fill(amber_enqueue_queue_t *queue) {
+    apr_time_t now = apr_time_now();
+    amber_url_hash_db_t *entry;
+    int state;
+
+    apr_thread_mutex_lock(queue->mutex);
+    entry = queue->url_hash_dbs;
+    apr_thread_mutex_unlock(queue->mutex);
+
+    for (; entry; entry = entry->next) {
+        if ((AMBER_URL_HASH_UNAVAILABLE == entry->state) ||
+            (entry->filled && (now - entry->filled < apr_time_from_sec(AMBER_URL_HASH_UPDATE_INTERVAL)))) {
+            continue;
+        }
+        state = amber_url_hash_fill_database(queue, entry->path);
+        entry->filled = (AMBER_URL_HASH_PENDING == state) ? 0 : now;
+
+        /* Once urls are looked up by hash they stay that way, even if a later fill fails */
+        if ((AMBER_URL_HASH_PENDING == entry->state) && (AMBER_URL_HASH_PENDING != state)) {
+            apr_thread_mutex_lock(queue->mutex);
+            entry->state = state;
+            apr_thread_mutex_unlock(queue->mutex);
+        }
+    }
 }
 
-/* Get the contents of behavior attribute based on the status of the link
-   and the configuration settings.
+/**
+ * Write a batch of urls to the amber_queue table. Consecutive urls for the same database are written 
+ * in a single transaction. Runs on the writer thread.
+ * @param queue the enqueue queue, which owns the writer's database connection
+ * @param items urls to write
+ * @param item_count number of urls
+ */
+static void amber_enqueue_write_batch(amber_enqueue_queue_t *queue, amber_enqueue_item_t *items, int item_count) {
+    amber_db_t *db = &queue->db;
+    amber_url_hash_db_t *url_hash;
+    int url_hash_state;
+    int sqlite_rc;
+    int i;
 
-   amber_options_t *options : configuration settings
-   char *out               : buffer to where the attribute is written
-   int status              : whether the site is up or down
+    for (i = 0; i < item_count; i++) {
+        url_hash = amber_url_hash_find(queue, items[i].db_path);
+        url_hash_state = url_hash ? url_hash->state : AMBER_URL_HASH_PENDING;
+        if (!db->path || strcmp(db->path, items[i].db_path) || (db->url_hash != url_hash_state)) {
+            /* Switch databases (or to queuing by url_hash), committing anything written so far */
+            if (db->handle) {
+                sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+                amber_db_close(queue->server, db);
+            }
+            if (!(db->handle = amber_db_open(queue->server, items[i].db_path))) {
+                continue;
+            }
+            db->path = strdup(items[i].db_path);
+            db->url_hash = url_hash_state;
+            sqlite3_busy_timeout(db->handle, AMBER_ENQUEUE_BUSY_TIMEOUT);
+            if (sqlite3_prepare_v2(db->handle, (AMBER_URL_HASH_READY == url_hash_state) ? AMBER_SQL_ENQUEUE_URL_HASH : AMBER_SQL_ENQUEUE_URL, 
+                                   -1, &db->enqueue_url_query, NULL) != SQLITE_OK) {
+                ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, queue->server, "AMBER error creating sqlite prepared statement: %s", sqlite3_errmsg(db->handle));
+                amber_db_close(queue->server, db);
+                continue;
+            }
+            if ((sqlite_rc = sqlite3_exec(db->handle, "BEGIN IMMEDIATE", NULL, NULL, NULL)) != SQLITE_OK) {
+                ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, queue->server, "Amber: error starting enqueue transaction (%d)", sqlite_rc);
+                amber_stats_count_sqlite(sqlite_rc);
+            }
+        }
 
-   returns 0 on success
+        sqlite3_bind_text(db->enqueue_url_query, 1, items[i].url, -1, SQLITE_STATIC);
+        sqlite3_bind_int(db->enqueue_url_query, 2, items[i].created);
+        if (AMBER_URL_HASH_READY == url_hash_state) {
+            sqlite3_bind_int64(db->enqueue_url_query, 3, (sqlite3_int64) items[i].hash);
+        }
+        sqlite_rc = sqlite3_step(db->enqueue_url_query);
+        if (sqlite_rc == SQLITE_DONE) { /* No data returned */
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, queue->server, "Enqueued URL: %s", items[i].url);
+        } else {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, queue->server, "Amber: error writing sqlite database. Make sure database file and its directory are writable (%d)", sqlite_rc);
+            amber_stats_count_sqlite(sqlite_rc);
+        }
+        sqlite3_reset(db->enqueue_url_query);
+        sqlite3_clear_bindings(db->enqueue_url_query);
+    }
 
-   TODO: Country-specific behavior
-   */
-int amber_get_behavior(amber_options_t *options, unsigned char *out, int status) {
-    if (!options || !out) {
-        return 1;
+    /* The connection is kept open (outside a transaction) for the next batch */
+    if (db->handle && !sqlite3_get_autocommit(db->handle)) {
+        if ((sqlite_rc = sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL)) != SQLITE_OK) {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, queue->server, "Amber: error committing enqueued urls (%d)", sqlite_rc);
+            amber_stats_count_sqlite(sqlite_rc);
+            sqlite3_exec(db->handle, "ROLLBACK", NULL, NULL, NULL);
+        }
     }
-    if (status == AMBER_STATUS_UP) {
-        switch (options->behavior_up) {
-            case AMBER_ACTION_HOVER:
-                snprintf((char *)out,
-                         AMBER_MAX_ATTRIBUTE_STRING,
-                         "up hover:%d",
-                         options->hover_delay_up);
-                break;
-            case AMBER_ACTION_POPUP:
-                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "up popup");
-                break;
-            case AMBER_ACTION_CACHE:
-                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "up cache");
-                break;
-            case AMBER_ACTION_NONE:
-                out[0] = 0;
-                break;
+}
+
+/**
+ * The background writer thread. Waits until a batch of urls is queued or the interval passes, 
+ * then writes whatever is queued, and any view counts and url hashes that are due to be written. When the child
+ * exits, everything left in the queue and all the outstanding view counts are written.
+ */
+static void * APR_THREAD_FUNC amber_background_thread(apr_thread_t *thread, void *data) {
+    amber_enqueue_queue_t *queue = data;
+    amber_enqueue_item_t *batch = malloc(queue->batch_size * sizeof(amber_enqueue_item_t));
+    apr_uint32_t dropped;
+    int batch_count;
+    int i;
+
+    apr_thread_mutex_lock(queue->mutex);
+    while (1) {
+        if (!queue->shutdown && (queue->count < queue->batch_size)) {
+            apr_thread_cond_timedwait(queue->cond, queue->mutex, queue->interval);
+        }
+        if (!queue->count && queue->shutdown) {
+            break;
+        }
+
+        /* Take a batch off the queue, and write it without holding the lock */
+        for (batch_count = 0; (batch_count < queue->batch_size) && queue->count; batch_count++) {
+            batch[batch_count] = queue->items[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+            queue->count--;
+        }
+        apr_thread_mutex_unlock(queue->mutex);
+
+        /* View counts and url hashes are written on their own timers, however busy the queue is */
+        amber_activity_flush(queue->server, 0);
+        amber_url_hash_fill(queue);
+        amber_output_cache_sweep(queue->server);
+        if (!batch_count) {
+            apr_thread_mutex_lock(queue->mutex);
+            continue;
         }
-    } else if (status == AMBER_STATUS_DOWN) {
-        switch (options->behavior_down) {
-            case AMBER_ACTION_HOVER:
-                snprintf((char *)out,
-                         AMBER_MAX_ATTRIBUTE_STRING,
-                         "down hover:%d",
-                         options->hover_delay_down);
-                break;
-            case AMBER_ACTION_POPUP:
-                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "down popup");
-                break;
-            case AMBER_ACTION_CACHE:
-                snprintf((char *)out, AMBER_MAX_ATTRIBUTE_STRING, "down cache");
-                break;
-            case AMBER_ACTION_NONE:
-                out[0] = 0;
-                break;
 
+        amber_enqueue_write_batch(queue, batch, batch_count);
+        for (i = 0; i < batch_count; i++) {
+            free(batch[i].db_path);
+            free(batch[i].url);
+        }
+        if ((dropped = apr_atomic_xchg32(&queue->dropped, 0))) {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, queue->server, "Amber: enqueue queue full, %u urls were not enqueued", dropped);
         }
+
+        apr_thread_mutex_lock(queue->mutex);
     }
-    if (options->country && strlen(options->country)) {
-        char country_attribute[AMBER_MAX_ATTRIBUTE_STRING];
-        if (status == AMBER_STATUS_UP) {
-            switch (options->country_behavior_up) {
-                case AMBER_ACTION_HOVER:
-                    snprintf(country_attribute,
-                             AMBER_MAX_ATTRIBUTE_STRING,
-                             ",%s up hover:%d",
-                             options->country,
-                             options->country_hover_delay_up);
-                    break;
-                case AMBER_ACTION_POPUP:
-                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s up popup", options->country);
-                    break;
-                case AMBER_ACTION_CACHE:
-                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s up cache", options->country);
-                    break;
-                case AMBER_ACTION_NONE:
-                    break;
-            }
-        } else if (status == AMBER_STATUS_DOWN) {
-            switch (options->country_behavior_down) {
-                case AMBER_ACTION_HOVER:
-                    snprintf(country_attribute,
-                             AMBER_MAX_ATTRIBUTE_STRING,
-                             ",%s down hover:%d",
-                             options->country,
-                             options->country_hover_delay_down);
-                    break;
-                case AMBER_ACTION_POPUP:
-                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s down popup", options->country);
-                    break;
-                case AMBER_ACTION_CACHE:
-                    snprintf(country_attribute, AMBER_MAX_ATTRIBUTE_STRING, ",%s down cache", options->country);
-                    break;
-                case AMBER_ACTION_NONE:
-                    break;
+    apr_thread_mutex_unlock(queue->mutex);
+
+    amber_activity_flush(queue->server, 1);
+    if (queue->db.path) {
+        amber_db_close(queue->server, &queue->db);
+    }
+    free(batch);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/**
+ * Stop the writer thread, once it has written everything outstanding. Registered as a pre-cleanup 
+ * on the child pool, so it runs before the thread's own pool is destroyed.
+ */
+static apr_status_t amber_enqueue_shutdown(void *data) {
+    amber_enqueue_queue_t *queue = data;
+    amber_url_hash_db_t *entry;
+    apr_status_t thread_rv;
+
+    apr_thread_mutex_lock(queue->mutex);
+    queue->shutdown = 1;
+    apr_thread_cond_signal(queue->cond);
+    apr_thread_mutex_unlock(queue->mutex);
+    apr_thread_join(&thread_rv, queue->thread);
+
+    if (amber_enqueue_queue == queue) {
+        amber_enqueue_queue = NULL;
+    }
+    while ((entry = queue->url_hash_dbs)) {
+        queue->url_hash_dbs = entry->next;
+        free(entry->path);
+        free(entry);
+    }
+    return APR_SUCCESS;
+}
+
+#endif /* APR_HAS_THREADS */
+
+/**
+ * Start the background writer thread for this child. If background enqueuing has been disabled, 
+ * the thread only writes view counts.
+ * @param pchild the child pool
+ * @param s the main server
+ */
+static void amber_background_child_init(apr_pool_t *pchild, server_rec *s) {
+#if APR_HAS_THREADS
+    amber_server_options_t *server_options = ap_get_module_config(s->module_config, &amber_module);
+    amber_enqueue_queue_t *queue;
+    apr_status_t rv;
+
+    amber_enqueue_queue = NULL;
+    if (!sqlite3_threadsafe()) {
+        /* The thread would share the sqlite library with the request (see amber_check_sqlite_threads()) */
+        return;
+    }
+
+    queue = apr_pcalloc(pchild, sizeof(amber_enqueue_queue_t));
+    queue->server = s;
+    queue->capacity = (server_options->enqueue_queue_size > 0) ? server_options->enqueue_queue_size : 0;
+    queue->batch_size = server_options->enqueue_batch_size;
+    queue->interval = apr_time_from_msec(server_options->enqueue_interval);
+    queue->items = apr_pcalloc(pchild, (queue->capacity + 1) * sizeof(amber_enqueue_item_t));
+
+    if (((rv = apr_thread_mutex_create(&queue->mutex, APR_THREAD_MUTEX_DEFAULT, pchild)) != APR_SUCCESS) ||
+        ((rv = apr_thread_cond_create(&queue->cond, pchild)) != APR_SUCCESS) ||
+        ((rv = apr_thread_create(&queue->thread, NULL, amber_background_thread, queue, pchild)) != APR_SUCCESS)) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "Amber: could not start the background writer thread - urls and views will be written synchronously");
+        return;
+    }
+    apr_pool_pre_cleanup_register(pchild, queue, amber_enqueue_shutdown);
+    amber_enqueue_queue = queue;
+#endif
+}
+
+/**
+ * Hand a url to the background writer to be added to the amber_queue table. If the queue is full
+ * (or the url can't be copied), the url is dropped, and will be seen again the next time the page 
+ * is viewed
+ * @param r the request
+ * @param db_path the database to add the url to
+ * @param url the url to enqueue, in canonical form
+ * @param hash amber_index_hash() of the url
+ * @return AMBER_ENQUEUE_QUEUED if the background writer will write the url, AMBER_ENQUEUE_DROPPED 
+ *         if it was dropped, or AMBER_ENQUEUE_SYNC if the caller should write it to the database itself
+ */
+static int amber_enqueue_push(request_rec *r, const char *db_path, const char *url, uint64_t hash) {
+#if APR_HAS_THREADS
+    amber_enqueue_queue_t *queue = amber_enqueue_queue;
+    amber_enqueue_item_t *item;
+    int result = AMBER_ENQUEUE_DROPPED;
+
+    if (!queue || !queue->capacity || !db_path) {
+        return AMBER_ENQUEUE_SYNC;
+    }
+
+    apr_thread_mutex_lock(queue->mutex);
+    if (queue->count >= queue->capacity) {
+        apr_atomic_inc32(&queue->dropped);
+        amber_stats_count(AMBER_STAT_ENQUEUES_DROPPED, 1);
+        amber_debug1("Amber: enqueue queue full, dropping %s", url);
+    } else {
+        item = &queue->items[(queue->head + queue->count) % queue->capacity];
+        item->db_path = strdup(db_path);
+        item->url = strdup(url);
+        item->hash = hash;
+        item->created = time(NULL);
+        if (item->db_path && item->url) {
+            queue->count++;
+            result = AMBER_ENQUEUE_QUEUED;
+            if (queue->count == queue->batch_size) {
+                apr_thread_cond_signal(queue->cond);
             }
+        } else {
+            free(item->db_path);
+            free(item->url);
+            apr_atomic_inc32(&queue->dropped);
+            amber_stats_count(AMBER_STAT_ENQUEUES_DROPPED, 1);
         }
-        if (strlen(country_attribute)) {
-            strncat((char *) out, country_attribute, AMBER_MAX_ATTRIBUTE_STRING - strlen((char *)out));
-        }
+    }
+    apr_thread_mutex_unlock(queue->mutex);
+    return result;
+#else
+    return AMBER_ENQUEUE_SYNC;
+#endif
+}
+
+/**
+ * Find out whether the url_hash column of a database has been filled in, so that urls can be looked 
+ * up and queued by it. The first time a database is asked about, the background writer is woken to 
+ * add the column and fill it in, and it then fills it in for newly checked urls every 
+ * AMBER_URL_HASH_UPDATE_INTERVAL seconds. Without the writer, urls are looked up as written.
+ * @param r the request
+ * @param db_path the database
+ * @return AMBER_URL_HASH_READY, AMBER_URL_HASH_PENDING if it's not done yet, or 
+ *         AMBER_URL_HASH_UNAVAILABLE if urls have to be looked up as written
+ */
+static int amber_url_hash_state(request_rec *r, const char *db_path) {
+#if APR_HAS_THREADS
+    amber_enqueue_queue_t *queue = amber_enqueue_queue;
+    amber_url_hash_db_t *entry;
+    int state = AMBER_URL_HASH_PENDING;
+
+    if (!queue || !db_path) {
+        return AMBER_URL_HASH_UNAVAILABLE;
     }
 
-    return 0;
+    apr_thread_mutex_lock(queue->mutex);
+    for (entry = queue->url_hash_dbs; entry && strcmp(entry->path, db_path); entry = entry->next) {
+    }
+    if (entry) {
+        state = entry->state;
+    } else if ((entry = calloc(1, sizeof(amber_url_hash_db_t))) && (entry->path = strdup(db_path))) {
+        entry->next = queue->url_hash_dbs;
+        queue->url_hash_dbs = entry;
+        apr_thread_cond_signal(queue->cond);
+        amber_debug1("Amber: asked the background writer to fill in url_hash in %s", db_path);
+    } else {
+        /* Asked again next time */
+        free(entry);
+    }
+    apr_thread_mutex_unlock(queue->mutex);
+    return state;
+#else
+    return AMBER_URL_HASH_UNAVAILABLE;
+#endif
 }
 
+/* ======================================================================== */
+/* Shared memory lookup cache                                               */
+/* ======================================================================== */
+
+/**
+ * Destroy the lookup cache when the configuration pool is cleared (on restart)
+ */
+static apr_status_t amber_lookup_cache_destroy(void *data) {
+    amber_lookup_cache = NULL;
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the shared memory segment and mutex for the lookup cache, if it is enabled.
+ * Called from post_config, so the segment is inherited by all the children.
+ * @param pconf the configuration pool, which owns the segment
+ * @param s the main server
+ * @param server_options server-wide configuration
+ * @return APR_SUCCESS, or an error if the cache is enabled but could not be created
+ */
+static apr_status_t amber_lookup_cache_create(apr_pool_t *pconf, server_rec *s, amber_server_options_t *server_options) {
+    amber_lookup_cache_t *cache;
+    apr_status_t rv;
+
+    amber_lookup_cache = NULL;
+    if (server_options->lookup_cache_size < AMBER_LOOKUP_CACHE_WAYS * sizeof(amber_lookup_cache_entry_t)) {
+        return APR_SUCCESS;
+    }
+
+    cache = apr_pcalloc(pconf, sizeof(amber_lookup_cache_t));
+    if ((rv = apr_shm_create(&cache->shm, server_options->lookup_cache_size, NULL, pconf)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "Amber: could not create shared memory for the lookup cache (%" APR_SIZE_T_FMT " bytes)", server_options->lookup_cache_size);
+        return rv;
+    }
+    if ((rv = ap_global_mutex_create(&cache->mutex, NULL, AMBER_SHM_MUTEX_TYPE, "lookup-cache", s, pconf, 0)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "Amber: could not create mutex for the lookup cache");
+        return rv;
+    }
+
+    cache->entries = apr_shm_baseaddr_get(cache->shm);
+    cache->set_count = apr_shm_size_get(cache->shm) / (AMBER_LOOKUP_CACHE_WAYS * sizeof(amber_lookup_cache_entry_t));
+    cache->ttl = apr_time_from_sec(server_options->lookup_cache_ttl);
+    memset(cache->entries, 0, cache->set_count * AMBER_LOOKUP_CACHE_WAYS * sizeof(amber_lookup_cache_entry_t));
 
+    apr_pool_cleanup_register(pconf, NULL, amber_lookup_cache_destroy, apr_pool_cleanup_null);
+    amber_lookup_cache = cache;
+    ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, 0, s, "Amber: lookup cache enabled with %" APR_SIZE_T_FMT " entries", cache->set_count * AMBER_LOOKUP_CACHE_WAYS);
+    return APR_SUCCESS;
+}
+
+/**
+ * Reattach to the lookup cache mutex in a child process
+ * @param pchild the child pool
+ * @param s the main server
+ */
+static void amber_lookup_cache_child_init(apr_pool_t *pchild, server_rec *s) {
+    apr_status_t rv;
+    if (amber_lookup_cache) {
+        if ((rv = apr_global_mutex_child_init(&amber_lookup_cache->mutex, apr_global_mutex_lockfile(amber_lookup_cache->mutex), pchild)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "Amber: could not attach to the lookup cache mutex - lookup cache disabled");
+            amber_lookup_cache = NULL;
+        }
+    }
+}
 
+/**
+ * Get the key for a url in the lookup cache. The database path is part of the key, since 
+ * different virtual hosts may use different databases.
+ */
+static uint64_t amber_lookup_cache_key(const char *db_path, const char *url) {
+    uint64_t key = amber_hash(url, amber_hash(db_path, 0));
+    return key ? key : 1;   /* 0 marks an unused entry */
+}
+
+/**
+ * Look up a url in the shared lookup cache
+ * @param r the request
+ * @param db_path the database the url would be looked up in
+ * @param url the url to look up
+ * @param lookup the cached result, with the location allocated from the request pool
+ * @return 1 if the url was found in the cache, 0 otherwise
+ */
+static int amber_lookup_cache_get(request_rec *r, const char *db_path, const char *url, amber_lookup_t *lookup) {
+    amber_lookup_cache_entry_t *set;
+    uint64_t key;
+    apr_time_t now;
+    int i;
+    int found = 0;
+
+    if (!amber_lookup_cache || !db_path || (strlen(url) >= AMBER_LOOKUP_CACHE_MAX_URL)) {
+        return 0;
+    }
+
+    key = amber_lookup_cache_key(db_path, url);
+    set = amber_lookup_cache->entries + (key % amber_lookup_cache->set_count) * AMBER_LOOKUP_CACHE_WAYS;
+    now = apr_time_now();
+
+    if (apr_global_mutex_lock(amber_lookup_cache->mutex) != APR_SUCCESS) {
+        return 0;
+    }
+    for (i = 0; i < AMBER_LOOKUP_CACHE_WAYS; i++) {
+        if ((set[i].key == key) && (set[i].expires > now) && !strcmp(set[i].url, url)) {
+            lookup->result = set[i].result;
+            lookup->location = apr_pstrdup(r->pool, set[i].location);
+            lookup->date = set[i].date;
+            lookup->status = set[i].status;
+            lookup->generation = set[i].generation;
+            found = 1;
+            break;
+        }
+    }
+    apr_global_mutex_unlock(amber_lookup_cache->mutex);
+
+    amber_debug2("Amber: lookup cache %s: %s", found ? "hit" : "miss", url);
+    return found;
+}
+
+/**
+ * Save the result of looking up a url in the shared lookup cache. If all the slots the url could go 
+ * in are full, the one that expires soonest is replaced.
+ * @param r the request
+ * @param db_path the database the url was looked up in
+ * @param url the url that was looked up
+ * @param lookup the result to cache
+ */
+static void amber_lookup_cache_set(request_rec *r, const char *db_path, const char *url, amber_lookup_t *lookup) {
+    amber_lookup_cache_entry_t *set;
+    amber_lookup_cache_entry_t *entry = NULL;
+    uint64_t key;
+    int i;
+
+    if (!amber_lookup_cache || !db_path || (strlen(url) >= AMBER_LOOKUP_CACHE_MAX_URL) || 
+        (lookup->location && (strlen(lookup->location) >= AMBER_LOOKUP_CACHE_MAX_LOCATION))) {
+        return;
+    }
+
+    key = amber_lookup_cache_key(db_path, url);
+    set = amber_lookup_cache->entries + (key % amber_lookup_cache->set_count) * AMBER_LOOKUP_CACHE_WAYS;
+
+    if (apr_global_mutex_lock(amber_lookup_cache->mutex) != APR_SUCCESS) {
+        return;
+    }
+    for (i = 0; i < AMBER_LOOKUP_CACHE_WAYS; i++) {
+        if ((set[i].key == key) && !strcmp(set[i].url, url)) {
+            entry = &set[i];
+            break;
+        }
+        if (!entry || (set[i].expires < entry->expires)) {
+            entry = &set[i];
+        }
+    }
+    entry->key = key;
+    entry->expires = apr_time_now() + amber_lookup_cache->ttl;
+    entry->result = lookup->result;
+    entry->date = lookup->date;
+    entry->status = lookup->status;
+    entry->generation = lookup->generation;
+    apr_cpystrn(entry->url, url, AMBER_LOOKUP_CACHE_MAX_URL);
+    apr_cpystrn(entry->location, lookup->location ? lookup->location : "", AMBER_LOOKUP_CACHE_MAX_LOCATION);
+    apr_global_mutex_unlock(amber_lookup_cache->mutex);
+}
+
+/* ======================================================================== */
+/* Memory-mapped lookup index                                               */
+/* ======================================================================== */
+
+/**
+ * Drop a reference to a mapped lookup index, and unmap it if that was the last one. 
+ * The mutex must be held.
+ * @param map the mapped index
+ */
+static void amber_index_unref(amber_index_map_t *map) {
+    if (--map->refs == 0) {
+        apr_pool_destroy(map->pool);
+    }
+}
+
+/**
+ * Release the reference a request holds on a mapped lookup index. Registered as a cleanup on the request pool
+ */
+static apr_status_t amber_index_release(void *data) {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(amber_index_pool->mutex);
+#endif
+    amber_index_unref(data);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(amber_index_pool->mutex);
+#endif
+    return APR_SUCCESS;
+}
+
+/**
+ * Unmap all the lookup indexes. Registered as a cleanup on the child pool.
+ */
+static apr_status_t amber_index_pool_destroy(void *data) {
+    amber_index_pool_t *pool = data;
+    int i;
+    for (i = 0; i < AMBER_MAX_INDEXES; i++) {
+        if (pool->files[i].map) {
+            amber_index_unref(pool->files[i].map);
+        }
+        if (pool->files[i].path) {
+            free(pool->files[i].path);
+        }
+    }
+    if (amber_index_pool == pool) {
+        amber_index_pool = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Set up the per-child table of mapped lookup indexes. Indexes are mapped the first time a request needs them
+ * @param pchild the child pool, which owns the table
+ * @param s the server, for logging
+ */
+static void amber_index_child_init(apr_pool_t *pchild, server_rec *s) {
+    amber_index_pool_t *pool = apr_pcalloc(pchild, sizeof(amber_index_pool_t));
+
+    amber_index_pool = NULL;
+    pool->server = s;
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT, pchild) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "Amber: could not create lookup index mutex");
+        return;
+    }
+#endif
+    apr_pool_cleanup_register(pchild, pool, amber_index_pool_destroy, apr_pool_cleanup_null);
+    amber_index_pool = pool;
+}
+
+/**
+ * Map a lookup index file into memory, and check that it's valid
+ * @param s the server, for logging
+ * @param path location of the index
+ * @param finfo set to the size, modification time and inode of the file that was mapped
+ * @return the mapped index, with one reference, or NULL if it could not be mapped
+ */
+static amber_index_map_t *amber_index_map_file(server_rec *s, const char *path, apr_finfo_t *finfo) {
+    amber_index_map_t *map;
+    apr_pool_t *pool;
+    apr_file_t *file;
+    apr_mmap_t *mm;
+    apr_status_t rv;
+
+    /* Each mapping has its own pool, since mappings come and go independently of the child pool */
+    if ((rv = apr_pool_create_unmanaged_ex(&pool, NULL, NULL)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "Amber: could not create pool for lookup index %s", path);
+        return NULL;
+    }
+    if (((rv = apr_file_open(&file, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, pool)) != APR_SUCCESS) ||
+        ((rv = apr_file_info_get(finfo, APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_INODE, file)) != APR_SUCCESS) ||
+        ((rv = apr_mmap_create(&mm, file, 0, (apr_size_t)finfo->size, APR_MMAP_READ, pool)) != APR_SUCCESS)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Amber: could not map lookup index %s, looking links up in the database", path);
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+    /* The mapping stays valid after the file is closed */
+    apr_file_close(file);
+
+    map = apr_pcalloc(pool, sizeof(amber_index_map_t));
+    map->pool = pool;
+    map->refs = 1;
+    map->mtime = finfo->mtime;
+    map->inode = finfo->inode;
+    if (amber_index_open(&map->index, mm->mm, mm->size)) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, s, "Amber: %s is not a valid lookup index (rebuild it with amber_index), looking links up in the database", path);
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+    ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, 0, s, "Amber: mapped lookup index %s (%u urls)", path, (unsigned)map->index.header->entry_count);
+    return map;
+}
+
+/**
+ * Get the lookup index to use for a response. At most once every AMBER_INDEX_CHECK_INTERVAL seconds, 
+ * the file is checked, and if it has been rebuilt the new version is mapped in place of the old one. 
+ * The reference taken here is released when the request ends, so the index can be used for the whole 
+ * response without holding any lock.
+ * @param r the request
+ * @param path location of the index
+ * @return the mapped index, or NULL if there is none (links are looked up in the database instead)
+ */
+static amber_index_map_t *amber_index_acquire(request_rec *r, const char *path) {
+    amber_index_file_t *file = NULL;
+    amber_index_map_t *map = NULL;
+    apr_time_t now = apr_time_now();
+    apr_finfo_t finfo;
+    int i;
+
+    if (!amber_index_pool) {
+        return NULL;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(amber_index_pool->mutex);
+#endif
+    for (i = 0; i < AMBER_MAX_INDEXES; i++) {
+        amber_index_file_t *slot = &amber_index_pool->files[i];
+        if (slot->path && !strcmp(slot->path, path)) {
+            file = slot;
+            break;
+        }
+        if (!slot->path && !file) {
+            file = slot;
+        }
+    }
+    if (file && !file->path) {
+        /* The first time this index has been used. The size marks it as never having been looked at */
+        file->path = strdup(path);
+        file->size = -2;
+        file->checked = 0;
+    }
+
+    if (file && (now - file->checked >= apr_time_from_sec(AMBER_INDEX_CHECK_INTERVAL))) {
+        file->checked = now;
+        if (APR_SUCCESS != apr_stat(&finfo, path, APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_INODE, r->pool)) {
+            if (-1 != file->size) {
+                ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r->server, "Amber: lookup index %s not found, looking links up in the database", path);
+            }
+            if (file->map) {
+                amber_index_unref(file->map);
+                file->map = NULL;
+            }
+            file->size = -1;
+        } else if ((finfo.mtime != file->mtime) || (finfo.size != file->size) || (finfo.inode != file->inode)) {
+            /* A rebuilt index is renamed over the old one, so a new version is a new file */
+            if (file->map) {
+                amber_index_unref(file->map);
+            }
+            file->map = amber_index_map_file(r->server, path, &finfo);
+            file->mtime = finfo.mtime;
+            file->size = finfo.size;
+            file->inode = finfo.inode;
+        }
+    }
+
+    if (file && file->map) {
+        map = file->map;
+        map->refs++;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(amber_index_pool->mutex);
+#endif
+
+    if (map) {
+        apr_pool_cleanup_register(r->pool, map, amber_index_release, apr_pool_cleanup_null);
+    } else if (!file) {
+        amber_debug1("Amber: too many lookup indexes, not using %s", path);
+    }
+    return map;
+}
+
+/* ======================================================================== */
+/* Skip lists                                                               */
+/* ======================================================================== */
+
+/**
+ * Drop a reference to a skip list, and free it if that was the last one. The mutex must be held.
+ * @param list the skip list
+ */
+static void amber_skip_unref(amber_skip_list_t *list) {
+    if (--list->refs == 0) {
+        apr_pool_destroy(list->pool);
+    }
+}
+
+/**
+ * Release the reference a request holds on a skip list. Registered as a cleanup on the request pool
+ */
+static apr_status_t amber_skip_release(void *data) {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(amber_skip_pool->mutex);
+#endif
+    amber_skip_unref(data);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(amber_skip_pool->mutex);
+#endif
+    return APR_SUCCESS;
+}
+
+/**
+ * Free all the skip lists. Registered as a cleanup on the child pool.
+ */
+static apr_status_t amber_skip_pool_destroy(void *data) {
+    amber_skip_pool_t *pool = data;
+    int i;
+    for (i = 0; i < AMBER_MAX_SKIP_LISTS; i++) {
+        if (pool->slots[i].list) {
+            amber_skip_unref(pool->slots[i].list);
+        }
+        free(pool->slots[i].db_path);
+        free(pool->slots[i].hosts);
+    }
+    if (amber_skip_pool == pool) {
+        amber_skip_pool = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Set up the per-child table of skip lists. Lists are loaded the first time a request needs them
+ * @param pchild the child pool, which owns the table
+ * @param s the server, for logging
+ */
+static void amber_skip_child_init(apr_pool_t *pchild, server_rec *s) {
+    amber_skip_pool_t *pool = apr_pcalloc(pchild, sizeof(amber_skip_pool_t));
+
+    amber_skip_pool = NULL;
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT, pchild) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "Amber: could not create skip list mutex");
+        return;
+    }
+#endif
+    apr_pool_cleanup_register(pchild, pool, amber_skip_pool_destroy, apr_pool_cleanup_null);
+    amber_skip_pool = pool;
+}
+
+/**
+ * Build a skip list from AmberSkipHosts and the amber_exclude table. If the table can't be read, 
+ * the list just has the hosts from the configuration
+ * @param r the request
+ * @param options the configuration
+ * @return the skip list, with one reference, or NULL if it could not be built
+ */
+static amber_skip_list_t *amber_skip_load(request_rec *r, amber_options_t *options) {
+    amber_skip_list_t *list;
+    apr_array_header_t *patterns;
+    apr_pool_t *pool;
+    amber_db_t *db;
+    char *hosts, *host, *state;
+    int i;
+
+    /* Each list has its own pool, since lists come and go independently of the child pool */
+    if (apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS) {
+        amber_error("Amber: could not create pool for skip list");
+        return NULL;
+    }
+    patterns = apr_array_make(pool, 16, sizeof(char *));
+    if (options->skip_hosts) {
+        hosts = apr_pstrdup(pool, options->skip_hosts);
+        for (host = apr_strtok(hosts, " ", &state); host; host = apr_strtok(NULL, " ", &state)) {
+            APR_ARRAY_PUSH(patterns, char *) = host;
+        }
+    }
+    if (options->database && (db = amber_db_get_database(r, options->database))) {
+        amber_db_get_exclusions(r, db, patterns);
+        amber_db_release_database(r, db);
+    }
+
+    list = apr_pcalloc(pool, sizeof(amber_skip_list_t));
+    list->pool = pool;
+    list->refs = 1;
+    if (amber_skip_init(&list->skip, patterns->nelts, amber_pool_alloc, pool)) {
+        amber_error("Amber: could not allocate skip list");
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+    for (i = 0; i < patterns->nelts; i++) {
+        char *pattern = APR_ARRAY_IDX(patterns, i, char *);
+        if (strstr(pattern, "://")) {
+            pattern = amber_canonical_url(amber_pool_alloc, pool, pattern);
+        }
+        if (amber_skip_add(&list->skip, pattern)) {
+            amber_debug1("Amber: ignoring exclusion: %s", pattern);
+        }
+    }
+    amber_debug1("Amber: loaded skip list with %d hosts and urls", (int)list->skip.count);
+    return list;
+}
+
+/**
+ * Get the skip list to use for a response. It's reloaded every AMBER_SKIP_REFRESH_INTERVAL seconds, 
+ * by one request while the others carry on with the old list. The reference taken here is released 
+ * when the request ends.
+ * @param r the request
+ * @param options the configuration, which identifies the list
+ * @return the skip list, or NULL if there is none
+ */
+static amber_skip_list_t *amber_skip_acquire(request_rec *r, amber_options_t *options) {
+    const char *db_path = options->database ? options->database : "";
+    const char *hosts = options->skip_hosts ? options->skip_hosts : "";
+    amber_skip_slot_t *slot = NULL;
+    amber_skip_list_t *list = NULL;
+    amber_skip_list_t *loaded;
+    apr_time_t now = apr_time_now();
+    int load = 0;
+    int i;
+
+    if (!amber_skip_pool) {
+        return NULL;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(amber_skip_pool->mutex);
+#endif
+    for (i = 0; i < AMBER_MAX_SKIP_LISTS; i++) {
+        amber_skip_slot_t *candidate = &amber_skip_pool->slots[i];
+        if (candidate->db_path && !strcmp(candidate->db_path, db_path) && !strcmp(candidate->hosts, hosts)) {
+            slot = candidate;
+            break;
+        }
+        if (!candidate->db_path && !slot) {
+            slot = candidate;
+        }
+    }
+    if (slot && !slot->db_path) {
+        slot->db_path = strdup(db_path);
+        slot->hosts = strdup(hosts);
+        slot->loaded = 0;
+    }
+    if (slot && !slot->loading && (now - slot->loaded >= apr_time_from_sec(AMBER_SKIP_REFRESH_INTERVAL))) {
+        slot->loading = 1;
+        load = 1;
+    }
+    if (slot && slot->list) {
+        list = slot->list;
+        list->refs++;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(amber_skip_pool->mutex);
+#endif
+
+    if (load) {
+        /* Read the database without holding the mutex */
+        loaded = amber_skip_load(r, options);
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(amber_skip_pool->mutex);
+#endif
+        if (loaded) {
+            if (slot->list) {
+                amber_skip_unref(slot->list);
+            }
+            slot->list = loaded;
+            if (!list) {
+                list = loaded;
+                list->refs++;
+            }
+        }
+        slot->loaded = now;
+        slot->loading = 0;
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(amber_skip_pool->mutex);
+#endif
+    }
+
+    if (list) {
+        apr_pool_cleanup_register(r->pool, list, amber_skip_release, apr_pool_cleanup_null);
+    } else if (!slot) {
+        amber_debug1("Amber: too many skip lists, not skipping links for %s", db_path);
+    }
+    return list;
+}
+
+/* ======================================================================== */
+/* Shared memory view counts                                                */
+/* ======================================================================== */
+
+/**
+ * Forget the view counts when the configuration pool is cleared (on restart)
+ */
+static apr_status_t amber_activity_destroy(void *data) {
+    amber_activity = NULL;
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the shared memory segment and mutex for view counts. Called from post_config, so the 
+ * segment is inherited by all the children. If this fails, views are written as they happen.
+ * @param pconf the configuration pool, which owns the segment
+ * @param s the main server
+ * @return APR_SUCCESS, or the error that prevented the segment being created
+ */
+static apr_status_t amber_activity_create(apr_pool_t *pconf, server_rec *s) {
+    amber_activity_t *activity;
+    apr_status_t rv;
+
+    amber_activity = NULL;
+    activity = apr_pcalloc(pconf, sizeof(amber_activity_t));
+    if ((rv = apr_shm_create(&activity->shm, sizeof(amber_activity_shm_t), NULL, pconf)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Amber: could not create shared memory for view counts - views will be written as they happen");
+        return rv;
+    }
+    if ((rv = ap_global_mutex_create(&activity->mutex, NULL, AMBER_SHM_MUTEX_TYPE, "activity", s, pconf, 0)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Amber: could not create mutex for view counts - views will be written as they happen");
+        return rv;
+    }
+    activity->data = apr_shm_baseaddr_get(activity->shm);
+    memset(activity->data, 0, sizeof(amber_activity_shm_t));
+    activity->data->last_flush = apr_time_now();
+
+    apr_pool_cleanup_register(pconf, NULL, amber_activity_destroy, apr_pool_cleanup_null);
+    amber_activity = activity;
+    return APR_SUCCESS;
+}
+
+/**
+ * Reattach to the view count mutex in a child process
+ * @param pchild the child pool
+ * @param s the main server
+ */
+static void amber_activity_child_init(apr_pool_t *pchild, server_rec *s) {
+    apr_status_t rv;
+    if (amber_activity) {
+        if ((rv = apr_global_mutex_child_init(&amber_activity->mutex, apr_global_mutex_lockfile(amber_activity->mutex), pchild)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "Amber: could not attach to the view count mutex - views will be written as they happen");
+            amber_activity = NULL;
+        }
+    }
+}
+
+/**
+ * Count a view of a cache item in shared memory
+ * @param r the request
+ * @param db_path the database the view will be written to
+ * @param cache_id the cache item that was viewed
+ * @return 1 if the view was counted, 0 if it must be written to the database now (because there is 
+ *         no room, or shared memory is not available)
+ */
+static int amber_activity_record(request_rec *r, const char *db_path, const char *cache_id) {
+    amber_activity_entry_t *set;
+    amber_activity_entry_t *entry = NULL;
+    uint64_t key;
+    int i;
+
+    if (!amber_activity || !db_path || (strlen(db_path) >= AMBER_MAX_PATH) || (strlen(cache_id) >= AMBER_MAX_CACHE_ID)) {
+        return 0;
+    }
+
+    key = amber_hash(cache_id, amber_hash(db_path, 0));
+    key = key ? key : 1;   /* 0 marks an unused entry */
+    set = amber_activity->data->entries + (key % (AMBER_ACTIVITY_MAX_ENTRIES / AMBER_ACTIVITY_WAYS)) * AMBER_ACTIVITY_WAYS;
+
+    if (apr_global_mutex_lock(amber_activity->mutex) != APR_SUCCESS) {
+        return 0;
+    }
+    for (i = 0; i < AMBER_ACTIVITY_WAYS; i++) {
+        if ((set[i].key == key) && !strcmp(set[i].cache_id, cache_id) && !strcmp(set[i].db_path, db_path)) {
+            entry = &set[i];
+            break;
+        }
+        if (!entry && !set[i].key) {
+            entry = &set[i];
+        }
+    }
+    if (entry) {
+        if (!entry->key) {
+            entry->key = key;
+            apr_cpystrn(entry->db_path, db_path, AMBER_MAX_PATH);
+            apr_cpystrn(entry->cache_id, cache_id, AMBER_MAX_CACHE_ID);
+        }
+        entry->views++;
+        entry->last_view = apr_time_now();
+    }
+    apr_global_mutex_unlock(amber_activity->mutex);
+
+    return entry ? 1 : 0;
+}
+
+/**
+ * Write outstanding view counts to the amber_activity table, one transaction per database. Counts are 
+ * written at most every AMBER_ACTIVITY_FLUSH_INTERVAL seconds, by whichever child gets there first.
+ * @param s the server, for logging
+ * @param force write the counts even if the interval has not passed (when the child is exiting)
+ */
+static void amber_activity_flush(server_rec *s, int force) {
+    amber_activity_entry_t *pending;
+    int pending_count = 0;
+    apr_time_t now = apr_time_now();
+    sqlite3 *sqlite_handle = NULL;
+    sqlite3_stmt *sqlite_statement = NULL;
+    const char *db_path = NULL;
+    int sqlite_rc;
+    int i;
+
+    if (!amber_activity || (!force && (now - amber_activity->data->last_flush < apr_time_from_sec(AMBER_ACTIVITY_FLUSH_INTERVAL)))) {
+        return;
+    }
+    if (!(pending = malloc(AMBER_ACTIVITY_MAX_ENTRIES * sizeof(amber_activity_entry_t)))) {
+        return;
+    }
+
+    /* Take the counts out of shared memory, so that new views can be counted while we write */
+    if (apr_global_mutex_lock(amber_activity->mutex) != APR_SUCCESS) {
+        free(pending);
+        return;
+    }
+    if (force || (now - amber_activity->data->last_flush >= apr_time_from_sec(AMBER_ACTIVITY_FLUSH_INTERVAL))) {
+        amber_activity->data->last_flush = now;
+        for (i = 0; i < AMBER_ACTIVITY_MAX_ENTRIES; i++) {
+            amber_activity_entry_t *entry = &amber_activity->data->entries[i];
+            if (entry->key) {
+                pending[pending_count++] = *entry;
+                memset(entry, 0, sizeof(amber_activity_entry_t));
+            }
+        }
+    }
+    apr_global_mutex_unlock(amber_activity->mutex);
+
+    for (i = 0; i < pending_count; i++) {
+        if (!db_path || strcmp(db_path, pending[i].db_path)) {
+            /* Switch databases, committing anything written so far */
+            if (sqlite_handle) {
+                sqlite3_exec(sqlite_handle, "COMMIT", NULL, NULL, NULL);
+                sqlite3_finalize(sqlite_statement);
+                sqlite3_close(sqlite_handle);
+                sqlite_statement = NULL;
+            }
+            db_path = pending[i].db_path;
+            if (!(sqlite_handle = amber_db_open(s, pending[i].db_path))) {
+                continue;
+            }
+            sqlite3_busy_timeout(sqlite_handle, AMBER_ENQUEUE_BUSY_TIMEOUT);
+            if (sqlite3_prepare_v2(sqlite_handle, AMBER_SQL_LOG_ACTIVITY, -1, &sqlite_statement, NULL) != SQLITE_OK) {
+                ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "AMBER error creating sqlite prepared statement: %s", sqlite3_errmsg(sqlite_handle));
+                sqlite3_close(sqlite_handle);
+                sqlite_handle = NULL;
+                continue;
+            }
+            sqlite3_exec(sqlite_handle, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+        }
+        if (!sqlite_statement) {
+            continue;
+        }
+
+        sqlite3_bind_text(sqlite_statement, 1, pending[i].cache_id, -1, SQLITE_STATIC);
+        sqlite3_bind_int(sqlite_statement, 2, (int) apr_time_sec(pending[i].last_view));
+        sqlite3_bind_int(sqlite_statement, 3, pending[i].views);
+        if ((sqlite_rc = sqlite3_step(sqlite_statement)) != SQLITE_DONE) {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "Amber: error writing sqlite database. Make sure database file and its directory are writable (%d)", sqlite_rc);
+            amber_stats_count_sqlite(sqlite_rc);
+        }
+        sqlite3_reset(sqlite_statement);
+        sqlite3_clear_bindings(sqlite_statement);
+    }
+    if (sqlite_handle) {
+        if ((sqlite_rc = sqlite3_exec(sqlite_handle, "COMMIT", NULL, NULL, NULL)) != SQLITE_OK) {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "Amber: error committing view counts (%d)", sqlite_rc);
+            amber_stats_count_sqlite(sqlite_rc);
+        }
+        sqlite3_finalize(sqlite_statement);
+        sqlite3_close(sqlite_handle);
+    }
+    if (pending_count) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, s, "Amber: wrote view counts for %d cache items", pending_count);
+    }
+    free(pending);
+}
+
+/* ======================================================================== */
+/* Cache of rewritten responses                                             */
+/* ======================================================================== */
+
+/**
+ * Remove the temporary file of a response that was not stored. Registered as a cleanup on the request pool.
+ */
+static apr_status_t amber_output_cache_cleanup(void *data) {
+    amber_output_cache_abandon((amber_context_t *)data);
+    return APR_SUCCESS;
+}
+
+/**
+ * Decide whether the response to this request can come from (or be saved in) the output cache. Only
+ * responses with validators from upstream (so static files) without a query string are cached. Each 
+ * url has one file, which starts with a line containing the key: the url, the validators, the database 
+ * generation, when the configuration was loaded, and which lookup index file there is. If the key 
+ * matches, the rest of the file is the response.
+ * @param f the filter
+ * @param context the filter context, where the outcome is recorded
+ */
+static void amber_output_cache_open(ap_filter_t *f, amber_context_t *context) {
+    amber_server_options_t *server_options = ap_get_module_config(f->r->server->module_config, &amber_module);
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(f->r->per_dir_config, &amber_module); 
+    request_rec *r = f->r;
+    const char *etag, *last_modified, *encoding, *url, *key;
+    char stored_key[AMBER_OUTPUT_CACHE_MAX_KEY];
+    apr_finfo_t finfo;
+    uint64_t generation;
+    amber_db_t *db;
+    int rc;
+
+    context->output_cache_state = AMBER_OUTPUT_CACHE_NONE;
+    if (!server_options->output_cache_dir || (r->method_number != M_GET) || r->header_only || 
+        (r->status != HTTP_OK) || !options->database || (r->args && r->args[0])) {
+        /* The query string may change the page without changing its validators */
+        return;
+    }
+    etag = apr_table_get(r->headers_out, "ETag");
+    last_modified = apr_table_get(r->headers_out, "Last-Modified");
+    encoding = apr_table_get(r->headers_out, "Content-Encoding");
+    if (!etag && !last_modified) {
+        return;
+    }
+
+    if (!(db = amber_db_get_database(r, options->database))) {
+        return;
+    }
+    rc = amber_db_get_generation(r, db, &generation);
+    amber_db_release_database(r, db);
+    if (rc) {
+        return;
+    }
+    if (!context->index_checked) {
+        context->index = options->index ? amber_index_acquire(r, options->index) : NULL;
+        context->index_checked = 1;
+    }
+
+    url = apr_psprintf(r->pool, "%s://%s:%d%s", ap_http_scheme(r), 
+                       r->hostname ? r->hostname : r->server->server_hostname, ap_get_server_port(r), r->uri);
+    key = apr_psprintf(r->pool, "%s\t%s\t%s\t%s\t%s\t%016" APR_UINT64_T_HEX_FMT "\t%" APR_TIME_T_FMT "\t%" APR_UINT64_T_FMT "\t%" APR_TIME_T_FMT "\n", 
+                       url, options->database, etag ? etag : "", last_modified ? last_modified : "", 
+                       encoding ? encoding : (r->content_encoding ? r->content_encoding : ""), generation, amber_config_generation,
+                       context->index ? (apr_uint64_t) context->index->inode : 0, context->index ? context->index->mtime : 0);
+    if (strlen(key) >= AMBER_OUTPUT_CACHE_MAX_KEY) {
+        return;
+    }
+    context->output_cache_path = apr_psprintf(r->pool, "%s/amber-%016" APR_UINT64_T_HEX_FMT, 
+                                               server_options->output_cache_dir, amber_hash(url, amber_hash(options->database, 0)));
+
+    /* Is the stored response for the same key? */
+    if (APR_SUCCESS == apr_file_open(&context->output_cache_file, context->output_cache_path, APR_FOPEN_READ | APR_FOPEN_SENDFILE_ENABLED, 
+                                     APR_OS_DEFAULT, r->pool)) {
+        if ((APR_SUCCESS == apr_file_gets(stored_key, sizeof(stored_key), context->output_cache_file)) && 
+            !strcmp(stored_key, key) && 
+            (APR_SUCCESS == apr_file_info_get(&finfo, APR_FINFO_SIZE, context->output_cache_file))) {
+            context->output_cache_state = AMBER_OUTPUT_CACHE_HIT;
+            amber_stats_count(AMBER_STAT_OUTPUT_CACHE_HITS, 1);
+            context->output_cache_offset = strlen(key);
+            context->output_cache_size = finfo.size - context->output_cache_offset;
+            amber_debug1("Amber: output cache hit: %s", url);
+            return;
+        }
+        apr_file_close(context->output_cache_file);
+        context->output_cache_file = NULL;
+    }
+
+    /* Write the response to a temporary file, which replaces the stored response once it is complete */
+    context->output_cache_temp_path = apr_pstrcat(r->pool, context->output_cache_path, ".XXXXXX", NULL);
+    if (APR_SUCCESS != apr_file_mktemp(&context->output_cache_file, (char *)context->output_cache_temp_path, 
+                                       APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL | APR_FOPEN_BUFFERED, r->pool)) {
+        amber_error1("Amber: could not create output cache file in %s", server_options->output_cache_dir);
+        context->output_cache_file = NULL;
+        return;
+    }
+    if (APR_SUCCESS != apr_file_write_full(context->output_cache_file, key, strlen(key), NULL)) {
+        apr_file_close(context->output_cache_file);
+        apr_file_remove(context->output_cache_temp_path, r->pool);
+        context->output_cache_file = NULL;
+        return;
+    }
+    context->output_cache_size = 0;
+    context->output_cache_state = AMBER_OUTPUT_CACHE_STORE;
+    context->output_cache_generation = generation;
+    if (context->index && (context->index->index.header->generation != generation)) {
+        /* The index was built from an older generation, so this response is looked up without it */
+        amber_debug1("Amber: not using lookup index %s for a response kept in the output cache, since the database has changed", options->index);
+        context->index = NULL;
+    }
+    apr_pool_cleanup_register(r->pool, context, amber_output_cache_cleanup, apr_pool_cleanup_null);
+    amber_debug1("Amber: output cache miss: %s", url);
+}
+
+/**
+ * Send the stored response instead of the one from upstream. The stored response goes out as a 
+ * file bucket (so it can be sent with sendfile), and all the data from upstream is thrown away.
+ * @param f the filter
+ * @param context the filter context
+ * @param bb the brigade from upstream
+ * @return status code
+ */
+static apr_status_t amber_output_cache_deliver(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb) {
+    apr_bucket *bucket, *next_bucket;
+
+    for (bucket = APR_BRIGADE_FIRST(bb); bucket != APR_BRIGADE_SENTINEL(bb); bucket = next_bucket) {
+        next_bucket = APR_BUCKET_NEXT(bucket);
+        if (APR_BUCKET_IS_EOS(bucket)) {
+            f->ctx = NULL;
+        }
+        if (!APR_BUCKET_IS_METADATA(bucket)) {
+            apr_bucket_delete(bucket);
+        }
+    }
+
+    if (context->output_cache_file) {
+        apr_bucket_brigade *stored = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+        apr_brigade_insert_file(stored, context->output_cache_file, context->output_cache_offset, context->output_cache_size, f->r->pool);
+        APR_BRIGADE_PREPEND(bb, stored);
+        ap_set_content_length(f->r, context->output_cache_size);
+        context->output_cache_file = NULL;
+    }
+    return ap_pass_brigade(f->next, bb);
+}
+
+/**
+ * Add the rewritten data about to be sent to the response being stored. The response is stored 
+ * once the brigade containing EOS is seen, and abandoned if it grows too large.
+ * @param f the filter
+ * @param context the filter context
+ * @param bb the brigade about to be passed on
+ */
+static void amber_output_cache_store(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb) {
+    request_rec *r = f->r;
+    amber_server_options_t *server_options;
+    apr_bucket *bucket;
+    const char *data;
+    apr_size_t size;
+
+    if (!context || (AMBER_OUTPUT_CACHE_STORE != context->output_cache_state)) {
+        return;
+    }
+    if (AMBER_BUDGET_TIME == context->budget_spent) {
+        /* Some links weren't looked up in time, so give the next request for the page a chance to do better */
+        amber_debug1("Amber: not storing response with links that weren't looked up in output cache file %s", context->output_cache_path);
+        amber_output_cache_abandon(context);
+        return;
+    }
+    if (context->output_cache_stale) {
+        amber_debug1("Amber: not storing response with links from an older database in output cache file %s", context->output_cache_path);
+        amber_output_cache_abandon(context);
+        return;
+    }
+    server_options = ap_get_module_config(f->r->server->module_config, &amber_module);
+
+    for (bucket = APR_BRIGADE_FIRST(bb); bucket != APR_BRIGADE_SENTINEL(bb); bucket = APR_BUCKET_NEXT(bucket)) {
+        if (APR_BUCKET_IS_EOS(bucket)) {
+            /* The response is complete, so make it available to everyone */
+            apr_status_t rv = apr_file_close(context->output_cache_file);
+            context->output_cache_file = NULL;
+            if ((APR_SUCCESS == rv) && 
+                (APR_SUCCESS == apr_file_rename(context->output_cache_temp_path, context->output_cache_path, f->r->pool))) {
+                amber_debug2("Amber: stored %" APR_OFF_T_FMT " bytes in output cache file %s", context->output_cache_size, context->output_cache_path);
+                context->output_cache_state = AMBER_OUTPUT_CACHE_NONE;
+                apr_atomic_add32(&amber_output_cache_stored, (apr_uint32_t) context->output_cache_size);
+#if APR_HAS_THREADS
+                if (!amber_enqueue_queue)
+#endif
+                {
+                    /* There's no background writer to do it */
+                    amber_output_cache_sweep(f->r->server);
+                }
+            } else {
+                amber_output_cache_abandon(context);
+            }
+            return;
+        }
+        if (APR_BUCKET_IS_METADATA(bucket)) {
+            continue;
+        }
+        if ((APR_SUCCESS != apr_bucket_read(bucket, &data, &size, APR_BLOCK_READ)) || 
+            (context->output_cache_size + size > server_options->output_cache_max) || 
+            (APR_SUCCESS != apr_file_write_full(context->output_cache_file, data, size, NULL))) {
+            amber_debug1("Amber: not storing response in output cache file %s", context->output_cache_path);
+            amber_output_cache_abandon(context);
+            return;
+        }
+        context->output_cache_size += size;
+    }
+}
+
+/**
+ * Stop storing the response, and remove the temporary file
+ * @param context the filter context
+ */
+static void amber_output_cache_abandon(amber_context_t *context) {
+    if (context && (AMBER_OUTPUT_CACHE_STORE == context->output_cache_state)) {
+        if (context->output_cache_file) {
+            apr_file_close(context->output_cache_file);
+            context->output_cache_file = NULL;
+        }
+        apr_file_remove(context->output_cache_temp_path, NULL);
+        context->output_cache_state = AMBER_OUTPUT_CACHE_NONE;
+    }
+}
+
+/**
+ * Get the number of bytes stored by this child after which the output cache directory is swept
+ * @param server_options the server-wide configuration
+ */
+static apr_uint32_t amber_output_cache_sweep_threshold(amber_server_options_t *server_options) {
+    apr_size_t threshold = server_options->output_cache_total / AMBER_OUTPUT_CACHE_SWEEP_PARTS;
+    return (threshold > (1u << 30)) ? (1u << 30) : (apr_uint32_t) threshold;
+}
+
+/**
+ * Sweep the output cache directory when this child starts, in case it's over the limit
+ * @param pchild the child pool
+ * @param s the main server
+ */
+static void amber_output_cache_child_init(apr_pool_t *pchild, server_rec *s) {
+    amber_server_options_t *server_options = ap_get_module_config(s->module_config, &amber_module);
+    apr_atomic_set32(&amber_output_cache_stored, amber_output_cache_sweep_threshold(server_options));
+}
+
+/* A stored response, as seen by amber_output_cache_sweep() */
+typedef struct {
+    const char  *name;
+    apr_time_t  mtime;
+    apr_off_t   size;
+} amber_output_cache_file_t;
+
+static int amber_output_cache_file_compare(const void *a, const void *b) {
+    const amber_output_cache_file_t *file_a = a;
+    const amber_output_cache_file_t *file_b = b;
+    return (file_a->mtime < file_b->mtime) ? -1 : (file_a->mtime > file_b->mtime);
+}
+
+/**
+ * Keep the output cache directory within AmberOutputCache total. Once this child has stored a 
+ * sixteenth of the total since the last sweep, the responses in the directory are added up, and if 
+ * they come to more than the total the oldest are removed until they are under AMBER_OUTPUT_CACHE_SWEEP_LOW 
+ * percent of it. Runs on the background writer thread if there is one, or otherwise after a response is stored.
+ * @param s the main server
+ */
+static void amber_output_cache_sweep(server_rec *s) {
+    amber_server_options_t *server_options = ap_get_module_config(s->module_config, &amber_module);
+    apr_uint32_t stored = apr_atomic_read32(&amber_output_cache_stored);
+    amber_output_cache_file_t *file;
+    apr_array_header_t *files;
+    apr_finfo_t finfo;
+    apr_pool_t *pool;
+    apr_dir_t *dir;
+    apr_off_t total = 0;
+    apr_off_t low;
+    apr_status_t rv;
+    int removed = 0;
+    int i;
+
+    if (!server_options->output_cache_dir || (stored < amber_output_cache_sweep_threshold(server_options)) ||
+        (apr_atomic_cas32(&amber_output_cache_stored, 0, stored) != stored)) {
+        return;
+    }
+    if (apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS) {
+        return;
+    }
+    if ((rv = apr_dir_open(&dir, server_options->output_cache_dir, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Amber: could not read output cache directory %s", server_options->output_cache_dir);
+        apr_pool_destroy(pool);
+        return;
+    }
+    files = apr_array_make(pool, 64, sizeof(amber_output_cache_file_t));
+    while (((rv = apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_SIZE | APR_FINFO_MTIME, dir)) == APR_SUCCESS) || 
+           (rv == APR_INCOMPLETE)) {
+        /* Temporary files have a suffix, and are removed by the request writing them */
+        if ((finfo.filetype != APR_REG) || strncmp(finfo.name, "amber-", 6) || strchr(finfo.name, '.') ||
+            ((finfo.valid & (APR_FINFO_SIZE | APR_FINFO_MTIME)) != (APR_FINFO_SIZE | APR_FINFO_MTIME))) {
+            continue;
+        }
+        file = apr_array_push(files);
+        file->name = apr_pstrdup(pool, finfo.name);
+        file->mtime = finfo.mtime;
+        file->size = finfo.size;
+        total += finfo.size;
+    }
+    apr_dir_close(dir);
+
+    if (total > (apr_off_t) server_options->output_cache_total) {
+        low = (apr_off_t) server_options->output_cache_total / 100 * AMBER_OUTPUT_CACHE_SWEEP_LOW;
+        qsort(files->elts, files->nelts, sizeof(amber_output_cache_file_t), amber_output_cache_file_compare);
+        for (i = 0; (i < files->nelts) && (total > low); i++) {
+            file = &APR_ARRAY_IDX(files, i, amber_output_cache_file_t);
+            if (APR_SUCCESS == apr_file_remove(apr_pstrcat(pool, server_options->output_cache_dir, "/", file->name, NULL), pool)) {
+                removed++;
+            }
+            total -= file->size;
+        }
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, s, "Amber: removed %d responses from output cache directory %s", 
+                     removed, server_options->output_cache_dir);
+    }
+    apr_pool_destroy(pool);
+}
+
+/* ======================================================================== */
+/* Shared memory filter of enqueued urls                                    */
+/* ======================================================================== */
+
+static apr_status_t amber_enqueue_filter_destroy(void *data) {
+    amber_enqueue_filter = NULL;
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the shared memory segment and mutex for the filter of enqueued urls, if it is enabled.
+ * Called from post_config, so the segment is inherited by all the children. If this fails, 
+ * every url that is not found is enqueued.
+ * @param pconf the configuration pool, which owns the segment
+ * @param s the main server
+ * @param server_options server-wide configuration
+ * @return APR_SUCCESS, or the error that prevented the segment being created
+ */
+static apr_status_t amber_enqueue_filter_create(apr_pool_t *pconf, server_rec *s, amber_server_options_t *server_options) {
+    amber_enqueue_filter_t *filter;
+    apr_size_t words;
+    apr_status_t rv;
+
+    amber_enqueue_filter = NULL;
+    if (server_options->enqueue_filter_size <= sizeof(amber_enqueue_filter_shm_t)) {
+        return APR_SUCCESS;
+    }
+
+    filter = apr_pcalloc(pconf, sizeof(amber_enqueue_filter_t));
+    if ((rv = apr_shm_create(&filter->shm, server_options->enqueue_filter_size, NULL, pconf)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Amber: could not create shared memory for the enqueue filter (%" APR_SIZE_T_FMT " bytes)", server_options->enqueue_filter_size);
+        return rv;
+    }
+    if ((rv = ap_global_mutex_create(&filter->mutex, NULL, AMBER_SHM_MUTEX_TYPE, "enqueue-filter", s, pconf, 0)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Amber: could not create mutex for the enqueue filter");
+        return rv;
+    }
+
+    /* Each filter gets half of the bit array */
+    words = (apr_shm_size_get(filter->shm) - APR_OFFSETOF(amber_enqueue_filter_shm_t, bits)) / sizeof(apr_uint32_t) / 2;
+    if (words > 0x7ffffff) {
+        words = 0x7ffffff;  /* Keep the bit count within 32 bits */
+    }
+    filter->data = apr_shm_baseaddr_get(filter->shm);
+    filter->filter_bits = words * 32;
+    filter->period_length = server_options->enqueue_filter_ttl / 2;
+    memset(filter->data, 0, APR_OFFSETOF(amber_enqueue_filter_shm_t, bits) + 2 * words * sizeof(apr_uint32_t));
+
+    apr_pool_cleanup_register(pconf, NULL, amber_enqueue_filter_destroy, apr_pool_cleanup_null);
+    amber_enqueue_filter = filter;
+    ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, 0, s, "Amber: enqueue filter enabled with %u bits", (unsigned int)filter->filter_bits);
+    return APR_SUCCESS;
+}
+
+/**
+ * Reattach to the enqueue filter mutex in a child process
+ * @param pchild the child pool
+ * @param s the main server
+ */
+static void amber_enqueue_filter_child_init(apr_pool_t *pchild, server_rec *s) {
+    apr_status_t rv;
+    if (amber_enqueue_filter) {
+        if ((rv = apr_global_mutex_child_init(&amber_enqueue_filter->mutex, apr_global_mutex_lockfile(amber_enqueue_filter->mutex), pchild)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "Amber: could not attach to the enqueue filter mutex - enqueue filter disabled");
+            amber_enqueue_filter = NULL;
+        }
+    }
+}
+
+/**
+ * Get the bit to set or test in a filter for one of the hashes of a url. The hashes are derived 
+ * from the two halves of a single 64-bit hash (double hashing)
+ */
+static apr_uint32_t amber_enqueue_filter_bit(uint64_t key, int i) {
+    apr_uint32_t h1 = (apr_uint32_t)key;
+    apr_uint32_t h2 = (apr_uint32_t)(key >> 32) | 1;
+    return (h1 + i * h2) % amber_enqueue_filter->filter_bits;
+}
+
+/**
+ * Check whether a url has been enqueued recently. The filter can only give false positives, which 
+ * delay enqueuing a url that has never been seen until the filters are next cleared.
+ * @param db_path the database the url would be enqueued in
+ * @param hash amber_index_hash() of the url
+ * @return 1 if the url has probably been enqueued, 0 if it definitely hasn't
+ */
+static int amber_enqueue_filter_check(const char *db_path, uint64_t hash) {
+    amber_enqueue_filter_shm_t *data;
+    apr_uint32_t period;
+    apr_uint32_t *bits;
+    uint64_t key;
+    int slot, i;
+
+    if (!amber_enqueue_filter || !db_path) {
+        return 0;
+    }
+    data = amber_enqueue_filter->data;
+    period = apr_time_sec(apr_time_now()) / amber_enqueue_filter->period_length;
+    key = amber_hash(db_path, hash);
+
+    /* Bits are only ever set outside the mutex, so we can read them without it. A filter being 
+       cleared at the same time just gives a miss */
+    for (slot = 0; slot < 2; slot++) {
+        apr_uint32_t filter_period = apr_atomic_read32(&data->period[slot]);
+        if ((filter_period != period) && (filter_period + 1 != period)) {
+            continue;
+        }
+        bits = data->bits + slot * (amber_enqueue_filter->filter_bits / 32);
+        for (i = 0; i < AMBER_ENQUEUE_FILTER_HASHES; i++) {
+            apr_uint32_t bit = amber_enqueue_filter_bit(key, i);
+            if (!(apr_atomic_read32(&bits[bit / 32]) & (1u << (bit % 32)))) {
+                break;
+            }
+        }
+        if (i == AMBER_ENQUEUE_FILTER_HASHES) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Remember that a url has been enqueued. The filter for the current period is cleared first if it 
+ * still holds urls from an earlier period.
+ * @param r the request
+ * @param db_path the database the url was enqueued in
+ * @param hash amber_index_hash() of the url
+ */
+static void amber_enqueue_filter_add(request_rec *r, const char *db_path, uint64_t hash) {
+    amber_enqueue_filter_shm_t *data;
+    apr_uint32_t period;
+    apr_uint32_t *bits;
+    apr_uint32_t old;
+    uint64_t key;
+    int slot, i;
+
+    if (!amber_enqueue_filter || !db_path) {
+        return;
+    }
+    data = amber_enqueue_filter->data;
+    period = apr_time_sec(apr_time_now()) / amber_enqueue_filter->period_length;
+    slot = period % 2;
+    bits = data->bits + slot * (amber_enqueue_filter->filter_bits / 32);
+
+    if (apr_atomic_read32(&data->period[slot]) != period) {
+        if (apr_global_mutex_lock(amber_enqueue_filter->mutex) != APR_SUCCESS) {
+            return;
+        }
+        if (apr_atomic_read32(&data->period[slot]) != period) {
+            memset(bits, 0, amber_enqueue_filter->filter_bits / 8);
+            apr_atomic_set32(&data->period[slot], period);
+            amber_debug1("Amber: started enqueue filter for period %u", (unsigned int)period);
+        }
+        apr_global_mutex_unlock(amber_enqueue_filter->mutex);
+    }
+
+    key = amber_hash(db_path, hash);
+    for (i = 0; i < AMBER_ENQUEUE_FILTER_HASHES; i++) {
+        apr_uint32_t bit = amber_enqueue_filter_bit(key, i);
+        do {
+            old = apr_atomic_read32(&bits[bit / 32]);
+        } while ((!(old & (1u << (bit % 32)))) && 
+                 (apr_atomic_cas32(&bits[bit / 32], old | (1u << (bit % 32)), old) != old));
+    }
+}
+
+/* ======================================================================== */
+/* Shared memory statistics                                                 */
+/* ======================================================================== */
+
+/* 64 bit atomics were added in APR 1.7 */
+#if APR_VERSION_AT_LEAST(1,7,0)
+#define amber_stats_add(p, n) apr_atomic_add64((p), (n))
+#define amber_stats_read(p) apr_atomic_read64(p)
+#else
+#define amber_stats_add(p, n) __sync_fetch_and_add((p), (n))
+#define amber_stats_read(p) (*(p))
+#endif
+
+/* Names and descriptions of the counters, in the order of AMBER_STAT_* */
+static const char *amber_stat_names[AMBER_STAT_COUNTERS][2] = {
+    { "responses_filtered",   "HTML responses where Amber is enabled (including those sent from the output cache)" },
+    { "responses_skipped",    "Responses passed on without being searched for links" },
+    { "output_cache_hits",    "Responses sent from the output cache" },
+    { "scanned_bytes",        "Bytes searched for links" },
+    { "links_matched",        "Links found" },
+    { "lookup_hits",          "Urls looked up that have a cache" },
+    { "lookup_misses",        "Urls looked up that have no cache" },
+    { "lookup_errors",        "Urls that could not be looked up" },
+    { "lookup_cache_hits",    "Urls found in the shared lookup cache" },
+    { "enqueues",             "Urls enqueued for caching" },
+    { "enqueues_filtered",    "Urls not enqueued because they were enqueued recently" },
+    { "enqueues_dropped",     "Urls not enqueued because the background queue was full" },
+    { "cache_deliveries",     "Cached pages delivered" },
+    { "sqlite_busy",          "Database operations that failed because the database was busy or locked" },
+    { "lookup_index_hits",    "Urls looked up in the lookup index, instead of the database" },
+    { "links_skipped",        "Links left alone because of AmberSkipHosts or the amber_exclude table" },
+    { "lookup_budget_spent",  "Responses partly passed on without annotations because of AmberLookupBudget" },
+    { "lookup_index_misses",  "Urls not in the lookup index, which were looked up in the database" }
+};
+
+/* Names and descriptions of the latency histograms, in the order of AMBER_HISTOGRAM_* */
+static const char *amber_histogram_names[AMBER_HISTOGRAMS][2] = {
+    { "scan_seconds",         "Time spent searching each response for links" },
+    { "lookup_seconds",       "Time spent looking up the links in each response" },
+    { "rewrite_seconds",      "Time spent rewriting each response, including searching and lookups" }
+};
+
+/* Upper bounds of the histogram buckets, in microseconds */
+static const apr_interval_time_t amber_histogram_bounds[AMBER_HISTOGRAM_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000
+};
+
+/**
+ * Forget the statistics when the configuration pool is cleared (on restart)
+ */
+static apr_status_t amber_stats_destroy(void *data) {
+    amber_stats = NULL;
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the shared memory segment for the statistics. Called from post_config, so the segment is 
+ * inherited by all the children. The counters start again from zero when Apache is restarted.
+ * @param pconf the configuration pool, which owns the segment
+ * @param s the main server
+ * @return APR_SUCCESS, or the error that prevented the segment being created
+ */
+static apr_status_t amber_stats_create(apr_pool_t *pconf, server_rec *s) {
+    amber_stats_t *stats;
+    apr_status_t rv;
+
+    amber_stats = NULL;
+    stats = apr_pcalloc(pconf, sizeof(amber_stats_t));
+    if ((rv = apr_shm_create(&stats->shm, sizeof(amber_stats_shm_t), NULL, pconf)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Amber: could not create shared memory for statistics - amber-status will not be available");
+        return rv;
+    }
+    stats->data = apr_shm_baseaddr_get(stats->shm);
+    memset(stats->data, 0, sizeof(amber_stats_shm_t));
+    stats->data->started = apr_time_now();
+
+    apr_pool_cleanup_register(pconf, NULL, amber_stats_destroy, apr_pool_cleanup_null);
+    amber_stats = stats;
+    return APR_SUCCESS;
+}
+
+/**
+ * Add to one of the counters
+ * @param counter one of AMBER_STAT_*
+ * @param n the amount to add
+ */
+static void amber_stats_count(int counter, apr_uint64_t n) {
+    if (amber_stats && n) {
+        amber_stats_add(&amber_stats->data->counters[counter], n);
+    }
+}
+
+/**
+ * Count a failed database operation if it failed because another connection had the database locked
+ * @param sqlite_rc the sqlite3 status code of the operation
+ */
+static void amber_stats_count_sqlite(int sqlite_rc) {
+    if (((sqlite_rc & 0xff) == SQLITE_BUSY) || ((sqlite_rc & 0xff) == SQLITE_LOCKED)) {
+        amber_stats_count(AMBER_STAT_SQLITE_BUSY, 1);
+    }
+}
+
+/**
+ * Record the time taken for a response in one of the latency histograms
+ * @param histogram one of AMBER_HISTOGRAM_*
+ * @param elapsed the time taken
+ */
+static void amber_stats_time(int histogram, apr_interval_time_t elapsed) {
+    int i;
+
+    if (!amber_stats) {
+        return;
+    }
+    for (i = 0; (i < AMBER_HISTOGRAM_BUCKETS) && (elapsed > amber_histogram_bounds[i]); i++);
+    amber_stats_add(&amber_stats->data->histograms[histogram][i], 1);
+    amber_stats_add(&amber_stats->data->histogram_sums[histogram], (apr_uint64_t) elapsed);
+}
+
+/**
+ * Apache: Report the statistics for all the children, as text or (with ?prometheus) in the 
+ * Prometheus exposition format. Enabled with "SetHandler amber-status"
+ * @param r the request
+ * @return status code
+ */
+static int amber_stats_handler(request_rec *r) {
+    amber_stats_shm_t *data;
+    char started[APR_RFC822_DATE_LEN];
+    apr_uint64_t counts[AMBER_HISTOGRAM_BUCKETS + 1];
+    apr_uint64_t total, sum;
+    int prometheus;
+    int h, i;
+
+    if (!r->handler || strcmp(r->handler, AMBER_STATS_HANDLER)) {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if (!amber_stats) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Amber: statistics are not available");
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    prometheus = r->args && (!strcmp(r->args, "prometheus") || !strcmp(r->args, "format=prometheus"));
+    ap_set_content_type(r, prometheus ? "text/plain; version=0.0.4" : "text/plain; charset=ISO-8859-1");
+    apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+    if (r->header_only) {
+        return OK;
+    }
+
+    data = amber_stats->data;
+    if (!prometheus) {
+        apr_rfc822_date(started, data->started);
+        ap_rprintf(r, "Amber status\n\nCounting since: %s\nUptime: %" APR_TIME_T_FMT " seconds\n\n", 
+                   started, apr_time_sec(apr_time_now() - data->started));
+    }
+
+    for (i = 0; i < AMBER_STAT_COUNTERS; i++) {
+        if (prometheus) {
+            ap_rprintf(r, "# HELP amber_%s_total %s\n# TYPE amber_%s_total counter\namber_%s_total %" APR_UINT64_T_FMT "\n", 
+                       amber_stat_names[i][0], amber_stat_names[i][1], amber_stat_names[i][0], amber_stat_names[i][0], 
+                       amber_stats_read(&data->counters[i]));
+        } else {
+            ap_rprintf(r, "%-20s %12" APR_UINT64_T_FMT "  %s\n", amber_stat_names[i][0], amber_stats_read(&data->counters[i]), amber_stat_names[i][1]);
+        }
+    }
+
+    for (h = 0; h < AMBER_HISTOGRAMS; h++) {
+        total = 0;
+        for (i = 0; i <= AMBER_HISTOGRAM_BUCKETS; i++) {
+            counts[i] = amber_stats_read(&data->histograms[h][i]);
+            total += counts[i];
+        }
+        sum = amber_stats_read(&data->histogram_sums[h]);
+
+        if (prometheus) {
+            /* Prometheus buckets are cumulative */
+            ap_rprintf(r, "# HELP amber_%s %s\n# TYPE amber_%s histogram\n", amber_histogram_names[h][0], amber_histogram_names[h][1], amber_histogram_names[h][0]);
+            for (i = 0, total = 0; i < AMBER_HISTOGRAM_BUCKETS; i++) {
+                total += counts[i];
+                ap_rprintf(r, "amber_%s_bucket{le=\"%g\"} %" APR_UINT64_T_FMT "\n", amber_histogram_names[h][0], amber_histogram_bounds[i] / 1e6, total);
+            }
+            total += counts[AMBER_HISTOGRAM_BUCKETS];
+            ap_rprintf(r, "amber_%s_bucket{le=\"+Inf\"} %" APR_UINT64_T_FMT "\namber_%s_sum %g\namber_%s_count %" APR_UINT64_T_FMT "\n", 
+                       amber_histogram_names[h][0], total, amber_histogram_names[h][0], sum / 1e6, amber_histogram_names[h][0], total);
+        } else {
+            ap_rprintf(r, "\n%s (%s): %" APR_UINT64_T_FMT " responses, average %.6f\n", amber_histogram_names[h][0], amber_histogram_names[h][1], 
+                       total, total ? sum / 1e6 / total : 0.0);
+            for (i = 0; i < AMBER_HISTOGRAM_BUCKETS; i++) {
+                ap_rprintf(r, "  <= %.6f %12" APR_UINT64_T_FMT "\n", amber_histogram_bounds[i] / 1e6, counts[i]);
+            }
+            ap_rprintf(r, "  >  %.6f %12" APR_UINT64_T_FMT "\n", amber_histogram_bounds[AMBER_HISTOGRAM_BUCKETS - 1] / 1e6, counts[AMBER_HISTOGRAM_BUCKETS]);
+        }
+    }
+    return OK;
+}
+
+/* ======================================================================== */
+/* Serving cached items                                                     */
+/* ======================================================================== */
+
+/* Encodings of the precompressed copies of a cache item, kept next to it, in order of preference */
+static const char *amber_cache_encodings[][2] = {
+    { "br",     ".br" },
+    { "gzip",   ".gz" },
+};
+
+/**
+ * Set up the per-child table of cache item metadata
+ * @param pchild the child pool, which owns the table
+ * @param s the server, for logging
+ */
+static void amber_cache_meta_child_init(apr_pool_t *pchild, server_rec *s) {
+    amber_cache_meta_t *meta = apr_pcalloc(pchild, sizeof(amber_cache_meta_t));
+
+    amber_cache_meta = NULL;
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&meta->mutex, APR_THREAD_MUTEX_DEFAULT, pchild) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "Amber: could not create cache item metadata mutex");
+        return;
+    }
+#endif
+    amber_cache_meta = meta;
+}
+
+/**
+ * Get the content type and date of a cache item. They are read from the database the first time, 
+ * and then remembered until the cached file changes.
+ * @param r the request
+ * @param cache_id the cache item
+ * @param finfo size and modification time of the cached file
+ * @param type set to the content type, or an empty string if the item is not in the database
+ *        (AMBER_MAX_CONTENT_TYPE characters)
+ * @param date set to when the item was cached
+ * @return 0 on success
+ */
+static int amber_cache_get_metadata(request_rec *r, const char *cache_id, const apr_finfo_t *finfo, char *type, int *date) {
+    amber_cache_meta_entry_t *entry = NULL;
+    amber_options_t *options = (amber_options_t*) ap_get_module_config(r->per_dir_config, &amber_module); 
+    sqlite3_stmt *sqlite_statement;
+    amber_db_t *db;
+    uint64_t key;
+    int sqlite_rc;
+    int found = 0;
+
+    key = amber_hash(cache_id, amber_hash(options->database ? options->database : "", 0));
+    key = key ? key : 1;   /* 0 marks an unused entry */
+    if (amber_cache_meta) {
+        entry = &amber_cache_meta->entries[key % AMBER_CACHE_META_ENTRIES];
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(amber_cache_meta->mutex);
+#endif
+        if ((entry->key == key) && (entry->mtime == finfo->mtime) && (entry->size == finfo->size)) {
+            apr_cpystrn(type, entry->type, AMBER_MAX_CONTENT_TYPE);
+            *date = entry->date;
+            found = 1;
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(amber_cache_meta->mutex);
+#endif
+        if (found) {
+            return 0;
+        }
+    }
+
+    db = amber_db_get_database(r, options->database);
+    if (!db) {
+        return -1;
+    }
+    sqlite_statement = amber_db_get_content_type_date_query(r, db);
+    if (!sqlite_statement) {
+        amber_db_release_database(r, db);
+        return -1;
+    }
+    if ((sqlite_rc = sqlite3_bind_text(sqlite_statement, 1, cache_id, strlen(cache_id), SQLITE_STATIC)) != SQLITE_OK) {
+        amber_error2("Amber: error binding sqlite parameter: %s (%d)", cache_id, sqlite_rc);
+        amber_db_reset_statement(r, sqlite_statement);
+        amber_db_release_database(r, db);
+        return -1;
+    }
+
+    sqlite_rc = sqlite3_step(sqlite_statement);
+    if (sqlite_rc == SQLITE_DONE) { /* Not in the database, which is remembered too */
+        type[0] = 0;
+        *date = 0;
+    } else if (sqlite_rc == SQLITE_ROW) {
+        const char *mimetype = (const char *)sqlite3_column_text(sqlite_statement, 0);
+        apr_cpystrn(type, mimetype ? mimetype : "", AMBER_MAX_CONTENT_TYPE);
+        *date = sqlite3_column_int(sqlite_statement, 1);
+    } else {
+        amber_error2("Error retrieving cache item content type: %s (%d)", cache_id, sqlite_rc);
+        amber_db_reset_statement(r, sqlite_statement);
+        amber_db_release_database(r, db);
+        return -1;
+    }
+    amber_db_reset_statement(r, sqlite_statement);
+    amber_db_release_database(r, db);
+
+    if (entry) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(amber_cache_meta->mutex);
+#endif
+        entry->key = key;
+        entry->mtime = finfo->mtime;
+        entry->size = finfo->size;
+        entry->date = *date;
+        apr_cpystrn(entry->type, type, AMBER_MAX_CONTENT_TYPE);
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(amber_cache_meta->mutex);
+#endif
+    }
+    return 0;
+}
+
+/**
+ * Check whether the client will accept a content encoding
+ * @param r the request
+ * @param encoding the encoding, e.g. "gzip"
+ * @return 1 if it's listed in Accept-Encoding, without q=0
+ */
+static int amber_accepts_encoding(request_rec *r, const char *encoding) {
+    const char *accept = apr_table_get(r->headers_in, "Accept-Encoding");
+    char *list, *item, *params, *end, *state;
+    const char *q;
+
+    if (!accept) {
+        return 0;
+    }
+    list = apr_pstrdup(r->pool, accept);
+    for (item = apr_strtok(list, ",", &state); item; item = apr_strtok(NULL, ",", &state)) {
+        if ((params = strchr(item, ';'))) {
+            *params++ = 0;
+        }
+        while (apr_isspace(*item)) {
+            item++;
+        }
+        for (end = item + strlen(item); (end > item) && apr_isspace(end[-1]); end--) {
+            *(end - 1) = 0;
+        }
+        if (strcasecmp(item, encoding)) {
+            continue;
+        }
+        q = params ? strstr(params, "q=") : NULL;
+        return !q || (atof(q + 2) > 0);
+    }
+    return 0;
+}
+
+/**
+ * Apache: Serve an item from the cache, with its content type, Memento-Datetime, ETag and Last-Modified 
+ * headers. Conditional requests are answered here, and ranges by the byterange filter. A copy of the item 
+ * compressed with brotli or gzip (<id>.br or <id>.gz) is served instead to clients that accept it. 
+ * Enabled with "SetHandler amber-cache" for urls like /amber/cache/<id>/, where the item is <id>/<id>.
+ * @param r the request
+ * @return status code
+ */
+static int amber_cache_handler(request_rec *r) {
+    amber_options_t *options;
+    apr_bucket_brigade *bb;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_finfo_t body_finfo;
+    apr_status_t rv;
+    char type[AMBER_MAX_CONTENT_TYPE];
+    char memento_time[APR_RFC822_DATE_LEN];
+    const char *encoding = NULL;
+    const char *body_path;
+    char *cache_id;
+    char *path;
+    size_t length;
+    int date = 0;
+    int i, rc;
+
+    if (!r->handler || strcmp(r->handler, AMBER_CACHE_HANDLER)) {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    cache_id = get_cache_item_id(r);
+    if (!cache_id || (strlen(cache_id) >= AMBER_MAX_CACHE_ID) || (strspn(cache_id, "0123456789abcdefABCDEF") != strlen(cache_id))) {
+        return HTTP_NOT_FOUND;
+    }
+
+    /* The url maps to the item's directory, or to the item itself if it has been rewritten */
+    if (r->finfo.filetype == APR_DIR) {
+        path = apr_pstrdup(r->pool, r->filename);
+        length = strlen(path);
+        if (length && (path[length - 1] == '/')) {
+            path[length - 1] = 0;
+        }
+        path = apr_pstrcat(r->pool, path, "/", cache_id, NULL);
+    } else if (r->finfo.filetype == APR_REG) {
+        path = r->filename;
+    } else {
+        return HTTP_NOT_FOUND;
+    }
+    if (((rv = apr_stat(&finfo, path, APR_FINFO_TYPE | APR_FINFO_SIZE | APR_FINFO_MTIME, r->pool)) != APR_SUCCESS) || (finfo.filetype != APR_REG)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, "Amber: cache item not found: %s", path);
+        return HTTP_NOT_FOUND;
+    }
+
+    body_path = path;
+    apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+    for (i = 0; i < sizeof(amber_cache_encodings) / sizeof(amber_cache_encodings[0]); i++) {
+        const char *compressed = apr_pstrcat(r->pool, path, amber_cache_encodings[i][1], NULL);
+        if (amber_accepts_encoding(r, amber_cache_encodings[i][0]) && 
+            (apr_stat(&body_finfo, compressed, APR_FINFO_TYPE, r->pool) == APR_SUCCESS) && (body_finfo.filetype == APR_REG)) {
+            encoding = amber_cache_encodings[i][0];
+            body_path = compressed;
+            break;
+        }
+    }
+
+    if (((rv = apr_file_open(&file, body_path, APR_FOPEN_READ | APR_FOPEN_BINARY | APR_FOPEN_SENDFILE_ENABLED, APR_OS_DEFAULT, r->pool)) != APR_SUCCESS) ||
+        ((rv = apr_file_info_get(&body_finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, file)) != APR_SUCCESS)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, "Amber: could not open cache item: %s", body_path);
+        return HTTP_NOT_FOUND;
+    }
+
+    options = (amber_options_t*) ap_get_module_config(r->per_dir_config, &amber_module); 
+    type[0] = 0;
+    if (options->database && amber_cache_get_metadata(r, cache_id, &finfo, type, &date)) {
+        type[0] = 0;
+        date = 0;
+    }
+    ap_set_content_type(r, type[0] ? apr_pstrdup(r->pool, type) : "text/html");
+    if (date > 0) {
+        apr_rfc822_date(memento_time, apr_time_from_sec(date));
+        apr_table_set(r->headers_out, "Memento-Datetime", memento_time);
+    }
+    if (encoding) {
+        r->content_encoding = encoding;
+    }
+
+    /* Cached files are only ever replaced, never changed in place, so the ETag can be strong */
+    apr_table_setn(r->headers_out, "ETag", apr_psprintf(r->pool, "\"%s-%x-%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "%s%s\"", 
+                   cache_id, date, (apr_uint64_t) body_finfo.size, (apr_uint64_t) body_finfo.mtime, encoding ? "-" : "", encoding ? encoding : ""));
+    ap_update_mtime(r, body_finfo.mtime);
+    ap_set_last_modified(r);
+
+    if ((rc = ap_meets_conditions(r)) != OK) {
+        return rc;
+    }
+    ap_set_content_length(r, body_finfo.size);
+    if (r->header_only) {
+        return OK;
+    }
+
+    /* Only responses that send the item count as views, not those answered with 304 Not Modified */
+    if (options->database) {
+        amber_log_activity(r);
+    }
+    amber_stats_count(AMBER_STAT_CACHE_DELIVERIES, 1);
+
+    /* A file bucket, so that the core can send it with sendfile */
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    apr_brigade_insert_file(bb, file, 0, body_finfo.size, r->pool);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+    if ((rv = ap_pass_brigade(r->output_filters, bb)) != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, "Amber: error sending cache item: %s", body_path);
+        return AP_FILTER_ERROR;
+    }
+    return OK;
+}
+
+/* ======================================================================== */
+/* Compressed responses                                                     */
+/* ======================================================================== */
+
+/**
+ * Find out how a response is compressed
+ * @param r the request
+ * @return one of AMBER_ENCODING_*. Anything other than a single gzip or deflate encoding is unsupported
+ */
+static int amber_get_content_encoding(request_rec *r) {
+    const char *encoding = apr_table_get(r->headers_out, "Content-Encoding");
+    if (!encoding) {
+        encoding = r->content_encoding;
+    }
+    if (!encoding || !*encoding || !strcasecmp(encoding, "identity")) {
+        return AMBER_ENCODING_NONE;
+    } else if (!strcasecmp(encoding, "gzip") || !strcasecmp(encoding, "x-gzip")) {
+        return AMBER_ENCODING_GZIP;
+    } else if (!strcasecmp(encoding, "deflate")) {
+        return AMBER_ENCODING_DEFLATE;
+    }
+    return AMBER_ENCODING_UNSUPPORTED;
+}
+
+/**
+ * Release the zlib streams. Registered as a cleanup on the request pool
+ */
+static apr_status_t amber_gzip_cleanup(void *data) {
+    amber_gzip_t *gzip = data;
+    inflateEnd(&gzip->inflate);
+    deflateEnd(&gzip->deflate);
+    if (gzip->out) {
+        apr_bucket_free(gzip->out);
+        gzip->out = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Set up the zlib streams to rewrite a compressed response. The response is compressed again 
+ * with the same encoding, so the headers are left as they are.
+ * @param f the filter
+ * @param context the filter context, where the state is kept
+ * @param encoding AMBER_ENCODING_GZIP or AMBER_ENCODING_DEFLATE
+ * @return 0 on success, or -1 if the response can't be rewritten
+ */
+static int amber_gzip_start(ap_filter_t *f, amber_context_t *context, int encoding) {
+    request_rec *r = f->r;
+    amber_gzip_t *gzip = apr_pcalloc(f->r->pool, sizeof(amber_gzip_t));
+    int window_bits = (AMBER_ENCODING_GZIP == encoding) ? MAX_WBITS + 16 : MAX_WBITS;
+    int zrc;
+
+    gzip->encoding = encoding;
+    if ((zrc = inflateInit2(&gzip->inflate, window_bits)) != Z_OK) {
+        amber_error1("Amber: could not initialise zlib to inflate the response (%d)", zrc);
+        return -1;
+    }
+    if ((zrc = deflateInit2(&gzip->deflate, AMBER_GZIP_LEVEL, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY)) != Z_OK) {
+        amber_error1("Amber: could not initialise zlib to deflate the response (%d)", zrc);
+        inflateEnd(&gzip->inflate);
+        return -1;
+    }
+    gzip->plain = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+    gzip->raw = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+    apr_pool_cleanup_register(f->r->pool, gzip, amber_gzip_cleanup, apr_pool_cleanup_null);
+    context->gzip = gzip;
+    amber_debug1("Amber: rewriting %s response", (AMBER_ENCODING_GZIP == encoding) ? "gzip" : "deflate");
+    return 0;
+}
+
+/**
+ * Inflate a bucket of compressed content, and rewrite it. The inflated content is added to the plain 
+ * brigade in buckets of up to AMBER_GZIP_BUFFER_SIZE, each of which is rewritten as it is added.
+ * @param f the filter
+ * @param context the filter context
+ * @param buffer the compressed content
+ * @param buffer_size the size of the compressed content
+ */
+static void amber_gzip_inflate(ap_filter_t *f, amber_context_t *context, const char *buffer, size_t buffer_size) {
+    request_rec *r = f->r;
+    amber_gzip_t *gzip = context->gzip;
+    z_stream *z = &gzip->inflate;
+    apr_bucket *bucket;
+    char *chunk;
+    apr_size_t chunk_size;
+    int zrc;
+
+    z->next_in = (Bytef *) buffer;
+    z->avail_in = buffer_size;
+    do {
+        chunk = apr_bucket_alloc(AMBER_GZIP_BUFFER_SIZE, f->c->bucket_alloc);
+        z->next_out = (Bytef *) chunk;
+        z->avail_out = AMBER_GZIP_BUFFER_SIZE;
+        zrc = inflate(z, Z_NO_FLUSH);
+
+        if ((chunk_size = AMBER_GZIP_BUFFER_SIZE - z->avail_out)) {
+            bucket = apr_bucket_heap_create(chunk, chunk_size, apr_bucket_free, f->c->bucket_alloc);
+            APR_BRIGADE_INSERT_TAIL(gzip->plain, bucket);
+            amber_process_bucket(f, context, bucket, chunk, chunk_size);
+        } else {
+            apr_bucket_free(chunk);
+        }
+
+        if (Z_STREAM_END == zrc) {
+            /* A gzip file can have several members, one after the other */
+            inflateReset(z);
+        } else if (Z_BUF_ERROR == zrc) {
+            /* Nothing more can be done until there is more input */
+            break;
+        } else if (Z_OK != zrc) {
+            amber_error2("Amber: could not inflate the response (%d): %s", zrc, z->msg ? z->msg : "");
+            gzip->error = 1;
+            break;
+        }
+    } while (z->avail_in || !z->avail_out);
+}
+
+/**
+ * Give up on a compressed response that can't be inflated (or read). If none of it has been compressed 
+ * again yet, the response is passed on as it came, without any links annotated. Otherwise, part of the 
+ * rewritten response may have been sent already, so it can't be completed: the compressed stream is 
+ * left unfinished and an error bucket is sent, so that the core closes the connection without ending 
+ * the response, and the client can tell it was cut short.
+ * @param f the filter
+ * @param context the filter context
+ * @param bb the rest of the response, starting with the bucket that couldn't be inflated
+ * @param rv the error
+ * @return status of passing the response on, or the error
+ */
+static apr_status_t amber_gzip_abort(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb, apr_status_t rv) {
+    amber_gzip_t *gzip = context->gzip;
+    apr_bucket_brigade *out = context->out;
+    apr_status_t pass_rv;
+
+    amber_output_cache_abandon(context);
+    apr_brigade_cleanup(gzip->plain);
+    ap_remove_output_filter(f);
+    if (!gzip->sent) {
+        /* The output brigade only has metadata buckets, which were in the response before the raw content */
+        APR_BRIGADE_CONCAT(out, gzip->raw);
+        APR_BRIGADE_CONCAT(out, bb);
+        pass_rv = ap_pass_brigade(f->next, out);
+        apr_brigade_cleanup(out);
+        return pass_rv;
+    }
+
+    apr_brigade_cleanup(bb);
+    f->c->keepalive = AP_CONN_CLOSE;
+    APR_BRIGADE_INSERT_TAIL(out, ap_bucket_error_create(HTTP_BAD_GATEWAY, NULL, f->r->pool, f->c->bucket_alloc));
+    APR_BRIGADE_INSERT_TAIL(out, apr_bucket_eos_create(f->c->bucket_alloc));
+    ap_pass_brigade(f->next, out);
+    apr_brigade_cleanup(out);
+    return rv;
+}
+
+/**
+ * Compress some content, adding the output to a brigade in buckets of AMBER_GZIP_BUFFER_SIZE. The last 
+ * partly filled buffer is kept for next time, unless flushing.
+ * @param f the filter
+ * @param gzip the compression state
+ * @param bb the brigade to add the output to
+ * @param buffer the content to compress
+ * @param buffer_size the size of the content
+ * @param flush Z_NO_FLUSH, Z_SYNC_FLUSH to output everything so far, or Z_FINISH to end the stream
+ */
+static void amber_gzip_write(ap_filter_t *f, amber_gzip_t *gzip, apr_bucket_brigade *bb, const char *buffer, apr_size_t buffer_size, int flush) {
+    request_rec *r = f->r;
+    z_stream *z = &gzip->deflate;
+    int full;
+    int zrc;
+
+    z->next_in = (Bytef *) buffer;
+    z->avail_in = buffer_size;
+    do {
+        if (!gzip->out) {
+            gzip->out = apr_bucket_alloc(AMBER_GZIP_BUFFER_SIZE, f->c->bucket_alloc);
+            z->next_out = (Bytef *) gzip->out;
+            z->avail_out = AMBER_GZIP_BUFFER_SIZE;
+        }
+        if ((zrc = deflate(z, flush)) == Z_STREAM_ERROR) {
+            amber_error("Amber: could not deflate the response");
+            return;
+        }
+        if ((full = !z->avail_out)) {
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(gzip->out, AMBER_GZIP_BUFFER_SIZE, apr_bucket_free, f->c->bucket_alloc));
+            gzip->out = NULL;
+            gzip->sent = 1;
+        }
+        /* When flushing, zlib may have more to output for as long as it fills the buffer */
+    } while (z->avail_in || ((Z_FINISH == flush) ? (Z_STREAM_END != zrc) : ((Z_NO_FLUSH != flush) && full)));
+
+    if ((Z_NO_FLUSH != flush) && gzip->out && (z->avail_out < AMBER_GZIP_BUFFER_SIZE)) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(gzip->out, AMBER_GZIP_BUFFER_SIZE - z->avail_out, apr_bucket_free, f->c->bucket_alloc));
+        gzip->out = NULL;
+        gzip->sent = 1;
+    }
+}
+
+/**
+ * Compress the rewritten content in the plain brigade, and add it to the output brigade
+ * @param f the filter
+ * @param context the filter context
+ * @param bb the output brigade
+ * @param flush Z_NO_FLUSH, Z_SYNC_FLUSH to send everything so far (when the response is flushed), or 
+ *              Z_FINISH at the end of the response
+ */
+static void amber_gzip_deflate(ap_filter_t *f, amber_context_t *context, apr_bucket_brigade *bb, int flush) {
+    request_rec *r = f->r;
+    amber_gzip_t *gzip = context->gzip;
+    apr_bucket *bucket;
+    const char *buffer;
+    apr_size_t buffer_size;
+
+    while (!APR_BRIGADE_EMPTY(gzip->plain)) {
+        /* The plain brigade only holds heap, pool and immortal buckets, so this never blocks */
+        bucket = APR_BRIGADE_FIRST(gzip->plain);
+        if (apr_bucket_read(bucket, &buffer, &buffer_size, APR_BLOCK_READ) == APR_SUCCESS) {
+            amber_gzip_write(f, gzip, bb, buffer, buffer_size, Z_NO_FLUSH);
+        } else {
+            amber_error("Amber: could not read rewritten content");
+        }
+        apr_bucket_delete(bucket);
+    }
+    if (Z_NO_FLUSH != flush) {
+        amber_gzip_write(f, gzip, bb, NULL, 0, flush);
+    }
+}
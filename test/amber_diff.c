@@ -0,0 +1,102 @@
+/* ======================================================================== */
+/* Differential test for amber_core                                         */
+/*                                                                          */
+/* Rewrites pages made of random pieces of HTML, whole and in buckets of    */
+/* many sizes, and prints a checksum of each result. It's built once as it  */
+/* is and once without SSE2, and "make check" fails if the two builds (or   */
+/* the SSE2 build with and without AVX2) print anything different. See      */
+/* README.md                                                                */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amber_harness.h"
+
+#define DIFF_PAGES 300
+#define DIFF_PAGE_SIZE (16 * 1024)      /* Size of each generated page, at most */
+
+/* Buckets the pages are delivered in. 0 is the whole page at once */
+static const size_t diff_bucket_sizes[] = { 0, 1, 2, 7, 63, 64, 65, 129, 1000, AMBER_MAX_CARRY + 1 };
+
+/* Pieces the pages are made of: everything the tokenizer and the searches for "<", "</" and "href"
+   treat specially, so that they land on every alignment and split between buckets everywhere */
+static const char *diff_pieces[] = {
+    "<a href=\"http://example.com/a\">", "<A HREF='http://example.com/b'>", "<area href=http://example.com/c>",
+    "<link rel=x href=\"http://example.com/d\">", "<a title=\"x>y\" href=\"http://example.com/e\">",
+    "<a\nhref=\"http://example.com/f\">", "<a data-href=\"http://example.com/g\">", "href=\"http://example.com/h\"",
+    "<script>", "</script>", "</script ", "</scr", "<style>", "</style>", "<textarea>", "</textarea>",
+    "<title>", "</title>", "<!--", "-->", "--", "<!doctype html>", "<?xml?>", "<!", "</", "<", ">", "/>",
+    "'", "\"", "=", " ", "\n", "\t", "a", "b", "<p>", "</p>", "<div class=\"x\">", "http", "href", "href=",
+    "<a ", "<a", "<aa href=\"http://example.com/i\">", "<abbr href=\"http://example.com/j\">", "\xc3\xa9", "\0"
+};
+
+/* Mark every link found with its url, so that the checksum covers where each link was found and what
+   was taken as its url */
+static const char *diff_attribute(void *baton, int index, const char *url)
+{
+    static char attribute[AMBER_MAX_CARRY + 32];
+
+    snprintf(attribute, sizeof(attribute), "[%s]", url);
+    return attribute;
+}
+
+/* Generate a page of random pieces, with runs of text between some of them to shift the rest */
+static size_t diff_generate_page(char *page, unsigned int seed)
+{
+    const size_t piece_count = sizeof(diff_pieces) / sizeof(diff_pieces[0]);
+    size_t size = 0;
+
+    while (size < DIFF_PAGE_SIZE - 256) {
+        int choice = rand_r(&seed) % (piece_count + 4);
+        if (choice < (int) piece_count) {
+            size_t piece_size = diff_pieces[choice][0] ? strlen(diff_pieces[choice]) : 1;
+            memcpy(page + size, diff_pieces[choice], piece_size);
+            size += piece_size;
+        } else {
+            size_t run = rand_r(&seed) % 200;
+            memset(page + size, 'x', run);
+            size += run;
+        }
+    }
+    return size;
+}
+
+/* Checksum of what a page was rewritten as */
+static uint64_t diff_checksum(const char *data, size_t size)
+{
+    uint64_t sum = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        sum = (sum ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+/* Print the checksum of every page rewritten in every bucket size. With "noavx2", AVX2 isn't used
+   even if the CPU has it */
+int main(int argc, char **argv)
+{
+    const size_t bucket_count = sizeof(diff_bucket_sizes) / sizeof(diff_bucket_sizes[0]);
+    harness_rewrite_t *rewrite = calloc(1, sizeof(harness_rewrite_t));
+    char *page = malloc(DIFF_PAGE_SIZE);
+    size_t size;
+    size_t b;
+    int i;
+
+    rewrite->attribute = diff_attribute;
+    rewrite->no_avx2 = (argc > 1) && !strcmp(argv[1], "noavx2");
+    for (i = 0; i < DIFF_PAGES; i++) {
+        size = diff_generate_page(page, i + 1);
+        for (b = 0; b < bucket_count; b++) {
+            harness_rewrite_page(rewrite, page, size, diff_bucket_sizes[b] ? diff_bucket_sizes[b] : size);
+            printf("%d %lu %lu %016llx\n", i, (unsigned long) diff_bucket_sizes[b], (unsigned long) rewrite->out_size,
+                   (unsigned long long) diff_checksum(rewrite->out, rewrite->out_size));
+        }
+    }
+    harness_rewrite_free(rewrite);
+    free(rewrite);
+    free(page);
+    return 0;
+}
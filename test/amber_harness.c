@@ -0,0 +1,194 @@
+/* ======================================================================== */
+/* Rewriting pages as the Apache module does, for the tests and benchmarks  */
+/* See amber_harness.h                                                      */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "amber_harness.h"
+
+/* Allocate from an arena (an amber_alloc_fn, whose baton is the harness_arena_t) */
+void *harness_alloc(void *baton, size_t size)
+{
+    harness_arena_t *arena = baton;
+    harness_block_t *block = arena->blocks;
+
+    size = (size + 7) & ~(size_t)7;
+    if (!block || (block->used + size > block->size)) {
+        size_t block_size = (size > HARNESS_ARENA_BLOCK) ? size : HARNESS_ARENA_BLOCK;
+        if (!(block = malloc(sizeof(harness_block_t) + block_size))) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = block_size;
+        arena->blocks = block;
+    }
+    arena->allocations++;
+    arena->bytes += size;
+    block->used += size;
+    return block->data + block->used - size;
+}
+
+void harness_arena_clear(harness_arena_t *arena)
+{
+    while (arena->blocks) {
+        harness_block_t *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->bytes = 0;
+}
+
+/* Collect the rewritten output (an amber_emit_fn, whose baton is the harness_rewrite_t) */
+int harness_emit(void *baton, const char *data, size_t size, int inserted)
+{
+    harness_rewrite_t *rewrite = baton;
+
+    if (rewrite->out_size + size > rewrite->out_allocated) {
+        rewrite->out_allocated = (rewrite->out_size + size) * 2;
+        rewrite->out = realloc(rewrite->out, rewrite->out_allocated);
+    }
+    memcpy(rewrite->out + rewrite->out_size, data, size);
+    rewrite->out_size += size;
+    return 0;
+}
+
+/* Clear the scratch arena once a bucket has been rewritten, noting how much it used */
+static void harness_scratch_clear(harness_rewrite_t *rewrite)
+{
+    if (rewrite->scratch.bytes > rewrite->scratch_peak) {
+        rewrite->scratch_peak = rewrite->scratch.bytes;
+    }
+    harness_arena_clear(&rewrite->scratch);
+}
+
+/* Rewrite a page delivered in buckets of a given size into rewrite->out, carrying a link split
+   between buckets over to the next one with amber_scan_join() and amber_scan_hold(), as the Apache
+   module does. What was allocated for the last page is freed first */
+void harness_rewrite_page(harness_rewrite_t *rewrite, const char *data, size_t size, size_t bucket_size)
+{
+    amber_matches_t links;
+    amber_junction_t junction;
+    const char *carry;
+    size_t carry_size;
+    size_t offset;
+
+    harness_arena_clear(&rewrite->arena);
+    rewrite->out_size = 0;
+    amber_scan_init(&rewrite->scan, harness_alloc, &rewrite->scratch);
+    rewrite->scan.avx2 = rewrite->scan.avx2 && !rewrite->no_avx2;
+    for (offset = 0; offset < size; offset += bucket_size) {
+        const char *buffer = data + offset;
+        size_t buffer_size = (size - offset < bucket_size) ? size - offset : bucket_size;
+        size_t scan_start = amber_scan_join(&rewrite->scan, buffer, buffer_size, &junction);
+        size_t keep_size;
+
+        if (junction.size) {
+            if (rewrite->lookup) {
+                rewrite->lookup(rewrite, junction.links.url, junction.links.count);
+            }
+            amber_splice(junction.data, junction.size, &junction.links, rewrite->attribute, harness_emit, rewrite);
+        }
+        if (scan_start <= buffer_size) {
+            amber_find_links(&rewrite->scan, buffer, buffer_size, scan_start, &links);
+            keep_size = amber_scan_hold(&rewrite->scan, buffer, buffer_size, &links);
+            if (rewrite->lookup) {
+                rewrite->lookup(rewrite, links.url, links.count);
+            }
+            amber_splice(buffer, keep_size, &links, rewrite->attribute, harness_emit, rewrite);
+        }
+        harness_scratch_clear(rewrite);
+    }
+    if ((carry_size = amber_scan_flush(&rewrite->scan, &carry))) {
+        harness_emit(rewrite, carry, carry_size, 0);
+    }
+}
+
+void harness_rewrite_free(harness_rewrite_t *rewrite)
+{
+    harness_arena_clear(&rewrite->arena);
+    harness_arena_clear(&rewrite->scratch);
+    free(rewrite->out);
+    rewrite->out = NULL;
+    rewrite->out_size = rewrite->out_allocated = 0;
+}
+
+/* Prepare the query the module looks urls up with (see amber_lookup_query()), for a database with
+   a url_hash column */
+int harness_prepare_lookup(sqlite3 *db, sqlite3_stmt **statement)
+{
+    harness_arena_t arena = { NULL, 0, 0 };
+    int rc = sqlite3_prepare_v2(db, amber_lookup_query(harness_alloc, &arena, 1), -1, statement, NULL);
+
+    harness_arena_clear(&arena);
+    return rc;
+}
+
+/* Look up to AMBER_LOOKUP_BATCH_SIZE urls as the module does: by the hash of each one's canonical
+   form, or by the url as written for rows without a hash, keeping the first row whose url has the
+   same canonical form. The canonical forms and locations are allocated from the arena
+
+    returns SQLITE_OK, or the error from sqlite
+*/
+int harness_lookup(sqlite3_stmt *statement, harness_arena_t *arena, harness_lookup_t *lookups, int count)
+{
+    int rc;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        lookups[i].canonical = amber_canonical_url(harness_alloc, arena, lookups[i].url);
+        lookups[i].location = NULL;
+        sqlite3_bind_int64(statement, i + 1, (sqlite3_int64) amber_index_hash(lookups[i].canonical));
+        sqlite3_bind_text(statement, AMBER_LOOKUP_BATCH_SIZE + i + 1, lookups[i].url, -1, SQLITE_STATIC);
+    }
+    while (SQLITE_ROW == (rc = sqlite3_step(statement))) {
+        const char *url = (const char *) sqlite3_column_text(statement, 0);
+        const char *location = (const char *) sqlite3_column_text(statement, 1);
+        const char *canonical;
+        if (!url) {
+            continue;
+        }
+        canonical = amber_canonical_url(harness_alloc, arena, url);
+        for (i = 0; i < count; i++) {
+            if (lookups[i].location || strcmp(lookups[i].canonical, canonical)) {
+                continue;
+            }
+            lookups[i].location = strcpy(harness_alloc(arena, strlen(location ? location : "") + 1), location ? location : "");
+            lookups[i].date = sqlite3_column_int(statement, 2);
+            lookups[i].status = sqlite3_column_int(statement, 3);
+        }
+    }
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+/* Run a function in count threads at once, each passed its own element of an array whose elements
+   are size bytes, and wait for them all to finish
+
+    returns the number of threads that could not be started
+*/
+int harness_run_threads(void *(*run)(void *), void *threads, size_t size, int count)
+{
+    pthread_t *ids = calloc(count, sizeof(pthread_t));
+    char *started = calloc(count, 1);
+    int failed = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        started[i] = !pthread_create(&ids[i], NULL, run, (char *) threads + i * size);
+        failed += !started[i];
+    }
+    for (i = 0; i < count; i++) {
+        if (started[i]) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+    free(ids);
+    free(started);
+    return failed;
+}
@@ -0,0 +1,68 @@
+/* ======================================================================== */
+/* Rewriting pages as the Apache module does, for the tests and benchmarks  */
+/*                                                                          */
+/* Arenas that stand in for the module's pools, collecting the output,      */
+/* rewriting a page delivered in buckets, looking urls up with the          */
+/* module's query, and running threads. Used by test/ and bench/            */
+/* ======================================================================== */
+
+#ifndef AMBER_HARNESS_H
+#define AMBER_HARNESS_H
+
+#include <stddef.h>
+#include <sqlite3.h>
+#include "amber_core.h"
+
+#define HARNESS_ARENA_BLOCK (64 * 1024)
+
+/* Allocations are made from an arena that is cleared for each page, like a request pool, or for each
+   bucket, like the module's scratch pool */
+typedef struct harness_block_s {
+    struct harness_block_s *next;
+    size_t  used;
+    size_t  size;
+    char    data[1];
+} harness_block_t;
+
+typedef struct {
+    harness_block_t *blocks;
+    unsigned long   allocations;
+    size_t          bytes;          /* Allocated since the arena was last cleared */
+} harness_arena_t;
+
+/* State for rewriting pages, passed to the attribute and lookup functions */
+typedef struct harness_rewrite_s {
+    amber_scan_t        scan;
+    harness_arena_t     arena;          /* Cleared before each page */
+    harness_arena_t     scratch;        /* Cleared after each bucket */
+    size_t              scratch_peak;   /* Most scratch memory used by one bucket */
+    amber_attribute_fn  attribute;      /* The attributes for each link, passed this structure */
+    void                (*lookup)(struct harness_rewrite_s *rewrite, char **urls, int count);
+                                        /* Called with the links found in each piece of a page before
+                                           they are spliced, to look them up together (or NULL) */
+    int                 no_avx2;        /* Don't use AVX2, even if the CPU has it */
+    void                *data;          /* For the caller */
+    char                *out;           /* Rewritten output */
+    size_t              out_size;
+    size_t              out_allocated;
+} harness_rewrite_t;
+
+/* A url looked up in the database */
+typedef struct {
+    const char  *url;           /* As written in the page */
+    const char  *canonical;     /* Filled in by harness_lookup() */
+    const char  *location;      /* NULL if the url has no cache */
+    int         date;
+    int         status;
+} harness_lookup_t;
+
+void *harness_alloc(void *baton, size_t size);
+void harness_arena_clear(harness_arena_t *arena);
+int harness_emit(void *baton, const char *data, size_t size, int inserted);
+void harness_rewrite_page(harness_rewrite_t *rewrite, const char *data, size_t size, size_t bucket_size);
+void harness_rewrite_free(harness_rewrite_t *rewrite);
+int harness_prepare_lookup(sqlite3 *db, sqlite3_stmt **statement);
+int harness_lookup(sqlite3_stmt *statement, harness_arena_t *arena, harness_lookup_t *lookups, int count);
+int harness_run_threads(void *(*run)(void *), void *threads, size_t size, int count);
+
+#endif
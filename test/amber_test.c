@@ -0,0 +1,335 @@
+/* ======================================================================== */
+/* Tests for amber_core                                                     */
+/*                                                                          */
+/* Rewrites generated pages in the same way as the filter (finding links,   */
+/* carrying them across buckets, looking their canonical forms up in a      */
+/* database with the module's query and in a lookup index, and splicing in  */
+/* attributes), in many threads at once and with buckets of many sizes.     */
+/* Every page is checked against what it should come out as, and the exit   */
+/* status is 1 if any of them differ. See README.md                         */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "amber_harness.h"
+
+#define TEST_URLS 600                   /* A third are cached, a third checked but not cached, a third unknown */
+#define TEST_PAGES 6
+#define TEST_PAGE_SIZE (48 * 1024)      /* Size of each generated page */
+#define TEST_THREADS 16
+
+/* Buckets the pages are delivered in. 0 is the whole page at once */
+static const size_t test_bucket_sizes[] = { 0, 1, 3, 17, 64, 500, AMBER_MAX_CARRY - 1, AMBER_MAX_CARRY,
+                                            AMBER_MAX_CARRY + 1, 8000 };
+
+/* A generated page, and what it should be rewritten as */
+typedef struct {
+    char    *data;
+    size_t  size;
+    char    *expected;
+    size_t  expected_size;
+} test_page_t;
+
+/* What the tests share: the pages, and the urls with the caches they should be given */
+typedef struct {
+    test_page_t         pages[TEST_PAGES];
+    char                *urls[TEST_URLS];           /* As they are in the database */
+    char                *written[TEST_URLS];        /* As they are written in the pages */
+    const char          *attributes[TEST_URLS]; /* Attributes each url should be given, or NULL */
+    amber_index_t       index;
+    char                db_path[32];
+    const char          *behavior[2];
+} test_corpus_t;
+
+/* State for one thread rewriting the pages */
+typedef struct {
+    int                 index;
+    const test_corpus_t *corpus;
+    sqlite3             *db;            /* This thread's own connection, as the module keeps */
+    sqlite3_stmt        *lookup;
+    harness_rewrite_t   rewrite;
+    unsigned long       pages;          /* Pages rewritten */
+    unsigned long       failures;       /* Pages that weren't rewritten as expected, and lookups that disagree */
+} test_thread_t;
+
+/* Append to a page and to what it should be rewritten as */
+static void test_append(test_page_t *page, const char *data, const char *expected)
+{
+    size_t size = strlen(data);
+    size_t expected_size = strlen(expected);
+
+    memcpy(page->data + page->size, data, size + 1);
+    page->size += size;
+    memcpy(page->expected + page->expected_size, expected, expected_size + 1);
+    page->expected_size += expected_size;
+}
+
+/* Generate a page of links that should be rewritten, between ones that shouldn't (in scripts, styles,
+   comments, other attributes and text), with the attributes for them added where they should be */
+static void test_generate_page(test_corpus_t *corpus, test_page_t *page, unsigned int seed)
+{
+    static const char *links[] = {
+        "<a href=\"%s\">", "<A HREF='%s' class=\"x\">", "<area shape=rect href=\"%s\">",
+        "<link rel=\"stylesheet\" href=\"%s\">", "<a title=\"a > b\" href=\"%s\">", "<a\nhref=\"%s\">",
+        "<a class=x href='%s' title=\"<b>\">"
+    };
+    static const char *others[] = {
+        "<script>document.write('<a href=\"%s\">');</script>", "<!-- <a href=\"%s\"> -->",
+        "<style>a[href=\"%s\"] { color: red }</style>", "<textarea><a href=\"%s\"></textarea>",
+        "<div data-href=\"%s\">", "<img src=\"%s\">", "<a data-x='href=\"%s\"'>", "<p>href=\"%s\"</p>",
+        "<script type=\"application/ld+json\">{\"html\": \"<a href='%s'>\"}</script>", "<title>href=\"%s\"</title>"
+    };
+    char data[1024], expected[1024];
+
+    page->data = malloc(TEST_PAGE_SIZE + sizeof(data));
+    page->expected = malloc((TEST_PAGE_SIZE + sizeof(data)) * 5);   /* Attributes are longer than the links they are added to */
+    page->size = page->expected_size = 0;
+    while (page->size < TEST_PAGE_SIZE) {
+        int url = rand_r(&seed) % TEST_URLS;
+        int choice = rand_r(&seed) % 3;
+        if (choice == 0) {
+            const char *href;
+            snprintf(data, sizeof(data), links[rand_r(&seed) % (sizeof(links) / sizeof(links[0]))], corpus->written[url]);
+            href = strstr(data, "href") ? strstr(data, "href") : strstr(data, "HREF");
+            snprintf(expected, sizeof(expected), "%.*s%s%s", (int)(href - data), data,
+                     corpus->attributes[url] ? corpus->attributes[url] : "", href);
+            test_append(page, data, expected);
+        } else if (choice == 1) {
+            snprintf(data, sizeof(data), others[rand_r(&seed) % (sizeof(others) / sizeof(others[0]))], corpus->written[url]);
+            test_append(page, data, data);
+        } else {
+            test_append(page, "<p>Lorem ipsum dolor sit amet, <a href=\"/local\">consectetur</a> adipiscing elit.</p>\n",
+                              "<p>Lorem ipsum dolor sit amet, <a href=\"/local\">consectetur</a> adipiscing elit.</p>\n");
+        }
+    }
+}
+
+/* Create the database file the threads share, and the lookup index built from it, and work out the
+   attributes each url should be given. Most urls have a url_hash, and some of those are written in 
+   the pages in another form with the same canonical form (which is how the index has them). The 
+   rest have no url_hash yet, like rows the module hasn't filled in, and are found as written */
+static int test_create_corpus(test_corpus_t *corpus, harness_arena_t *arena)
+{
+    amber_index_entry_t entries[TEST_URLS];
+    char date_string[AMBER_MAX_DATE_STRING];
+    sqlite3 *db = NULL;
+    sqlite3_stmt *cache = NULL, *check = NULL;
+    size_t size;
+    void *data;
+    int count = 0;
+    int fd;
+    int i;
+
+    strcpy(corpus->db_path, "/tmp/amber_test_XXXXXX");
+    if (((fd = mkstemp(corpus->db_path)) < 0) || (sqlite3_open(corpus->db_path, &db) != SQLITE_OK)) {
+        printf("could not create a database file\n");
+        return 1;
+    }
+    close(fd);
+    sqlite3_exec(db,
+        "CREATE TABLE amber_cache (id TEXT PRIMARY KEY, url TEXT, location TEXT, date INTEGER, type TEXT, size INTEGER);"
+        "CREATE INDEX url_index ON amber_cache (url);"
+        "CREATE TABLE amber_check (id TEXT PRIMARY KEY, url TEXT, status INTEGER, last_checked INTEGER, next_check INTEGER, message TEXT, url_hash INTEGER);"
+        "CREATE INDEX amber_check_url_hash ON amber_check (url_hash);"
+        "BEGIN", NULL, NULL, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO amber_cache (id, url, location, date, type) VALUES (?1, ?2, ?3, ?4, 'text/html')", -1, &cache, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO amber_check (id, url, status, last_checked, url_hash) VALUES (?1, ?2, ?3, 1400000000, ?4)", -1, &check, NULL);
+
+    for (i = 0; i < TEST_URLS; i++) {
+        char id[40];
+        char *location;
+        int date = 1400000000 + (i % 50) * 86400;
+        int status = (i % 5) ? AMBER_STATUS_UP : AMBER_STATUS_DOWN;
+        int hashed = (i % 7 != 0);
+
+        corpus->urls[i] = harness_alloc(arena, 64);
+        sprintf(corpus->urls[i], (i % 2) ? "http://example%d.com/page/%d" : "HTTPS://www.example%d.org/%d?q=1", i % 37, i);
+        corpus->written[i] = corpus->urls[i];
+        if (hashed && (i % 4 < 2)) {
+            corpus->written[i] = harness_alloc(arena, 64);
+            sprintf(corpus->written[i], (i % 2) ? "http://EXAMPLE%d.com:80/page/%d" : "https://www.example%d.org/%d?q=1#top", i % 37, i);
+        }
+        corpus->attributes[i] = NULL;
+        if (i % 3 == 2) {
+            continue;
+        }
+        sprintf(id, "%032llx", (unsigned long long)amber_hash(corpus->urls[i], 0));
+        location = harness_alloc(arena, 64);
+        sprintf(location, (i % 3 == 0) ? "amber/cache/%s/" : "", id);
+        if (i % 3 == 0) {
+            sqlite3_bind_text(cache, 1, id, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(cache, 2, corpus->urls[i], -1, SQLITE_STATIC);
+            sqlite3_bind_text(cache, 3, location, -1, SQLITE_STATIC);
+            sqlite3_bind_int(cache, 4, date);
+            sqlite3_step(cache);
+            sqlite3_reset(cache);
+            amber_format_date(date, date_string);
+            corpus->attributes[i] = amber_format_attribute(harness_alloc, arena, "http://localhost/", location,
+                                                           date_string, corpus->behavior[status]);
+        }
+        sqlite3_bind_text(check, 1, id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(check, 2, corpus->urls[i], -1, SQLITE_STATIC);
+        sqlite3_bind_int(check, 3, status);
+        if (hashed) {
+            sqlite3_bind_int64(check, 4, (sqlite3_int64) amber_index_hash(amber_canonical_url(harness_alloc, arena, corpus->urls[i])));
+        } else {
+            sqlite3_bind_null(check, 4);
+        }
+        sqlite3_step(check);
+        sqlite3_reset(check);
+
+        entries[count].url = amber_canonical_url(harness_alloc, arena, corpus->urls[i]);
+        entries[count].location = location;
+        entries[count].date = date;
+        entries[count].status = status;
+        count++;
+    }
+    sqlite3_finalize(cache);
+    sqlite3_finalize(check);
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_close(db);
+
+    if (!(size = amber_index_size(entries, count)) || !(data = harness_alloc(arena, size)) ||
+        !(size = amber_index_build(entries, count, 0, data)) || amber_index_open(&corpus->index, data, size)) {
+        printf("could not build a lookup index\n");
+        return 1;
+    }
+    for (i = 0; i < TEST_PAGES; i++) {
+        test_generate_page(corpus, &corpus->pages[i], i + 1);
+    }
+    return 0;
+}
+
+/* Look a url up by its canonical form in the lookup index and in the database, which must agree, and
+   build its attributes as the module does */
+static const char *test_attribute(void *baton, int index, const char *url)
+{
+    harness_rewrite_t *rewrite = baton;
+    test_thread_t *thread = rewrite->data;
+    harness_lookup_t lookup;
+    const char *location = NULL;
+    char date_string[AMBER_MAX_DATE_STRING];
+    int date = 0, status = 0;
+    int found;
+
+    lookup.url = url;
+    if (harness_lookup(thread->lookup, &rewrite->arena, &lookup, 1) != SQLITE_OK) {
+        printf("  thread %d: could not look up %s in the database\n", thread->index, url);
+        thread->failures++;
+    }
+    found = (amber_index_lookup(&thread->corpus->index, lookup.canonical, &location, &date, &status) == AMBER_CACHE_ATTRIBUTES_FOUND);
+    if ((found != (lookup.location != NULL)) ||
+        (found && (strcmp(location, lookup.location) || (date != lookup.date) || (status != lookup.status)))) {
+        printf("  thread %d: the lookup index and the database disagree about %s\n", thread->index, url);
+        thread->failures++;
+    }
+
+    if (!found) {
+        return NULL;
+    }
+    amber_format_date(date, date_string);
+    return amber_format_attribute(harness_alloc, &rewrite->arena, "http://localhost/", location, date_string,
+                                  thread->corpus->behavior[status]);
+}
+
+/* Rewrite every page in every bucket size, starting from a different one in each thread, with a
+   database connection of this thread's own */
+static void *test_thread_run(void *data)
+{
+    test_thread_t *thread = data;
+    const size_t bucket_count = sizeof(test_bucket_sizes) / sizeof(test_bucket_sizes[0]);
+    size_t b;
+    int i;
+
+    if ((sqlite3_open_v2(thread->corpus->db_path, &thread->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) ||
+        (harness_prepare_lookup(thread->db, &thread->lookup) != SQLITE_OK)) {
+        printf("  thread %d: could not open the database\n", thread->index);
+        thread->failures++;
+        sqlite3_close(thread->db);
+        return NULL;
+    }
+    thread->rewrite.attribute = test_attribute;
+    thread->rewrite.data = thread;
+    for (b = 0; b < bucket_count; b++) {
+        size_t bucket_size = test_bucket_sizes[(b + thread->index) % bucket_count];
+        for (i = 0; i < TEST_PAGES; i++) {
+            const test_page_t *page = &thread->corpus->pages[i];
+            harness_rewrite_t *rewrite = &thread->rewrite;
+            harness_rewrite_page(rewrite, page->data, page->size, bucket_size ? bucket_size : page->size);
+            thread->pages++;
+            if ((rewrite->out_size != page->expected_size) || memcmp(rewrite->out, page->expected, page->expected_size)) {
+                size_t at = 0;
+                while ((at < rewrite->out_size) && (at < page->expected_size) && (rewrite->out[at] == page->expected[at])) {
+                    at++;
+                }
+                printf("  thread %d: page %d in %lu byte buckets differs at byte %lu (%lu bytes, expected %lu)\n",
+                       thread->index, i, (unsigned long)(bucket_size ? bucket_size : page->size), (unsigned long)at,
+                       (unsigned long)rewrite->out_size, (unsigned long)page->expected_size);
+                thread->failures++;
+            }
+        }
+    }
+    sqlite3_finalize(thread->lookup);
+    sqlite3_close(thread->db);
+    harness_rewrite_free(&thread->rewrite);
+    return NULL;
+}
+
+/* Rewrite the pages in a number of threads at once, and count the failures */
+static unsigned long test_threads(const test_corpus_t *corpus, int thread_count)
+{
+    test_thread_t *threads = calloc(thread_count, sizeof(test_thread_t));
+    unsigned long pages = 0, failures = 0;
+    int i;
+
+    for (i = 0; i < thread_count; i++) {
+        threads[i].index = i;
+        threads[i].corpus = corpus;
+    }
+    if ((failures = harness_run_threads(test_thread_run, threads, sizeof(test_thread_t), thread_count))) {
+        printf("  could not start %lu threads\n", failures);
+    }
+    for (i = 0; i < thread_count; i++) {
+        pages += threads[i].pages;
+        failures += threads[i].failures;
+    }
+    printf("%2d threads: %lu pages rewritten, %lu failures\n", thread_count, pages, failures);
+    free(threads);
+    return failures;
+}
+
+int main(void)
+{
+    amber_options_t options = { 1, NULL, AMBER_ACTION_HOVER, AMBER_ACTION_POPUP, 2, 0, NULL, -1, -1, -1, -1, 0, { NULL, NULL } };
+    unsigned char behavior_up[AMBER_MAX_BEHAVIOR_STRING] = "", behavior_down[AMBER_MAX_BEHAVIOR_STRING] = "";
+    test_corpus_t *corpus = calloc(1, sizeof(test_corpus_t));
+    harness_arena_t arena = { NULL, 0, 0 };
+    unsigned long failures;
+    int i;
+
+    amber_get_behavior(&options, behavior_down, AMBER_STATUS_DOWN);
+    amber_get_behavior(&options, behavior_up, AMBER_STATUS_UP);
+    corpus->behavior[AMBER_STATUS_DOWN] = (char *) behavior_down;
+    corpus->behavior[AMBER_STATUS_UP] = (char *) behavior_up;
+    if (test_create_corpus(corpus, &arena)) {
+        unlink(corpus->db_path);
+        return 1;
+    }
+
+    /* One thread first, so that a plain mistake shows up on its own */
+    failures = test_threads(corpus, 1);
+    failures += test_threads(corpus, TEST_THREADS);
+
+    unlink(corpus->db_path);
+    for (i = 0; i < TEST_PAGES; i++) {
+        free(corpus->pages[i].data);
+        free(corpus->pages[i].expected);
+    }
+    harness_arena_clear(&arena);
+    free(corpus);
+    printf(failures ? "FAILED\n" : "OK\n");
+    return failures ? 1 : 0;
+}
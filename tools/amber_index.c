@@ -0,0 +1,188 @@
+/* ======================================================================== */
+/* Build a lookup index from an Amber database                              */
+/*                                                                          */
+/* Writes a read-only snapshot of the cache and check tables, which the     */
+/* Apache module maps into memory to look links up without querying the    */
+/* database (see AmberLookupIndex). Run it again whenever the database      */
+/* changes, e.g. from the cron jobs after caching. See tools/README.md      */
+/* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "amber_core.h"
+
+#define INDEX_SQL_ENTRIES "SELECT ah.url, COALESCE(aa.location, ''), COALESCE(aa.date, 0), ah.status FROM amber_check ah LEFT JOIN amber_cache aa ON aa.id = ah.id WHERE ah.url IS NOT NULL"
+#define INDEX_SQL_GENERATION "SELECT generation FROM amber_generation"
+#define INDEX_BUSY_TIMEOUT 10000        /* Milliseconds to wait for the database lock */
+
+static char *index_strdup(const char *s)
+{
+    char *copy = malloc(strlen(s) + 1);
+    if (!copy) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return strcpy(copy, s);
+}
+
+/* Allocate memory for amber_core */
+static void *index_alloc(void *baton, size_t size)
+{
+    void *memory = malloc(size);
+    if (!memory) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return memory;
+}
+
+/* Read every url that has been checked (with its cache, if it has one) from the database, in the canonical form the module looks them up in,
+   and the generation they were read in (0 if the module hasn't added the amber_generation table yet) */
+static int index_read_entries(const char *db_path, amber_index_entry_t **entries, int *count, uint64_t *generation)
+{
+    sqlite3 *db = NULL;
+    sqlite3_stmt *statement = NULL;
+    int allocated = 0;
+    int rc;
+
+    *entries = NULL;
+    *count = 0;
+    *generation = 0;
+    if ((rc = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", db_path, db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_busy_timeout(db, INDEX_BUSY_TIMEOUT);
+
+    /* Read the generation and the urls in one transaction, so the module can tell whether the index is current */
+    if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Could not read %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    if (sqlite3_prepare_v2(db, INDEX_SQL_GENERATION, -1, &statement, NULL) == SQLITE_OK) {
+        if (sqlite3_step(statement) == SQLITE_ROW) {
+            *generation = (uint64_t) sqlite3_column_int64(statement, 0);
+        }
+        sqlite3_finalize(statement);
+        statement = NULL;
+    }
+    if (sqlite3_prepare_v2(db, INDEX_SQL_ENTRIES, -1, &statement, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Could not read %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        amber_index_entry_t *entry;
+        if (*count == allocated) {
+            allocated = allocated ? allocated * 2 : 1024;
+            if (!(*entries = realloc(*entries, allocated * sizeof(amber_index_entry_t)))) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        entry = &(*entries)[(*count)++];
+        entry->url = amber_canonical_url(index_alloc, NULL, (const char *) sqlite3_column_text(statement, 0));
+        entry->location = index_strdup((const char *) sqlite3_column_text(statement, 1));
+        entry->date = sqlite3_column_int(statement, 2);
+        entry->status = sqlite3_column_int(statement, 3);
+    }
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Could not read %s: %s\n", db_path, sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(statement);
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_close(db);
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/* Write the index to a temporary file next to the index, and rename it over the index, so that 
+   Apache never sees a partly written file */
+static int index_write(const char *index_path, const void *data, size_t size)
+{
+    size_t temp_path_size = strlen(index_path) + 32;
+    char *temp_path = malloc(temp_path_size);
+    FILE *file;
+
+    snprintf(temp_path, temp_path_size, "%s.%ld.tmp", index_path, (long) getpid());
+    if (!(file = fopen(temp_path, "wb"))) {
+        perror(temp_path);
+        free(temp_path);
+        return -1;
+    }
+    if ((fwrite(data, 1, size, file) != size) || fflush(file) || fsync(fileno(file))) {
+        perror(temp_path);
+        fclose(file);
+        unlink(temp_path);
+        free(temp_path);
+        return -1;
+    }
+    if (fclose(file) || rename(temp_path, index_path)) {
+        perror(index_path);
+        unlink(temp_path);
+        free(temp_path);
+        return -1;
+    }
+    free(temp_path);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    amber_index_entry_t *entries;
+    amber_index_t index;
+    const char *location;
+    int date, status;
+    size_t size;
+    int rc;
+    void *data;
+    uint64_t generation;
+    int count;
+    int i;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <database> <index>\n", argv[0]);
+        return 2;
+    }
+    if (index_read_entries(argv[1], &entries, &count, &generation)) {
+        return 1;
+    }
+    if (!(size = amber_index_size(entries, count))) {
+        fprintf(stderr, "Too many urls for an index\n");
+        return 1;
+    }
+    if (!(data = calloc(1, size))) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size = amber_index_build(entries, count, generation, data);
+
+    /* Make sure the module will accept what we've built */
+    if (amber_index_open(&index, data, size)) {
+        fprintf(stderr, "Built an invalid index\n");
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        rc = amber_index_lookup(&index, entries[i].url, &location, &date, &status);
+        if ((AMBER_CACHE_ATTRIBUTES_FOUND != rc) && (AMBER_CACHE_ATTRIBUTES_EMPTY != rc)) {
+            fprintf(stderr, "Could not find %s in the index\n", entries[i].url);
+            return 1;
+        }
+    }
+
+    if (index_write(argv[2], data, size)) {
+        return 1;
+    }
+    printf("%s: %u urls, %lu bytes\n", argv[2], index.header->entry_count, (unsigned long) size);
+    for (i = 0; i < count; i++) {
+        free((char *) entries[i].url);
+        free((char *) entries[i].location);
+    }
+    free(entries);
+    free(data);
+    return 0;
+}